@@ -6,6 +6,8 @@ check_include_files(inttypes.h HAVE_INTTYPES_H)
 check_include_files(pthread.h HAVE_PTHREAD_H)
 check_include_files(sys/endian.h HAVE_SYS_ENDIAN_H)
 check_include_files(sys/param.h HAVE_SYS_PARAM_H)
+check_include_files(sys/resource.h HAVE_SYS_RESOURCE_H)
+check_include_files(sys/uio.h HAVE_SYS_UIO_H)
 check_include_files(sys/utsname.h HAVE_SYS_UTSNAME_H)
 check_include_files(fcntl.h HAVE_FCNTL_H)
 check_include_files(unistd.h HAVE_UNISTD_H)
@@ -27,14 +29,17 @@ if(WIN32 AND MSVC)
 else()
   check_function_exists(access HAVE_ACCESS) #Unix <unistd.h>
   check_function_exists(fork HAVE_FORK) #Unix <unistd.h>
+  check_function_exists(fsync HAVE_FSYNC) #Unix <unistd.h>
   check_function_exists(getopt HAVE_GETOPT) #Unix <unistd.h>
   check_function_exists(getpid HAVE_GETPID) #Unix <unistd.h>
   check_function_exists(getpwent HAVE_GETPWENT) #Unix <sys/types.h>,<pwd.h>
   check_function_exists(gmtime_r HAVE_GMTIME_R) #Unix <time.h>
+  check_function_exists(link HAVE_LINK) #Unix <unistd.h>
   check_function_exists(localtime_r HAVE_LOCALTIME_R) #Unix <time.h>
   check_function_exists(mkdir HAVE_MKDIR) #Unix <sys/stat.h>,<sys/types.h>
   check_function_exists(open HAVE_OPEN) #Unix <sys/stat.h>,<sys/types.h>,<fcntl.h>
   check_function_exists(nanosleep HAVE_NANOSLEEP) #Unix <time.h>
+  check_function_exists(setrlimit HAVE_SETRLIMIT) #Unix <sys/resource.h>
   check_function_exists(signal HAVE_SIGNAL) #Unix <signal.h>
   check_function_exists(stat HAVE_STAT) #Unix <sys/stat.h>,<sys/types.h>,<unistd.h>
   check_function_exists(strdup HAVE_STRDUP) #Unix <string.h>
@@ -45,6 +50,7 @@ else()
   check_function_exists(usleep HAVE_USLEEP) #Unix <unistd.h>
   check_function_exists(waitpid HAVE_WAITPID) #Unix <sys/types.h>,<sys/wait.h>
   check_function_exists(write HAVE_WRITE) #Unix <unistd.h>
+  check_function_exists(writev HAVE_WRITEV) #Unix <sys/uio.h>
   if(NOT MINGW)
     check_function_exists(alarm HAVE_ALARM) #Unix <unistd.h>
   endif()
@@ -306,6 +306,7 @@ void icalparameter_set_${lc}(icalparameter *param, ${type} v)
         free((void *)param->string);
     }
     $set_code
+    icalproperty_touch(param->parent);
 }
 
 EOM
@@ -48,8 +48,10 @@ if ($opt_i) {
 
 sub insert_code
 {
-  # First build the property restriction table
-  print "static const icalrestriction_property_record icalrestriction_property_records[] = {\n";
+  # Collect the property restrictions, keeping the rows for each method
+  # and component together in the order they first appear
+  my @groups;
+  my %rows;
 
   while (<F>) {
 
@@ -69,17 +71,47 @@ sub insert_code
     $restr =~ s/\s+$//;
 
     if ($prop ne "NONE") {
-      print(
+      my $group = "${method},${targetcomp}";
+
+      if (!exists $rows{$group}) {
+        push(@groups, $group);
+        $rows{$group} = [];
+      }
+      push(@{$rows{$group}},
 "    \{ICAL_METHOD_${method}, ICAL_${targetcomp}_COMPONENT, ICAL_${prop}_PROPERTY, ICAL_RESTRICTION_${restr}, $sub},\n"
       );
     }
 
   }
 
+  # First build the property restriction table
+  print "static const icalrestriction_property_record icalrestriction_property_records[] = {\n";
+
+  foreach my $group (@groups) {
+    print @{$rows{$group}};
+  }
+
   # Print the terminating line
   print
     "    {ICAL_METHOD_NONE, ICAL_NO_COMPONENT, ICAL_NO_PROPERTY, ICAL_RESTRICTION_NONE, NULL}\n";
 
+  print "};\n\n";
+
+  # Then the range of records that applies to each method and component
+  print "static const icalrestriction_component_table icalrestriction_component_tables[] = {\n";
+
+  my $first = 0;
+
+  foreach my $group (@groups) {
+    my ($method, $targetcomp) = split(/,/, $group);
+    my $num = scalar(@{$rows{$group}});
+
+    print "    {ICAL_METHOD_${method}, ICAL_${targetcomp}_COMPONENT, $first, $num},\n";
+    $first += $num;
+  }
+
+  print "    {ICAL_METHOD_NONE, ICAL_NO_COMPONENT, 0, 0}\n";
+
   print "};\n";
 
 }
@@ -18,6 +18,7 @@ set(COMBINEDHEADERSICAL
   ${TOPS}/src/libical/icalproperty.h
   ${TOPS}/src/libical/pvl.h
   ${TOPS}/src/libical/icalcomponent.h
+  ${TOPS}/src/libical/icaldiff.h
   ${TOPS}/src/libical/icaltimezone.h
   ${TOPS}/src/libical/icaltz-util.h
   ${TOPS}/src/libical/icalparser.h
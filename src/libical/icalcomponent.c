@@ -20,16 +20,27 @@
 #include <config.h>
 #endif
 
-#include "icalcomponent.h"
+#include "icalcomponent_p.h"
 #include "icalerror.h"
 #include "icalmemory.h"
 #include "icalparser.h"
 #include "icalrestriction.h"
 #include "icaltimezone.h"
+#include "icalvalue.h"
 
 #include <assert.h>
 #include <stdlib.h>
 
+#if defined(HAVE_PTHREAD) && !defined(__ATOMIC_RELAXED)
+#include <pthread.h>
+static pthread_mutex_t revision_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The last revision given out. A component allocated where a freed one
+   was must not take over a revision an index remembers for the freed
+   one, so revisions are never reused, not even by another component. */
+static unsigned long icalcomponent_last_revision = 0;
+
 struct icalcomponent_impl
 {
     char id[5];
@@ -41,17 +52,83 @@ struct icalcomponent_impl
     pvl_elem component_iterator;
     struct icalcomponent_impl *parent;
 
+        /** The element of parent->components holding this component, so that
+           it can be removed without searching the list */
+    pvl_elem parent_elem;
+
         /** An array of icaltimezone structs. We use this so we can do fast
            lookup of timezones using binary searches. timezones_sorted is
            set to 0 whenever we add a timezone, so we remember to sort the
            array before doing a binary search. */
     icalarray *timezones;
     int timezones_sorted;
+
+        /** Counts changes to the subtree rooted at this component. Adding
+           or removing a component or property, setting a value or changing
+           a parameter anywhere below moves it to a new revision, and it is
+           never less than the revision of any component below. Revisions
+           are drawn from one counter for the whole process, so no two
+           states of any components share one. */
+    unsigned long revision;
+
+        /** The revision at which a VTIMEZONE in this subtree last changed,
+           was added or was removed, or 0 if there never was one. Times
+           depend on the VTIMEZONEs of the whole tree, so that of the root
+           is what cached times are checked against. */
+    unsigned long timezones_revision;
+
+        /** Results of icalcomponent_get_dtstart(), icalcomponent_get_dtend()
+           and icalcomponent_get_span(), flagged in times_cached. They are
+           only valid while revision equals times_revision and the
+           timezones_revision of the root equals times_tz_revision. */
+    int times_cached;
+    unsigned long times_revision;
+    unsigned long times_tz_revision;
+    struct icaltimetype cached_dtstart;
+    struct icaltimetype cached_dtend;
+    icaltime_span cached_span;
+
+        /** For a VTIMEZONE: the text of everything but its TZID, which
+           decides whether two VTIMEZONEs describe the same zone, and a
+           hash of that text. Valid while revision equals tz_revision. */
+    char *tz_content;
+    unsigned int tz_content_hash;
+    unsigned long tz_revision;
+
+        /** The result of icalcomponent_fingerprint(), valid while
+           fingerprint_cached is set and revision equals
+           fingerprint_revision. */
+    int fingerprint_cached;
+    unsigned long fingerprint_revision;
+    icalfingerprint fingerprint;
+};
+
+#define ICALCOMPONENT_DTSTART_CACHED 0x1
+#define ICALCOMPONENT_DTEND_CACHED   0x2
+#define ICALCOMPONENT_SPAN_CACHED    0x4
+
+/** A TZID of a calendar being merged, and the name it is given in the
+    calendar it is merged into */
+struct icaltzid_rename
+{
+    char *tzid;
+    char *new_tzid;
+    unsigned int hash;
+};
+
+/** An open addressing hash table over an icalarray of icaltzid_rename.
+    Buckets hold an index into the array plus one, or 0 when empty. */
+struct icaltzid_rename_index
+{
+    icalarray *renames;
+    size_t *buckets;
+    size_t num_buckets;
 };
 
 static void icalcomponent_add_children(icalcomponent *impl, va_list args);
 static icalcomponent *icalcomponent_new_impl(icalcomponent_kind kind);
 
+static int icalcomponent_is_not_vtimezone(icalcomponent *comp, void *data);
 static void icalcomponent_merge_vtimezone(icalcomponent *comp,
                                           icalcomponent *vtimezone, icalarray *tzids_to_rename);
 static void icalcomponent_handle_conflicting_vtimezones(icalcomponent *comp,
@@ -60,11 +137,21 @@ static void icalcomponent_handle_conflicting_vtimezones(icalcomponent *comp,
                                                         const char *tzid,
                                                         icalarray *tzids_to_rename);
 static size_t icalcomponent_get_tzid_prefix_len(const char *tzid);
+static void icalcomponent_add_tzid_rename(icalarray *tzids_to_rename,
+                                          const char *tzid, const char *new_tzid);
 static void icalcomponent_rename_tzids(icalcomponent *comp, icalarray *rename_table);
 static void icalcomponent_rename_tzids_callback(icalparameter *param, void *data);
 static int icalcomponent_compare_vtimezones(icalcomponent *vtimezone1, icalcomponent *vtimezone2);
 static int icalcomponent_compare_timezone_fn(const void *elem1, const void *elem2);
+static void icalcomponent_sort_timezones(icalcomponent *comp);
+static unsigned int icalcomponent_hash_string(const char *str);
 static struct icaltimetype icalcomponent_get_datetime(icalcomponent *comp, icalproperty *prop);
+static icaltime_span icalcomponent_get_span_of_times(icalcomponent *comp);
+static unsigned long icalcomponent_new_revision(void);
+static void icalcomponent_join_revisions(icalcomponent *parent, icalcomponent *child);
+static void icalcomponent_split_revisions(icalcomponent *parent, icalcomponent *child);
+static int icalcomponent_times_are_cached(icalcomponent *comp, int which);
+static void icalcomponent_set_times_cached(icalcomponent *comp, int which);
 
 void icalcomponent_add_children(icalcomponent *impl, va_list args)
 {
@@ -103,6 +190,7 @@ static icalcomponent *icalcomponent_new_impl(icalcomponent_kind kind)
     comp->properties = pvl_newlist();
     comp->components = pvl_newlist();
     comp->timezones_sorted = 1;
+    comp->revision = icalcomponent_new_revision();
 
     return comp;
 }
@@ -160,6 +248,10 @@ icalcomponent *icalcomponent_new_clone(icalcomponent *old)
         return 0;
     }
 
+    if (old->x_name != 0) {
+        new->x_name = icalmemory_strdup(old->x_name);
+    }
+
     for (itr = pvl_head(old->properties); itr != 0; itr = pvl_next(itr)) {
         p = (icalproperty *) pvl_data(itr);
         icalcomponent_add_property(new, icalproperty_new_clone(p));
@@ -224,6 +316,8 @@ void icalcomponent_free(icalcomponent *c)
             c->timezones = 0;
         }
 
+        free(c->tz_content);
+
         c->kind = ICAL_NO_COMPONENT;
         c->properties = 0;
         c->property_iterator = 0;
@@ -301,7 +395,7 @@ char *icalcomponent_as_ical_string_r(icalcomponent *impl)
     }
 
     icalmemory_append_string(&buf, &buf_ptr, &buf_size, "END:");
-    icalmemory_append_string(&buf, &buf_ptr, &buf_size, icalcomponent_kind_to_string(kind));
+    icalmemory_append_string(&buf, &buf_ptr, &buf_size, kind_string);
     icalmemory_append_string(&buf, &buf_ptr, &buf_size, newline);
 
     return buf;
@@ -323,6 +417,13 @@ icalcomponent_kind icalcomponent_isa(const icalcomponent *component)
     return component->kind;
 }
 
+const char *icalcomponent_get_x_name(const icalcomponent *component)
+{
+    icalerror_check_arg_rz((component != 0), "component");
+
+    return component->x_name;
+}
+
 int icalcomponent_isa_component(void *component)
 {
     icalcomponent *impl = component;
@@ -349,6 +450,8 @@ void icalcomponent_add_property(icalcomponent *component, icalproperty *property
     icalproperty_set_parent(property, component);
 
     pvl_push(component->properties, property);
+
+    icalcomponent_touch(component);
 }
 
 void icalcomponent_remove_property(icalcomponent *component, icalproperty *property)
@@ -378,6 +481,7 @@ void icalcomponent_remove_property(icalcomponent *component, icalproperty *prope
 
             (void)pvl_remove(component->properties, itr);
             icalproperty_set_parent(property, 0);
+            icalcomponent_touch(component);
         }
     }
 }
@@ -459,14 +563,17 @@ void icalcomponent_add_component(icalcomponent *parent, icalcomponent *child)
         icalerror_set_errno(ICAL_USAGE_ERROR);
     }
 
+    icalcomponent_join_revisions(parent, child);
     child->parent = parent;
 
     /* Fix for Mozilla - bug 327602 */
     if (child->kind != ICAL_VTIMEZONE_COMPONENT) {
         pvl_push(parent->components, child);
+        child->parent_elem = pvl_tail(parent->components);
     } else {
         /* VTIMEZONES should be first in the resulting VCALENDAR. */
         pvl_unshift(parent->components, child);
+        child->parent_elem = pvl_head(parent->components);
 
         /* Add the VTIMEZONE to our array. */
         /* FIXME: Currently we are also creating this array when loading in
@@ -481,45 +588,298 @@ void icalcomponent_add_component(icalcomponent *parent, icalcomponent *child)
     }
 }
 
+/* Removes the icaltimezone of a VTIMEZONE child from parent->timezones,
+   finding it by binary search on its TZID when the array is sorted. */
+static void icalcomponent_remove_timezone(icalcomponent *parent, icalcomponent *child)
+{
+    icaltimezone *zone;
+    size_t i, lower, upper, num_elements;
+    icalproperty *tzid_prop;
+    const char *tzid = 0;
+
+    num_elements = parent->timezones ? parent->timezones->num_elements : 0;
+
+    tzid_prop = icalcomponent_get_first_property(child, ICAL_TZID_PROPERTY);
+    if (tzid_prop)
+        tzid = icalproperty_get_tzid(tzid_prop);
+
+    i = num_elements;
+    if (parent->timezones_sorted && tzid) {
+        lower = 0;
+        upper = num_elements;
+        while (lower < upper) {
+            size_t middle = (lower + upper) >> 1;
+
+            zone = icalarray_element_at(parent->timezones, middle);
+            if (strcmp(icaltimezone_get_tzid(zone), tzid) < 0) {
+                lower = middle + 1;
+            } else {
+                upper = middle;
+            }
+        }
+
+        for (i = lower; i < num_elements; i++) {
+            zone = icalarray_element_at(parent->timezones, i);
+            if (strcmp(icaltimezone_get_tzid(zone), tzid) != 0) {
+                i = num_elements;
+                break;
+            }
+            if (icaltimezone_get_component(zone) == child)
+                break;
+        }
+    }
+
+    /* The array is unsorted, or the TZID was changed after the VTIMEZONE
+       was added */
+    if (i == num_elements) {
+        for (i = 0; i < num_elements; i++) {
+            zone = icalarray_element_at(parent->timezones, i);
+            if (icaltimezone_get_component(zone) == child)
+                break;
+        }
+    }
+
+    if (i < num_elements) {
+        zone = icalarray_element_at(parent->timezones, i);
+        icaltimezone_free(zone, 0);
+        icalarray_remove_element_at(parent->timezones, i);
+        /* Later zones have moved down */
+        icalcomponent_touch(parent);
+    }
+}
+
 void icalcomponent_remove_component(icalcomponent *parent, icalcomponent *child)
 {
-    pvl_elem itr, next_itr;
+    pvl_elem itr;
 
     icalerror_check_arg_rv((parent != 0), "parent");
     icalerror_check_arg_rv((child != 0), "child");
 
     /* If the component is a VTIMEZONE, remove it from our array as well. */
     if (child->kind == ICAL_VTIMEZONE_COMPONENT) {
-        icaltimezone *zone;
-        size_t i, num_elements;
+        icalcomponent_remove_timezone(parent, child);
+    }
 
-        num_elements = parent->timezones ? parent->timezones->num_elements : 0;
-        for (i = 0; i < num_elements; i++) {
-            zone = icalarray_element_at(parent->timezones, i);
-            if (icaltimezone_get_component(zone) == child) {
-                icaltimezone_free(zone, 0);
-                icalarray_remove_element_at(parent->timezones, i);
+    if (child->parent == parent && child->parent_elem != 0) {
+        itr = child->parent_elem;
+    } else {
+        /* The child was attached with icalcomponent_set_parent() */
+        for (itr = pvl_head(parent->components); itr != 0; itr = pvl_next(itr)) {
+            if (pvl_data(itr) == (void *)child)
                 break;
-            }
         }
+        if (itr == 0)
+            return;
     }
 
+    if (parent->component_iterator == itr) {
+        /* Don't let the current iterator become invalid */
+
+        /* HACK. The semantics for this are troubling. */
+        parent->component_iterator = pvl_next(parent->component_iterator);
+    }
+    (void)pvl_remove(parent->components, itr);
+    child->parent = 0;
+    child->parent_elem = 0;
+    icalcomponent_split_revisions(parent, child);
+}
+
+size_t icalcomponent_remove_components(icalcomponent *parent, icalcomponent_kind kind,
+                                       int (*match) (icalcomponent *child, void *data),
+                                       void *data)
+{
+    pvl_elem itr, next_itr;
+    size_t count = 0;
+
+    icalerror_check_arg_rz((parent != 0), "parent");
+
     for (itr = pvl_head(parent->components); itr != 0; itr = next_itr) {
+        icalcomponent *child = (icalcomponent *) pvl_data(itr);
+
         next_itr = pvl_next(itr);
 
-        if (pvl_data(itr) == (void *)child) {
+        if ((kind == ICAL_ANY_COMPONENT || child->kind == kind) &&
+            (match == 0 || (*match) (child, data))) {
+            icalcomponent_remove_component(parent, child);
+            icalcomponent_free(child);
+            count++;
+        }
+    }
 
-            if (parent->component_iterator == itr) {
-                /* Don't let the current iterator become invalid */
+    return count;
+}
 
-                /* HACK. The semantics for this are troubling. */
-                parent->component_iterator = pvl_next(parent->component_iterator);
+size_t icalcomponent_move_components(icalcomponent *to, icalcomponent *from,
+                                     icalcomponent_kind kind,
+                                     int (*match) (icalcomponent *child, void *data),
+                                     void *data)
+{
+    pvl_elem itr, next_itr;
+    size_t count = 0;
+
+    icalerror_check_arg_rz((to != 0), "to");
+    icalerror_check_arg_rz((from != 0), "from");
+    icalerror_check_arg_rz((to != from), "from");
+
+    for (itr = pvl_head(from->components); itr != 0; itr = next_itr) {
+        icalcomponent *child = (icalcomponent *) pvl_data(itr);
+
+        next_itr = pvl_next(itr);
+
+        if ((kind == ICAL_ANY_COMPONENT || child->kind == kind) &&
+            (match == 0 || (*match) (child, data))) {
+            icalcomponent_remove_component(from, child);
+            icalcomponent_add_component(to, child);
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/** A child of the component being sorted, and its key */
+struct icalcomponent_sort_entry
+{
+    icalcomponent_sortkey key;
+    icalcomponent *comp;
+};
+
+static int icalcomponent_compare_sortkeys(const icalcomponent_sortkey *a,
+                                          const icalcomponent_sortkey *b)
+{
+    if (a->group != b->group) {
+        return (a->group < b->group) ? -1 : 1;
+    }
+    if (a->time != b->time) {
+        return (a->time < b->time) ? -1 : 1;
+    }
+    if (a->text == 0 || b->text == 0) {
+        return (a->text != 0) - (b->text != 0);
+    }
+
+    return strcmp(a->text, b->text);
+}
+
+void icalcomponent_sortkey_dtstart(icalcomponent *comp, icalcomponent_sortkey *key, void *data)
+{
+    struct icaltimetype dtstart = icalcomponent_get_dtstart(comp);
+
+    _unused(data);
+
+    if (icaltime_is_null_time(dtstart)) {
+        key->group = 1;
+        return;
+    }
+
+    key->time = icaltime_as_timet_with_zone(dtstart,
+                                            dtstart.zone ? dtstart.zone :
+                                            icaltimezone_get_utc_timezone());
+}
+
+void icalcomponent_sortkey_uid(icalcomponent *comp, icalcomponent_sortkey *key, void *data)
+{
+    _unused(data);
+
+    key->text = icalcomponent_get_uid(comp);
+    if (key->text == 0) {
+        key->group = 1;
+    }
+}
+
+size_t icalcomponent_sort_components(icalcomponent *comp, icalcomponent_kind kind,
+                                     icalcomponent_sortkey_fn keyfn, void *data)
+{
+    struct icalcomponent_sort_entry *entries, *buf, *from, *to, *swap;
+    pvl_elem *elems;
+    pvl_elem itr;
+    size_t count = 0, width, i;
+
+    icalerror_check_arg_rz((comp != 0), "comp");
+
+    if (keyfn == 0) {
+        keyfn = icalcomponent_sortkey_dtstart;
+    }
+
+    for (itr = pvl_head(comp->components); itr != 0; itr = pvl_next(itr)) {
+        if (kind == ICAL_ANY_COMPONENT || ((icalcomponent *) pvl_data(itr))->kind == kind) {
+            count++;
+        }
+    }
+    if (count < 2) {
+        return count;
+    }
+
+    entries = malloc(2 * count * sizeof(struct icalcomponent_sort_entry));
+    elems = malloc(count * sizeof(pvl_elem));
+    if (entries == 0 || elems == 0) {
+        free(entries);
+        free(elems);
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+    buf = entries + count;
+
+    /* Compute every key once, rather than once per comparison */
+    count = 0;
+    for (itr = pvl_head(comp->components); itr != 0; itr = pvl_next(itr)) {
+        icalcomponent *child = (icalcomponent *) pvl_data(itr);
+
+        if (kind == ICAL_ANY_COMPONENT || child->kind == kind) {
+            memset(&entries[count].key, 0, sizeof(icalcomponent_sortkey));
+            (*keyfn) (child, &entries[count].key, data);
+            entries[count].comp = child;
+            elems[count++] = itr;
+        }
+    }
+
+    /* A bottom-up merge sort, which keeps equal keys in their order */
+    from = entries;
+    to = buf;
+    for (width = 1; width < count; width *= 2) {
+        for (i = 0; i < count; i += 2 * width) {
+            size_t left = i, mid = i + width, right = i + 2 * width, out = i;
+            size_t l = left, r;
+
+            if (mid > count) {
+                mid = count;
+            }
+            if (right > count) {
+                right = count;
+            }
+            r = mid;
+
+            while (l < mid && r < right) {
+                if (icalcomponent_compare_sortkeys(&from[r].key, &from[l].key) < 0) {
+                    to[out++] = from[r++];
+                } else {
+                    to[out++] = from[l++];
+                }
+            }
+            while (l < mid) {
+                to[out++] = from[l++];
+            }
+            while (r < right) {
+                to[out++] = from[r++];
             }
-            (void)pvl_remove(parent->components, itr);
-            child->parent = 0;
-            break;
         }
+        swap = from;
+        from = to;
+        to = swap;
+    }
+
+    /* Put the sorted children back into the slots the selected ones held,
+       so children of other kinds stay where they are */
+    for (i = 0; i < count; i++) {
+        pvl_set_data(elems[i], from[i].comp);
+        from[i].comp->parent_elem = elems[i];
     }
+
+    free(entries);
+    free(elems);
+
+    icalcomponent_touch(comp);
+
+    return count;
 }
 
 int icalcomponent_count_components(icalcomponent *component, icalcomponent_kind kind)
@@ -529,6 +889,10 @@ int icalcomponent_count_components(icalcomponent *component, icalcomponent_kind
 
     icalerror_check_arg_rz((component != 0), "component");
 
+    if (kind == ICAL_ANY_COMPONENT) {
+        return pvl_count(component->components);
+    }
+
     for (itr = pvl_head(component->components); itr != 0; itr = pvl_next(itr)) {
         if (kind == icalcomponent_isa((icalcomponent *) pvl_data(itr)) ||
             kind == ICAL_ANY_COMPONENT) {
@@ -634,7 +998,6 @@ icaltime_span icalcomponent_get_span(icalcomponent *comp)
     icalcomponent *inner;
     icalcomponent_kind kind;
     icaltime_span span;
-    struct icaltimetype start, end;
 
     span.start = 0;
     span.end = 0;
@@ -645,6 +1008,11 @@ icaltime_span icalcomponent_get_span(icalcomponent *comp)
         return span;
     }
 
+    /* Only spans that passed the checks below are cached */
+    if (icalcomponent_times_are_cached(comp, ICALCOMPONENT_SPAN_CACHED)) {
+        return comp->cached_span;
+    }
+
     /* FIXME this might go away */
     kind = icalcomponent_isa(comp);
     if (kind == ICAL_VCALENDAR_COMPONENT) {
@@ -677,6 +1045,23 @@ or empty VCALENDAR component"); */
         return span;
     }
 
+    span = icalcomponent_get_span_of_times(comp);
+
+    comp->cached_span = span;
+    icalcomponent_set_times_cached(comp, ICALCOMPONENT_SPAN_CACHED);
+
+    return span;
+}
+
+static icaltime_span icalcomponent_get_span_of_times(icalcomponent *comp)
+{
+    icaltime_span span;
+    struct icaltimetype start, end;
+
+    span.start = 0;
+    span.end = 0;
+    span.is_busy = 1;
+
     /* Get to work. starting with DTSTART */
     start = icalcomponent_get_dtstart(comp);
     if (icaltime_is_null_time(start)) {
@@ -1143,7 +1528,135 @@ icalcomponent *icalcomponent_get_parent(icalcomponent *component)
 
 void icalcomponent_set_parent(icalcomponent *component, icalcomponent *parent)
 {
+    icalcomponent *old_parent = component->parent;
+
+    if (parent != 0) {
+        icalcomponent_join_revisions(parent, component);
+    }
     component->parent = parent;
+    component->parent_elem = 0;
+    if (parent == 0 && old_parent != 0) {
+        icalcomponent_split_revisions(old_parent, component);
+    }
+}
+
+unsigned long icalcomponent_get_revision(icalcomponent *component)
+{
+    icalerror_check_arg_rz((component != 0), "component");
+
+    return component->revision;
+}
+
+static icalcomponent *icalcomponent_get_root(icalcomponent *comp)
+{
+    while (comp->parent != 0) {
+        comp = comp->parent;
+    }
+
+    return comp;
+}
+
+static unsigned long icalcomponent_new_revision(void)
+{
+    unsigned long revision;
+
+#if defined(__ATOMIC_RELAXED)
+    revision = __atomic_add_fetch(&icalcomponent_last_revision, 1, __ATOMIC_RELAXED);
+#else
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_lock(&revision_mutex);
+#endif
+    revision = ++icalcomponent_last_revision;
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_unlock(&revision_mutex);
+#endif
+#endif
+
+    return revision;
+}
+
+/* Record that the VTIMEZONEs of comp's tree changed at comp's revision */
+static void icalcomponent_touch_timezones(icalcomponent *comp)
+{
+    unsigned long revision = comp->revision;
+
+    for (; comp != 0; comp = comp->parent) {
+        comp->timezones_revision = revision;
+    }
+}
+
+void icalcomponent_touch(icalcomponent *comp)
+{
+    icalcomponent *c;
+    unsigned long revision;
+    int in_timezone = 0;
+
+    if (comp == 0) {
+        return;
+    }
+
+    revision = icalcomponent_new_revision();
+    for (c = comp; c != 0; c = c->parent) {
+        c->revision = revision;
+        if (c->kind == ICAL_VTIMEZONE_COMPONENT) {
+            in_timezone = 1;
+        }
+    }
+
+    if (in_timezone) {
+        icalcomponent_touch_timezones(comp);
+    }
+}
+
+/* Whether child is or ever held a VTIMEZONE, which its tree joining or
+   leaving another changes the timezones of */
+static int icalcomponent_has_timezones(icalcomponent *child)
+{
+    return child->kind == ICAL_VTIMEZONE_COMPONENT || child->timezones_revision != 0;
+}
+
+/* When child's tree is grafted into parent's, move parent and everything
+   above it to a new revision, past both trees. The rest of parent's tree
+   keeps its cached times unless child brings VTIMEZONEs along; child's
+   tree checks its own against the root it now has. */
+static void icalcomponent_join_revisions(icalcomponent *parent, icalcomponent *child)
+{
+    icalcomponent_touch(parent);
+    if (icalcomponent_has_timezones(child)) {
+        icalcomponent_touch_timezones(parent);
+    }
+}
+
+/* When child has been cut from parent's tree, it becomes a root itself and
+   starts at a revision that nothing cached in the old tree can match. If
+   it held VTIMEZONEs, both trees now have different ones. */
+static void icalcomponent_split_revisions(icalcomponent *parent, icalcomponent *child)
+{
+    icalcomponent_touch(parent);
+    child->revision = icalcomponent_new_revision();
+    if (icalcomponent_has_timezones(child)) {
+        icalcomponent_touch_timezones(parent);
+        child->timezones_revision = child->revision;
+    }
+}
+
+static int icalcomponent_times_are_cached(icalcomponent *comp, int which)
+{
+    return (comp->times_cached & which) != 0 &&
+           comp->times_revision == comp->revision &&
+           comp->times_tz_revision == icalcomponent_get_root(comp)->timezones_revision;
+}
+
+static void icalcomponent_set_times_cached(icalcomponent *comp, int which)
+{
+    unsigned long tz_revision = icalcomponent_get_root(comp)->timezones_revision;
+
+    if (comp->times_revision != comp->revision || comp->times_tz_revision != tz_revision) {
+        comp->times_cached = 0;
+        comp->times_revision = comp->revision;
+        comp->times_tz_revision = tz_revision;
+    }
+    comp->times_cached |= which;
 }
 
 static icalcompiter icalcompiter_null = { ICAL_NO_COMPONENT, 0 };
@@ -1456,15 +1969,26 @@ static struct icaltimetype icalcomponent_get_datetime(icalcomponent *comp, icalp
  */
 struct icaltimetype icalcomponent_get_dtstart(icalcomponent *comp)
 {
-    icalcomponent *inner = icalcomponent_get_inner(comp);
+    icalcomponent *inner;
     icalproperty *prop;
+    struct icaltimetype ret = icaltime_null_time();
 
+    if (comp != 0 && icalcomponent_times_are_cached(comp, ICALCOMPONENT_DTSTART_CACHED)) {
+        return comp->cached_dtstart;
+    }
+
+    inner = icalcomponent_get_inner(comp);
     prop = icalcomponent_get_first_property(inner, ICAL_DTSTART_PROPERTY);
-    if (prop == 0) {
-        return icaltime_null_time();
+    if (prop != 0) {
+        ret = icalcomponent_get_datetime(comp, prop);
+    }
+
+    if (inner != 0) {
+        comp->cached_dtstart = ret;
+        icalcomponent_set_times_cached(comp, ICALCOMPONENT_DTSTART_CACHED);
     }
 
-    return icalcomponent_get_datetime(comp, prop);
+    return ret;
 }
 
 /**     @brief Get DTEND property as an icaltime
@@ -1481,11 +2005,18 @@ struct icaltimetype icalcomponent_get_dtstart(icalcomponent *comp)
  */
 struct icaltimetype icalcomponent_get_dtend(icalcomponent *comp)
 {
-    icalcomponent *inner = icalcomponent_get_inner(comp);
-    icalproperty *end_prop = icalcomponent_get_first_property(inner, ICAL_DTEND_PROPERTY);
-    icalproperty *dur_prop = icalcomponent_get_first_property(inner, ICAL_DURATION_PROPERTY);
+    icalcomponent *inner;
+    icalproperty *end_prop, *dur_prop;
     struct icaltimetype ret = icaltime_null_time();
 
+    if (comp != 0 && icalcomponent_times_are_cached(comp, ICALCOMPONENT_DTEND_CACHED)) {
+        return comp->cached_dtend;
+    }
+
+    inner = icalcomponent_get_inner(comp);
+    end_prop = icalcomponent_get_first_property(inner, ICAL_DTEND_PROPERTY);
+    dur_prop = icalcomponent_get_first_property(inner, ICAL_DURATION_PROPERTY);
+
     if (end_prop != 0) {
         ret = icalcomponent_get_datetime(comp, end_prop);
     } else if (dur_prop != 0) {
@@ -1503,6 +2034,11 @@ struct icaltimetype icalcomponent_get_dtend(icalcomponent *comp)
         ret = icaltime_add(start, duration);
     }
 
+    if (inner != 0) {
+        comp->cached_dtend = ret;
+        icalcomponent_set_times_cached(comp, ICALCOMPONENT_DTEND_CACHED);
+    }
+
     return ret;
 }
 
@@ -2015,7 +2551,7 @@ void icalcomponent_merge_component(icalcomponent *comp, icalcomponent *comp_to_m
     /* Step through each subcomponent of comp_to_merge, looking for VTIMEZONEs.
        For each VTIMEZONE found, check if we need to add it to comp and if we
        need to rename it and all TZID references to it. */
-    tzids_to_rename = icalarray_new(sizeof(char *), 16);
+    tzids_to_rename = icalarray_new(sizeof(struct icaltzid_rename), 16);
     subcomp = icalcomponent_get_first_component(comp_to_merge, ICAL_VTIMEZONE_COMPONENT);
     while (subcomp) {
         next_subcomp = icalcomponent_get_next_component(comp_to_merge, ICAL_VTIMEZONE_COMPONENT);
@@ -2033,28 +2569,31 @@ void icalcomponent_merge_component(icalcomponent *comp, icalcomponent *comp_to_m
 
         /* Now free the tzids_to_rename array. */
         for (i = 0; i < tzids_to_rename->num_elements; i++) {
-            free(icalarray_element_at(tzids_to_rename, i));
+            struct icaltzid_rename *rename = icalarray_element_at(tzids_to_rename, i);
+
+            free(rename->tzid);
+            free(rename->new_tzid);
         }
     }
     icalarray_free(tzids_to_rename);
     tzids_to_rename = 0;
     /* Now move all the components from comp_to_merge to comp, excluding
        VTIMEZONE components. */
-    subcomp = icalcomponent_get_first_component(comp_to_merge, ICAL_ANY_COMPONENT);
-    while (subcomp) {
-        next_subcomp = icalcomponent_get_next_component(comp_to_merge, ICAL_ANY_COMPONENT);
-        if (icalcomponent_isa(subcomp) != ICAL_VTIMEZONE_COMPONENT) {
-            icalcomponent_remove_component(comp_to_merge, subcomp);
-            icalcomponent_add_component(comp, subcomp);
-        }
-        subcomp = next_subcomp;
-    }
+    (void)icalcomponent_move_components(comp, comp_to_merge, ICAL_ANY_COMPONENT,
+                                        icalcomponent_is_not_vtimezone, 0);
 
     /* Free comp_to_merge. We have moved most of the subcomponents over to
        comp now. */
     icalcomponent_free(comp_to_merge);
 }
 
+static int icalcomponent_is_not_vtimezone(icalcomponent *comp, void *data)
+{
+    _unused(data);
+
+    return comp->kind != ICAL_VTIMEZONE_COMPONENT;
+}
+
 static void icalcomponent_merge_vtimezone(icalcomponent *comp,
                                           icalcomponent *vtimezone, icalarray *tzids_to_rename)
 {
@@ -2098,7 +2637,8 @@ static void icalcomponent_merge_vtimezone(icalcomponent *comp,
         return;
     }
 
-    if (!icalcomponent_compare_vtimezones(comp, vtimezone)) {
+    if (icalcomponent_compare_vtimezones(icaltimezone_get_component(existing_vtimezone),
+                                         vtimezone) != 1) {
         /* FIXME: Handle possible NEWFAILED error. */
 
         /* Now we have two different VTIMEZONEs with the same TZID. */
@@ -2115,55 +2655,59 @@ static void icalcomponent_handle_conflicting_vtimezones(icalcomponent *comp,
                                                         icalarray *tzids_to_rename)
 {
     int suffix, max_suffix = 0;
-    size_t i, num_elements, tzid_len;
-    char *tzid_copy, *new_tzid, suffix_buf[32];
-
-    _unused(tzid_prop);
+    size_t i, lower, upper, num_elements, tzid_len;
+    char *new_tzid, suffix_buf[32];
 
     /* Find the length of the TZID without any trailing digits. */
     tzid_len = icalcomponent_get_tzid_prefix_len(tzid);
 
-    /* Step through each of the VTIMEZONEs in comp. We may already have the
-       clashing VTIMEZONE in the calendar, but it may have been renamed
-       (i.e. a unique number added on the end of the TZID, e.g. 'London2').
-       So we compare the new VTIMEZONE with any VTIMEZONEs that have the
-       same prefix (e.g. 'London'). If it matches any of those, we have to
-       rename the TZIDs to that TZID, else we rename to a new TZID, using
-       the biggest numeric suffix found + 1. */
+    /* We may already have the clashing VTIMEZONE in the calendar, but it
+       may have been renamed (i.e. a unique number added on the end of the
+       TZID, e.g. 'London2'). So we compare the new VTIMEZONE with any
+       VTIMEZONEs that have the same prefix (e.g. 'London'). If it matches
+       any of those, we have to rename the TZIDs to that TZID, else we
+       rename to a new TZID, using the biggest numeric suffix found + 1.
+
+       The zones are sorted by TZID, so the ones starting with the prefix
+       are next to each other; find the first of them by binary search. */
+    icalcomponent_sort_timezones(comp);
+
     num_elements = comp->timezones ? comp->timezones->num_elements : 0;
-    for (i = 0; i < num_elements; i++) {
+    lower = 0;
+    upper = num_elements;
+    while (lower < upper) {
+        size_t middle = (lower + upper) >> 1;
+        icaltimezone *zone = icalarray_element_at(comp->timezones, middle);
+
+        if (strncmp(icaltimezone_get_tzid(zone), tzid, tzid_len) < 0) {
+            lower = middle + 1;
+        } else {
+            upper = middle;
+        }
+    }
+
+    for (i = lower; i < num_elements; i++) {
         icaltimezone *zone;
         const char *existing_tzid;
-        char *existing_tzid_copy;
         size_t existing_tzid_len;
 
         zone = icalarray_element_at(comp->timezones, i);
         existing_tzid = icaltimezone_get_tzid(zone);
 
+        if (strncmp(existing_tzid, tzid, tzid_len) != 0)
+            break;
+
         /* Find the length of the TZID without any trailing digits. */
         existing_tzid_len = icalcomponent_get_tzid_prefix_len(existing_tzid);
 
         /* Check if we have the same prefix. */
-        if (tzid_len == existing_tzid_len && !strncmp(tzid, existing_tzid, tzid_len)) {
+        if (tzid_len == existing_tzid_len) {
             /* Compare the VTIMEZONEs. */
-            if (icalcomponent_compare_vtimezones(icaltimezone_get_component(zone), vtimezone)) {
+            if (icalcomponent_compare_vtimezones(icaltimezone_get_component(zone),
+                                                 vtimezone) == 1) {
                 /* The VTIMEZONEs match, so we can use the existing VTIMEZONE. But
                    we have to rename TZIDs to this TZID. */
-                tzid_copy = strdup(tzid);
-                if (!tzid_copy) {
-                    icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-                    return;
-                }
-                existing_tzid_copy = strdup(existing_tzid);
-                if (!existing_tzid_copy) {
-                    icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-                    free(tzid_copy);
-                } else {
-                    icalarray_append(tzids_to_rename, tzid_copy);
-                    free(tzid_copy);
-                    icalarray_append(tzids_to_rename, existing_tzid_copy);
-                    free(existing_tzid_copy);
-                }
+                icalcomponent_add_tzid_rename(tzids_to_rename, tzid, existing_tzid);
                 return;
             } else {
                 /* FIXME: Handle possible NEWFAILED error. */
@@ -2179,25 +2723,23 @@ static void icalcomponent_handle_conflicting_vtimezones(icalcomponent *comp,
 
     /* We didn't find a VTIMEZONE that matched, so we have to rename the TZID,
        using the maximum numerical suffix found + 1. */
-    tzid_copy = strdup(tzid);
-    if (!tzid_copy) {
-        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-        return;
-    }
-
     snprintf(suffix_buf, sizeof(suffix_buf), "%i", max_suffix + 1);
     new_tzid = malloc(tzid_len + strlen(suffix_buf) + 1);
     if (!new_tzid) {
         icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-        free(tzid_copy);
         return;
     }
 
     strncpy(new_tzid, tzid, tzid_len);
     strcpy(new_tzid + tzid_len, suffix_buf);
-    icalarray_append(tzids_to_rename, tzid_copy);
-    icalarray_append(tzids_to_rename, new_tzid);
-    free(tzid_copy);
+    icalcomponent_add_tzid_rename(tzids_to_rename, tzid, new_tzid);
+
+    /* The TZIDs will refer to this VTIMEZONE under its new name, so it has
+       to move to comp as well. */
+    icalproperty_set_tzid(tzid_prop, new_tzid);
+    icalcomponent_remove_component(icalcomponent_get_parent(vtimezone), vtimezone);
+    icalcomponent_add_component(comp, vtimezone);
+
     free(new_tzid);
 }
 
@@ -2217,31 +2759,105 @@ static size_t icalcomponent_get_tzid_prefix_len(const char *tzid)
     return len;
 }
 
+static unsigned int icalcomponent_hash_string(const char *str)
+{
+    unsigned int hash = 2166136261U;
+
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619U;
+    }
+
+    return hash;
+}
+
+/* Adds a pair of a current TZID and the new TZID to rename it to. A TZID
+   that is already in the table keeps its first new name. */
+static void icalcomponent_add_tzid_rename(icalarray *tzids_to_rename,
+                                          const char *tzid, const char *new_tzid)
+{
+    struct icaltzid_rename rename;
+    size_t i;
+
+    for (i = 0; i < tzids_to_rename->num_elements; i++) {
+        struct icaltzid_rename *existing = icalarray_element_at(tzids_to_rename, i);
+
+        if (!strcmp(existing->tzid, tzid))
+            return;
+    }
+
+    rename.tzid = strdup(tzid);
+    rename.new_tzid = strdup(new_tzid);
+    if (!rename.tzid || !rename.new_tzid) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        free(rename.tzid);
+        free(rename.new_tzid);
+        return;
+    }
+    rename.hash = icalcomponent_hash_string(tzid);
+
+    icalarray_append(tzids_to_rename, &rename);
+}
+
 /**
  * Renames all references to the given TZIDs to a new name. rename_table
- * contains pairs of strings - a current TZID, and the new TZID to rename it
- * to.
+ * contains struct icaltzid_rename pairs of a current TZID, and the new TZID
+ * to rename it to. They are looked up through an open addressing hash table,
+ * so each TZID parameter costs one hash of its value.
  */
 static void icalcomponent_rename_tzids(icalcomponent *comp, icalarray *rename_table)
 {
-    icalcomponent_foreach_tzid(comp, icalcomponent_rename_tzids_callback, rename_table);
+    struct icaltzid_rename_index index;
+    size_t i;
+
+    index.renames = rename_table;
+    index.num_buckets = 16;
+    while (index.num_buckets < 2 * rename_table->num_elements) {
+        index.num_buckets *= 2;
+    }
+
+    index.buckets = (size_t *)calloc(index.num_buckets, sizeof(size_t));
+    if (!index.buckets) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return;
+    }
+
+    for (i = 0; i < rename_table->num_elements; i++) {
+        struct icaltzid_rename *rename = icalarray_element_at(rename_table, i);
+        size_t bucket = rename->hash & (index.num_buckets - 1);
+
+        while (index.buckets[bucket] != 0) {
+            bucket = (bucket + 1) & (index.num_buckets - 1);
+        }
+        index.buckets[bucket] = i + 1;
+    }
+
+    icalcomponent_foreach_tzid(comp, icalcomponent_rename_tzids_callback, &index);
+
+    free(index.buckets);
 }
 
 static void icalcomponent_rename_tzids_callback(icalparameter *param, void *data)
 {
-    icalarray *rename_table = data;
+    struct icaltzid_rename_index *index = data;
     const char *tzid;
-    size_t i;
+    unsigned int hash;
+    size_t bucket;
 
     tzid = icalparameter_get_tzid(param);
     if (!tzid)
         return;
 
-    /* Step through the rename table to see if the current TZID matches
-       any of the ones we want to rename. */
-    for (i = 0; i < rename_table->num_elements - 1; i += 2) {
-        if (!strcmp(tzid, icalarray_element_at(rename_table, i))) {
-            icalparameter_set_tzid(param, icalarray_element_at(rename_table, i + 1));
+    hash = icalcomponent_hash_string(tzid);
+
+    /* Probe the table to see if the current TZID matches any of the ones
+       we want to rename. */
+    for (bucket = hash & (index->num_buckets - 1);
+         index->buckets[bucket] != 0; bucket = (bucket + 1) & (index->num_buckets - 1)) {
+        struct icaltzid_rename *rename =
+            icalarray_element_at(index->renames, index->buckets[bucket] - 1);
+
+        if (rename->hash == hash && !strcmp(tzid, rename->tzid)) {
+            icalparameter_set_tzid(param, rename->new_tzid);
             break;
         }
     }
@@ -2291,6 +2907,16 @@ void icalcomponent_foreach_tzid(icalcomponent *comp,
  *  Returns the icaltimezone from the component corresponding to the given
  *  TZID, or NULL if the component does not have a corresponding VTIMEZONE.
  */
+static void icalcomponent_sort_timezones(icalcomponent *comp)
+{
+    if (comp->timezones && !comp->timezones_sorted) {
+        icalarray_sort(comp->timezones, icalcomponent_compare_timezone_fn);
+        comp->timezones_sorted = 1;
+        /* Sorting moves the zones that cached times point to */
+        icalcomponent_touch(comp);
+    }
+}
+
 icaltimezone *icalcomponent_get_timezone(icalcomponent *comp, const char *tzid)
 {
     icaltimezone *zone;
@@ -2302,10 +2928,7 @@ icaltimezone *icalcomponent_get_timezone(icalcomponent *comp, const char *tzid)
         return NULL;
 
     /* Sort the array if necessary (by the TZID string). */
-    if (!comp->timezones_sorted) {
-        icalarray_sort(comp->timezones, icalcomponent_compare_timezone_fn);
-        comp->timezones_sorted = 1;
-    }
+    icalcomponent_sort_timezones(comp);
 
     /* Do a simple binary search. */
     lower = middle = 0;
@@ -2351,65 +2974,353 @@ static int icalcomponent_compare_timezone_fn(const void *elem1, const void *elem
  * Compares 2 VTIMEZONE components to see if they match, ignoring their TZIDs.
  * It returns 1 if they match, 0 if they don't, or -1 on error.
  */
+/* Returns the text of a VTIMEZONE without its TZID property, computing it
+   only when the VTIMEZONE has changed since the last call. */
+static const char *icalcomponent_get_vtimezone_content(icalcomponent *vtimezone)
+{
+    char *buf, *buf_ptr;
+    size_t buf_size = 1024;
+    pvl_elem itr;
+
+    if (vtimezone->tz_content != 0 && vtimezone->tz_revision == vtimezone->revision) {
+        return vtimezone->tz_content;
+    }
+
+    buf = icalmemory_new_buffer(buf_size);
+    if (!buf) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+    buf_ptr = buf;
+
+    for (itr = pvl_head(vtimezone->properties); itr != 0; itr = pvl_next(itr)) {
+        icalproperty *prop = (icalproperty *) pvl_data(itr);
+        char *str;
+
+        if (icalproperty_isa(prop) == ICAL_TZID_PROPERTY)
+            continue;
+
+        str = icalproperty_as_ical_string_r(prop);
+        if (str) {
+            icalmemory_append_string(&buf, &buf_ptr, &buf_size, str);
+            free(str);
+        }
+    }
+
+    for (itr = pvl_head(vtimezone->components); itr != 0; itr = pvl_next(itr)) {
+        char *str = icalcomponent_as_ical_string_r((icalcomponent *) pvl_data(itr));
+
+        if (str) {
+            icalmemory_append_string(&buf, &buf_ptr, &buf_size, str);
+            free(str);
+        }
+    }
+
+    free(vtimezone->tz_content);
+    vtimezone->tz_content = buf;
+    vtimezone->tz_content_hash = icalcomponent_hash_string(buf);
+    vtimezone->tz_revision = vtimezone->revision;
+
+    return buf;
+}
+
+/* Returns 1 if the two VTIMEZONEs are the same apart from their TZIDs, 0 if
+   they differ and -1 if either has no TZID. The text compared is cached on
+   each VTIMEZONE, so comparing against a zone that is already part of a
+   calendar costs a hash comparison, and a string comparison on a match. */
 static int icalcomponent_compare_vtimezones(icalcomponent *vtimezone1, icalcomponent *vtimezone2)
 {
     icalproperty *prop1, *prop2;
-    const char *tzid1, *tzid2;
-    char *tzid2_copy, *string1, *string2;
-    int cmp;
+    const char *content1, *content2;
 
     /* Get the TZID property of the first VTIMEZONE. */
     prop1 = icalcomponent_get_first_property(vtimezone1, ICAL_TZID_PROPERTY);
-    if (!prop1)
-        return -1;
-
-    tzid1 = icalproperty_get_tzid(prop1);
-    if (!tzid1)
+    if (!prop1 || !icalproperty_get_tzid(prop1))
         return -1;
 
     /* Get the TZID property of the second VTIMEZONE. */
     prop2 = icalcomponent_get_first_property(vtimezone2, ICAL_TZID_PROPERTY);
-    if (!prop2)
+    if (!prop2 || !icalproperty_get_tzid(prop2))
         return -1;
 
-    tzid2 = icalproperty_get_tzid(prop2);
-    if (!tzid2)
+    content1 = icalcomponent_get_vtimezone_content(vtimezone1);
+    content2 = icalcomponent_get_vtimezone_content(vtimezone2);
+    if (!content1 || !content2)
         return -1;
 
-    /* Copy the second TZID, and set the property to the same as the first
-       TZID, since we don't care if these match of not. */
-    tzid2_copy = strdup(tzid2);
-    if (!tzid2_copy) {
-        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+    if (vtimezone1->tz_content_hash != vtimezone2->tz_content_hash)
         return 0;
+
+    return (strcmp(content1, content2) == 0) ? 1 : 0;
+}
+
+/* The 128 bit variant of MurmurHash3 for 32 bit platforms, by Austin
+   Appleby, who placed it in the public domain */
+
+#define ICALCOMPONENT_ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+static unsigned int icalcomponent_fmix32(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static void icalcomponent_murmur3_128(const void *key, size_t len, unsigned int seed,
+                                      unsigned int out[4])
+{
+    const unsigned char *data = (const unsigned char *)key;
+    const unsigned int c1 = 0x239b961bU, c2 = 0xab0e9789U;
+    const unsigned int c3 = 0x38b34ae5U, c4 = 0xa1e38b93U;
+    unsigned int h1 = seed, h2 = seed, h3 = seed, h4 = seed;
+    unsigned int k1, k2, k3, k4;
+    size_t nblocks = len / 16;
+    size_t i;
+
+    for (i = 0; i < nblocks; i++) {
+        const unsigned char *b = data + i * 16;
+
+        k1 = b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+        k2 = b[4] | (b[5] << 8) | (b[6] << 16) | ((unsigned int)b[7] << 24);
+        k3 = b[8] | (b[9] << 8) | (b[10] << 16) | ((unsigned int)b[11] << 24);
+        k4 = b[12] | (b[13] << 8) | (b[14] << 16) | ((unsigned int)b[15] << 24);
+
+        k1 *= c1; k1 = ICALCOMPONENT_ROTL32(k1, 15); k1 *= c2; h1 ^= k1;
+        h1 = ICALCOMPONENT_ROTL32(h1, 19); h1 += h2; h1 = h1 * 5 + 0x561ccd1bU;
+        k2 *= c2; k2 = ICALCOMPONENT_ROTL32(k2, 16); k2 *= c3; h2 ^= k2;
+        h2 = ICALCOMPONENT_ROTL32(h2, 17); h2 += h3; h2 = h2 * 5 + 0x0bcaa747U;
+        k3 *= c3; k3 = ICALCOMPONENT_ROTL32(k3, 17); k3 *= c4; h3 ^= k3;
+        h3 = ICALCOMPONENT_ROTL32(h3, 15); h3 += h4; h3 = h3 * 5 + 0x96cd1c35U;
+        k4 *= c4; k4 = ICALCOMPONENT_ROTL32(k4, 18); k4 *= c1; h4 ^= k4;
+        h4 = ICALCOMPONENT_ROTL32(h4, 13); h4 += h1; h4 = h4 * 5 + 0x32ac3b17U;
+    }
+
+    data += nblocks * 16;
+    k1 = k2 = k3 = k4 = 0;
+
+    switch (len & 15) {
+    case 15: k4 ^= (unsigned int)data[14] << 16; /* Falls through. */
+    case 14: k4 ^= (unsigned int)data[13] << 8; /* Falls through. */
+    case 13: k4 ^= data[12];
+        k4 *= c4; k4 = ICALCOMPONENT_ROTL32(k4, 18); k4 *= c1; h4 ^= k4;
+        /* Falls through. */
+    case 12: k3 ^= (unsigned int)data[11] << 24; /* Falls through. */
+    case 11: k3 ^= (unsigned int)data[10] << 16; /* Falls through. */
+    case 10: k3 ^= (unsigned int)data[9] << 8; /* Falls through. */
+    case 9: k3 ^= data[8];
+        k3 *= c3; k3 = ICALCOMPONENT_ROTL32(k3, 17); k3 *= c4; h3 ^= k3;
+        /* Falls through. */
+    case 8: k2 ^= (unsigned int)data[7] << 24; /* Falls through. */
+    case 7: k2 ^= (unsigned int)data[6] << 16; /* Falls through. */
+    case 6: k2 ^= (unsigned int)data[5] << 8; /* Falls through. */
+    case 5: k2 ^= data[4];
+        k2 *= c2; k2 = ICALCOMPONENT_ROTL32(k2, 16); k2 *= c3; h2 ^= k2;
+        /* Falls through. */
+    case 4: k1 ^= (unsigned int)data[3] << 24; /* Falls through. */
+    case 3: k1 ^= (unsigned int)data[2] << 16; /* Falls through. */
+    case 2: k1 ^= (unsigned int)data[1] << 8; /* Falls through. */
+    case 1: k1 ^= data[0];
+        k1 *= c1; k1 = ICALCOMPONENT_ROTL32(k1, 15); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= (unsigned int)len; h2 ^= (unsigned int)len;
+    h3 ^= (unsigned int)len; h4 ^= (unsigned int)len;
+
+    h1 += h2; h1 += h3; h1 += h4;
+    h2 += h1; h3 += h1; h4 += h1;
+
+    h1 = icalcomponent_fmix32(h1);
+    h2 = icalcomponent_fmix32(h2);
+    h3 = icalcomponent_fmix32(h3);
+    h4 = icalcomponent_fmix32(h4);
+
+    h1 += h2; h1 += h3; h1 += h4;
+    h2 += h1; h3 += h1; h4 += h1;
+
+    out[0] = h1;
+    out[1] = h2;
+    out[2] = h3;
+    out[3] = h4;
+}
+
+/* Hashes a string. A NULL string hashes like an empty one. */
+static void icalcomponent_fingerprint_string(const char *str, unsigned int out[4])
+{
+    icalcomponent_murmur3_128(str ? str : "", str ? strlen(str) : 0, 0, out);
+}
+
+/* Hashes the words of the given hashes, in order */
+static void icalcomponent_fingerprint_words(const unsigned int *words, size_t num_words,
+                                            unsigned int out[4])
+{
+    unsigned char buf[12 * 4];
+    size_t i;
+
+    for (i = 0; i < num_words && i < 12; i++) {
+        buf[4 * i] = (unsigned char)(words[i] & 0xff);
+        buf[4 * i + 1] = (unsigned char)((words[i] >> 8) & 0xff);
+        buf[4 * i + 2] = (unsigned char)((words[i] >> 16) & 0xff);
+        buf[4 * i + 3] = (unsigned char)((words[i] >> 24) & 0xff);
     }
 
-    icalproperty_set_tzid(prop2, tzid1);
+    icalcomponent_murmur3_128(buf, 4 * i, 0x69636172U, out);
+}
 
-    /* Now convert both VTIMEZONEs to strings and compare them. */
-    string1 = icalcomponent_as_ical_string_r(vtimezone1);
-    if (!string1) {
-        free(tzid2_copy);
-        return -1;
+/* Adds hash to sum, which makes the sum independent of the order in which
+   hashes are added */
+static void icalcomponent_fingerprint_add(unsigned int sum[4], const unsigned int hash[4])
+{
+    sum[0] += hash[0];
+    sum[1] += hash[1];
+    sum[2] += hash[2];
+    sum[3] += hash[3];
+}
+
+/* Converts between the words of a hash and the bytes of a fingerprint */
+static void icalcomponent_words_to_fingerprint(const unsigned int words[4],
+                                               icalfingerprint *fingerprint)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        fingerprint->digest[4 * i] = (unsigned char)(words[i] & 0xff);
+        fingerprint->digest[4 * i + 1] = (unsigned char)((words[i] >> 8) & 0xff);
+        fingerprint->digest[4 * i + 2] = (unsigned char)((words[i] >> 16) & 0xff);
+        fingerprint->digest[4 * i + 3] = (unsigned char)((words[i] >> 24) & 0xff);
     }
+}
 
-    string2 = icalcomponent_as_ical_string_r(vtimezone2);
-    if (!string2) {
-        free(string1);
-        free(tzid2_copy);
-        return -1;
+static void icalcomponent_fingerprint_to_words(const icalfingerprint *fingerprint,
+                                               unsigned int words[4])
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        words[i] = (unsigned int)fingerprint->digest[4 * i] |
+                   ((unsigned int)fingerprint->digest[4 * i + 1] << 8) |
+                   ((unsigned int)fingerprint->digest[4 * i + 2] << 16) |
+                   ((unsigned int)fingerprint->digest[4 * i + 3] << 24);
+    }
+}
+
+/* Hashes a property from its name, its value as the serializer writes it
+   and the sum of the hashes of its parameters, which RFC 5545 leaves
+   unordered. */
+static void icalcomponent_fingerprint_property(icalproperty *prop, unsigned int out[4])
+{
+    unsigned int words[12];
+    icalparameter *param;
+    icalvalue *value;
+    char *str;
+
+    memset(words, 0, sizeof(words));
+
+    str = icalproperty_get_property_name_r(prop);
+    icalcomponent_fingerprint_string(str, &words[0]);
+    free(str);
+
+    value = icalproperty_get_value(prop);
+    str = value ? icalvalue_as_ical_string_r(value) : 0;
+    icalcomponent_fingerprint_string(str, &words[4]);
+    free(str);
+
+    for (param = icalproperty_get_first_parameter(prop, ICAL_ANY_PARAMETER);
+         param != 0;
+         param = icalproperty_get_next_parameter(prop, ICAL_ANY_PARAMETER)) {
+        unsigned int hash[4];
+
+        str = icalparameter_as_ical_string_r(param);
+        icalcomponent_fingerprint_string(str, hash);
+        free(str);
+        icalcomponent_fingerprint_add(&words[8], hash);
+    }
+
+    icalcomponent_fingerprint_words(words, 12, out);
+}
+
+icalfingerprint icalcomponent_fingerprint(icalcomponent *comp)
+{
+    unsigned int words[12], hash[4];
+    icalfingerprint fingerprint;
+    pvl_elem itr;
+
+    memset(&fingerprint, 0, sizeof(fingerprint));
+    icalerror_check_arg_rx((comp != 0), "comp", fingerprint);
+
+    if (comp->fingerprint_cached && comp->fingerprint_revision == comp->revision) {
+        return comp->fingerprint;
     }
 
-    cmp = strcmp(string1, string2);
+    memset(words, 0, sizeof(words));
 
-    free(string1);
-    free(string2);
+    icalcomponent_fingerprint_string(comp->kind == ICAL_X_COMPONENT ?
+                                     comp->x_name : icalcomponent_kind_to_string(comp->kind),
+                                     &words[0]);
 
-    /* Now reset the second TZID. */
-    icalproperty_set_tzid(prop2, tzid2_copy);
-    free(tzid2_copy);
+    for (itr = pvl_head(comp->properties); itr != 0; itr = pvl_next(itr)) {
+        icalcomponent_fingerprint_property((icalproperty *) pvl_data(itr), hash);
+        icalcomponent_fingerprint_add(&words[4], hash);
+    }
+
+    /* Children keep fingerprints of their own, so a change below only
+       rehashes the properties of the components on the way up */
+    for (itr = pvl_head(comp->components); itr != 0; itr = pvl_next(itr)) {
+        icalfingerprint child = icalcomponent_fingerprint((icalcomponent *) pvl_data(itr));
+
+        icalcomponent_fingerprint_to_words(&child, hash);
+        icalcomponent_fingerprint_add(&words[8], hash);
+    }
+
+    icalcomponent_fingerprint_words(words, 12, hash);
+    icalcomponent_words_to_fingerprint(hash, &fingerprint);
+
+    comp->fingerprint = fingerprint;
+    comp->fingerprint_revision = comp->revision;
+    comp->fingerprint_cached = 1;
+
+    return fingerprint;
+}
+
+icalfingerprint icalcomponent_property_fingerprint(icalproperty *prop)
+{
+    icalfingerprint fingerprint;
+    unsigned int hash[4];
+
+    icalcomponent_fingerprint_property(prop, hash);
+    icalcomponent_words_to_fingerprint(hash, &fingerprint);
+
+    return fingerprint;
+}
+
+int icalfingerprint_compare(const icalfingerprint *a, const icalfingerprint *b)
+{
+    return memcmp(a->digest, b->digest, sizeof(a->digest));
+}
+
+char *icalfingerprint_as_string_r(const icalfingerprint *fingerprint)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *str;
+    size_t i;
+
+    icalerror_check_arg_rz((fingerprint != 0), "fingerprint");
+
+    str = icalmemory_new_buffer(2 * sizeof(fingerprint->digest) + 1);
+    if (!str) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(fingerprint->digest); i++) {
+        str[2 * i] = hex[fingerprint->digest[i] >> 4];
+        str[2 * i + 1] = hex[fingerprint->digest[i] & 0xf];
+    }
+    str[2 * i] = '\0';
 
-    return (cmp == 0) ? 1 : 0;
+    return str;
 }
 
 /**
@@ -36,6 +36,13 @@ typedef struct icalcompiter
 
 } icalcompiter;
 
+/** A 128 bit hash of the content of a component,
+    see icalcomponent_fingerprint() */
+typedef struct icalfingerprint
+{
+    unsigned char digest[16];
+} icalfingerprint;
+
 LIBICAL_ICAL_EXPORT icalcomponent *icalcomponent_new(icalcomponent_kind kind);
 
 LIBICAL_ICAL_EXPORT icalcomponent *icalcomponent_new_clone(icalcomponent *component);
@@ -56,6 +63,9 @@ LIBICAL_ICAL_EXPORT int icalcomponent_is_valid(icalcomponent *component);
 
 LIBICAL_ICAL_EXPORT icalcomponent_kind icalcomponent_isa(const icalcomponent *component);
 
+/** Return the name of an ICAL_X_COMPONENT, or NULL for other kinds */
+LIBICAL_ICAL_EXPORT const char *icalcomponent_get_x_name(const icalcomponent *component);
+
 LIBICAL_ICAL_EXPORT int icalcomponent_isa_component(void *component);
 
 /*
@@ -95,9 +105,64 @@ LIBICAL_ICAL_EXPORT icalcomponent *icalcomponent_get_inner(icalcomponent *comp);
 
 LIBICAL_ICAL_EXPORT void icalcomponent_add_component(icalcomponent *parent, icalcomponent *child);
 
+/* Removal takes constant time, except for a VTIMEZONE, which also leaves
+   the parent's sorted array of timezones */
 LIBICAL_ICAL_EXPORT void icalcomponent_remove_component(icalcomponent *parent,
                                                         icalcomponent *child);
 
+/** Remove and free, in one pass, all children of the given kind (or of any
+    kind, for ICAL_ANY_COMPONENT) for which match returns nonzero. A NULL
+    match selects them all. Returns the number of children removed. */
+LIBICAL_ICAL_EXPORT size_t icalcomponent_remove_components(icalcomponent *parent,
+                                                           icalcomponent_kind kind,
+                                                           int (*match) (icalcomponent *child,
+                                                                         void *data),
+                                                           void *data);
+
+/** Move, in one pass, all children of 'from' of the given kind for which
+    match returns nonzero to 'to', as icalcomponent_add_component() would
+    add them. A NULL match selects them all. Returns the number of children
+    moved. */
+LIBICAL_ICAL_EXPORT size_t icalcomponent_move_components(icalcomponent *to,
+                                                         icalcomponent *from,
+                                                         icalcomponent_kind kind,
+                                                         int (*match) (icalcomponent *child,
+                                                                       void *data),
+                                                         void *data);
+
+/** What icalcomponent_sort_components() orders children by. Keys are
+    compared by group, then time, then text with strcmp(); a NULL text
+    sorts first. */
+typedef struct icalcomponent_sortkey
+{
+    int group;
+    time_t time;
+    const char *text;
+} icalcomponent_sortkey;
+
+/** Fills in the key of a child. The key starts out zeroed, and text must
+    stay valid until the sort returns. */
+typedef void (*icalcomponent_sortkey_fn) (icalcomponent *child,
+                                          icalcomponent_sortkey *key, void *data);
+
+/** Sort by DTSTART in UTC seconds; children without one go last */
+LIBICAL_ICAL_EXPORT void icalcomponent_sortkey_dtstart(icalcomponent *child,
+                                                       icalcomponent_sortkey *key, void *data);
+
+/** Sort by UID; children without one go last */
+LIBICAL_ICAL_EXPORT void icalcomponent_sortkey_uid(icalcomponent *child,
+                                                   icalcomponent_sortkey *key, void *data);
+
+/** Reorder the children of the given kind (or all of them, for
+    ICAL_ANY_COMPONENT) by the keys keyfn gives them, which is
+    icalcomponent_sortkey_dtstart() when NULL. Each key is computed once,
+    the sort is stable, and children of other kinds keep their places.
+    Returns the number of children sorted. */
+LIBICAL_ICAL_EXPORT size_t icalcomponent_sort_components(icalcomponent *comp,
+                                                         icalcomponent_kind kind,
+                                                         icalcomponent_sortkey_fn keyfn,
+                                                         void *data);
+
 LIBICAL_ICAL_EXPORT int icalcomponent_count_components(icalcomponent *component,
                                                        icalcomponent_kind kind);
 
@@ -155,6 +220,14 @@ LIBICAL_ICAL_EXPORT icalcomponent *icalcomponent_get_parent(icalcomponent *compo
 LIBICAL_ICAL_EXPORT void icalcomponent_set_parent(icalcomponent *component,
                                                   icalcomponent *parent);
 
+/** Return a counter of the changes made to the component and everything
+   below it. It grows whenever a property, parameter, value or child
+   anywhere in the subtree is added, removed or changed, so an index built
+   over the component can tell whether it is still up to date. Revisions
+   are never 0 and never given out twice in a process, so a component
+   allocated where a freed one was does not share the freed one's. */
+LIBICAL_ICAL_EXPORT unsigned long icalcomponent_get_revision(icalcomponent *component);
+
 /* Kind conversion routines */
 
 LIBICAL_ICAL_EXPORT int icalcomponent_kind_is_valid(const icalcomponent_kind kind);
@@ -177,6 +250,23 @@ LIBICAL_ICAL_EXPORT icalcomponent *icalcomponent_get_first_real_component(icalco
    times of an event in UTC */
 LIBICAL_ICAL_EXPORT struct icaltime_span icalcomponent_get_span(icalcomponent *comp);
 
+/** Return a hash of what a component means rather than how it is written:
+   its kind, the names, values and parameters of its properties and the
+   fingerprints of its children. Properties, parameters and children may
+   appear in any order, and values are hashed as the serializer writes
+   them, so a calendar that is parsed and written out again keeps its
+   fingerprint. The result is cached on each component in the tree and
+   recomputed only for the parts that have changed since. */
+LIBICAL_ICAL_EXPORT icalfingerprint icalcomponent_fingerprint(icalcomponent *comp);
+
+/** Compare two fingerprints like memcmp(), returning 0 if they are equal */
+LIBICAL_ICAL_EXPORT int icalfingerprint_compare(const icalfingerprint *a,
+                                                const icalfingerprint *b);
+
+/** Return a fingerprint as 32 hexadecimal digits. The caller owns the
+   string. */
+LIBICAL_ICAL_EXPORT char *icalfingerprint_as_string_r(const icalfingerprint *fingerprint);
+
 /******************** Convenience routines **********************/
 
 LIBICAL_ICAL_EXPORT void icalcomponent_set_dtstart(icalcomponent *comp, struct icaltimetype v);
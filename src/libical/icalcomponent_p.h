@@ -0,0 +1,28 @@
+/*======================================================================
+ FILE: icalcomponent_p.h
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+======================================================================*/
+
+#ifndef ICALCOMPONENT_P_H
+#define ICALCOMPONENT_P_H
+
+#include "icalcomponent.h"
+
+/* Record that something in the tree containing comp has changed, so that
+   times cached by the component accessors are recomputed. comp may be 0. */
+LIBICAL_ICAL_NO_EXPORT void icalcomponent_touch(icalcomponent *comp);
+
+/* The hash that icalcomponent_fingerprint() combines for each property */
+LIBICAL_ICAL_NO_EXPORT icalfingerprint icalcomponent_property_fingerprint(icalproperty *prop);
+
+#endif /* ICALCOMPONENT_P_H */
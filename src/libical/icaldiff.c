@@ -0,0 +1,863 @@
+/*======================================================================
+ FILE: icaldiff.c
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+======================================================================*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "icaldiff.h"
+#include "icalcomponent_p.h"
+#include "icalerror.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ICALDIFF_PATCH             "X-LIC-PATCH"
+#define ICALDIFF_ADD_PROPERTY      "X-LIC-ADD-PROPERTY"
+#define ICALDIFF_REMOVE_PROPERTY   "X-LIC-REMOVE-PROPERTY"
+#define ICALDIFF_SET_PROPERTY      "X-LIC-SET-PROPERTY"
+#define ICALDIFF_ADD_COMPONENT     "X-LIC-ADD-COMPONENT"
+#define ICALDIFF_REMOVE_COMPONENT  "X-LIC-REMOVE-COMPONENT"
+#define ICALDIFF_PATCH_COMPONENT   "X-LIC-PATCH-COMPONENT"
+#define ICALDIFF_OCCURRENCE        "X-LIC-OCCURRENCE"
+
+static int icaldiff_is(icalcomponent *comp, const char *x_name)
+{
+    const char *name = icalcomponent_get_x_name(comp);
+
+    return icalcomponent_isa(comp) == ICAL_X_COMPONENT &&
+           name != 0 && strcasecmp(name, x_name) == 0;
+}
+
+/* What the diff needs of a property or child, worked out once each.
+   Entries are matched by sorting both sides on a key and walking them
+   together, so that equal keys pair up in document order. */
+struct icaldiff_entry
+{
+    size_t index;               /**< position in its component */
+    size_t match;               /**< index of the entry it pairs with, or ICALDIFF_NO_MATCH */
+};
+
+#define ICALDIFF_NO_MATCH ((size_t)-1)
+
+struct icaldiff_prop_entry
+{
+    struct icaldiff_entry entry;
+    icalproperty *prop;
+    icalfingerprint fingerprint;
+    char *name;                 /**< property name, 0 if it has none */
+    int side;                   /**< 0 for the old version, 1 for the new one */
+    size_t num_named[2];        /**< properties with this name on each side */
+};
+
+struct icaldiff_child_entry
+{
+    struct icaldiff_entry entry;
+    icalcomponent *comp;
+    icalfingerprint fingerprint;
+    int key_class;              /**< one of the ICALDIFF_KEY_ values */
+    icalcomponent_kind kind;
+    const char *x_name;         /**< for X components only */
+    icalproperty_kind id_kind;
+    char *id;                   /**< value of the UID or TZID */
+    char *rid;                  /**< value of the RECURRENCE-ID, 0 if none */
+    size_t occurrence;          /**< earlier children with the same key */
+};
+
+/* Children are matched by content when they have no UID or TZID, and by
+   identity when they do; some that have one can match nothing at all */
+#define ICALDIFF_KEY_NONE     0
+#define ICALDIFF_KEY_CONTENT  1
+#define ICALDIFF_KEY_IDENTITY 2
+
+static int icaldiff_compare_index(const struct icaldiff_entry *a, const struct icaldiff_entry *b)
+{
+    return (a->index > b->index) - (a->index < b->index);
+}
+
+static int icaldiff_compare_strings(const char *a, const char *b, int nocase)
+{
+    if (a == 0 || b == 0) {
+        return (a != 0) - (b != 0);
+    }
+
+    return nocase ? strcasecmp(a, b) : strcmp(a, b);
+}
+
+static int icaldiff_compare_prop_key(const void *a, const void *b)
+{
+    const struct icaldiff_prop_entry *pa = *(struct icaldiff_prop_entry * const *)a;
+    const struct icaldiff_prop_entry *pb = *(struct icaldiff_prop_entry * const *)b;
+
+    return icalfingerprint_compare(&pa->fingerprint, &pb->fingerprint);
+}
+
+static int icaldiff_compare_prop(const void *a, const void *b)
+{
+    int cmp = icaldiff_compare_prop_key(a, b);
+
+    return cmp != 0 ? cmp :
+        icaldiff_compare_index(*(struct icaldiff_entry * const *)a,
+                               *(struct icaldiff_entry * const *)b);
+}
+
+static int icaldiff_compare_prop_name(const void *a, const void *b)
+{
+    const struct icaldiff_prop_entry *pa = *(struct icaldiff_prop_entry * const *)a;
+    const struct icaldiff_prop_entry *pb = *(struct icaldiff_prop_entry * const *)b;
+
+    return icaldiff_compare_strings(pa->name, pb->name, 1);
+}
+
+static int icaldiff_compare_child_key(const void *a, const void *b)
+{
+    const struct icaldiff_child_entry *ca = *(struct icaldiff_child_entry * const *)a;
+    const struct icaldiff_child_entry *cb = *(struct icaldiff_child_entry * const *)b;
+    int cmp;
+
+    if (ca->key_class != cb->key_class) {
+        return ca->key_class - cb->key_class;
+    }
+
+    switch (ca->key_class) {
+    case ICALDIFF_KEY_CONTENT:
+        return icalfingerprint_compare(&ca->fingerprint, &cb->fingerprint);
+
+    case ICALDIFF_KEY_IDENTITY:
+        if (ca->kind != cb->kind) {
+            return (int)ca->kind - (int)cb->kind;
+        }
+        if ((cmp = icaldiff_compare_strings(ca->x_name, cb->x_name, 1)) != 0) {
+            return cmp;
+        }
+        if (ca->id_kind != cb->id_kind) {
+            return (int)ca->id_kind - (int)cb->id_kind;
+        }
+        if ((cmp = icaldiff_compare_strings(ca->id, cb->id, 0)) != 0) {
+            return cmp;
+        }
+        return icaldiff_compare_strings(ca->rid, cb->rid, 0);
+
+    default:
+        return 0;
+    }
+}
+
+static int icaldiff_compare_child(const void *a, const void *b)
+{
+    int cmp = icaldiff_compare_child_key(a, b);
+
+    return cmp != 0 ? cmp :
+        icaldiff_compare_index(*(struct icaldiff_entry * const *)a,
+                               *(struct icaldiff_entry * const *)b);
+}
+
+/* Pairs the entries of a and b, sorted with compare, whose keys are equal
+   by compare_key. Within a run of equal keys the first of a pairs with
+   the first of b, and so on. If matches is given, an entry of a it
+   rejects is left unpaired. */
+static void icaldiff_match(void **a, size_t num_a, void **b, size_t num_b,
+                           int (*compare)(const void *, const void *),
+                           int (*compare_key)(const void *, const void *),
+                           int (*matches)(const void *))
+{
+    size_t i = 0, j = 0;
+
+    qsort(a, num_a, sizeof(void *), compare);
+    qsort(b, num_b, sizeof(void *), compare);
+
+    while (i < num_a && j < num_b) {
+        int cmp = compare_key(&a[i], &b[j]);
+
+        if (cmp < 0) {
+            i++;
+        } else if (cmp > 0) {
+            j++;
+        } else {
+            if (matches == 0 || matches(a[i])) {
+                ((struct icaldiff_entry *)a[i])->match = ((struct icaldiff_entry *)b[j])->index;
+                ((struct icaldiff_entry *)b[j])->match = ((struct icaldiff_entry *)a[i])->index;
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+static int icaldiff_child_matches(const void *c)
+{
+    return ((const struct icaldiff_child_entry *)c)->key_class != ICALDIFF_KEY_NONE;
+}
+
+/* Returns the property that names a child, or 0 if it has none */
+static icalproperty *icaldiff_get_id_property(icalcomponent *comp)
+{
+    icalproperty *prop = icalcomponent_get_first_property(comp, ICAL_UID_PROPERTY);
+
+    if (prop == 0 && icalcomponent_isa(comp) == ICAL_VTIMEZONE_COMPONENT) {
+        prop = icalcomponent_get_first_property(comp, ICAL_TZID_PROPERTY);
+    }
+
+    return prop;
+}
+
+/* Fills in what identifies comp: by its UID or TZID and RECURRENCE-ID if
+   it has one, else by its content */
+static void icaldiff_init_child(struct icaldiff_child_entry *c, icalcomponent *comp, size_t index)
+{
+    icalproperty *id = icaldiff_get_id_property(comp);
+    icalproperty *rid;
+
+    memset(c, 0, sizeof(*c));
+    c->entry.index = index;
+    c->entry.match = ICALDIFF_NO_MATCH;
+    c->comp = comp;
+    c->fingerprint = icalcomponent_fingerprint(comp);
+    c->kind = icalcomponent_isa(comp);
+
+    if (id == 0) {
+        c->key_class = ICALDIFF_KEY_CONTENT;
+        return;
+    }
+
+    c->key_class = ICALDIFF_KEY_IDENTITY;
+    c->id_kind = icalproperty_isa(id);
+    if ((c->id = icalproperty_get_value_as_string_r(id)) == 0) {
+        c->key_class = ICALDIFF_KEY_NONE;
+    }
+    if (c->kind == ICAL_X_COMPONENT &&
+        (c->x_name = icalcomponent_get_x_name(comp)) == 0) {
+        c->key_class = ICALDIFF_KEY_NONE;
+    }
+    rid = icalcomponent_get_first_property(comp, ICAL_RECURRENCEID_PROPERTY);
+    if (rid != 0 && (c->rid = icalproperty_get_value_as_string_r(rid)) == 0) {
+        c->key_class = ICALDIFF_KEY_NONE;
+    }
+}
+
+static void icaldiff_free_children(struct icaldiff_child_entry *children, size_t num_children)
+{
+    size_t i;
+
+    if (children == 0) {
+        return;
+    }
+    for (i = 0; i < num_children; i++) {
+        free(children[i].id);
+        free(children[i].rid);
+    }
+    free(children);
+}
+
+/* Numbers the children sorted by icaldiff_compare_child() that share a
+   key, in document order */
+static void icaldiff_number_children(void **sorted, size_t num)
+{
+    size_t i;
+
+    for (i = 0; i < num; i++) {
+        struct icaldiff_child_entry *c = (struct icaldiff_child_entry *)sorted[i];
+
+        c->occurrence = (i > 0 && icaldiff_compare_child_key(&sorted[i - 1], &sorted[i]) == 0) ?
+            ((struct icaldiff_child_entry *)sorted[i - 1])->occurrence + 1 : 0;
+    }
+}
+
+/* Returns a component that only carries what identifies c, including
+   which of the children with the same identity it is */
+static icalcomponent *icaldiff_new_stub(const struct icaldiff_child_entry *c)
+{
+    icalcomponent *comp = c->comp;
+    icalproperty *id = icaldiff_get_id_property(comp);
+    icalproperty *rid;
+    icalcomponent *stub;
+
+    if (id == 0) {
+        return icalcomponent_new_clone(comp);
+    }
+
+    if (icalcomponent_isa(comp) == ICAL_X_COMPONENT) {
+        stub = icalcomponent_new_x(icalcomponent_get_x_name(comp));
+    } else {
+        stub = icalcomponent_new(icalcomponent_isa(comp));
+    }
+    if (stub == 0) {
+        return 0;
+    }
+
+    icalcomponent_add_property(stub, icalproperty_new_clone(id));
+    rid = icalcomponent_get_first_property(comp, ICAL_RECURRENCEID_PROPERTY);
+    if (rid != 0) {
+        icalcomponent_add_property(stub, icalproperty_new_clone(rid));
+    }
+    if (c->occurrence > 0) {
+        char occurrence[32];
+        icalproperty *prop;
+
+        snprintf(occurrence, sizeof(occurrence), "%lu", (unsigned long)c->occurrence);
+        prop = icalproperty_new_x(occurrence);
+        icalproperty_set_x_name(prop, ICALDIFF_OCCURRENCE);
+        icalcomponent_add_property(stub, prop);
+    }
+
+    return stub;
+}
+
+/* The children of a component being patched, sorted by key once so that
+   each operation finds its child by a binary search */
+struct icaldiff_lookup
+{
+    struct icaldiff_child_entry *comps;
+    void **sorted;
+    size_t num;
+};
+
+static struct icaldiff_child_entry *icaldiff_get_components(icalcomponent *comp,
+                                                            size_t *num_comps);
+static void **icaldiff_pointers(void *base, size_t n, size_t size);
+
+static int icaldiff_lookup_init(struct icaldiff_lookup *lookup, icalcomponent *comp)
+{
+    if (lookup->comps != 0) {
+        return 0;
+    }
+
+    if ((lookup->comps = icaldiff_get_components(comp, &lookup->num)) == 0 ||
+        (lookup->sorted = icaldiff_pointers(lookup->comps, lookup->num,
+                                            sizeof(*lookup->comps))) == 0) {
+        return -1;
+    }
+    qsort(lookup->sorted, lookup->num, sizeof(void *), icaldiff_compare_child);
+    icaldiff_number_children(lookup->sorted, lookup->num);
+
+    return 0;
+}
+
+static void icaldiff_lookup_free(struct icaldiff_lookup *lookup)
+{
+    icaldiff_free_children(lookup->comps, lookup->num);
+    free(lookup->sorted);
+}
+
+/* Returns the child that stub identifies, or 0. Each child is returned
+   once at most: children that are identified by content alone are told
+   apart by the order they are asked for in, all others by the
+   X-LIC-OCCURRENCE of the stub. */
+static icalcomponent *icaldiff_find_child(struct icaldiff_lookup *lookup, icalcomponent *stub)
+{
+    struct icaldiff_child_entry key;
+    const void *pkey = &key;
+    icalproperty *prop;
+    icalcomponent *found = 0;
+    size_t lo = 0, hi = lookup->num, i;
+
+    icaldiff_init_child(&key, stub, 0);
+
+    for (prop = icalcomponent_get_first_property(stub, ICAL_X_PROPERTY);
+         prop != 0; prop = icalcomponent_get_next_property(stub, ICAL_X_PROPERTY)) {
+        const char *name = icalproperty_get_x_name(prop);
+
+        if (name != 0 && strcasecmp(name, ICALDIFF_OCCURRENCE) == 0 &&
+            icalproperty_get_x(prop) != 0) {
+            key.occurrence = strtoul(icalproperty_get_x(prop), 0, 10);
+        }
+    }
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (icaldiff_compare_child_key(&lookup->sorted[mid], &pkey) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (i = lo; key.key_class != ICALDIFF_KEY_NONE && i < lookup->num &&
+         icaldiff_compare_child_key(&lookup->sorted[i], &pkey) == 0; i++) {
+        struct icaldiff_child_entry *c = (struct icaldiff_child_entry *)lookup->sorted[i];
+
+        if (c->entry.match == ICALDIFF_NO_MATCH &&
+            (key.key_class == ICALDIFF_KEY_CONTENT || c->occurrence == key.occurrence)) {
+            c->entry.match = 0;
+            found = c->comp;
+            break;
+        }
+    }
+
+    free(key.id);
+    free(key.rid);
+
+    return found;
+}
+
+static struct icaldiff_prop_entry *icaldiff_get_properties(icalcomponent *comp, int side,
+                                                           size_t *num_props)
+{
+    struct icaldiff_prop_entry *props;
+    icalproperty *prop;
+    size_t n = 0;
+
+    props = calloc((size_t)icalcomponent_count_properties(comp, ICAL_ANY_PROPERTY) + 1,
+                   sizeof(*props));
+    if (props == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    for (prop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
+         prop != 0; prop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY)) {
+        props[n].entry.index = n;
+        props[n].entry.match = ICALDIFF_NO_MATCH;
+        props[n].prop = prop;
+        props[n].fingerprint = icalcomponent_property_fingerprint(prop);
+        props[n].name = icalproperty_get_property_name_r(prop);
+        props[n].side = side;
+        n++;
+    }
+    *num_props = n;
+
+    return props;
+}
+
+static void icaldiff_free_properties(struct icaldiff_prop_entry *props, size_t num_props)
+{
+    size_t i;
+
+    if (props == 0) {
+        return;
+    }
+    for (i = 0; i < num_props; i++) {
+        free(props[i].name);
+    }
+    free(props);
+}
+
+static struct icaldiff_child_entry *icaldiff_get_components(icalcomponent *comp,
+                                                            size_t *num_comps)
+{
+    struct icaldiff_child_entry *comps;
+    icalcomponent *child;
+    size_t n = 0;
+
+    comps = calloc((size_t)icalcomponent_count_components(comp, ICAL_ANY_COMPONENT) + 1,
+                   sizeof(*comps));
+    if (comps == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    for (child = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+         child != 0; child = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT)) {
+        icaldiff_init_child(&comps[n], child, n);
+        n++;
+    }
+    *num_comps = n;
+
+    return comps;
+}
+
+/* Returns an array of pointers to the n entries of size size at base */
+static void **icaldiff_pointers(void *base, size_t n, size_t size)
+{
+    void **ptrs = malloc((n + 1) * sizeof(void *));
+    size_t i;
+
+    if (ptrs != 0) {
+        for (i = 0; i < n; i++) {
+            ptrs[i] = (char *)base + i * size;
+        }
+    }
+
+    return ptrs;
+}
+
+/* Counts, for each property of a and b, the properties with its name on
+   either side */
+static void icaldiff_count_named(void **all, size_t num_all)
+{
+    size_t i, j, k;
+
+    qsort(all, num_all, sizeof(void *), icaldiff_compare_prop_name);
+
+    for (i = 0; i < num_all; i = j) {
+        size_t num_named[2] = { 0, 0 };
+
+        for (j = i; j < num_all && icaldiff_compare_prop_name(&all[i], &all[j]) == 0; j++) {
+            num_named[((struct icaldiff_prop_entry *)all[j])->side]++;
+        }
+        if (((struct icaldiff_prop_entry *)all[i])->name == 0) {
+            /* A property without a name is never replaced by name */
+            continue;
+        }
+        for (k = i; k < j; k++) {
+            ((struct icaldiff_prop_entry *)all[k])->num_named[0] = num_named[0];
+            ((struct icaldiff_prop_entry *)all[k])->num_named[1] = num_named[1];
+        }
+    }
+}
+
+/* Adds op to patch if it has anything in it, and frees it otherwise */
+static void icaldiff_add_op(icalcomponent *patch, icalcomponent *op)
+{
+    if (icalcomponent_count_properties(op, ICAL_ANY_PROPERTY) != 0 ||
+        icalcomponent_count_components(op, ICAL_ANY_COMPONENT) != 0) {
+        icalcomponent_add_component(patch, op);
+    } else {
+        icalcomponent_free(op);
+    }
+}
+
+/* A property that occurs once in both versions is replaced by name,
+   which keeps the old value out of the patch */
+static int icaldiff_set_by_name(const struct icaldiff_prop_entry *p)
+{
+    return p->num_named[0] == 1 && p->num_named[1] == 1;
+}
+
+static int icaldiff_diff_properties(icalcomponent *a, icalcomponent *b, icalcomponent *patch)
+{
+    struct icaldiff_prop_entry *props_a, *props_b;
+    size_t num_a = 0, num_b = 0, i, j;
+    void **sorted_a = 0, **sorted_b = 0, **all = 0;
+    icalcomponent *remove_op, *set_op, *add_op;
+
+    props_a = icaldiff_get_properties(a, 0, &num_a);
+    props_b = icaldiff_get_properties(b, 1, &num_b);
+    if (props_a != 0 && props_b != 0) {
+        sorted_a = icaldiff_pointers(props_a, num_a, sizeof(*props_a));
+        sorted_b = icaldiff_pointers(props_b, num_b, sizeof(*props_b));
+        all = malloc((num_a + num_b + 1) * sizeof(void *));
+    }
+    if (sorted_a == 0 || sorted_b == 0 || all == 0) {
+        icaldiff_free_properties(props_a, num_a);
+        icaldiff_free_properties(props_b, num_b);
+        free(sorted_a);
+        free(sorted_b);
+        free(all);
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return -1;
+    }
+
+    memcpy(all, sorted_a, num_a * sizeof(void *));
+    memcpy(all + num_a, sorted_b, num_b * sizeof(void *));
+    icaldiff_count_named(all, num_a + num_b);
+
+    /* Properties that appear unchanged in both need no operation */
+    icaldiff_match(sorted_a, num_a, sorted_b, num_b,
+                   icaldiff_compare_prop, icaldiff_compare_prop_key, 0);
+
+    remove_op = icalcomponent_new_x(ICALDIFF_REMOVE_PROPERTY);
+    set_op = icalcomponent_new_x(ICALDIFF_SET_PROPERTY);
+    add_op = icalcomponent_new_x(ICALDIFF_ADD_PROPERTY);
+
+    for (i = 0; i < num_a; i++) {
+        if (props_a[i].entry.match == ICALDIFF_NO_MATCH && !icaldiff_set_by_name(&props_a[i])) {
+            icalcomponent_add_property(remove_op, icalproperty_new_clone(props_a[i].prop));
+        }
+    }
+    for (j = 0; j < num_b; j++) {
+        if (props_b[j].entry.match != ICALDIFF_NO_MATCH) {
+            continue;
+        }
+        if (icaldiff_set_by_name(&props_b[j])) {
+            icalcomponent_add_property(set_op, icalproperty_new_clone(props_b[j].prop));
+        } else {
+            icalcomponent_add_property(add_op, icalproperty_new_clone(props_b[j].prop));
+        }
+    }
+
+    icaldiff_add_op(patch, remove_op);
+    icaldiff_add_op(patch, set_op);
+    icaldiff_add_op(patch, add_op);
+
+    icaldiff_free_properties(props_a, num_a);
+    icaldiff_free_properties(props_b, num_b);
+    free(sorted_a);
+    free(sorted_b);
+    free(all);
+
+    return 0;
+}
+
+static int icaldiff_diff_components(icalcomponent *a, icalcomponent *b, icalcomponent *patch);
+
+static int icaldiff_diff_children(icalcomponent *a, icalcomponent *b, icalcomponent *patch)
+{
+    struct icaldiff_child_entry *comps_a, *comps_b;
+    size_t num_a = 0, num_b = 0, i, j;
+    void **sorted_a = 0, **sorted_b = 0;
+    icalcomponent *remove_op, *add_op;
+    int status = 0;
+
+    comps_a = icaldiff_get_components(a, &num_a);
+    comps_b = icaldiff_get_components(b, &num_b);
+    if (comps_a != 0 && comps_b != 0) {
+        sorted_a = icaldiff_pointers(comps_a, num_a, sizeof(*comps_a));
+        sorted_b = icaldiff_pointers(comps_b, num_b, sizeof(*comps_b));
+    }
+    if (sorted_a == 0 || sorted_b == 0) {
+        icaldiff_free_children(comps_a, num_a);
+        icaldiff_free_children(comps_b, num_b);
+        free(sorted_a);
+        free(sorted_b);
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return -1;
+    }
+
+    icaldiff_match(sorted_a, num_a, sorted_b, num_b,
+                   icaldiff_compare_child, icaldiff_compare_child_key, icaldiff_child_matches);
+    icaldiff_number_children(sorted_a, num_a);
+
+    remove_op = icalcomponent_new_x(ICALDIFF_REMOVE_COMPONENT);
+    add_op = icalcomponent_new_x(ICALDIFF_ADD_COMPONENT);
+
+    for (j = 0; j < num_b && status == 0; j++) {
+        struct icaldiff_child_entry *old;
+
+        if (comps_b[j].entry.match == ICALDIFF_NO_MATCH) {
+            continue;
+        }
+        old = &comps_a[comps_b[j].entry.match];
+
+        if (icalfingerprint_compare(&old->fingerprint, &comps_b[j].fingerprint) != 0) {
+            icalcomponent *op = icalcomponent_new_x(ICALDIFF_PATCH_COMPONENT);
+            icalcomponent *nested = icalcomponent_new_x(ICALDIFF_PATCH);
+
+            icalcomponent_add_component(op, icaldiff_new_stub(old));
+            icalcomponent_add_component(op, nested);
+            status = icaldiff_diff_components(old->comp, comps_b[j].comp, nested);
+            icalcomponent_add_component(patch, op);
+        }
+    }
+
+    for (i = 0; i < num_a; i++) {
+        if (comps_a[i].entry.match == ICALDIFF_NO_MATCH) {
+            icalcomponent_add_component(remove_op, icaldiff_new_stub(&comps_a[i]));
+        }
+    }
+    for (j = 0; j < num_b; j++) {
+        if (comps_b[j].entry.match == ICALDIFF_NO_MATCH) {
+            icalcomponent_add_component(add_op, icalcomponent_new_clone(comps_b[j].comp));
+        }
+    }
+
+    icaldiff_add_op(patch, remove_op);
+    icaldiff_add_op(patch, add_op);
+
+    icaldiff_free_children(comps_a, num_a);
+    icaldiff_free_children(comps_b, num_b);
+    free(sorted_a);
+    free(sorted_b);
+
+    return status;
+}
+
+static int icaldiff_diff_components(icalcomponent *a, icalcomponent *b, icalcomponent *patch)
+{
+    icalfingerprint fa = icalcomponent_fingerprint(a);
+    icalfingerprint fb = icalcomponent_fingerprint(b);
+
+    if (icalfingerprint_compare(&fa, &fb) == 0) {
+        return 0;
+    }
+
+    if (icaldiff_diff_properties(a, b, patch) != 0) {
+        return -1;
+    }
+
+    return icaldiff_diff_children(a, b, patch);
+}
+
+icalcomponent *icalcomponent_diff(icalcomponent *a, icalcomponent *b)
+{
+    icalcomponent *patch;
+
+    icalerror_check_arg_rz((a != 0), "a");
+    icalerror_check_arg_rz((b != 0), "b");
+    icalerror_check_arg_rz((icalcomponent_isa(a) == icalcomponent_isa(b)), "b");
+
+    patch = icalcomponent_new_x(ICALDIFF_PATCH);
+    if (patch == 0) {
+        return 0;
+    }
+
+    if (icaldiff_diff_components(a, b, patch) != 0) {
+        icalcomponent_free(patch);
+        return 0;
+    }
+
+    return patch;
+}
+
+static int icaldiff_remove_property(icalcomponent *comp, icalproperty *old)
+{
+    icalfingerprint fold = icalcomponent_property_fingerprint(old);
+    icalproperty *prop;
+
+    for (prop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
+         prop != 0; prop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY)) {
+        icalfingerprint fprop = icalcomponent_property_fingerprint(prop);
+
+        if (icalfingerprint_compare(&fprop, &fold) == 0) {
+            icalcomponent_remove_property(comp, prop);
+            icalproperty_free(prop);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static int icaldiff_set_property(icalcomponent *comp, icalproperty *new_prop)
+{
+    char *name = icalproperty_get_property_name_r(new_prop);
+    icalproperty *prop, *target = 0;
+    int num_named = 0;
+
+    for (prop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
+         prop != 0 && name != 0; prop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY)) {
+        char *prop_name = icalproperty_get_property_name_r(prop);
+
+        if (prop_name != 0 && strcasecmp(prop_name, name) == 0) {
+            target = prop;
+            num_named++;
+        }
+        free(prop_name);
+    }
+    free(name);
+
+    if (num_named != 1) {
+        return -1;
+    }
+
+    icalcomponent_remove_property(comp, target);
+    icalproperty_free(target);
+    icalcomponent_add_property(comp, icalproperty_new_clone(new_prop));
+
+    return 0;
+}
+
+static int icaldiff_apply(icalcomponent *comp, icalcomponent *patch);
+
+static int icaldiff_apply_op(icalcomponent *comp, struct icaldiff_lookup *lookup,
+                             icalcomponent *op)
+{
+    icalproperty *prop;
+    icalcomponent *child;
+
+    if (icaldiff_is(op, ICALDIFF_ADD_PROPERTY)) {
+        for (prop = icalcomponent_get_first_property(op, ICAL_ANY_PROPERTY);
+             prop != 0; prop = icalcomponent_get_next_property(op, ICAL_ANY_PROPERTY)) {
+            icalcomponent_add_property(comp, icalproperty_new_clone(prop));
+        }
+
+    } else if (icaldiff_is(op, ICALDIFF_REMOVE_PROPERTY)) {
+        for (prop = icalcomponent_get_first_property(op, ICAL_ANY_PROPERTY);
+             prop != 0; prop = icalcomponent_get_next_property(op, ICAL_ANY_PROPERTY)) {
+            if (icaldiff_remove_property(comp, prop) != 0) {
+                return -1;
+            }
+        }
+
+    } else if (icaldiff_is(op, ICALDIFF_SET_PROPERTY)) {
+        for (prop = icalcomponent_get_first_property(op, ICAL_ANY_PROPERTY);
+             prop != 0; prop = icalcomponent_get_next_property(op, ICAL_ANY_PROPERTY)) {
+            if (icaldiff_set_property(comp, prop) != 0) {
+                return -1;
+            }
+        }
+
+    } else if (icaldiff_is(op, ICALDIFF_ADD_COMPONENT)) {
+        for (child = icalcomponent_get_first_component(op, ICAL_ANY_COMPONENT);
+             child != 0; child = icalcomponent_get_next_component(op, ICAL_ANY_COMPONENT)) {
+            icalcomponent_add_component(comp, icalcomponent_new_clone(child));
+        }
+
+    } else if (icaldiff_is(op, ICALDIFF_REMOVE_COMPONENT)) {
+        for (child = icalcomponent_get_first_component(op, ICAL_ANY_COMPONENT);
+             child != 0; child = icalcomponent_get_next_component(op, ICAL_ANY_COMPONENT)) {
+            icalcomponent *target;
+
+            if (icaldiff_lookup_init(lookup, comp) != 0 ||
+                (target = icaldiff_find_child(lookup, child)) == 0) {
+                return -1;
+            }
+            icalcomponent_remove_component(comp, target);
+            icalcomponent_free(target);
+        }
+
+    } else if (icaldiff_is(op, ICALDIFF_PATCH_COMPONENT)) {
+        icalcomponent *stub = 0, *nested = 0, *target;
+
+        for (child = icalcomponent_get_first_component(op, ICAL_ANY_COMPONENT);
+             child != 0; child = icalcomponent_get_next_component(op, ICAL_ANY_COMPONENT)) {
+            if (icaldiff_is(child, ICALDIFF_PATCH)) {
+                nested = child;
+            } else {
+                stub = child;
+            }
+        }
+
+        if (stub == 0 || nested == 0 || icaldiff_lookup_init(lookup, comp) != 0 ||
+            (target = icaldiff_find_child(lookup, stub)) == 0) {
+            return -1;
+        }
+
+        return icaldiff_apply(target, nested);
+
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int icaldiff_apply(icalcomponent *comp, icalcomponent *patch)
+{
+    struct icaldiff_lookup lookup;
+    icalcomponent *op;
+    int status = 0;
+
+    if (!icaldiff_is(patch, ICALDIFF_PATCH)) {
+        return -1;
+    }
+
+    /* Operations name the children comp had before any of them applied */
+    memset(&lookup, 0, sizeof(lookup));
+
+    for (op = icalcomponent_get_first_component(patch, ICAL_ANY_COMPONENT);
+         op != 0 && status == 0;
+         op = icalcomponent_get_next_component(patch, ICAL_ANY_COMPONENT)) {
+        status = icaldiff_apply_op(comp, &lookup, op);
+    }
+
+    icaldiff_lookup_free(&lookup);
+
+    return status;
+}
+
+int icalcomponent_apply_patch(icalcomponent *comp, icalcomponent *patch)
+{
+    icalerror_check_arg_rx((comp != 0), "comp", -1);
+    icalerror_check_arg_rx((patch != 0), "patch", -1);
+
+    if (icaldiff_apply(comp, patch) != 0) {
+        icalerror_set_errno(ICAL_MALFORMEDDATA_ERROR);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*======================================================================
+ FILE: icaldiff.h
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+======================================================================*/
+
+#ifndef ICALDIFF_H
+#define ICALDIFF_H
+
+#include "libical_ical_export.h"
+#include "icalcomponent.h"
+
+/** @file icaldiff.h
+ *  @brief Structural differences between two versions of a component
+ *
+ *  A patch is an X-LIC-PATCH component holding a list of operations, each
+ *  an X component of its own:
+ *
+ *  - X-LIC-ADD-PROPERTY: add the properties it holds
+ *  - X-LIC-REMOVE-PROPERTY: remove a property equal to each one it holds,
+ *    parameters compared in any order
+ *  - X-LIC-SET-PROPERTY: replace the only property of the same name with
+ *    the one it holds, which covers changes to values and to parameters
+ *  - X-LIC-ADD-COMPONENT: add the components it holds
+ *  - X-LIC-REMOVE-COMPONENT: remove the child each component it holds
+ *    identifies
+ *  - X-LIC-PATCH-COMPONENT: apply the X-LIC-PATCH it holds to the child
+ *    the other component it holds identifies
+ *
+ *  A child with a UID, or for a VTIMEZONE a TZID, is identified by its
+ *  kind, that property and its RECURRENCE-ID, and the components naming it
+ *  in a patch hold only those properties. When several children share all
+ *  three, the components naming any but the first also hold an
+ *  X-LIC-OCCURRENCE with the number of such children before it in the
+ *  component the patch applies to. Any other child is identified by its
+ *  whole content.
+ *
+ *  Patches are ordinary components, so they can be stored or sent with
+ *  icalcomponent_as_ical_string_r() and read back with
+ *  icalparser_parse_string().
+ */
+
+/** @brief Compute the changes that turn one component into another
+ *
+ *  @param a  The old version
+ *  @param b  The new version, of the same kind as a
+ *
+ *  @return An X-LIC-PATCH component, which has no children if a and b have
+ *          the same fingerprint, or NULL on error. The caller must free it
+ *          with icalcomponent_free().
+ *
+ *  Children that appear in both versions under the same identity but have
+ *  changed are described by a nested patch rather than replaced.
+ */
+LIBICAL_ICAL_EXPORT icalcomponent *icalcomponent_diff(icalcomponent *a, icalcomponent *b);
+
+/** @brief Apply a patch made by icalcomponent_diff() to a component
+ *
+ *  @return 0 on success. If the patch is not an X-LIC-PATCH, or a property
+ *          or child it changes cannot be found, returns -1 and sets
+ *          ICAL_MALFORMEDDATA_ERROR; the operations before that one stay
+ *          applied, so patch a clone where that matters.
+ *
+ *  The properties and components the patch adds are copied, so the patch
+ *  can be applied to several components.
+ */
+LIBICAL_ICAL_EXPORT int icalcomponent_apply_patch(icalcomponent *comp, icalcomponent *patch);
+
+#endif /* !ICALDIFF_H */
@@ -64,6 +64,44 @@ icalerrorenum *icalerrno_return(void)
     return _errno;
 }
 
+/* Error states set for the calling thread only, indexed like
+   error_state_map; ICAL_ERROR_UNKNOWN where the global state applies */
+static pthread_key_t thread_states_key;
+static pthread_once_t thread_states_key_once = PTHREAD_ONCE_INIT;
+
+static void thread_states_destroy(void *buf)
+{
+    free(buf);
+    pthread_setspecific(thread_states_key, NULL);
+}
+
+static void thread_states_key_alloc(void)
+{
+    pthread_key_create(&thread_states_key, thread_states_destroy);
+}
+
+static icalerrorstate *icalerror_thread_states(int alloc)
+{
+    icalerrorstate *states;
+    int i;
+
+    pthread_once(&thread_states_key_once, thread_states_key_alloc);
+
+    states = (icalerrorstate *) pthread_getspecific(thread_states_key);
+
+    if (!states && alloc) {
+        states = malloc(ICAL_UNKNOWN_ERROR * sizeof(icalerrorstate));
+        if (!states) {
+            return 0;
+        }
+        for (i = 0; i < ICAL_UNKNOWN_ERROR; i++) {
+            states[i] = ICAL_ERROR_UNKNOWN;
+        }
+        pthread_setspecific(thread_states_key, states);
+    }
+    return states;
+}
+
 #else
 
 static icalerrorenum icalerrno_storage = ICAL_NO_ERROR;
@@ -73,6 +111,22 @@ icalerrorenum *icalerrno_return(void)
     return &icalerrno_storage;
 }
 
+static icalerrorstate thread_states_storage[ICAL_UNKNOWN_ERROR];
+static int thread_states_set = 0;
+
+static icalerrorstate *icalerror_thread_states(int alloc)
+{
+    int i;
+
+    if (!thread_states_set && alloc) {
+        for (i = 0; i < ICAL_UNKNOWN_ERROR; i++) {
+            thread_states_storage[i] = ICAL_ERROR_UNKNOWN;
+        }
+        thread_states_set = 1;
+    }
+    return thread_states_set ? thread_states_storage : 0;
+}
+
 #endif
 
 static int foo;
@@ -117,9 +171,15 @@ int icalerror_get_errors_are_fatal()
 #if defined(ICAL_SETERROR_ISFUNC)
 void icalerror_set_errno(icalerrorenum x)
 {
+    icalerrorstate es = icalerror_get_thread_error_state(x);
+
+    if (es == ICAL_ERROR_UNKNOWN) {
+        es = icalerror_get_error_state(x);
+    }
+
     icalerrno = x;
-    if (icalerror_get_error_state(x) == ICAL_ERROR_FATAL ||
-        (icalerror_get_error_state(x) == ICAL_ERROR_DEFAULT && icalerror_errors_are_fatal == 1)) {
+    if (es == ICAL_ERROR_FATAL ||
+        (es == ICAL_ERROR_DEFAULT && icalerror_errors_are_fatal == 1)) {
         icalerror_warn(icalerror_strerror(x));
         ical_bt();
         assert(0);
@@ -245,6 +305,37 @@ icalerrorstate icalerror_get_error_state(icalerrorenum error)
     return ICAL_ERROR_UNKNOWN;
 }
 
+icalerrorstate icalerror_set_thread_error_state(icalerrorenum error, icalerrorstate state)
+{
+    icalerrorstate *states;
+    icalerrorstate es;
+
+    if ((int)error < 0 || error >= ICAL_UNKNOWN_ERROR || error == ICAL_NO_ERROR) {
+        return ICAL_ERROR_UNKNOWN;
+    }
+
+    if ((states = icalerror_thread_states(state != ICAL_ERROR_UNKNOWN)) == 0) {
+        return ICAL_ERROR_UNKNOWN;
+    }
+
+    es = states[error];
+    states[error] = state;
+
+    return es;
+}
+
+icalerrorstate icalerror_get_thread_error_state(icalerrorenum error)
+{
+    icalerrorstate *states;
+
+    if ((int)error < 0 || error >= ICAL_UNKNOWN_ERROR ||
+        (states = icalerror_thread_states(0)) == 0) {
+        return ICAL_ERROR_UNKNOWN;
+    }
+
+    return states[error];
+}
+
 const char *icalerror_strerror(icalerrorenum e)
 {
     int i;
@@ -300,6 +300,36 @@ LIBICAL_ICAL_EXPORT void icalerror_set_error_state(icalerrorenum error, icalerro
  */
 LIBICAL_ICAL_EXPORT icalerrorstate icalerror_get_error_state(icalerrorenum error);
 
+/**
+ * @brief Set the ::icalerrorstate of @a error for the calling thread only
+ * @param error The error to change
+ * @param state The new error state of the error in this thread, or
+ *  ::ICAL_ERROR_UNKNOWN to follow icalerror_get_error_state() again
+ * @return The state the thread had before, to restore once done
+ *
+ * Unlike icalerror_set_error_state(), this neither changes nor races with
+ * the state other threads see, so a thread can make errors nonfatal while
+ * it parses untrusted data.
+ *
+ * ### Usage
+ * ```c
+ * icalerrorstate es =
+ *     icalerror_set_thread_error_state(ICAL_MALFORMEDDATA_ERROR, ICAL_ERROR_NONFATAL);
+ * // parse
+ * icalerror_set_thread_error_state(ICAL_MALFORMEDDATA_ERROR, es);
+ * ```
+ */
+LIBICAL_ICAL_EXPORT icalerrorstate icalerror_set_thread_error_state(icalerrorenum error,
+                                                                    icalerrorstate state);
+
+/**
+ * @brief Get the ::icalerrorstate the calling thread set for @a error
+ * @param error The error to examine
+ * @return The state set by icalerror_set_thread_error_state(), or
+ *  ::ICAL_ERROR_UNKNOWN if the thread follows the global state
+ */
+LIBICAL_ICAL_EXPORT icalerrorstate icalerror_get_thread_error_state(icalerrorenum error);
+
 /**
  * @brief Read an error from a string
  * @param str The error name string
@@ -27,6 +27,7 @@
 
 #include "icalparameter.h"
 #include "icalparameterimpl.h"
+#include "icalproperty_p.h"
 #include "icalerror.h"
 #include "icalmemory.h"
 
@@ -356,6 +357,8 @@ void icalparameter_set_xname(icalparameter *param, const char *v)
     if (param->x_name == 0) {
         errno = ENOMEM;
     }
+
+    icalproperty_touch(param->parent);
 }
 
 const char *icalparameter_get_xname(icalparameter *param)
@@ -379,6 +382,8 @@ void icalparameter_set_xvalue(icalparameter *param, const char *v)
     if (param->string == 0) {
         errno = ENOMEM;
     }
+
+    icalproperty_touch(param->parent);
 }
 
 const char *icalparameter_get_xvalue(icalparameter *param)
@@ -24,7 +24,7 @@
 #endif
 
 #include "icalproperty_p.h"
-#include "icalcomponent.h"
+#include "icalcomponent_p.h"
 #include "icalerror.h"
 #include "icalmemory.h"
 #include "icalparser.h"
@@ -102,6 +102,9 @@ icalproperty *icalproperty_new_clone(icalproperty *old)
 
     if (old->value != 0) {
         new->value = icalvalue_new_clone(old->value);
+        if (new->value != 0) {
+            icalvalue_set_parent(new->value, new);
+        }
     }
 
     if (old->x_name != 0) {
@@ -124,6 +127,7 @@ icalproperty *icalproperty_new_clone(icalproperty *old)
             return 0;
         }
 
+        icalparameter_set_parent(param, new);
         pvl_push(new->parameters, param);
     }
 
@@ -192,6 +196,7 @@ void icalproperty_free(icalproperty *p)
     }
 
     while ((param = pvl_pop(p->parameters)) != 0) {
+        icalparameter_set_parent(param, 0);
         icalparameter_free(param);
     }
 
@@ -486,7 +491,10 @@ void icalproperty_add_parameter(icalproperty *p, icalparameter *parameter)
     icalerror_check_arg_rv((p != 0), "prop");
     icalerror_check_arg_rv((parameter != 0), "parameter");
 
+    icalparameter_set_parent(parameter, p);
     pvl_push(p->parameters, parameter);
+
+    icalproperty_touch(p);
 }
 
 void icalproperty_set_parameter(icalproperty *prop, icalparameter *parameter)
@@ -646,7 +654,9 @@ void icalproperty_remove_parameter_by_kind(icalproperty *prop, icalparameter_kin
 
         if (icalparameter_isa(param) == kind) {
             (void)pvl_remove(prop->parameters, p);
+            icalparameter_set_parent(param, 0);
             icalparameter_free(param);
+            icalproperty_touch(prop);
             break;
         }
     }
@@ -689,7 +699,9 @@ void icalproperty_remove_parameter_by_name(icalproperty *prop, const char *name)
 
         if (0 == strcmp(kind_string, name)) {
             (void)pvl_remove(prop->parameters, p);
+            icalparameter_set_parent(param, 0);
             icalparameter_free(param);
+            icalproperty_touch(prop);
             break;
         }
     }
@@ -716,7 +728,9 @@ void icalproperty_remove_parameter_by_ref(icalproperty *prop, icalparameter *par
 
         if (icalparameter_has_same_name(parameter, p_param)) {
             (void)pvl_remove(prop->parameters, p);
+            icalparameter_set_parent(p_param, 0);
             icalparameter_free(p_param);
+            icalproperty_touch(prop);
             break;
         }
     }
@@ -790,6 +804,8 @@ void icalproperty_set_value(icalproperty *p, icalvalue *value)
     p->value = value;
 
     icalvalue_set_parent(value, p);
+
+    icalproperty_touch(p);
 }
 
 void icalproperty_set_value_from_string(icalproperty *prop, const char *str, const char *type)
@@ -874,6 +890,8 @@ void icalproperty_set_x_name(icalproperty *prop, const char *name)
     if (prop->x_name == 0) {
         icalerror_set_errno(ICAL_NEWFAILED_ERROR);
     }
+
+    icalproperty_touch(prop);
 }
 
 const char *icalproperty_get_x_name(icalproperty *prop)
@@ -924,6 +942,13 @@ char *icalproperty_get_property_name_r(const icalproperty *prop)
     return buf;
 }
 
+void icalproperty_touch(icalproperty *prop)
+{
+    if (prop != 0) {
+        icalcomponent_touch(prop->parent);
+    }
+}
+
 void icalproperty_set_parent(icalproperty *property, icalcomponent *component)
 {
     icalerror_check_arg_rv((property != 0), "property");
@@ -21,6 +21,12 @@
 
 #include "icalproperty.h"
 
+/* Record that prop, one of its parameters or its value has changed, in
+   the revision of the component holding it, so that everything cached
+   over that component is recomputed. Every mutator of a property,
+   parameter or value calls this. prop may be 0. */
+LIBICAL_ICAL_NO_EXPORT void icalproperty_touch(icalproperty *prop);
+
 /* Check validity and attributes of icalproperty_kind and icalvalue_kind pair */
 LIBICAL_ICAL_NO_EXPORT int icalproperty_value_kind_is_valid(icalproperty_kind pkind,
                                                             icalvalue_kind vkind);
@@ -143,6 +143,10 @@
 #include <stddef.h>     /* For offsetof() macro */
 #include <stdlib.h>
 
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
 #if defined(HAVE_LIBICU)
 #include <unicode/ucal.h>
 #include <unicode/ustring.h>
@@ -542,15 +546,14 @@ static int icalrecur_add_bydayrules(struct icalrecur_parser *parser,
     return 0;
 }
 
-struct icalrecurrencetype icalrecurrencetype_from_string(const char *str)
+static int icalrecur_parse(const char *str, struct icalrecurrencetype *rt)
 {
     struct icalrecur_parser parser;
+    int r = 0;
 
     memset(&parser, 0, sizeof(parser));
     icalrecurrencetype_clear(&parser.rt);
 
-    icalerror_check_arg_re(str != 0, "str", parser.rt);
-
     /* Set up the parser struct */
     parser.rule = str;
     parser.copy = icalmemory_strdup(parser.rule);
@@ -558,14 +561,14 @@ struct icalrecurrencetype icalrecurrencetype_from_string(const char *str)
 
     if (parser.copy == 0) {
         icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-        return parser.rt;
+        *rt = parser.rt;
+        return -1;
     }
 
     /* Loop through all of the clauses */
     for (icalrecur_first_clause(&parser);
          parser.this_clause != 0; icalrecur_next_clause(&parser)) {
         char *name, *value;
-        int r = 0;
 
         icalrecur_clause_name_and_value(&parser, &name, &value);
 
@@ -649,7 +652,281 @@ struct icalrecurrencetype icalrecurrencetype_from_string(const char *str)
 
     free(parser.copy);
 
-    return parser.rt;
+    *rt = parser.rt;
+    return r;
+}
+
+/*********************** Rule cache ************************/
+
+/* Parsed rules are interned by their text, so that a feed in which the
+   same handful of RRULEs repeats over many events parses each only once.
+
+   Every entry holds one parsed rule and its canonical string, which is
+   the output of icalrecurrencetype_as_string_r(). The table maps both
+   the canonical string and each raw spelling seen (case, clause order,
+   redundant defaults) to its entry, so the spellings of one rule share
+   the parse. Entries are never modified after they are added and are
+   copied out to the caller, so a flush cannot invalidate a rule that
+   has already been returned. */
+
+#define RECUR_CACHE_BUCKETS 1024
+#define RECUR_CACHE_MAX_KEYS 4096
+
+struct recur_cache_entry
+{
+    struct icalrecurrencetype rt;
+    char *canonical;
+    struct recur_cache_entry *next;
+};
+
+struct recur_cache_key
+{
+    char *text;
+    unsigned int hash;
+    struct recur_cache_entry *entry;
+    struct recur_cache_key *next;
+};
+
+static struct recur_cache_key *recur_cache[RECUR_CACHE_BUCKETS];
+static struct recur_cache_entry *recur_cache_entries = 0;
+static size_t recur_cache_num_keys = 0;
+
+#if defined(HAVE_PTHREAD)
+static pthread_mutex_t recur_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned int recur_cache_hash(const char *str)
+{
+    unsigned int hash = 2166136261U;
+
+    while (*str) {
+        hash = (hash ^ (unsigned char)*str++) * 16777619U;
+    }
+
+    return hash;
+}
+
+static struct recur_cache_entry *recur_cache_lookup(const char *text, unsigned int hash)
+{
+    struct recur_cache_key *key;
+
+    for (key = recur_cache[hash % RECUR_CACHE_BUCKETS]; key != 0; key = key->next) {
+        if (key->hash == hash && strcmp(key->text, text) == 0) {
+            return key->entry;
+        }
+    }
+
+    return 0;
+}
+
+static void recur_cache_add_key(const char *text, unsigned int hash,
+                                struct recur_cache_entry *entry)
+{
+    struct recur_cache_key *key;
+
+    key = (struct recur_cache_key *)malloc(sizeof(struct recur_cache_key));
+    if (key == 0) {
+        return;
+    }
+
+    key->text = icalmemory_strdup(text);
+    if (key->text == 0) {
+        free(key);
+        return;
+    }
+
+    key->hash = hash;
+    key->entry = entry;
+    key->next = recur_cache[hash % RECUR_CACHE_BUCKETS];
+    recur_cache[hash % RECUR_CACHE_BUCKETS] = key;
+    recur_cache_num_keys++;
+}
+
+static void recur_cache_flush(void)
+{
+    size_t i;
+
+    for (i = 0; i < RECUR_CACHE_BUCKETS; i++) {
+        while (recur_cache[i] != 0) {
+            struct recur_cache_key *key = recur_cache[i];
+
+            recur_cache[i] = key->next;
+            free(key->text);
+            free(key);
+        }
+    }
+
+    while (recur_cache_entries != 0) {
+        struct recur_cache_entry *entry = recur_cache_entries;
+
+        recur_cache_entries = entry->next;
+        free(entry->rt.rscale);
+        free(entry->canonical);
+        free(entry);
+    }
+
+    recur_cache_num_keys = 0;
+}
+
+/* Whether two parsed rules are identical, rather than merely printing the
+   same: fields that icalrecurrencetype_as_string_r() leaves out when they
+   hold their default still have to match before a parse is shared. The
+   fields are compared one by one, since the padding in the structures is
+   not set by the parser. */
+static int recur_parse_is_identical(const struct icalrecurrencetype *a,
+                                    const struct icalrecurrencetype *b)
+{
+    if (a->freq != b->freq || a->count != b->count || a->interval != b->interval ||
+        a->week_start != b->week_start || a->skip != b->skip) {
+        return 0;
+    }
+
+    if (a->until.year != b->until.year || a->until.month != b->until.month ||
+        a->until.day != b->until.day || a->until.hour != b->until.hour ||
+        a->until.minute != b->until.minute || a->until.second != b->until.second ||
+        a->until.is_utc != b->until.is_utc || a->until.is_date != b->until.is_date ||
+        a->until.is_daylight != b->until.is_daylight || a->until.zone != b->until.zone) {
+        return 0;
+    }
+
+    if ((a->rscale == 0) != (b->rscale == 0) ||
+        (a->rscale != 0 && strcmp(a->rscale, b->rscale) != 0)) {
+        return 0;
+    }
+
+    return memcmp(a->by_second, b->by_second, sizeof(a->by_second)) == 0 &&
+           memcmp(a->by_minute, b->by_minute, sizeof(a->by_minute)) == 0 &&
+           memcmp(a->by_hour, b->by_hour, sizeof(a->by_hour)) == 0 &&
+           memcmp(a->by_day, b->by_day, sizeof(a->by_day)) == 0 &&
+           memcmp(a->by_month_day, b->by_month_day, sizeof(a->by_month_day)) == 0 &&
+           memcmp(a->by_year_day, b->by_year_day, sizeof(a->by_year_day)) == 0 &&
+           memcmp(a->by_week_no, b->by_week_no, sizeof(a->by_week_no)) == 0 &&
+           memcmp(a->by_month, b->by_month, sizeof(a->by_month)) == 0 &&
+           memcmp(a->by_set_pos, b->by_set_pos, sizeof(a->by_set_pos)) == 0;
+}
+
+static void recur_cache_copy_out(const struct recur_cache_entry *entry,
+                                 struct icalrecurrencetype *rt)
+{
+    *rt = entry->rt;
+    if (entry->rt.rscale != 0) {
+        rt->rscale = icalmemory_strdup(entry->rt.rscale);
+    }
+}
+
+/* Add a rule that parsed cleanly from text. Returns 0 if the rule stays
+   owned by the caller, or 1 if the cache took ownership of rt->rscale. */
+static int recur_cache_insert(const char *text, unsigned int hash,
+                              struct icalrecurrencetype *rt)
+{
+    struct recur_cache_entry *entry;
+    unsigned int canonical_hash;
+    char *canonical;
+
+    canonical = icalrecurrencetype_as_string_r(rt);
+    if (canonical == 0) {
+        return 0;
+    }
+    canonical_hash = recur_cache_hash(canonical);
+
+    if (recur_cache_num_keys + 2 > RECUR_CACHE_MAX_KEYS) {
+        recur_cache_flush();
+    }
+
+    /* Another thread may have parsed the same text meanwhile */
+    if (recur_cache_lookup(text, hash) != 0) {
+        free(canonical);
+        return 0;
+    }
+
+    entry = recur_cache_lookup(canonical, canonical_hash);
+    if (entry != 0 && recur_parse_is_identical(&entry->rt, rt)) {
+        recur_cache_add_key(text, hash, entry);
+        free(canonical);
+        return 0;
+    }
+
+    entry = (struct recur_cache_entry *)malloc(sizeof(struct recur_cache_entry));
+    if (entry == 0) {
+        free(canonical);
+        return 0;
+    }
+
+    entry->rt = *rt;
+    entry->canonical = canonical;
+    entry->next = recur_cache_entries;
+    recur_cache_entries = entry;
+
+    if (recur_cache_lookup(canonical, canonical_hash) == 0) {
+        recur_cache_add_key(canonical, canonical_hash, entry);
+    }
+    if (strcmp(text, canonical) != 0) {
+        recur_cache_add_key(text, hash, entry);
+    }
+
+    return 1;
+}
+
+struct icalrecurrencetype icalrecurrencetype_from_string(const char *str)
+{
+    struct icalrecurrencetype rt;
+    struct recur_cache_entry *entry;
+    unsigned int hash;
+
+    icalrecurrencetype_clear(&rt);
+
+    icalerror_check_arg_re(str != 0, "str", rt);
+
+    hash = recur_cache_hash(str);
+
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_lock(&recur_cache_mutex);
+#endif
+    entry = recur_cache_lookup(str, hash);
+    if (entry != 0) {
+        recur_cache_copy_out(entry, &rt);
+    }
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_unlock(&recur_cache_mutex);
+#endif
+
+    if (entry != 0) {
+        return rt;
+    }
+
+    /* Malformed rules are not cached, so that every attempt to parse
+       one reports the error again. */
+    if (icalrecur_parse(str, &rt) != 0 || rt.freq == ICAL_NO_RECURRENCE) {
+        return rt;
+    }
+
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_lock(&recur_cache_mutex);
+#endif
+    if (recur_cache_insert(str, hash, &rt)) {
+        struct icalrecurrencetype cached = rt;
+
+        /* The cache owns the parsed rscale now; hand out a copy */
+        if (cached.rscale != 0) {
+            rt.rscale = icalmemory_strdup(cached.rscale);
+        }
+    }
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_unlock(&recur_cache_mutex);
+#endif
+
+    return rt;
+}
+
+void icalrecurrencetype_free_cache(void)
+{
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_lock(&recur_cache_mutex);
+#endif
+    recur_cache_flush();
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_unlock(&recur_cache_mutex);
+#endif
 }
 
 static struct recur_map
@@ -878,10 +1155,97 @@ static void daysmask_setbit(unsigned long mask[], short n, int v)
     }
 }
 
-static unsigned long daysmask_getbit(unsigned long mask[], short n)
+/* The days masks are processed a word at a time below */
+
+#if defined(__GNUC__)
+#define daysmask_popcount(w)  __builtin_popcountl(w)
+#define daysmask_ctz(w)       __builtin_ctzl(w)
+#else
+static int daysmask_popcount(unsigned long w)
 {
-    n += ICAL_YEARDAYS_MASK_OFFSET;
-    return (mask[n / BITS_PER_LONG] >> (n % BITS_PER_LONG)) & 1;
+    int n = 0;
+
+    for (; w; w &= w - 1) {
+        n++;
+    }
+    return n;
+}
+
+/* w must be non-zero */
+static int daysmask_ctz(unsigned long w)
+{
+    int n = 0;
+
+    for (; !(w & 1); w >>= 1) {
+        n++;
+    }
+    return n;
+}
+#endif
+
+/* Bits 0, 7, 14, ... of an unsigned long */
+#define DAYSMASK_EVERY_7TH_BIT  ((unsigned long)0x8102040810204081ULL)
+
+/* Word w of a mask with year days from..to (inclusive) set */
+static unsigned long daysmask_range(int w, int from, int to)
+{
+    int lo = from + ICAL_YEARDAYS_MASK_OFFSET - w * (int)BITS_PER_LONG;
+    int hi = to + ICAL_YEARDAYS_MASK_OFFSET - w * (int)BITS_PER_LONG;
+
+    if (hi < 0 || lo >= (int)BITS_PER_LONG || lo > hi) {
+        return 0;
+    }
+    if (lo < 0) {
+        lo = 0;
+    }
+    if (hi >= (int)BITS_PER_LONG) {
+        hi = BITS_PER_LONG - 1;
+    }
+
+    return (~0UL >> (BITS_PER_LONG - 1 - hi)) & (~0UL << lo);
+}
+
+/* Set the bits for year day first and every 7th day after it, up to last */
+static void daysmask_setweekly(unsigned long mask[], int first, int last)
+{
+    int bit = first + ICAL_YEARDAYS_MASK_OFFSET;
+    int w;
+
+    for (w = 0; w < (int)LONGS_PER_BITS(ICAL_YEARDAYS_MASK_SIZE); w++) {
+        /* Position within this word of the first bit in step with 'first' */
+        int phase = (bit - w * (int)BITS_PER_LONG) % 7;
+
+        if (phase < 0) {
+            phase += 7;
+        }
+        mask[w] |= (DAYSMASK_EVERY_7TH_BIT << phase) & daysmask_range(w, first, last);
+    }
+}
+
+/* Return the first year day >= n that is set in mask,
+   or ICAL_YEARDAYS_MASK_SIZE if there is none */
+static short daysmask_find_next_bit(unsigned long mask[], short n)
+{
+    int bit = n + ICAL_YEARDAYS_MASK_OFFSET;
+    int w = bit / (int)BITS_PER_LONG;
+    unsigned long word;
+
+    if (n >= ICAL_YEARDAYS_MASK_SIZE) {
+        return ICAL_YEARDAYS_MASK_SIZE;
+    }
+
+    word = mask[w] & (~0UL << (bit % BITS_PER_LONG));
+    for (;;) {
+        if (word) {
+            n = (short)(w * (int)BITS_PER_LONG + daysmask_ctz(word) -
+                        ICAL_YEARDAYS_MASK_OFFSET);
+            return (n < ICAL_YEARDAYS_MASK_SIZE) ? n : ICAL_YEARDAYS_MASK_SIZE;
+        }
+        if (++w >= (int)LONGS_PER_BITS(ICAL_YEARDAYS_MASK_SIZE)) {
+            return ICAL_YEARDAYS_MASK_SIZE;
+        }
+        word = mask[w];
+    }
 }
 
 int icalrecur_iterator_sizeof_byarray(short *byarray)
@@ -2242,23 +2606,6 @@ static int next_day(icalrecur_iterator *impl)
     return 0;
 }
 
-static int check_set_position(icalrecur_iterator *impl, int set_pos)
-{
-    int i;
-    int found = 0;
-
-    for (i = 0;
-         i < ICAL_BY_SETPOS_SIZE &&
-             impl->rule.by_set_pos[i] != ICAL_RECURRENCE_ARRAY_MAX;
-         i++) {
-        if (impl->rule.by_set_pos[i] == set_pos) {
-            found = 1;
-            break;
-        }
-    }
-    return found;
-}
-
 /* Add each BYMONTHDAY to the year days bitmask */
 static int expand_bymonth_days(icalrecur_iterator *impl, int year, int month)
 {
@@ -2323,8 +2670,7 @@ static int expand_by_day(icalrecur_iterator *impl, int year,
 {
     /* Try to calculate each of the occurrences. */
     unsigned long bydays[LONGS_PER_BITS(ICAL_YEARDAYS_MASK_SIZE)];
-    int i, set_pos_total = 0;
-    short doy;
+    int i, w, set_pos_total = 0;
 
     daysmask_clearall(bydays);
 
@@ -2362,6 +2708,12 @@ static int expand_by_day(icalrecur_iterator *impl, int year,
             }
         }
 
+        if (!pos && !has_by_data(impl, BY_WEEK_NO)) {
+            /* Every instance of the weekday within the period */
+            daysmask_setweekly(bydays, day + doy_offset, last_day + doy_offset);
+            continue;
+        }
+
         (void)__icaltime_from_day_of_year(impl, day + doy_offset, year,
                                           &this_weekno);
 
@@ -2388,22 +2740,22 @@ static int expand_by_day(icalrecur_iterator *impl, int year,
     }
 
     /* Apply bydays map to the year days bitmask */
-    for (doy = doy_offset+1; doy <= doy_offset + last_day; doy++) {
-        int valid;
+    for (w = 0; w < (int)LONGS_PER_BITS(ICAL_YEARDAYS_MASK_SIZE); w++) {
+        unsigned long period = daysmask_range(w, doy_offset + 1, doy_offset + last_day);
+        unsigned long valid = bydays[w] & period;
 
         if (is_limiting) {
             /* "Filter" the year days bitmask with the bydays bitmask */
-            valid = (int)(daysmask_getbit(impl->days, doy) &
-                          daysmask_getbit(bydays, doy));
-        } else {
-            /* Add each BYDAY to the year days bitmask */
-            valid = (int)daysmask_getbit(bydays, doy);
+            valid &= impl->days[w];
         }
 
-        daysmask_setbit(impl->days, doy, valid);
+        impl->days[w] = (impl->days[w] & ~period) | valid;
 
         if (valid) {
-            set_pos_total++;
+            short doy = (short)(w * (int)BITS_PER_LONG + daysmask_ctz(valid) -
+                                ICAL_YEARDAYS_MASK_OFFSET);
+
+            set_pos_total += daysmask_popcount(valid);
             if (doy < impl->days_index) impl->days_index = doy;
         }
     }
@@ -2415,22 +2767,49 @@ static int expand_by_day(icalrecur_iterator *impl, int year,
 static void filter_bysetpos(icalrecur_iterator *impl, int pos_total,
                             int start_doy, int end_doy)
 {
-    int pos_count = 0;
-    short doy;
+    unsigned long selected[LONGS_PER_BITS(ICAL_YEARDAYS_MASK_SIZE)];
+    int i, w;
 
-    impl->days_index = ICAL_YEARDAYS_MASK_SIZE;
+    daysmask_clearall(selected);
+
+    /* Select the nth set bit of the period for each BYSETPOS */
+    for (i = 0;
+         i < ICAL_BY_SETPOS_SIZE &&
+             impl->rule.by_set_pos[i] != ICAL_RECURRENCE_ARRAY_MAX;
+         i++) {
+        int set_pos = impl->rule.by_set_pos[i];
+        int nth = (set_pos > 0) ? set_pos - 1 : pos_total + set_pos;
 
-    for (doy = start_doy; doy <= end_doy; doy++) {
-        if (daysmask_getbit(impl->days, doy)) {
+        if (set_pos == 0 || nth < 0) {
+            continue;
+        }
 
-            daysmask_setbit(impl->days, doy,
-                            (check_set_position(impl, pos_count + 1) ||
-                             check_set_position(impl, pos_count - pos_total)));
+        for (w = 0; w < (int)LONGS_PER_BITS(ICAL_YEARDAYS_MASK_SIZE); w++) {
+            unsigned long word = impl->days[w] & daysmask_range(w, start_doy, end_doy);
+            int count = daysmask_popcount(word);
 
-            if (daysmask_getbit(impl->days, doy) && doy < impl->days_index) {
-                impl->days_index = doy;
+            if (nth < count) {
+                /* Drop the nth lowest set bits, then take the lowest */
+                for (; nth > 0; nth--) {
+                    word &= word - 1;
+                }
+                selected[w] |= word & (~word + 1);
+                break;
             }
-            pos_count++;
+            nth -= count;
+        }
+    }
+
+    impl->days_index = ICAL_YEARDAYS_MASK_SIZE;
+
+    for (w = 0; w < (int)LONGS_PER_BITS(ICAL_YEARDAYS_MASK_SIZE); w++) {
+        unsigned long period = daysmask_range(w, start_doy, end_doy);
+
+        impl->days[w] = (impl->days[w] & ~period) | selected[w];
+
+        if (selected[w] && impl->days_index == ICAL_YEARDAYS_MASK_SIZE) {
+            impl->days_index = (short)(w * (int)BITS_PER_LONG + daysmask_ctz(selected[w]) -
+                                       ICAL_YEARDAYS_MASK_OFFSET);
         }
     }
 }
@@ -2741,8 +3120,7 @@ static int next_yearday(icalrecur_iterator *impl,
     (void)get_day_of_year(impl, start.year, start.month, start.day, NULL);
 
     /* Find next year day that is set */
-    while (++impl->days_index < ICAL_YEARDAYS_MASK_SIZE &&
-           !daysmask_getbit(impl->days, impl->days_index));
+    impl->days_index = daysmask_find_next_bit(impl->days, impl->days_index + 1);
 
     if (impl->days_index >= ICAL_YEARDAYS_MASK_SIZE) {
 
@@ -218,11 +218,28 @@ LIBICAL_ICAL_EXPORT int icalrecurrencetype_month_month(short month);
 
 /** Recurrance rule parser */
 
-/** Convert between strings and recurrencetype structures. */
+/** Convert between strings and recurrencetype structures.
+ *
+ *  Rules that parse cleanly are kept in a process-wide cache keyed by
+ *  their text, so parsing a rule string that has been seen before costs
+ *  a hash lookup. The cache is safe to use from several threads. Each
+ *  call returns its own copy of the rule, and the caller owns its
+ *  rscale string as before.
+ */
 LIBICAL_ICAL_EXPORT struct icalrecurrencetype icalrecurrencetype_from_string(const char *str);
 
+/** Free the memory held by the cache of parsed rules. */
+LIBICAL_ICAL_EXPORT void icalrecurrencetype_free_cache(void);
+
 LIBICAL_ICAL_EXPORT char *icalrecurrencetype_as_string(struct icalrecurrencetype *recur);
 
+/** The string form is canonical: clause order, case and values left at
+ *  their default do not depend on how the rule was written, so it can
+ *  be used to hash rules. It is not a test of equality, though. Fields
+ *  holding their default are left out, and two rules that print the
+ *  same may still differ in them, such as an explicit WKST=MO against no
+ *  WKST, or the zone of UNTIL. The cache of parsed rules shares a parse
+ *  under this form only with a rule that matches field for field. */
 LIBICAL_ICAL_EXPORT char *icalrecurrencetype_as_string_r(struct icalrecurrencetype *recur);
 
 /** Recurrence iteration routines */
@@ -45,6 +45,10 @@ static pthread_mutex_t builtin_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #else
 static pthread_mutex_t builtin_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
+/* Serializes the lazy expansion of zone->changes, so that threads converting
+   times in a shared zone do not expand it twice or free it under each other.
+   Without atomic loads, checking whether it covers a year takes it too. */
+static pthread_mutex_t changes_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 #if defined(_WIN32)
@@ -108,7 +112,7 @@ struct _icaltimezonechange
 static icalarray *builtin_timezones = NULL;
 
 /** This is the special UTC timezone, which isn't in builtin_timezones. */
-static icaltimezone utc_timezone = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+static icaltimezone utc_timezone = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
 static char *zone_files_directory = NULL;
 
@@ -122,7 +126,7 @@ static void icaltimezone_reset(icaltimezone *zone);
 static void icaltimezone_expand_changes(icaltimezone *zone, int end_year);
 static int icaltimezone_compare_change_fn(const void *elem1, const void *elem2);
 
-static size_t icaltimezone_find_nearby_change(icaltimezone *zone, icaltimezonechange *change);
+static size_t icaltimezone_find_nearby_change(icalarray *changes, icaltimezonechange *change);
 
 static void icaltimezone_adjust_change(icaltimezonechange *tt,
                                        int days, int hours, int minutes, int seconds);
@@ -136,7 +140,7 @@ static int icaltimezone_get_vtimezone_properties(icaltimezone *zone, icalcompone
 
 static void icaltimezone_load_builtin_timezone(icaltimezone *zone);
 
-static void icaltimezone_ensure_coverage(icaltimezone *zone, int end_year);
+static icalarray *icaltimezone_ensure_coverage(icaltimezone *zone, int end_year);
 
 static void icaltimezone_init_builtin_timezones(void);
 
@@ -191,6 +195,7 @@ icaltimezone *icaltimezone_copy(icaltimezone *originalzone)
     if (zone->changes != NULL) {
         zone->changes = icalarray_copy(zone->changes);
     }
+    zone->retired_changes = NULL;
 
     /* Let the caller set the component because then they will
        know to be careful not to free this reference twice. */
@@ -227,6 +232,16 @@ static void icaltimezone_reset(icaltimezone *zone)
         zone->changes = NULL;
     }
 
+    if (zone->retired_changes) {
+        size_t i;
+
+        for (i = 0; i < zone->retired_changes->num_elements; i++) {
+            icalarray_free(*(icalarray **) icalarray_element_at(zone->retired_changes, i));
+        }
+        icalarray_free(zone->retired_changes);
+        zone->retired_changes = NULL;
+    }
+
     icaltimezone_init(zone);
 }
 
@@ -242,6 +257,7 @@ static void icaltimezone_init(icaltimezone *zone)
     zone->builtin_timezone = NULL;
     zone->end_year = 0;
     zone->changes = NULL;
+    zone->retired_changes = NULL;
 }
 
 /** Gets the TZID, LOCATION/X-LIC-LOCATION and TZNAME properties of
@@ -423,33 +439,60 @@ char *icaltimezone_get_tznames_from_vtimezone(icalcomponent *component)
     }
 }
 
-static void icaltimezone_ensure_coverage(icaltimezone *zone, int end_year)
+/* Expands the zone's changes up to at least end_year and returns the changes
+   array the caller should search. The returned array stays valid until the
+   zone is reset, even if another thread expands the zone further meanwhile. */
+static icalarray *icaltimezone_ensure_coverage(icaltimezone *zone, int end_year)
 {
     /* When we expand timezone changes we always expand at least up to this
        year, plus ICALTIMEZONE_EXTRA_COVERAGE. */
     static int icaltimezone_minimum_expansion_year = -1;
 
+    icalarray *changes;
     int changes_end_year;
 
     icaltimezone_load_builtin_timezone(zone);
 
-    if (icaltimezone_minimum_expansion_year == -1) {
-        struct icaltimetype today = icaltime_today();
+    /* Years past the maximum can never be covered, so don't keep
+       re-expanding the zone for them. */
+    if (end_year > ICALTIMEZONE_MAX_YEAR)
+        end_year = ICALTIMEZONE_MAX_YEAR;
+
+#if defined(__ATOMIC_ACQUIRE)
+    /* The expansion publishes end_year after the changes that cover it,
+       so a reader that sees end_year also sees those changes */
+    if (__atomic_load_n(&zone->end_year, __ATOMIC_ACQUIRE) >= end_year &&
+        (changes = __atomic_load_n(&zone->changes, __ATOMIC_ACQUIRE)) != NULL)
+        return changes;
+#endif
 
-        icaltimezone_minimum_expansion_year = today.year;
-    }
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_lock(&changes_mutex);
+#endif
+    if (!zone->changes || zone->end_year < end_year) {
+        if (icaltimezone_minimum_expansion_year == -1) {
+            struct icaltimetype today = icaltime_today();
+
+            icaltimezone_minimum_expansion_year = today.year;
+        }
 
-    changes_end_year = end_year;
-    if (changes_end_year < icaltimezone_minimum_expansion_year)
-        changes_end_year = icaltimezone_minimum_expansion_year;
+        changes_end_year = end_year;
+        if (changes_end_year < icaltimezone_minimum_expansion_year)
+            changes_end_year = icaltimezone_minimum_expansion_year;
 
-    changes_end_year += ICALTIMEZONE_EXTRA_COVERAGE;
+        changes_end_year += ICALTIMEZONE_EXTRA_COVERAGE;
 
-    if (changes_end_year > ICALTIMEZONE_MAX_YEAR)
-        changes_end_year = ICALTIMEZONE_MAX_YEAR;
+        if (changes_end_year > ICALTIMEZONE_MAX_YEAR)
+            changes_end_year = ICALTIMEZONE_MAX_YEAR;
 
-    if (!zone->changes || zone->end_year < end_year)
         icaltimezone_expand_changes(zone, changes_end_year);
+    }
+    changes = zone->changes;
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_unlock(&changes_mutex);
+#endif
+
+    return changes;
 }
 
 static void icaltimezone_expand_changes(icaltimezone *zone, int end_year)
@@ -476,13 +519,21 @@ static void icaltimezone_expand_changes(icaltimezone *zone, int end_year)
        matter. */
     icalarray_sort(changes, icaltimezone_compare_change_fn);
 
+    /* Readers may still be searching the old array, so keep it around
+       until the zone is reset rather than freeing it here. */
     if (zone->changes) {
-        icalarray_free(zone->changes);
-        zone->changes = 0;
+        if (!zone->retired_changes)
+            zone->retired_changes = icalarray_new(sizeof(icalarray *), 4);
+        icalarray_append(zone->retired_changes, &zone->changes);
     }
 
+#if defined(__ATOMIC_RELEASE)
+    __atomic_store_n(&zone->changes, changes, __ATOMIC_RELEASE);
+    __atomic_store_n(&zone->end_year, end_year, __ATOMIC_RELEASE);
+#else
     zone->changes = changes;
     zone->end_year = end_year;
+#endif
 }
 
 void icaltimezone_expand_vtimezone(icalcomponent *comp, int end_year, icalarray *changes)
@@ -760,6 +811,7 @@ void icaltimezone_convert_time(struct icaltimetype *tt,
    daylight-savings time. */
 int icaltimezone_get_utc_offset(icaltimezone *zone, struct icaltimetype *tt, int *is_daylight)
 {
+    icalarray *changes;
     icaltimezonechange *zone_change, *prev_zone_change, tt_change, tmp_change;
     size_t change_num, change_num_to_use;
     int found_change;
@@ -781,9 +833,9 @@ int icaltimezone_get_utc_offset(icaltimezone *zone, struct icaltimetype *tt, int
         zone = zone->builtin_timezone;
 
     /* Make sure the changes array is expanded up to the given time. */
-    icaltimezone_ensure_coverage(zone, tt->year);
+    changes = icaltimezone_ensure_coverage(zone, tt->year);
 
-    if (!zone->changes || zone->changes->num_elements == 0)
+    if (!changes || changes->num_elements == 0)
         return 0;
 
     /* Copy the time parts of the icaltimetype to an icaltimezonechange so we
@@ -797,11 +849,11 @@ int icaltimezone_get_utc_offset(icaltimezone *zone, struct icaltimetype *tt, int
 
     /* This should find a change close to the time, either the change before
        it or the change after it. */
-    change_num = icaltimezone_find_nearby_change(zone, &tt_change);
+    change_num = icaltimezone_find_nearby_change(changes, &tt_change);
 
     /* Now move backwards or forwards to find the timezone change that applies
        to tt. It should only have to do 1 or 2 steps. */
-    zone_change = icalarray_element_at(zone->changes, change_num);
+    zone_change = icalarray_element_at(changes, change_num);
     step = 1;
     found_change = 0;
     change_num_to_use = -1;
@@ -852,10 +904,10 @@ int icaltimezone_get_utc_offset(icaltimezone *zone, struct icaltimetype *tt, int
 
         change_num += step;
 
-        if (change_num >= zone->changes->num_elements)
+        if (change_num >= changes->num_elements)
             break;
 
-        zone_change = icalarray_element_at(zone->changes, change_num);
+        zone_change = icalarray_element_at(changes, change_num);
     }
 
     /* If we didn't find a change to use, then we have a bug! */
@@ -863,7 +915,7 @@ int icaltimezone_get_utc_offset(icaltimezone *zone, struct icaltimetype *tt, int
 
     /* Now we just need to check if the time is in the overlapped region of
        time when clocks go back. */
-    zone_change = icalarray_element_at(zone->changes, change_num_to_use);
+    zone_change = icalarray_element_at(changes, change_num_to_use);
 
     utc_offset_change = zone_change->utc_offset - zone_change->prev_utc_offset;
     if (utc_offset_change < 0 && change_num_to_use > 0) {
@@ -875,7 +927,7 @@ int icaltimezone_get_utc_offset(icaltimezone *zone, struct icaltimetype *tt, int
                either the current zone_change or the previous one. If the
                time has the is_daylight field set we use the matching change,
                else we use the change with standard time. */
-            prev_zone_change = icalarray_element_at(zone->changes, change_num_to_use - 1);
+            prev_zone_change = icalarray_element_at(changes, change_num_to_use - 1);
 
             /* I was going to add an is_daylight flag to struct icaltimetype,
                but iCalendar doesn't let us distinguish between standard and
@@ -911,6 +963,7 @@ int icaltimezone_get_utc_offset(icaltimezone *zone, struct icaltimetype *tt, int
 int icaltimezone_get_utc_offset_of_utc_time(icaltimezone *zone,
                                             struct icaltimetype *tt, int *is_daylight)
 {
+    icalarray *changes;
     icaltimezonechange *zone_change, tt_change, tmp_change;
     size_t change_num, change_num_to_use;
     int found_change = 1;
@@ -928,9 +981,9 @@ int icaltimezone_get_utc_offset_of_utc_time(icaltimezone *zone,
         zone = zone->builtin_timezone;
 
     /* Make sure the changes array is expanded up to the given time. */
-    icaltimezone_ensure_coverage(zone, tt->year);
+    changes = icaltimezone_ensure_coverage(zone, tt->year);
 
-    if (!zone->changes || zone->changes->num_elements == 0)
+    if (!changes || changes->num_elements == 0)
         return 0;
 
     /* Copy the time parts of the icaltimetype to an icaltimezonechange so we
@@ -944,11 +997,11 @@ int icaltimezone_get_utc_offset_of_utc_time(icaltimezone *zone,
 
     /* This should find a change close to the time, either the change before
        it or the change after it. */
-    change_num = icaltimezone_find_nearby_change(zone, &tt_change);
+    change_num = icaltimezone_find_nearby_change(changes, &tt_change);
 
     /* Now move backwards or forwards to find the timezone change that applies
        to tt. It should only have to do 1 or 2 steps. */
-    zone_change = icalarray_element_at(zone->changes, change_num);
+    zone_change = icalarray_element_at(changes, change_num);
     step = 1;
     found_change = 0;
     change_num_to_use = -1;
@@ -985,10 +1038,10 @@ int icaltimezone_get_utc_offset_of_utc_time(icaltimezone *zone,
 
         change_num += step;
 
-        if (change_num >= zone->changes->num_elements)
+        if (change_num >= changes->num_elements)
             break;
 
-        zone_change = icalarray_element_at(zone->changes, change_num);
+        zone_change = icalarray_element_at(changes, change_num);
     }
 
     /* If we didn't find a change to use, then we have a bug! */
@@ -996,7 +1049,7 @@ int icaltimezone_get_utc_offset_of_utc_time(icaltimezone *zone,
 
     /* Now we know exactly which timezone change applies to the time, so
        we can return the UTC offset and whether it is a daylight time. */
-    zone_change = icalarray_element_at(zone->changes, change_num_to_use);
+    zone_change = icalarray_element_at(changes, change_num_to_use);
     if (is_daylight)
         *is_daylight = zone_change->is_daylight;
 
@@ -1005,7 +1058,7 @@ int icaltimezone_get_utc_offset_of_utc_time(icaltimezone *zone,
 
 /** Returns the index of a timezone change which is close to the time
    given in change. */
-static size_t icaltimezone_find_nearby_change(icaltimezone *zone, icaltimezonechange * change)
+static size_t icaltimezone_find_nearby_change(icalarray *changes, icaltimezonechange * change)
 {
     icaltimezonechange *zone_change;
     size_t lower, middle, upper;
@@ -1013,11 +1066,11 @@ static size_t icaltimezone_find_nearby_change(icaltimezone *zone, icaltimezonech
 
     /* Do a simple binary search. */
     lower = middle = 0;
-    upper = zone->changes->num_elements;
+    upper = changes->num_elements;
 
     while (lower < upper) {
         middle = (lower + upper) / 2;
-        zone_change = icalarray_element_at(zone->changes, middle);
+        zone_change = icalarray_element_at(changes, middle);
         cmp = icaltimezone_compare_change_fn(change, zone_change);
         if (cmp == 0) {
             break;
@@ -1747,6 +1800,10 @@ static void icaltimezone_load_builtin_timezone(icaltimezone *zone)
     pthread_mutex_lock(&builtin_mutex);
 #endif
 
+    /* Another thread may have loaded it while we waited for the lock */
+    if (zone->component)
+        goto out;
+
     if (use_builtin_tzdata) {
         char *filename;
         size_t filename_len;
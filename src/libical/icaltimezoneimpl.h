@@ -67,6 +67,11 @@ struct _icaltimezone
     /**< A dynamically-allocated array of time zone changes, sorted by the
        time of the change in local time. So we can do fast binary-searches
        to convert from local time to UTC. */
+
+    icalarray *retired_changes;
+    /**< Arrays that were replaced in changes by a later expansion. They are
+       kept until the zone is reset, since another thread may still be
+       searching one of them. */
 };
 
 #endif /*ICALTIMEZONE_IMPL */
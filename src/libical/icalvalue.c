@@ -26,6 +26,7 @@
 
 #include "icalvalue.h"
 #include "icalvalueimpl.h"
+#include "icalproperty_p.h"
 #include "icalerror.h"
 #include "icalmemory.h"
 #include "icaltime.h"
@@ -1441,6 +1442,10 @@ icalparameter_xliccomparetype icalvalue_compare(const icalvalue *a, const icalva
 
 /** Examine the value and possibly change the kind to agree with the
  *  value
+ *
+ *  The generated icalvalue_set_*() functions, and through them the
+ *  date, time and duration setters, all end here, so this is also where
+ *  the component owning the value learns that it has changed.
  */
 
 void icalvalue_reset_kind(icalvalue *value)
@@ -1454,6 +1459,8 @@ void icalvalue_reset_kind(icalvalue *value)
             value->kind = ICAL_DATETIME_VALUE;
         }
     }
+
+    icalproperty_touch(value->parent);
 }
 
 void icalvalue_set_parent(icalvalue *value, icalproperty *property)
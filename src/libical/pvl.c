@@ -504,6 +504,18 @@ void *pvl_data(pvl_elem E)
 
 #endif
 
+/**
+ * @brief Replaces the data held by an element, which keeps its place
+ * in the list.
+ */
+
+void pvl_set_data(pvl_elem E, void *d)
+{
+    if (E != 0) {
+        E->d = d;
+    }
+}
+
 /**
  * @brief Call a function for every item in the list.
  *
@@ -88,6 +88,9 @@ LIBICAL_ICAL_EXPORT void *pvl_data(pvl_elem);
 #define pvl_data(x) x==0 ? 0 : ((struct pvl_elem_t *)x)->d;
 #endif
 
+/* replace the data in an element, leaving the links alone */
+LIBICAL_ICAL_EXPORT void pvl_set_data(pvl_elem e, void *d);
+
 /* Find an element for which a function returns true */
 typedef int (*pvl_findf) (void *a, void *b);    /*a is list elem, b is other data */
 
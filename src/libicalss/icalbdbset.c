@@ -959,6 +959,34 @@ icalerrorenum icalbdbset_add_component(icalset *set, icalcomponent *child)
     return ICAL_NO_ERROR;
 }
 
+icalerrorenum icalbdbset_add_components(icalset *set, icalcomponent **comps, size_t num_comps)
+{
+    icalbdbset *bset = (icalbdbset *) set;
+    icalerrorenum error = ICAL_NO_ERROR;
+    size_t i;
+
+    icalerror_check_arg_re((bset != 0), "bset", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((comps != 0 || num_comps == 0), "comps", ICAL_BADARG_ERROR);
+
+    for (i = 0; i < num_comps; i++) {
+        if (comps[i] == 0) {
+            error = ICAL_BADARG_ERROR;
+            continue;
+        }
+        icalcomponent_add_component(bset->cluster, comps[i]);
+        comps[i] = 0;
+    }
+
+    /* The next commit stores them all in one transaction */
+    icalbdbset_mark(set);
+
+    if (error != ICAL_NO_ERROR) {
+        icalerror_set_errno(error);
+    }
+
+    return error;
+}
+
 icalerrorenum icalbdbset_remove_component(icalset *set, icalcomponent *child)
 {
     icalbdbset *bset = (icalbdbset *) set;
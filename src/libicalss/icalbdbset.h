@@ -96,6 +96,10 @@ LIBICAL_ICALSS_EXPORT icalerrorenum icalbdbset_commit(icalset *set);
 
 LIBICAL_ICALSS_EXPORT icalerrorenum icalbdbset_add_component(icalset *set, icalcomponent *child);
 
+LIBICAL_ICALSS_EXPORT icalerrorenum icalbdbset_add_components(icalset *set,
+                                                              icalcomponent **comps,
+                                                              size_t num_comps);
+
 LIBICAL_ICALSS_EXPORT icalerrorenum icalbdbset_remove_component(icalset *set,
                                                                 icalcomponent *child);
 
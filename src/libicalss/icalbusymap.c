@@ -0,0 +1,391 @@
+/*======================================================================
+ FILE: icalbusymap.c
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+======================================================================*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "icalbusymap.h"
+#include "icalspanlist.h"
+#include "icaltimezone.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUSYMAP_BITS (8 * sizeof(unsigned long))
+
+/* The slots are processed a word at a time below */
+
+#if defined(__GNUC__)
+#define busymap_popcount(w)  __builtin_popcountl(w)
+#define busymap_ctz(w)       __builtin_ctzl(w)
+#else
+static int busymap_popcount(unsigned long w)
+{
+    int n = 0;
+
+    for (; w; w &= w - 1) {
+        n++;
+    }
+    return n;
+}
+
+/* w must be non-zero */
+static int busymap_ctz(unsigned long w)
+{
+    int n = 0;
+
+    for (; !(w & 1); w >>= 1) {
+        n++;
+    }
+    return n;
+}
+#endif
+
+struct icalbusymap_impl
+{
+    time_t start;               /**< start of the first slot, a multiple of delta_t **/
+    int delta_t;                /**< length of a slot in seconds **/
+    size_t num_slots;
+    size_t num_words;
+    unsigned long *bits;        /**< bit i is set if slot i is busy **/
+};
+
+static icalbusymap *icalbusymap_alloc(time_t start, int delta_t, size_t num_slots)
+{
+    icalbusymap *map;
+
+    if ((map = (icalbusymap *)malloc(sizeof(struct icalbusymap_impl))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    map->start = start;
+    map->delta_t = delta_t;
+    map->num_slots = num_slots;
+    map->num_words = (num_slots + BUSYMAP_BITS - 1) / BUSYMAP_BITS;
+
+    /* One word more than needed, so that an empty map has some */
+    map->bits = (unsigned long *)calloc(map->num_words + 1, sizeof(unsigned long));
+    if (map->bits == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        free(map);
+        return 0;
+    }
+
+    return map;
+}
+
+icalbusymap *icalbusymap_new(struct icaltimetype start, struct icaltimetype end, int delta_t)
+{
+    time_t map_start, map_end;
+
+    if (!delta_t)
+        delta_t = 3600;
+
+    icalerror_check_arg_rz((delta_t > 0), "delta_t");
+
+    map_start = icaltime_as_timet_with_zone(start, icaltimezone_get_utc_timezone());
+    map_end = icaltime_as_timet_with_zone(end, icaltimezone_get_utc_timezone());
+
+    /* Round the window to slot boundaries as
+       icalspanlist_as_freebusy_matrix() does */
+
+    map_start = (map_start / delta_t) * delta_t;
+    map_end = (map_end / delta_t) * delta_t;
+
+    if (map_end < map_start) {
+        map_end = map_start;
+    }
+
+    return icalbusymap_alloc(map_start, delta_t, (size_t)((map_end - map_start) / delta_t));
+}
+
+icalbusymap *icalbusymap_clone(const icalbusymap *map)
+{
+    icalbusymap *clone;
+
+    icalerror_check_arg_rz((map != 0), "map");
+
+    clone = icalbusymap_alloc(map->start, map->delta_t, map->num_slots);
+    if (clone != 0) {
+        memcpy(clone->bits, map->bits, map->num_words * sizeof(unsigned long));
+    }
+
+    return clone;
+}
+
+void icalbusymap_free(icalbusymap *map)
+{
+    if (map == 0)
+        return;
+
+    free(map->bits);
+    free(map);
+}
+
+icalbusymap *icalbusymap_new_from_vfreebusy(icalcomponent *comp, int delta_t)
+{
+    icalspanlist *sl;
+    icalbusymap *map;
+
+    icalerror_check_arg_rz((comp != 0), "comp");
+
+    if ((sl = icalspanlist_from_vfreebusy(comp)) == 0) {
+        return 0;
+    }
+
+    map = icalspanlist_as_busymap(sl, delta_t);
+    icalspanlist_free(sl);
+
+    return map;
+}
+
+icalcomponent *icalbusymap_as_vfreebusy(const icalbusymap *map,
+                                        const char *organizer, const char *attendee)
+{
+    icaltimezone *utc_zone = icaltimezone_get_utc_timezone();
+    icalcomponent *comp;
+    size_t slot = 0;
+
+    icalerror_check_arg_rz((map != 0), "map");
+
+    if (!attendee) {
+        icalerror_set_errno(ICAL_USAGE_ERROR);
+        return 0;
+    }
+
+    comp = icalcomponent_new_vfreebusy();
+
+    icalcomponent_add_property(
+        comp, icalproperty_new_dtstart(icaltime_from_timet_with_zone(map->start, 0, utc_zone)));
+    icalcomponent_add_property(
+        comp, icalproperty_new_dtend(icaltime_from_timet_with_zone(
+            icalbusymap_get_slot_start(map, map->num_slots), 0, utc_zone)));
+    icalcomponent_add_property(
+        comp, icalproperty_new_dtstamp(icaltime_from_timet_with_zone(time(0), 0, utc_zone)));
+
+    if (organizer) {
+        icalcomponent_add_property(comp, icalproperty_new_organizer(organizer));
+    }
+    icalcomponent_add_property(comp, icalproperty_new_attendee(attendee));
+
+    /* One FREEBUSY period for each run of busy slots. Whole words of free
+       slots are skipped at once. */
+
+    while (slot < map->num_slots) {
+        struct icalperiodtype period;
+        icalproperty *p;
+        size_t run_start;
+        unsigned long w = map->bits[slot / BUSYMAP_BITS] & (~0UL << (slot % BUSYMAP_BITS));
+
+        if (w == 0) {
+            slot = (slot / BUSYMAP_BITS + 1) * BUSYMAP_BITS;
+            continue;
+        }
+
+        run_start = (slot / BUSYMAP_BITS) * BUSYMAP_BITS + (size_t)busymap_ctz(w);
+        if (run_start >= map->num_slots) {
+            break;
+        }
+
+        for (slot = run_start + 1; icalbusymap_is_busy(map, slot); slot++) ;
+
+        period.start = icaltime_from_timet_with_zone(
+            icalbusymap_get_slot_start(map, run_start), 0, utc_zone);
+        period.end = icaltime_from_timet_with_zone(
+            icalbusymap_get_slot_start(map, slot), 0, utc_zone);
+        period.duration = icaldurationtype_null_duration();
+
+        p = icalproperty_new_freebusy(period);
+        icalproperty_add_parameter(p, icalparameter_new_fbtype(ICAL_FBTYPE_BUSY));
+        icalcomponent_add_property(comp, p);
+    }
+
+    return comp;
+}
+
+void icalbusymap_mark_busy(icalbusymap *map, time_t start, time_t end)
+{
+    size_t first, last, first_word, last_word, i;
+    time_t map_end;
+
+    icalerror_check_arg_rv((map != 0), "map");
+
+    map_end = icalbusymap_get_slot_start(map, map->num_slots);
+
+    if (end <= start || end <= map->start || start >= map_end) {
+        return;
+    }
+
+    /* The end is not part of the span, so the last slot is the one
+       holding the second before it */
+
+    first = (start <= map->start) ? 0 : (size_t)((start - map->start) / map->delta_t);
+    last = (end > map_end) ? map->num_slots - 1 :
+        (size_t)((end - 1 - map->start) / map->delta_t);
+
+    first_word = first / BUSYMAP_BITS;
+    last_word = last / BUSYMAP_BITS;
+
+    if (first_word == last_word) {
+        map->bits[first_word] |= (~0UL << (first % BUSYMAP_BITS)) &
+            (~0UL >> (BUSYMAP_BITS - 1 - last % BUSYMAP_BITS));
+        return;
+    }
+
+    map->bits[first_word] |= ~0UL << (first % BUSYMAP_BITS);
+    for (i = first_word + 1; i < last_word; i++) {
+        map->bits[i] = ~0UL;
+    }
+    map->bits[last_word] |= ~0UL >> (BUSYMAP_BITS - 1 - last % BUSYMAP_BITS);
+}
+
+size_t icalbusymap_get_num_slots(const icalbusymap *map)
+{
+    icalerror_check_arg_rz((map != 0), "map");
+
+    return map->num_slots;
+}
+
+time_t icalbusymap_get_slot_start(const icalbusymap *map, size_t slot)
+{
+    icalerror_check_arg_rz((map != 0), "map");
+
+    return map->start + (time_t)slot * map->delta_t;
+}
+
+int icalbusymap_is_busy(const icalbusymap *map, size_t slot)
+{
+    icalerror_check_arg_rz((map != 0), "map");
+
+    if (slot >= map->num_slots) {
+        return 0;
+    }
+
+    return (map->bits[slot / BUSYMAP_BITS] >> (slot % BUSYMAP_BITS)) & 1;
+}
+
+size_t icalbusymap_count_busy(const icalbusymap *map)
+{
+    size_t i, n = 0;
+
+    icalerror_check_arg_rz((map != 0), "map");
+
+    for (i = 0; i < map->num_words; i++) {
+        n += (size_t)busymap_popcount(map->bits[i]);
+    }
+
+    return n;
+}
+
+static int icalbusymap_same_grid(const icalbusymap *a, const icalbusymap *b)
+{
+    return (a->start == b->start && a->delta_t == b->delta_t && a->num_slots == b->num_slots);
+}
+
+icalerrorenum icalbusymap_union(icalbusymap *map, const icalbusymap *other)
+{
+    size_t i;
+
+    icalerror_check_arg_re((map != 0), "map", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((other != 0), "other", ICAL_BADARG_ERROR);
+
+    if (!icalbusymap_same_grid(map, other)) {
+        icalerror_set_errno(ICAL_USAGE_ERROR);
+        return ICAL_USAGE_ERROR;
+    }
+
+    for (i = 0; i < map->num_words; i++) {
+        map->bits[i] |= other->bits[i];
+    }
+
+    return ICAL_NO_ERROR;
+}
+
+icalerrorenum icalbusymap_intersect(icalbusymap *map, const icalbusymap *other)
+{
+    size_t i;
+
+    icalerror_check_arg_re((map != 0), "map", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((other != 0), "other", ICAL_BADARG_ERROR);
+
+    if (!icalbusymap_same_grid(map, other)) {
+        icalerror_set_errno(ICAL_USAGE_ERROR);
+        return ICAL_USAGE_ERROR;
+    }
+
+    for (i = 0; i < map->num_words; i++) {
+        map->bits[i] &= other->bits[i];
+    }
+
+    return ICAL_NO_ERROR;
+}
+
+void icalbusymap_invert(icalbusymap *map)
+{
+    size_t i;
+
+    icalerror_check_arg_rv((map != 0), "map");
+
+    for (i = 0; i < map->num_words; i++) {
+        map->bits[i] = ~map->bits[i];
+    }
+
+    /* Keep the bits past the last slot clear for the counts */
+    if (map->num_slots % BUSYMAP_BITS != 0) {
+        map->bits[map->num_words - 1] &= ~(~0UL << (map->num_slots % BUSYMAP_BITS));
+    }
+}
+
+int *icalbusymap_count_busy_maps(icalbusymap **maps, size_t num_maps)
+{
+    const icalbusymap *grid;
+    int *counts;
+    size_t m, i;
+
+    icalerror_check_arg_rz((maps != 0), "maps");
+    icalerror_check_arg_rz((num_maps > 0), "num_maps");
+
+    grid = maps[0];
+    for (m = 0; m < num_maps; m++) {
+        icalerror_check_arg_rz((maps[m] != 0), "maps");
+
+        if (!icalbusymap_same_grid(grid, maps[m])) {
+            icalerror_set_errno(ICAL_USAGE_ERROR);
+            return 0;
+        }
+    }
+
+    counts = (int *)calloc(grid->num_slots + 1, sizeof(int));
+    if (counts == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+    counts[grid->num_slots] = -1;
+
+    /* Only the busy bits are visited, so free words cost one test */
+    for (m = 0; m < num_maps; m++) {
+        for (i = 0; i < grid->num_words; i++) {
+            unsigned long w;
+
+            for (w = maps[m]->bits[i]; w != 0; w &= w - 1) {
+                counts[i * BUSYMAP_BITS + (size_t)busymap_ctz(w)]++;
+            }
+        }
+    }
+
+    return counts;
+}
@@ -0,0 +1,117 @@
+/*======================================================================
+ FILE: icalbusymap.h
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+=========================================================================*/
+#ifndef ICALBUSYMAP_H
+#define ICALBUSYMAP_H
+
+#include "libical_icalss_export.h"
+#include "icalcomponent.h"
+#include "icalerror.h"
+
+#include <time.h>
+
+/** @file icalbusymap.h
+ *  @brief Free/busy time as one bit per slot of a fixed grid
+ *
+ *  A busy map divides a window into slots of delta_t seconds and keeps
+ *  one bit per slot, set if the slot is busy. Maps on the same grid can
+ *  be combined a machine word at a time, so the free/busy time of many
+ *  users over a month of five minute slots can be merged or counted in
+ *  bulk. The window is rounded to multiples of delta_t the same way
+ *  icalspanlist_as_freebusy_matrix() rounds it, so slot i of a map is
+ *  entry i of the matrix.
+ */
+
+typedef struct icalbusymap_impl icalbusymap;
+
+/** @brief Make a map of the window from start to end with no busy slots
+ *
+ *  @param start    The start of the window, in UTC
+ *  @param end      The end of the window, in UTC
+ *  @param delta_t  The length of a slot in seconds. Default 3600.
+ */
+LIBICAL_ICALSS_EXPORT icalbusymap *icalbusymap_new(struct icaltimetype start,
+                                                   struct icaltimetype end, int delta_t);
+
+LIBICAL_ICALSS_EXPORT icalbusymap *icalbusymap_clone(const icalbusymap *map);
+
+LIBICAL_ICALSS_EXPORT void icalbusymap_free(icalbusymap *map);
+
+/** @brief Make a map of the busy periods of a VFREEBUSY component
+ *
+ *  The window is the DTSTART and DTEND of the VFREEBUSY. Periods are
+ *  busy as for icalspanlist_from_vfreebusy().
+ */
+LIBICAL_ICALSS_EXPORT icalbusymap *icalbusymap_new_from_vfreebusy(icalcomponent *comp,
+                                                                  int delta_t);
+
+/** @brief Return a VFREEBUSY component with a FREEBUSY period for each
+ *         run of busy slots
+ *
+ *  @param map        A valid busy map
+ *  @param organizer  The organizer specified as "MAILTO:user@domain", or NULL
+ *  @param attendee   The attendee specified as "MAILTO:user@domain"
+ */
+LIBICAL_ICALSS_EXPORT icalcomponent *icalbusymap_as_vfreebusy(const icalbusymap *map,
+                                                              const char *organizer,
+                                                              const char *attendee);
+
+/** @brief Mark the slots that overlap the time from start up to end busy
+ *
+ *  Times are in UTC. The parts outside the window are ignored.
+ */
+LIBICAL_ICALSS_EXPORT void icalbusymap_mark_busy(icalbusymap *map, time_t start, time_t end);
+
+/** @brief Return the number of slots in the map */
+LIBICAL_ICALSS_EXPORT size_t icalbusymap_get_num_slots(const icalbusymap *map);
+
+/** @brief Return the start of a slot, in UTC */
+LIBICAL_ICALSS_EXPORT time_t icalbusymap_get_slot_start(const icalbusymap *map, size_t slot);
+
+/** @brief Return 1 if a slot is busy, 0 if it is free or not in the map */
+LIBICAL_ICALSS_EXPORT int icalbusymap_is_busy(const icalbusymap *map, size_t slot);
+
+/** @brief Return the number of busy slots */
+LIBICAL_ICALSS_EXPORT size_t icalbusymap_count_busy(const icalbusymap *map);
+
+/** @brief Mark the slots busy in other busy in map too
+ *
+ *  The maps must have the same window and delta_t, or
+ *  ICAL_USAGE_ERROR is returned and map is not changed.
+ */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalbusymap_union(icalbusymap *map,
+                                                      const icalbusymap *other);
+
+/** @brief Leave only the slots busy in both maps busy in map
+ *
+ *  The maps must have the same window and delta_t.
+ */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalbusymap_intersect(icalbusymap *map,
+                                                          const icalbusymap *other);
+
+/** @brief Make the busy slots free and the free slots busy */
+LIBICAL_ICALSS_EXPORT void icalbusymap_invert(icalbusymap *map);
+
+/** @brief Count the maps that are busy in each slot
+ *
+ *  @param maps      Maps with the same window and delta_t
+ *  @param num_maps  The number of maps
+ *
+ *  @return An array with the count for each slot and a final entry of
+ *          -1, like icalspanlist_as_freebusy_matrix(), to be freed with
+ *          free(), or NULL if the maps are not on the same grid.
+ */
+LIBICAL_ICALSS_EXPORT int *icalbusymap_count_busy_maps(icalbusymap **maps, size_t num_maps);
+
+#endif /* !ICALBUSYMAP_H */
@@ -52,11 +52,21 @@
 
 #include "icaldirset.h"
 #include "icaldirsetimpl.h"
+#include "icalclusterimpl.h"
 #include "icalfileset.h"
+#include "icalfilesetimpl.h"
+#include "icalmemory.h"
+#include "icalparser.h"
+#include "icaltimeindex.h"
+#include "icaltimezone.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
 #if defined(HAVE_DIRENT_H)
 #include <dirent.h>
 #endif
@@ -68,509 +78,2257 @@
 /** Default options used when NULL is passed to icalset_new() **/
 static icaldirset_options icaldirset_options_default = { O_RDWR | O_CREAT };
 
-const char *icaldirset_path(icalset *set)
+/** The times of the components of a cluster file, as of when it was last
+    loaded */
+struct icaldirset_cluster_range
 {
-    icaldirset *dset = (icaldirset *) set;
+    char *path;
+    time_t mtime;
+    off_t size;
+    time_t start;
+    time_t end;
+};
+
+static struct icaldirset_cluster_range *icaldirset_find_cluster_range(icaldirset *dset,
+                                                                      const char *path)
+{
+    pvl_elem e;
 
-    return dset->dir;
+    for (e = pvl_head(dset->cluster_ranges); e != 0; e = pvl_next(e)) {
+        struct icaldirset_cluster_range *r = (struct icaldirset_cluster_range *)pvl_data(e);
+
+        if (strcmp(r->path, path) == 0) {
+            return r;
+        }
+    }
+
+    return 0;
 }
 
-void icaldirset_mark(icalset *set)
+static void icaldirset_forget_cluster_range(icaldirset *dset, const char *path)
 {
-    icaldirset *dset = (icaldirset *) set;
+    pvl_elem e;
 
-    icalcluster_mark(dset->cluster);
+    for (e = pvl_head(dset->cluster_ranges); e != 0; e = pvl_next(e)) {
+        struct icaldirset_cluster_range *r = (struct icaldirset_cluster_range *)pvl_data(e);
+
+        if (strcmp(r->path, path) == 0) {
+            (void)pvl_remove(dset->cluster_ranges, e);
+            free(r->path);
+            free(r);
+            return;
+        }
+    }
 }
 
-icalerrorenum icaldirset_commit(icalset *set)
+/* Note the range of the cluster that was just loaded */
+static void icaldirset_note_cluster_range(icaldirset *dset)
 {
-    icaldirset *dset = (icaldirset *) set;
-    icalset *fileset;
-    icalfileset_options options = icalfileset_options_default;
+    struct icaldirset_cluster_range *r;
+    const char *path;
+    icalcompiter i;
+    icalcomponent *c;
+    struct stat sbuf;
 
-    options.cluster = dset->cluster;
+    if (!dset->time_index || dset->cluster == 0) {
+        return;
+    }
 
-    fileset = icalset_new(ICAL_FILE_SET, icalcluster_key(dset->cluster), &options);
+    path = icalcluster_key(dset->cluster);
+    icaldirset_forget_cluster_range(dset, path);
 
-    (void)fileset->commit(fileset);
-    fileset->free(fileset);
+    if (stat(path, &sbuf) != 0) {
+        return;
+    }
 
-    return ICAL_NO_ERROR;
+    if ((r = (struct icaldirset_cluster_range *)malloc(sizeof(*r))) == 0) {
+        return;
+    }
+
+    r->path = strdup(path);
+    r->mtime = sbuf.st_mtime;
+    r->size = sbuf.st_size;
+    r->start = ICALTIMEINDEX_END_OF_TIME;
+    r->end = ICALTIMEINDEX_BEGINNING_OF_TIME;
+
+    if (r->path == 0) {
+        free(r);
+        return;
+    }
+
+    for (i = icalcomponent_begin_component(icalcluster_get_component(dset->cluster),
+                                           ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+        time_t start, end;
+
+        (void)icaltimeindex_get_component_range(c, &start, &end);
+
+        if (start < r->start) {
+            r->start = start;
+        }
+        if (end > r->end) {
+            r->end = end;
+        }
+    }
+
+    pvl_push(dset->cluster_ranges, r);
 }
 
-static void icaldirset_lock(const char *dir)
+/* Return 1 if none of the components in the cluster at path can pass
+   the gauge, going by its range as of when it was last loaded */
+static int icaldirset_skip_cluster(icaldirset *dset, const char *path)
 {
-    _unused(dir);
+    struct icaldirset_cluster_range *r;
+    time_t start, end;
+    struct stat sbuf;
+
+    if (!dset->time_index || dset->gauge == 0 ||
+        (r = icaldirset_find_cluster_range(dset, path)) == 0) {
+        return 0;
+    }
+
+    if (stat(path, &sbuf) != 0 || sbuf.st_mtime != r->mtime || sbuf.st_size != r->size) {
+        return 0;
+    }
+
+    if (!icaltimeindex_get_gauge_range(dset->gauge, &start, &end)) {
+        return 0;
+    }
+
+    return r->end < start || r->start > end;
 }
 
-static void icaldirset_unlock(const char *dir)
+static int icaldirset_scan_holds(icaldirset *dset, icalcluster *cluster);
+static void icaldirset_scan_forget(icaldirset *dset, icalcluster *cluster);
+static void icaldirset_scan_stop(icaldirset *dset);
+
+/***** The cluster cache *****/
+
+/** The clusters loaded are kept, most recently used first, up to a
+    number of clusters and of components in them. Changes to a cluster
+    are written back when it is committed; a changed cluster is not
+    dropped before then, so that adding items one by one does not write
+    and read back each cluster as it falls out of the cache. */
+#define ICALDIRSET_CACHE_CLUSTERS 32
+#define ICALDIRSET_CACHE_COMPONENTS 100000
+
+struct icaldirset_cached_cluster
 {
-    _unused(dir);
+    icalcluster *cluster;
+    time_t mtime;               /**< of the file when it was read or written... */
+    off_t size;                 /**< ...or -1 if there was no file */
+    size_t num_components;
+};
+
+static struct icaldirset_cached_cluster *icaldirset_cache_find(icaldirset *dset,
+                                                               const char *path)
+{
+    pvl_elem e;
+
+    for (e = pvl_head(dset->cache); e != 0; e = pvl_next(e)) {
+        struct icaldirset_cached_cluster *cc = (struct icaldirset_cached_cluster *)pvl_data(e);
+
+        if (strcmp(icalcluster_key(cc->cluster), path) == 0) {
+            return cc;
+        }
+    }
+
+    return 0;
 }
 
-/* Load the contents of the store directory into the store's internal directory list*/
-static icalerrorenum icaldirset_read_directory(icaldirset *dset)
+/* Return 1 if the cluster named name is cached with changes not written */
+static int icaldirset_cache_is_changed(icaldirset *dset, const char *name)
 {
-    char *str;
+    struct icaldirset_cached_cluster *cc;
+    char path[MAXPATHLEN];
 
-#if defined(HAVE_DIRENT_H)
-    struct dirent *de;
-    DIR *dp;
+    snprintf(path, sizeof(path), "%s/%s", dset->dir, name);
+    cc = icaldirset_cache_find(dset, path);
 
-    dp = opendir(dset->dir);
+    return cc != 0 && icalcluster_is_changed(cc->cluster);
+}
 
-    if (dp == 0) {
-        icalerror_set_errno(ICAL_FILE_ERROR);
-        return ICAL_FILE_ERROR;
+static int icaldirset_cache_has_changes(icaldirset *dset)
+{
+    pvl_elem e;
+
+    for (e = pvl_head(dset->cache); e != 0; e = pvl_next(e)) {
+        if (icalcluster_is_changed(((struct icaldirset_cached_cluster *)pvl_data(e))->cluster)) {
+            return 1;
+        }
     }
 
-    /* clear contents of directory list */
-    while ((str = pvl_pop(dset->directory))) {
-        free(str);
+    return 0;
+}
+
+/***** The UID index *****/
+
+/** The file in the directory holding the UID index. It lists the UIDs
+    of the components of each cluster, so a component can be found by
+    its UID without loading the other clusters. Each cluster is listed
+    with its modification time and size as of when its UIDs were read,
+    and a cluster changed behind the index's back is read again. */
+#define ICALDIRSET_UID_INDEX ".icaldirset-uids"
+
+struct icaldirset_uid_cluster
+{
+    char *name;                 /**< file name of the cluster in the directory */
+    time_t mtime;               /**< when its UIDs were read... */
+    off_t size;                 /**< ...or -1 if they must be read again */
+    int seen;                   /**< found by the last icaldirset_sync_uid_index() */
+    int number;                 /**< position in the index file while it is written */
+};
+
+struct icaldirset_uid_entry
+{
+    char *uid;
+    struct icaldirset_uid_cluster *cluster;
+    struct icaldirset_uid_entry *next;
+};
+
+struct icaldirset_uid_index
+{
+    pvl_list clusters;          /**< struct icaldirset_uid_cluster */
+    struct icaldirset_uid_entry **buckets;
+    size_t num_buckets;
+    size_t num_entries;
+    int dirty;                  /**< the index file is out of date */
+};
+
+/* Return 1 for the UID index, the journals of the clusters and the
+   files of interrupted commits, which are kept with the clusters but
+   are not clusters */
+static int icaldirset_is_index_file(const char *name)
+{
+    size_t len = strlen(name), suffix = strlen(ICALFILESET_JOURNAL_SUFFIX);
+
+    return strncmp(name, ICALDIRSET_UID_INDEX, strlen(ICALDIRSET_UID_INDEX)) == 0 ||
+        (len > suffix && strcmp(name + len - suffix, ICALFILESET_JOURNAL_SUFFIX) == 0) ||
+        strstr(name, ICALFILESET_TEMP_INFIX) != 0;
+}
+
+static int icaldirset_is_writable(icaldirset *dset)
+{
+    return (dset->options.flags & (O_WRONLY | O_RDWR)) != 0;
+}
+
+/* The UID of a component of a cluster, or 0 */
+static const char *icaldirset_component_uid(icalcomponent *comp)
+{
+    icalcomponent *inner = icalcomponent_get_inner(comp);
+    icalproperty *uid;
+
+    if (inner == 0 || (uid = icalcomponent_get_first_property(inner, ICAL_UID_PROPERTY)) == 0) {
+        return 0;
     }
 
-    /* load all of the cluster names in the directory list */
-    /* cppcheck-suppress readdirCalled since readdir is recommended */
-    for (de = readdir(dp); de != 0; de = readdir(dp)) {
+    return icalproperty_get_uid(uid);
+}
 
-        /* Remove known directory names  '.' and '..' */
-        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
-            continue;
-        }
+/* The name in the directory of a cluster, or 0 */
+static const char *icaldirset_cluster_name(icaldirset *dset, icalcluster *cluster)
+{
+    const char *key;
+    size_t len = strlen(dset->dir);
 
-        pvl_push(dset->directory, (void *)strdup(de->d_name));
+    if (cluster == 0) {
+        return 0;
     }
 
-    closedir(dp);
-#else
-    struct _finddata_t c_file;
-    intptr_t hFile;
+    key = icalcluster_key(cluster);
+    if (strncmp(key, dset->dir, len) != 0 || key[len] != '/') {
+        return 0;
+    }
 
-    /* Find first .c file in current directory */
-    if ((hFile = _findfirst("*", &c_file)) == -1L) {
-        icalerror_set_errno(ICAL_FILE_ERROR);
-        return ICAL_FILE_ERROR;
-    } else {
-        while ((str = pvl_pop(dset->directory))) {
-            free(str);
-        }
+    return key + len + 1;
+}
 
-        /* load all of the cluster names in the directory list */
-        do {
-            /* Remove known directory names  '.' and '..' */
-            if (strcmp(c_file.name, ".") == 0 || strcmp(c_file.name, "..") == 0) {
-                continue;
-            }
+static size_t icaldirset_uid_hash(struct icaldirset_uid_index *index, const char *uid)
+{
+    size_t h = 5381;
 
-            pvl_push(dset->directory, (void *)strdup(c_file.name));
-        } while (_findnext(hFile, &c_file) == 0);
+    for (; *uid != '\0'; uid++) {
+        h = h * 33 + (unsigned char)*uid;
+    }
 
-        _findclose(hFile);
+    return h & (index->num_buckets - 1);
+}
+
+static struct icaldirset_uid_index *icaldirset_uid_index_new(void)
+{
+    struct icaldirset_uid_index *index;
+
+    if ((index = (struct icaldirset_uid_index *)malloc(sizeof(*index))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
     }
 
-#endif
+    index->num_buckets = 256;
+    index->num_entries = 0;
+    index->dirty = 0;
+    index->clusters = pvl_newlist();
+    index->buckets = calloc(index->num_buckets, sizeof(struct icaldirset_uid_entry *));
 
-    return ICAL_NO_ERROR;
+    if (index->buckets == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        pvl_free(index->clusters);
+        free(index);
+        return 0;
+    }
+
+    return index;
 }
 
-icalset *icaldirset_init(icalset *set, const char *dir, void *options_in)
+static void icaldirset_uid_index_free(struct icaldirset_uid_index *index)
 {
-    icaldirset *dset;
-    icaldirset_options *options = options_in;
-    struct stat sbuf;
+    struct icaldirset_uid_cluster *cl;
+    size_t i;
 
-    icalerror_check_arg_rz((dir != 0), "dir");
-    icalerror_check_arg_rz((set != 0), "set");
-    dset = (icaldirset *) set;
+    for (i = 0; i < index->num_buckets; i++) {
+        struct icaldirset_uid_entry *e, *next;
 
-    if (stat(dir, &sbuf) != 0) {
-        icalerror_set_errno(ICAL_FILE_ERROR);
-        return 0;
+        for (e = index->buckets[i]; e != 0; e = next) {
+            next = e->next;
+            free(e->uid);
+            free(e);
+        }
     }
 
-    /* dir is not the name of a direectory */
-    if (!S_ISDIR(sbuf.st_mode)) {
-        icalerror_set_errno(ICAL_USAGE_ERROR);
+    while ((cl = (struct icaldirset_uid_cluster *)pvl_pop(index->clusters)) != 0) {
+        free(cl->name);
+        free(cl);
+    }
+
+    pvl_free(index->clusters);
+    free(index->buckets);
+    free(index);
+}
+
+static struct icaldirset_uid_cluster *icaldirset_uid_cluster(struct icaldirset_uid_index *index,
+                                                             const char *name, int create)
+{
+    struct icaldirset_uid_cluster *cl;
+    pvl_elem e;
+
+    for (e = pvl_head(index->clusters); e != 0; e = pvl_next(e)) {
+        cl = (struct icaldirset_uid_cluster *)pvl_data(e);
+
+        if (strcmp(cl->name, name) == 0) {
+            return cl;
+        }
+    }
+
+    if (!create || (cl = (struct icaldirset_uid_cluster *)malloc(sizeof(*cl))) == 0) {
         return 0;
     }
 
-    icaldirset_lock(dir);
+    if ((cl->name = strdup(name)) == 0) {
+        free(cl);
+        return 0;
+    }
+    cl->mtime = 0;
+    cl->size = -1;
+    cl->seen = 1;
+    cl->number = 0;
 
-    dset->dir = (char *)strdup(dir);
-    dset->options = *options;
-    dset->directory = pvl_newlist();
-    dset->directory_iterator = 0;
-    dset->gauge = 0;
-    dset->first_component = 0;
-    dset->cluster = 0;
+    pvl_push(index->clusters, cl);
 
-    return set;
+    return cl;
 }
 
-icalset *icaldirset_new(const char *dir)
+static void icaldirset_uid_index_add(struct icaldirset_uid_index *index, const char *uid,
+                                     struct icaldirset_uid_cluster *cl)
 {
-    return icalset_new(ICAL_DIR_SET, dir, &icaldirset_options_default);
+    struct icaldirset_uid_entry *e;
+    size_t h = icaldirset_uid_hash(index, uid);
+
+    for (e = index->buckets[h]; e != 0; e = e->next) {
+        if (e->cluster == cl && strcmp(e->uid, uid) == 0) {
+            return;
+        }
+    }
+
+    if ((e = (struct icaldirset_uid_entry *)malloc(sizeof(*e))) == 0) {
+        return;
+    }
+    if ((e->uid = strdup(uid)) == 0) {
+        free(e);
+        return;
+    }
+
+    e->cluster = cl;
+    e->next = index->buckets[h];
+    index->buckets[h] = e;
+    index->num_entries++;
+
+    if (index->num_entries > 2 * index->num_buckets) {
+        struct icaldirset_uid_entry **old_buckets = index->buckets;
+        size_t i, old_num_buckets = index->num_buckets;
+
+        index->num_buckets *= 2;
+        index->buckets = calloc(index->num_buckets, sizeof(struct icaldirset_uid_entry *));
+
+        if (index->buckets == 0) {
+            index->buckets = old_buckets;
+            index->num_buckets = old_num_buckets;
+            return;
+        }
+
+        for (i = 0; i < old_num_buckets; i++) {
+            struct icaldirset_uid_entry *next;
+
+            for (e = old_buckets[i]; e != 0; e = next) {
+                next = e->next;
+                h = icaldirset_uid_hash(index, e->uid);
+                e->next = index->buckets[h];
+                index->buckets[h] = e;
+            }
+        }
+
+        free(old_buckets);
+    }
 }
 
-icalset *icaldirset_new_reader(const char *dir)
+/* Remove the entries of uid in cl, or of every UID in cl if uid is 0 */
+static void icaldirset_uid_index_remove(struct icaldirset_uid_index *index, const char *uid,
+                                        struct icaldirset_uid_cluster *cl)
 {
-    icaldirset_options reader_options = icaldirset_options_default;
+    size_t i = 0, end = index->num_buckets;
 
-    reader_options.flags = O_RDONLY;
+    if (uid != 0) {
+        i = icaldirset_uid_hash(index, uid);
+        end = i + 1;
+    }
 
-    return icalset_new(ICAL_DIR_SET, dir, &reader_options);
+    for (; i < end; i++) {
+        struct icaldirset_uid_entry **ep = &index->buckets[i];
+
+        while (*ep != 0) {
+            struct icaldirset_uid_entry *e = *ep;
+
+            if (e->cluster == cl && (uid == 0 || strcmp(e->uid, uid) == 0)) {
+                *ep = e->next;
+                free(e->uid);
+                free(e);
+                index->num_entries--;
+            } else {
+                ep = &e->next;
+            }
+        }
+    }
 }
 
-icalset *icaldirset_new_writer(const char *dir)
+/* Read the UIDs of a cluster file into the index */
+static void icaldirset_uid_index_read_cluster(icaldirset *dset, struct icaldirset_uid_cluster *cl,
+                                              const struct stat *sbuf)
 {
-    icaldirset_options writer_options = icaldirset_options_default;
+    char path[MAXPATHLEN];
+    icalcluster *cluster;
+    icalcomponent *c;
 
-    writer_options.flags = O_RDWR | O_CREAT;
+    icaldirset_uid_index_remove(dset->uid_index, 0, cl);
+    dset->uid_index->dirty = 1;
+    cl->size = -1;
 
-    return icalset_new(ICAL_DIR_SET, dir, &writer_options);
+    snprintf(path, sizeof(path), "%s/%s", dset->dir, cl->name);
+
+    if ((cluster = icalfileset_produce_icalcluster(path)) == 0) {
+        return;
+    }
+
+    for (c = icalcluster_get_first_component(cluster); c != 0;
+         c = icalcluster_get_next_component(cluster)) {
+        const char *uid = icaldirset_component_uid(c);
+
+        if (uid != 0) {
+            icaldirset_uid_index_add(dset->uid_index, uid, cl);
+        }
+    }
+
+    icalcluster_free(cluster);
+
+    cl->mtime = sbuf->st_mtime;
+    cl->size = sbuf->st_size;
 }
 
-void icaldirset_free(icalset *s)
+/* Write s to f with backslashes, newlines and carriage returns escaped */
+static void icaldirset_write_escaped(FILE *f, const char *s)
 {
-    icaldirset *dset = (icaldirset *) s;
-    char *str;
+    for (; *s != '\0'; s++) {
+        switch (*s) {
+        case '\\':
+            fputs("\\\\", f);
+            break;
+        case '\n':
+            fputs("\\n", f);
+            break;
+        case '\r':
+            fputs("\\r", f);
+            break;
+        default:
+            fputc(*s, f);
+        }
+    }
+}
 
-    icaldirset_unlock(dset->dir);
+/* Unescape s in place, up to the end of the line, and return the end */
+static char *icaldirset_read_escaped(char *s)
+{
+    char *out = s, *end;
 
-    if (dset->dir != 0) {
-        free(dset->dir);
-        dset->dir = 0;
+    for (; *s != '\0' && *s != '\n'; s++) {
+        if (*s == '\\' && s[1] != '\0' && s[1] != '\n') {
+            s++;
+            *out++ = (*s == 'n') ? '\n' : (*s == 'r') ? '\r' : *s;
+        } else {
+            *out++ = *s;
+        }
     }
 
-    if (dset->gauge != 0) {
-        icalgauge_free(dset->gauge);
-        dset->gauge = 0;
+    end = (*s == '\n') ? s + 1 : s;
+    *out = '\0';
+
+    return end;
+}
+
+/* Replace the index file with the index, through a temporary file so
+   that readers see either the old index or the new one */
+static void icaldirset_write_uid_index(icaldirset *dset)
+{
+    struct icaldirset_uid_index *index = dset->uid_index;
+    char path[MAXPATHLEN], tmp[MAXPATHLEN + 16];
+    pvl_elem e;
+    FILE *f;
+    size_t i;
+    int n = 0, ok;
+
+    if (!icaldirset_is_writable(dset)) {
+        return;
     }
 
-    if (dset->cluster != 0) {
-        icalcluster_free(dset->cluster);
+    if (snprintf(path, sizeof(path), "%s/%s", dset->dir, ICALDIRSET_UID_INDEX) >=
+        (int)sizeof(path)) {
+        return;
     }
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
 
-    while (dset->directory != 0 && (str = pvl_pop(dset->directory)) != 0) {
-        free(str);
+    if ((f = fopen(tmp, "w")) == 0) {
+        return;
     }
 
-    if (dset->directory != 0) {
-        pvl_free(dset->directory);
-        dset->directory = 0;
+    /* Clusters are numbered in the order they are written, and the
+       UIDs refer to them by number. A cluster with changes that are
+       not written yet is listed to be read again. */
+
+    fprintf(f, "ICALDIRSET-UIDS 1\n");
+    for (e = pvl_head(index->clusters); e != 0; e = pvl_next(e)) {
+        struct icaldirset_uid_cluster *cl = (struct icaldirset_uid_cluster *)pvl_data(e);
+        int read_again = (cl->size < 0 || icaldirset_cache_is_changed(dset, cl->name));
+
+        cl->number = n++;
+        fprintf(f, "C %ld %ld ", (long)cl->mtime, read_again ? -1L : (long)cl->size);
+        icaldirset_write_escaped(f, cl->name);
+        fputc('\n', f);
     }
 
-    dset->directory_iterator = 0;
-    dset->first_component = 0;
+    for (i = 0; i < index->num_buckets; i++) {
+        struct icaldirset_uid_entry *ue;
+
+        for (ue = index->buckets[i]; ue != 0; ue = ue->next) {
+            fprintf(f, "U %d ", ue->cluster->number);
+            icaldirset_write_escaped(f, ue->uid);
+            fputc('\n', f);
+        }
+    }
+
+    ok = (fflush(f) == 0 && !ferror(f));
+    ok = (fclose(f) == 0) && ok;
+
+    if (ok && rename(tmp, path) == 0) {
+        index->dirty = 0;
+    } else {
+        (void)unlink(tmp);
+    }
 }
 
-static icalerrorenum icaldirset_next_cluster(icaldirset *dset)
+/* Read the index file, if there is one */
+static void icaldirset_read_uid_index(icaldirset *dset)
 {
+    struct icaldirset_uid_index *index = dset->uid_index;
+    struct icaldirset_uid_cluster **clusters = 0;
+    size_t num_clusters = 0, allocated = 0;
     char path[MAXPATHLEN];
+    struct stat sbuf;
+    char *buf, *line;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dset->dir, ICALDIRSET_UID_INDEX);
+
+    if (stat(path, &sbuf) != 0 || (f = fopen(path, "r")) == 0) {
+        return;
+    }
+
+    if ((buf = (char *)malloc((size_t)sbuf.st_size + 1)) == 0) {
+        fclose(f);
+        return;
+    }
+    buf[fread(buf, 1, (size_t)sbuf.st_size, f)] = '\0';
+    fclose(f);
+
+    line = buf;
+    if (strncmp(line, "ICALDIRSET-UIDS 1\n", 18) != 0) {
+        free(buf);
+        return;
+    }
+    line += 18;
+
+    while (*line != '\0') {
+        char *rest, *next;
+        long a, b;
+
+        if (line[0] == 'C' && line[1] == ' ') {
+            struct icaldirset_uid_cluster *cl;
+
+            a = strtol(line + 2, &rest, 10);
+            b = strtol(rest, &rest, 10);
+            next = icaldirset_read_escaped(rest + (*rest == ' '));
+
+            if (num_clusters == allocated) {
+                struct icaldirset_uid_cluster **grown;
+
+                allocated = allocated ? 2 * allocated : 16;
+                grown = realloc(clusters, allocated * sizeof(*clusters));
+                if (grown == 0) {
+                    break;
+                }
+                clusters = grown;
+            }
+
+            cl = icaldirset_uid_cluster(index, rest + (*rest == ' '), 1);
+            if (cl == 0) {
+                break;
+            }
+            cl->mtime = (time_t)a;
+            cl->size = (off_t)b;
+            clusters[num_clusters++] = cl;
+        } else if (line[0] == 'U' && line[1] == ' ') {
+            a = strtol(line + 2, &rest, 10);
+            next = icaldirset_read_escaped(rest + (*rest == ' '));
+
+            if (a >= 0 && (size_t)a < num_clusters) {
+                icaldirset_uid_index_add(index, rest + (*rest == ' '), clusters[a]);
+            }
+        } else {
+            next = strchr(line, '\n');
+            next = next ? next + 1 : line + strlen(line);
+        }
+
+        line = next;
+    }
+
+    free(clusters);
+    free(buf);
+}
+
+static icalerrorenum icaldirset_list_directory(const char *dir, pvl_list list);
+
+/* Bring the UID index up to date with the directory, reading the UIDs
+   of the clusters that changed since they were read. Returns 0 if the
+   index cannot be used. */
+static int icaldirset_sync_uid_index(icaldirset *dset)
+{
+    struct icaldirset_uid_index *index;
+    pvl_list names;
+    pvl_elem e, next;
+    char *name;
+
+    if (dset->uid_index == 0) {
+        if ((dset->uid_index = icaldirset_uid_index_new()) == 0) {
+            return 0;
+        }
+        icaldirset_read_uid_index(dset);
+    }
+
+    index = dset->uid_index;
+
+    names = pvl_newlist();
+    if (icaldirset_list_directory(dset->dir, names) != ICAL_NO_ERROR) {
+        pvl_free(names);
+        return 0;
+    }
+
+    for (e = pvl_head(index->clusters); e != 0; e = pvl_next(e)) {
+        ((struct icaldirset_uid_cluster *)pvl_data(e))->seen = 0;
+    }
+
+    while ((name = (char *)pvl_pop(names)) != 0) {
+        struct icaldirset_uid_cluster *cl = icaldirset_uid_cluster(index, name, 1);
+        char path[MAXPATHLEN];
+        struct stat sbuf;
+
+        snprintf(path, sizeof(path), "%s/%s", dset->dir, name);
+        free(name);
+
+        if (cl == 0) {
+            continue;
+        }
+        cl->seen = 1;
+
+        /* The changes to a cached cluster are not on disk yet */
+        if (icaldirset_cache_is_changed(dset, cl->name)) {
+            continue;
+        }
+
+        if (stat(path, &sbuf) != 0 || S_ISDIR(sbuf.st_mode)) {
+            continue;
+        }
+
+        if (cl->size != sbuf.st_size || cl->mtime != sbuf.st_mtime) {
+            icaldirset_uid_index_read_cluster(dset, cl, &sbuf);
+        }
+    }
+    pvl_free(names);
+
+    /* Forget the clusters that are gone */
+    for (e = pvl_head(index->clusters); e != 0; e = next) {
+        struct icaldirset_uid_cluster *cl = (struct icaldirset_uid_cluster *)pvl_data(e);
+
+        next = pvl_next(e);
+
+        if (!cl->seen && !icaldirset_cache_is_changed(dset, cl->name)) {
+            icaldirset_uid_index_remove(index, 0, cl);
+            (void)pvl_remove(index->clusters, e);
+            free(cl->name);
+            free(cl);
+            index->dirty = 1;
+        }
+    }
+
+    /* Changes to cached clusters leave writing it to when they are written */
+    if (index->dirty && !icaldirset_cache_has_changes(dset)) {
+        icaldirset_write_uid_index(dset);
+    }
+
+    return 1;
+}
+
+/* Write a cached cluster to its file if it has changes */
+static icalerrorenum icaldirset_write_cluster(icaldirset *dset,
+                                              struct icaldirset_cached_cluster *cc)
+{
+    icalfileset_options options = icalfileset_options_default;
+    const char *path = icalcluster_key(cc->cluster);
+    const char *name;
+    icalset *fileset;
+    icalerrorenum error;
+    struct stat sbuf;
+
+    if (!icalcluster_is_changed(cc->cluster)) {
+        return ICAL_NO_ERROR;
+    }
+
+    options.cluster = cc->cluster;
+
+    if ((fileset = icalset_new(ICAL_FILE_SET, path, &options)) == 0) {
+        return icalerrno;
+    }
+    error = icalset_commit(fileset);
+    icalset_free(fileset);
+
+    /* The cluster keeps its changes, to be written again later */
+    if (error != ICAL_NO_ERROR) {
+        icalerror_set_errno(error);
+        return error;
+    }
+
+    icalcluster_commit(cc->cluster);
+
+    if (stat(path, &sbuf) == 0) {
+        cc->mtime = sbuf.st_mtime;
+        cc->size = sbuf.st_size;
+    }
+
+    /* The cluster file now holds what the UID index says it does */
+    name = icaldirset_cluster_name(dset, cc->cluster);
+    if (dset->uid_index != 0 && name != 0) {
+        struct icaldirset_uid_cluster *cl = icaldirset_uid_cluster(dset->uid_index, name, 0);
+
+        if (cl != 0) {
+            cl->mtime = cc->mtime;
+            cl->size = cc->size;
+            dset->uid_index->dirty = 1;
+        }
+    }
+
+    return ICAL_NO_ERROR;
+}
+
+/* Drop a cluster from the cache, writing its changes first unless the
+   set is read only, in which case they are lost */
+static void icaldirset_cache_drop(icaldirset *dset, pvl_elem e)
+{
+    struct icaldirset_cached_cluster *cc = (struct icaldirset_cached_cluster *)pvl_data(e);
+
+    if (icalcluster_is_changed(cc->cluster)) {
+        const char *name = icaldirset_cluster_name(dset, cc->cluster);
+
+        if (!icaldirset_is_writable(dset) ||
+            icaldirset_write_cluster(dset, cc) != ICAL_NO_ERROR) {
+            struct icaldirset_uid_cluster *cl = (dset->uid_index != 0 && name != 0) ?
+                icaldirset_uid_cluster(dset->uid_index, name, 0) : 0;
+
+            /* Its UIDs must be read again from the file */
+            if (cl != 0) {
+                cl->size = -1;
+            }
+        }
+    }
+
+    if (dset->cluster == cc->cluster) {
+        dset->cluster = 0;
+    }
+    icaldirset_scan_forget(dset, cc->cluster);
+
+    (void)pvl_remove(dset->cache, e);
+    dset->cache_components -= cc->num_components;
+    icalcluster_free(cc->cluster);
+    free(cc);
+}
+
+/* Drop the least recently used clusters, but not the most recent one,
+   the one being scanned or those with changes not yet committed to a
+   writable set, until the cache is within its limits */
+static void icaldirset_cache_trim(icaldirset *dset)
+{
+    pvl_elem e = pvl_tail(dset->cache);
+
+    while (e != 0 && e != pvl_head(dset->cache) &&
+           (pvl_count(dset->cache) > (int)dset->cache_max_clusters ||
+            dset->cache_components > dset->cache_max_components)) {
+        pvl_elem prior = pvl_prior(e);
+        struct icaldirset_cached_cluster *cc = (struct icaldirset_cached_cluster *)pvl_data(e);
+
+        if (!(icalcluster_is_changed(cc->cluster) && icaldirset_is_writable(dset)) &&
+            !icaldirset_scan_holds(dset, cc->cluster)) {
+            icaldirset_cache_drop(dset, e);
+        }
+        e = prior;
+    }
+}
+
+/* Add a cluster read from its file to the front of the cache */
+static void icaldirset_cache_insert(icaldirset *dset, icalcluster *cluster,
+                                    time_t mtime, off_t size)
+{
+    struct icaldirset_cached_cluster *cc;
+
+    if ((cc = (struct icaldirset_cached_cluster *)malloc(sizeof(*cc))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        icalcluster_free(cluster);
+        return;
+    }
+
+    cc->cluster = cluster;
+    cc->mtime = mtime;
+    cc->size = size;
+    cc->num_components =
+        (size_t)icalcluster_count_components(cc->cluster, ICAL_ANY_COMPONENT);
+
+    pvl_unshift(dset->cache, cc);
+    dset->cache_components += cc->num_components;
+    icaldirset_cache_trim(dset);
+}
+
+/* Return the cluster for path, from the cache if its file has not
+   changed since it was cached, or else from the file */
+static icalcluster *icaldirset_load_cluster(icaldirset *dset, const char *path)
+{
+    struct icaldirset_cached_cluster *cc = icaldirset_cache_find(dset, path);
+    icalcluster *cluster;
+    struct stat sbuf;
+    int exists = (stat(path, &sbuf) == 0);
+
+    if (cc != 0 && !icalcluster_is_changed(cc->cluster) &&
+        (exists ? (sbuf.st_mtime != cc->mtime || sbuf.st_size != cc->size) : cc->size >= 0)) {
+        pvl_elem e;
+
+        for (e = pvl_head(dset->cache); pvl_data(e) != cc; e = pvl_next(e)) ;
+        icaldirset_cache_drop(dset, e);
+        cc = 0;
+    }
+
+    if (cc != 0) {
+        /* Move it to the front */
+        if (pvl_data(pvl_head(dset->cache)) != cc) {
+            pvl_elem e;
+
+            for (e = pvl_head(dset->cache); pvl_data(e) != cc; e = pvl_next(e)) ;
+            (void)pvl_remove(dset->cache, e);
+            pvl_unshift(dset->cache, cc);
+        }
+        return cc->cluster;
+    }
+
+    if ((cluster = icalfileset_produce_icalcluster(path)) == 0) {
+        return 0;
+    }
+
+    icaldirset_cache_insert(dset, cluster, exists ? sbuf.st_mtime : 0, exists ? sbuf.st_size : -1);
+
+    return (icaldirset_cache_find(dset, path) != 0) ? cluster : 0;
+}
+
+/* Account for components added to the current cluster, or for one
+   removed from it if added is 0 */
+static void icaldirset_cache_count(icaldirset *dset, size_t added)
+{
+    struct icaldirset_cached_cluster *cc =
+        icaldirset_cache_find(dset, icalcluster_key(dset->cluster));
+
+    if (cc == 0) {
+        return;
+    }
+
+    if (added > 0) {
+        cc->num_components += added;
+        dset->cache_components += added;
+        icaldirset_cache_trim(dset);
+    } else if (cc->num_components > 0) {
+        cc->num_components--;
+        dset->cache_components--;
+    }
+}
+
+/* Write all changed clusters and the UID index */
+static icalerrorenum icaldirset_flush(icaldirset *dset)
+{
+    icalerrorenum error = ICAL_NO_ERROR;
+    pvl_elem e;
+
+    for (e = pvl_head(dset->cache); e != 0; e = pvl_next(e)) {
+        icalerrorenum err =
+            icaldirset_write_cluster(dset, (struct icaldirset_cached_cluster *)pvl_data(e));
+
+        if (error == ICAL_NO_ERROR) {
+            error = err;
+        }
+    }
+
+    if (dset->uid_index != 0 && dset->uid_index->dirty) {
+        icaldirset_write_uid_index(dset);
+    }
+
+    return error;
+}
+
+const char *icaldirset_path(icalset *set)
+{
+    icaldirset *dset = (icaldirset *) set;
+
+    return dset->dir;
+}
+
+void icaldirset_mark(icalset *set)
+{
+    icaldirset *dset = (icaldirset *) set;
+
+    icalcluster_mark(dset->cluster);
+}
+
+icalerrorenum icaldirset_commit(icalset *set)
+{
+    icaldirset *dset = (icaldirset *) set;
+    icalerrorenum error = icaldirset_flush(dset);
+
+    /* The clusters kept only for their changes can go now */
+    icaldirset_cache_trim(dset);
+
+    return error;
+}
+
+static void icaldirset_lock(const char *dir)
+{
+    _unused(dir);
+}
+
+static void icaldirset_unlock(const char *dir)
+{
+    _unused(dir);
+}
+
+/* Load the names of the clusters in dir into list */
+static icalerrorenum icaldirset_list_directory(const char *dir, pvl_list list)
+{
+    char *str;
+
+#if defined(HAVE_DIRENT_H)
+    struct dirent *de;
+    DIR *dp;
+
+    dp = opendir(dir);
+
+    if (dp == 0) {
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
+    }
+
+    /* clear contents of directory list */
+    while ((str = pvl_pop(list))) {
+        free(str);
+    }
+
+    /* load all of the cluster names in the directory list */
+    /* cppcheck-suppress readdirCalled since readdir is recommended */
+    for (de = readdir(dp); de != 0; de = readdir(dp)) {
+
+        /* Remove known directory names  '.' and '..', the UID index and journals */
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+            icaldirset_is_index_file(de->d_name)) {
+            continue;
+        }
+
+        pvl_push(list, (void *)strdup(de->d_name));
+    }
+
+    closedir(dp);
+#else
+    struct _finddata_t c_file;
+    intptr_t hFile;
+
+    /* Find first .c file in current directory */
+    if ((hFile = _findfirst("*", &c_file)) == -1L) {
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
+    } else {
+        while ((str = pvl_pop(list))) {
+            free(str);
+        }
+
+        /* load all of the cluster names in the directory list */
+        do {
+            /* Remove known directory names  '.' and '..', the UID index and journals */
+            if (strcmp(c_file.name, ".") == 0 || strcmp(c_file.name, "..") == 0 ||
+                icaldirset_is_index_file(c_file.name)) {
+                continue;
+            }
+
+            pvl_push(list, (void *)strdup(c_file.name));
+        } while (_findnext(hFile, &c_file) == 0);
+
+        _findclose(hFile);
+    }
+
+#endif
+
+    return ICAL_NO_ERROR;
+}
+
+/* Load the contents of the store directory into the store's internal directory list*/
+static icalerrorenum icaldirset_read_directory(icaldirset *dset)
+{
+    return icaldirset_list_directory(dset->dir, dset->directory);
+}
+
+icalset *icaldirset_init(icalset *set, const char *dir, void *options_in)
+{
+    icaldirset *dset;
+    icaldirset_options *options = options_in;
+    struct stat sbuf;
+
+    icalerror_check_arg_rz((dir != 0), "dir");
+    icalerror_check_arg_rz((set != 0), "set");
+    dset = (icaldirset *) set;
+
+    if (stat(dir, &sbuf) != 0) {
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return 0;
+    }
+
+    /* dir is not the name of a direectory */
+    if (!S_ISDIR(sbuf.st_mode)) {
+        icalerror_set_errno(ICAL_USAGE_ERROR);
+        return 0;
+    }
+
+    icaldirset_lock(dir);
+
+    dset->dir = (char *)strdup(dir);
+    dset->options = *options;
+    dset->directory = pvl_newlist();
+    dset->directory_iterator = 0;
+    dset->gauge = 0;
+    dset->first_component = 0;
+    dset->cluster = 0;
+    dset->time_index = 0;
+    dset->cluster_ranges = pvl_newlist();
+    dset->uid_index = 0;
+    dset->cache = pvl_newlist();
+    dset->cache_components = 0;
+    dset->cache_max_clusters = ICALDIRSET_CACHE_CLUSTERS;
+    dset->cache_max_components = ICALDIRSET_CACHE_COMPONENTS;
+    dset->scan_threads = 1;
+    dset->scan_ordered = 1;
+    dset->scan = 0;
+
+    return set;
+}
+
+icalset *icaldirset_new(const char *dir)
+{
+    return icalset_new(ICAL_DIR_SET, dir, &icaldirset_options_default);
+}
+
+icalset *icaldirset_new_reader(const char *dir)
+{
+    icaldirset_options reader_options = icaldirset_options_default;
+
+    reader_options.flags = O_RDONLY;
+
+    return icalset_new(ICAL_DIR_SET, dir, &reader_options);
+}
+
+icalset *icaldirset_new_writer(const char *dir)
+{
+    icaldirset_options writer_options = icaldirset_options_default;
+
+    writer_options.flags = O_RDWR | O_CREAT;
+
+    return icalset_new(ICAL_DIR_SET, dir, &writer_options);
+}
+
+void icaldirset_free(icalset *s)
+{
+    icaldirset *dset = (icaldirset *) s;
+    char *str;
+
+    icaldirset_unlock(dset->dir);
+    icaldirset_scan_stop(dset);
+
+    /* Write the changed clusters as they are dropped */
+    while (pvl_head(dset->cache) != 0) {
+        icaldirset_cache_drop(dset, pvl_head(dset->cache));
+    }
+
+    if (dset->uid_index != 0) {
+        if (dset->uid_index->dirty) {
+            icaldirset_write_uid_index(dset);
+        }
+        icaldirset_uid_index_free(dset->uid_index);
+        dset->uid_index = 0;
+    }
+
+    pvl_free(dset->cache);
+    dset->cache = 0;
+
+    if (dset->dir != 0) {
+        free(dset->dir);
+        dset->dir = 0;
+    }
+
+    if (dset->gauge != 0) {
+        icalgauge_free(dset->gauge);
+        dset->gauge = 0;
+    }
+
+    while (dset->directory != 0 && (str = pvl_pop(dset->directory)) != 0) {
+        free(str);
+    }
+
+    if (dset->directory != 0) {
+        pvl_free(dset->directory);
+        dset->directory = 0;
+    }
+
+    if (dset->cluster_ranges != 0) {
+        (void)icaldirset_set_time_index(s, 0);
+        pvl_free(dset->cluster_ranges);
+        dset->cluster_ranges = 0;
+    }
+
+    dset->directory_iterator = 0;
+    dset->first_component = 0;
+}
+
+static icalerrorenum icaldirset_next_cluster(icaldirset *dset)
+{
+    char path[MAXPATHLEN];
+
+    if (dset->directory_iterator == 0) {
+        icalerror_set_errno(ICAL_INTERNAL_ERROR);
+        return ICAL_INTERNAL_ERROR;
+    }
+
+    do {
+        dset->directory_iterator = pvl_next(dset->directory_iterator);
+        if (dset->directory_iterator != 0) {
+            snprintf(path, sizeof(path), "%s/%s",
+                     dset->dir, (char *)pvl_data(dset->directory_iterator));
+        }
+    } while (dset->directory_iterator != 0 && icaldirset_skip_cluster(dset, path));
+
+    if (dset->directory_iterator == 0) {
+        /* There are no more clusters */
+        dset->cluster = 0;
+        return ICAL_NO_ERROR;
+    }
+
+    dset->cluster = icaldirset_load_cluster(dset, path);
+    icaldirset_note_cluster_range(dset);
+
+    return icalerrno;
+}
+
+/* The UID given to components that have none */
+static void icaldirset_default_uid(char *uidstring, size_t size)
+{
+#if defined(HAVE_SYS_UTSNAME_H)
+    struct utsname unamebuf;
+
+    uname(&unamebuf);
+    snprintf(uidstring, size, "%d-%s", (int)getpid(), unamebuf.nodename);
+#else
+    /* FIXME: There must be an easy get the system name */
+    snprintf(uidstring, size, "%d-%s", (int)getpid(), "WINDOWS");
+#endif
+}
+
+/* Give comp the default UID if it has none. uidstring holds the default
+   UID once it is first needed, so a batch works it out only once */
+static void icaldirset_add_uid(icalcomponent *comp, char *uidstring, size_t size)
+{
+    icalproperty *uid;
+
+    icalerror_check_arg_rv((comp != 0), "comp");
+
+    uid = icalcomponent_get_first_property(comp, ICAL_UID_PROPERTY);
+
+    if (uid == 0) {
+        if (uidstring[0] == '\0') {
+            icaldirset_default_uid(uidstring, size);
+        }
+        uid = icalproperty_new_uid(uidstring);
+        icalcomponent_add_property(comp, uid);
+    }
+}
+
+/* The month of the cluster comp belongs in, as year * 100 + month, or -1
+   if comp has no time to place it by. This is a HACK */
+static int icaldirset_cluster_month(icalcomponent *comp)
+{
+    icalproperty *dt = 0;
+    icalcomponent *inner;
+    struct icaltimetype tm;
+
+    for (inner = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+         inner != 0; inner = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT)) {
+
+        dt = icalcomponent_get_first_property(inner, ICAL_DTSTAMP_PROPERTY);
+
+        if (dt != 0) {
+            break;
+        }
+    }
+
+    if (dt == 0) {
+        for (inner = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+             inner != 0; inner = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT)) {
+
+            dt = icalcomponent_get_first_property(inner, ICAL_DTSTART_PROPERTY);
+
+            if (dt != 0) {
+                break;
+            }
+        }
+    }
+
+    if (dt == 0) {
+        return -1;
+    }
+
+    tm = icalvalue_get_datetime(icalproperty_get_value(dt));
+
+    return tm.year * 100 + tm.month;
+}
+
+static icalerrorenum icaldirset_add_batch(icalset *set, icalcomponent **comps,
+                                         size_t num_comps, int append);
+
+/**
+  This assumes that the top level component is a VCALENDAR, and there
+   is an inner component of type VEVENT, VTODO or VJOURNAL. The inner
+  component must have a DSTAMP property
+*/
+
+icalerrorenum icaldirset_add_component(icalset *set, icalcomponent *comp)
+{
+    icalerror_check_arg_rz((set != 0), "set");
+    icalerror_check_arg_rz((comp != 0), "comp");
+
+    return icaldirset_add_batch(set, &comp, 1, 0);
+}
+
+struct icaldirset_batch_entry
+{
+    int month;
+    size_t index;
+};
+
+static int icaldirset_compare_batch_entries(const void *a, const void *b)
+{
+    const struct icaldirset_batch_entry *ea = (const struct icaldirset_batch_entry *)a;
+    const struct icaldirset_batch_entry *eb = (const struct icaldirset_batch_entry *)b;
+
+    if (ea->month != eb->month) {
+        return (ea->month < eb->month) ? -1 : 1;
+    }
+
+    return (ea->index < eb->index) ? -1 : (ea->index > eb->index);
+}
+
+/* Append comps, all of which belong in clustername, to its file
+   without loading it, and free them. This is only done for clusters
+   not in the cache, which would otherwise be read only to be written
+   again, and only for batches, as the caller of
+   icaldirset_add_component() may use the component after adding it */
+static icalerrorenum icaldirset_append_to_cluster(icaldirset *dset, const char *clustername,
+                                                  icalcomponent **comps,
+                                                  struct icaldirset_batch_entry *entries,
+                                                  size_t count)
+{
+    const char *name = clustername + strlen(dset->dir) + 1;
+    struct icaldirset_uid_cluster *cl = 0;
+    icalcomponent **batch;
+    struct stat before, after;
+    icalerrorenum error;
+    int existed;
+    size_t i;
+
+    if ((batch = (icalcomponent **)malloc(count * sizeof(*batch))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return ICAL_NEWFAILED_ERROR;
+    }
+
+    for (i = 0; i < count; i++) {
+        batch[i] = comps[entries[i].index];
+    }
+
+    existed = (stat(clustername, &before) == 0);
+
+    error = icalfileset_append_components(clustername, icalfileset_options_default.mode,
+                                          batch, count);
+    free(batch);
+
+    if (error != ICAL_NO_ERROR) {
+        return error;
+    }
+
+    /* The index stays current for the file if it was before */
+    if (dset->uid_index != 0 && stat(clustername, &after) == 0 &&
+        (cl = icaldirset_uid_cluster(dset->uid_index, name, 1)) != 0) {
+        if (!existed) {
+            icaldirset_uid_index_remove(dset->uid_index, 0, cl);
+        }
+
+        if (!existed || (cl->size == before.st_size && cl->mtime == before.st_mtime)) {
+            for (i = 0; i < count; i++) {
+                const char *uid = icaldirset_component_uid(comps[entries[i].index]);
+
+                if (uid != 0) {
+                    icaldirset_uid_index_add(dset->uid_index, uid, cl);
+                }
+            }
+            cl->mtime = after.st_mtime;
+            cl->size = after.st_size;
+            dset->uid_index->dirty = 1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        icalcomponent_free(comps[entries[i].index]);
+        comps[entries[i].index] = 0;
+    }
+
+    icaldirset_forget_cluster_range(dset, clustername);
+
+    return ICAL_NO_ERROR;
+}
+
+/* Add comps, all of which belong in clustername, to that cluster,
+   setting their entries to 0 */
+static icalerrorenum icaldirset_add_to_cluster(icaldirset *dset, const char *clustername,
+                                               icalcomponent **comps,
+                                               struct icaldirset_batch_entry *entries,
+                                               size_t count, int append)
+{
+    struct icaldirset_uid_cluster *cl = 0;
+    size_t i;
+
+    if (append && icaldirset_is_writable(dset) &&
+        icaldirset_cache_find(dset, clustername) == 0 &&
+        icaldirset_append_to_cluster(dset, clustername, comps, entries, count) == ICAL_NO_ERROR) {
+        return ICAL_NO_ERROR;
+    }
+
+    /* Load the cluster and insert the objects */
+    if (dset->cluster == 0 || strcmp(clustername, icalcluster_key(dset->cluster)) != 0) {
+        dset->cluster = icaldirset_load_cluster(dset, clustername);
+
+        if (dset->cluster == 0) {
+            return icalerrno;
+        }
+    }
+
+    if (dset->uid_index != 0) {
+        const char *name = icaldirset_cluster_name(dset, dset->cluster);
+
+        cl = name ? icaldirset_uid_cluster(dset->uid_index, name, 1) : 0;
+        dset->uid_index->dirty = 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        icalcomponent *comp = comps[entries[i].index];
+
+        (void)icalcluster_add_component(dset->cluster, comp);
+        comps[entries[i].index] = 0;
+
+        if (cl != 0) {
+            const char *uid = icaldirset_component_uid(comp);
+
+            if (uid != 0) {
+                icaldirset_uid_index_add(dset->uid_index, uid, cl);
+            }
+        }
+    }
+
+    icaldirset_forget_cluster_range(dset, clustername);
+    icaldirset_cache_count(dset, count);
+
+    /* icalcluster_mark(impl->cluster); */
+
+    return ICAL_NO_ERROR;
+}
+
+static icalerrorenum icaldirset_add_batch(icalset *set, icalcomponent **comps,
+                                         size_t num_comps, int append)
+{
+    char clustername[MAXPATHLEN] = { 0 };
+    char uidstring[MAXPATHLEN] = { 0 };
+    struct icaldirset_batch_entry *entries;
+    icalerrorenum error = ICAL_NO_ERROR;
+    icaldirset *dset;
+    size_t i, n, start;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((comps != 0 || num_comps == 0), "comps", ICAL_BADARG_ERROR);
+
+    dset = (icaldirset *) set;
+
+    entries = (struct icaldirset_batch_entry *)malloc((num_comps + 1) * sizeof(*entries));
+    if (entries == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return ICAL_NEWFAILED_ERROR;
+    }
+
+    /* Determine which cluster each object belongs in */
+    for (i = 0, n = 0; i < num_comps; i++) {
+        if (comps[i] == 0) {
+            error = (error != ICAL_NO_ERROR) ? error : ICAL_BADARG_ERROR;
+            continue;
+        }
+
+        icaldirset_add_uid(comps[i], uidstring, sizeof(uidstring));
+
+        if ((entries[n].month = icaldirset_cluster_month(comps[i])) < 0) {
+            icalerror_warn("The component does not have a DTSTAMP or DTSTART property, "
+                           "so it cannot be added to the store");
+            error = (error != ICAL_NO_ERROR) ? error : ICAL_BADARG_ERROR;
+            continue;
+        }
+        entries[n++].index = i;
+    }
+
+    /* Group them by cluster, keeping their order within each, so that
+       each cluster is loaded once */
+    qsort(entries, n, sizeof(*entries), icaldirset_compare_batch_entries);
+
+    /* The index must hold the UIDs on disk before the ones added here */
+    if (n > 0 && dset->uid_index == 0) {
+        (void)icaldirset_sync_uid_index(dset);
+    }
+
+    for (start = 0; start < n; start = i) {
+        icalerrorenum err;
+
+        for (i = start + 1; i < n && entries[i].month == entries[start].month; i++) ;
+
+        snprintf(clustername, MAXPATHLEN, "%s/%04d%02d", dset->dir,
+                 entries[start].month / 100, entries[start].month % 100);
+
+        err = icaldirset_add_to_cluster(dset, clustername, comps, entries + start, i - start,
+                                        append);
+        if (err != ICAL_NO_ERROR && error == ICAL_NO_ERROR) {
+            error = err;
+        }
+    }
+
+    free(entries);
+
+    if (error != ICAL_NO_ERROR) {
+        icalerror_set_errno(error);
+    }
+
+    return error;
+}
+
+icalerrorenum icaldirset_add_components(icalset *set, icalcomponent **comps, size_t num_comps)
+{
+    return icaldirset_add_batch(set, comps, num_comps, 1);
+}
+
+/**
+   Remove a component in the current cluster. HACK. This routine is a
+   "friend" of icalfileset, and breaks its encapsulation. It was
+   either do it this way, or add several layers of interfaces that had
+   no other use.
+ */
+
+icalerrorenum icaldirset_remove_component(icalset *set, icalcomponent *comp)
+{
+    icaldirset *dset;
+    icalcomponent *filecomp;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((comp != 0), "comp", ICAL_BADARG_ERROR);
+
+    dset = (icaldirset *) set;
+    icalerror_check_arg_re((dset->cluster != 0), "Cluster pointer", ICAL_USAGE_ERROR);
+
+    filecomp = icalcluster_get_component(dset->cluster);
+
+    if (icalcomponent_get_parent(comp) != filecomp) {
+        icalerror_warn("icaldirset_remove_component: component is not part of current cluster");
+        icalerror_set_errno(ICAL_USAGE_ERROR);
+        return ICAL_USAGE_ERROR;
+    }
+
+    (void)icalcluster_remove_component(dset->cluster, comp);
+    icaldirset_cache_count(dset, 0);
+
+    /* Drop the UID from the index unless another component has it */
+    if (dset->uid_index != 0) {
+        const char *uid = icaldirset_component_uid(comp);
+        const char *name = icaldirset_cluster_name(dset, dset->cluster);
+        struct icaldirset_uid_cluster *cl =
+            name ? icaldirset_uid_cluster(dset->uid_index, name, 0) : 0;
+
+        if (uid != 0 && cl != 0) {
+            icalcompiter i;
+            icalcomponent *c;
+
+            for (i = icalcomponent_begin_component(filecomp, ICAL_ANY_COMPONENT);
+                 (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+                const char *other = icaldirset_component_uid(c);
+
+                if (other != 0 && strcmp(other, uid) == 0) {
+                    break;
+                }
+            }
+
+            if (c == 0) {
+                icaldirset_uid_index_remove(dset->uid_index, uid, cl);
+            }
+        }
+        dset->uid_index->dirty = 1;
+    }
+
+    /* icalcluster_mark(impl->cluster); */
+
+    /* If the removal emptied the fileset, get the next fileset. A
+       parallel scan moves on by itself. */
+    if (dset->scan == 0 &&
+        icalcluster_count_components(dset->cluster, ICAL_ANY_COMPONENT) == 0) {
+        icalerrorenum error = icaldirset_next_cluster(dset);
+
+        if (dset->cluster != 0 && error == ICAL_NO_ERROR) {
+            (void)icalcluster_get_first_component(dset->cluster);
+        } else {
+            /* HACK. Not strictly correct for impl->cluster==0 */
+            return error;
+        }
+    } else {
+        /* Do nothing */
+    }
+
+    return ICAL_NO_ERROR;
+}
+
+int icaldirset_count_components(icalset *store, icalcomponent_kind kind)
+{
+    _unused(store);
+    _unused(kind);
+
+    /* NOT IMPLEMENTED */
+    assert(0);
+
+    return 0;
+}
+
+icalcomponent *icaldirset_fetch_match(icalset *set, icalcomponent *c)
+{
+    const char *uid;
+
+    icalerror_check_arg_rz((set != 0), "set");
+    icalerror_check_arg_rz((c != 0), "c");
+
+    if ((uid = icaldirset_component_uid(c)) == 0) {
+        return 0;
+    }
+
+    return icaldirset_fetch(set, icalcomponent_isa(icalcomponent_get_inner(c)), uid);
+}
+
+/* Find a component by its UID in the clusters the UID index lists it in,
+   making the cluster it is found in the current one */
+static icalcomponent *icaldirset_fetch_indexed(icaldirset *dset, const char *uid)
+{
+    struct icaldirset_uid_entry *e;
+
+    for (e = dset->uid_index->buckets[icaldirset_uid_hash(dset->uid_index, uid)];
+         e != 0; e = e->next) {
+        char path[MAXPATHLEN];
+        icalcomponent *c;
+
+        if (strcmp(e->uid, uid) != 0) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", dset->dir, e->cluster->name);
+
+        if ((dset->cluster = icaldirset_load_cluster(dset, path)) == 0) {
+            continue;
+        }
+        icaldirset_note_cluster_range(dset);
+
+        for (c = icalcluster_get_first_component(dset->cluster); c != 0;
+             c = icalcluster_get_next_component(dset->cluster)) {
+            const char *other = icaldirset_component_uid(c);
+
+            if (other != 0 && strcmp(other, uid) == 0) {
+                return c;
+            }
+        }
+    }
+
+    return 0;
+}
+
+icalcomponent *icaldirset_fetch(icalset *set, icalcomponent_kind kind, const char *uid)
+{
+    icaldirset *dset;
+    icalgauge *gauge;
+    icalgauge *old_gauge;
+    icalcomponent *c;
+    char sql[256];
+
+    _unused(kind);
+
+    icalerror_check_arg_rz((set != 0), "set");
+    icalerror_check_arg_rz((uid != 0), "uid");
+
+    dset = (icaldirset *) set;
+
+    if (icaldirset_sync_uid_index(dset)) {
+        return icaldirset_fetch_indexed(dset, uid);
+    }
+
+    /* Without an index every cluster is searched */
+
+    snprintf(sql, 256, "SELECT * FROM VEVENT WHERE UID = \"%s\"", uid);
+
+    gauge = icalgauge_new_from_sql(sql, 0);
+    old_gauge = dset->gauge;
+    dset->gauge = gauge;
+
+    c = icaldirset_get_first_component(set);
+
+    dset->gauge = old_gauge;
+
+    if (gauge) {
+        icalgauge_free(gauge);
+    }
+
+    return c;
+}
+
+int icaldirset_has_uid(icalset *set, const char *uid)
+{
+    icaldirset *dset;
+    icalcomponent *c;
+
+    icalerror_check_arg_rz((set != 0), "set");
+    icalerror_check_arg_rz((uid != 0), "uid");
+
+    dset = (icaldirset *) set;
+
+    /* The index is kept up to date with the clusters, so it is enough */
+    if (icaldirset_sync_uid_index(dset)) {
+        struct icaldirset_uid_entry *e;
+
+        for (e = dset->uid_index->buckets[icaldirset_uid_hash(dset->uid_index, uid)];
+             e != 0; e = e->next) {
+            if (strcmp(e->uid, uid) == 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    c = icaldirset_fetch(set, 0, uid);
+
+    return c != 0;
+}
+
+icalerrorenum icaldirset_select(icalset *set, icalgauge *gauge)
+{
+    icaldirset *dset;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((gauge != 0), "gauge", ICAL_BADARG_ERROR);
+
+    dset = (icaldirset *) set;
+
+    /* A scan in progress goes by the gauge it began with */
+    icaldirset_scan_stop(dset);
+    dset->gauge = gauge;
+
+    return ICAL_NO_ERROR;
+}
+
+icalerrorenum icaldirset_modify(icalset *set, icalcomponent *old, icalcomponent *new)
+{
+    _unused(set);
+    _unused(old);
+    _unused(new);
+
+    /* NOT IMPLEMENTED */
+    assert(0);
+    return ICAL_NO_ERROR;
+}
+
+icalerrorenum icaldirset_set_time_index(icalset *set, int enable)
+{
+    icaldirset *dset;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    dset = (icaldirset *) set;
+
+    dset->time_index = enable ? 1 : 0;
+
+    if (!enable) {
+        struct icaldirset_cluster_range *r;
+
+        while ((r = (struct icaldirset_cluster_range *)pvl_pop(dset->cluster_ranges)) != 0) {
+            free(r->path);
+            free(r);
+        }
+    } else if (dset->cluster != 0) {
+        icaldirset_note_cluster_range(dset);
+    }
+
+    return ICAL_NO_ERROR;
+}
+
+icalerrorenum icaldirset_set_cache_size(icalset *set, size_t max_clusters,
+                                        size_t max_components)
+{
+    icaldirset *dset;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((max_clusters > 0), "max_clusters", ICAL_BADARG_ERROR);
+    dset = (icaldirset *) set;
+
+    dset->cache_max_clusters = max_clusters;
+    dset->cache_max_components = max_components;
+    icaldirset_cache_trim(dset);
+
+    return ICAL_NO_ERROR;
+}
+
+void icaldirset_clear(icalset *set)
+{
+    _unused(set);
+
+    /* NOT IMPLEMENTED */
+    assert(0);
+    return;
+}
+
+/***** Parallel scans *****/
+
+/** Upper bound on the number of threads a scan runs on */
+#define ICALDIRSET_MAX_SCAN_THREADS 64
+
+/** One cluster of a parallel scan */
+struct icaldirset_scan_slot
+{
+    char *path;
+    int cached;                 /**< 1 if it was cached when the scan began, so
+                                     it is not parsed by a worker */
+    int ready;                  /**< 1 once a worker is done with it */
+    icalcluster *cluster;       /**< as parsed by a worker */
+    time_t mtime;               /**< of the file parsed... */
+    off_t size;                 /**< ...or -1 if there was no file */
+    icalcomponent **matches;    /**< components of the cluster that pass the gauge */
+    size_t num_matches;
+};
+
+/** A scan of the clusters in which workers parse the clusters and test
+    their components against the gauge ahead of the caller. The
+    workers only ever touch the slots they claim; the cache and the rest
+    of the set are left to the caller's thread. */
+struct icaldirset_scan
+{
+    icalgauge *gauge;
+    struct icaldirset_scan_slot *slots;
+    size_t num_slots;
+    size_t next_claim;          /**< first slot not yet claimed by a worker */
+    size_t num_taken;           /**< slots taken by the caller */
+    size_t *ready_order;        /**< slots in the order they became ready */
+    size_t num_ready;
+    size_t window;              /**< slots claimed but not yet taken, at most */
+    int ordered;                /**< 1 to take the slots in cluster order */
+    int stop;
+    icalcluster *cluster;       /**< cluster of the slot being returned, or 0 */
+    struct icaldirset_scan_slot *slot;
+    size_t match;               /**< next match of the slot to return */
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t threads[ICALDIRSET_MAX_SCAN_THREADS];
+    int num_threads;            /**< workers still to be joined */
+#endif
+};
+
+static int icaldirset_scan_holds(icaldirset *dset, icalcluster *cluster)
+{
+    return dset->scan != 0 && dset->scan->cluster == cluster;
+}
+
+/* The cluster being scanned is gone, so skip the rest of its matches */
+static void icaldirset_scan_forget(icaldirset *dset, icalcluster *cluster)
+{
+    if (icaldirset_scan_holds(dset, cluster)) {
+        dset->scan->cluster = 0;
+    }
+}
+
+#if defined(HAVE_PTHREAD)
+
+/* Record the components of cluster that pass the gauge in slot */
+static void icaldirset_scan_match(struct icaldirset_scan_slot *slot, icalcluster *cluster,
+                                  icalgauge *gauge)
+{
+    icalcomponent *root = icalcluster_get_component(cluster);
+    icalcompiter i;
+    icalcomponent *c;
+    int n = icalcomponent_count_components(root, ICAL_ANY_COMPONENT);
+
+    free(slot->matches);
+    slot->num_matches = 0;
+
+    if ((slot->matches = (icalcomponent **)malloc(((size_t)n + 1) * sizeof(icalcomponent *))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return;
+    }
+
+    for (i = icalcomponent_begin_component(root, ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+        if (gauge == 0 || icalgauge_compare(gauge, c) != 0) {
+            slot->matches[slot->num_matches++] = c;
+        }
+    }
+}
+
+static char *icaldirset_read_stream(char *s, size_t size, void *d)
+{
+    return fgets(s, (int)size, (FILE *)d);
+}
 
-    if (dset->directory_iterator == 0) {
-        icalerror_set_errno(ICAL_INTERNAL_ERROR);
-        return ICAL_INTERNAL_ERROR;
+/* Parse the cluster at path as icalfileset_produce_icalcluster() does,
+   but without copying what was parsed. icalparser_parse() is not used
+   since it changes the error state, which all threads share; malformed
+   data is made nonfatal for each worker thread alone instead. */
+static icalcluster *icaldirset_parse_cluster(const char *path, time_t *mtime, off_t *size)
+{
+    icalcluster *cluster;
+    icalcomponent *c;
+    icalparser *parser;
+    struct stat sbuf;
+    char jpath[MAXPATHLEN];
+    char *line;
+    FILE *f;
+
+    if (stat(path, &sbuf) != 0) {
+        *mtime = 0;
+        *size = -1;
+        return icalcluster_new(path, 0);
     }
-    dset->directory_iterator = pvl_next(dset->directory_iterator);
 
-    if (dset->directory_iterator == 0) {
-        /* There are no more clusters */
-        if (dset->cluster != 0) {
-            icalcluster_free(dset->cluster);
-            dset->cluster = 0;
-        }
-        return ICAL_NO_ERROR;
+    /* A cluster with a journal is left to icalfileset to load */
+    snprintf(jpath, sizeof(jpath), "%s%s", path, ICALFILESET_JOURNAL_SUFFIX);
+    if (access(jpath, F_OK) == 0) {
+        return 0;
     }
 
-    snprintf(path, sizeof(path), "%s/%s", dset->dir, (char *)pvl_data(dset->directory_iterator));
+    if ((f = fopen(path, "r")) == 0) {
+        return 0;
+    }
 
-    icalcluster_free(dset->cluster);
-    dset->cluster = icalfileset_produce_icalcluster(path);
+    if ((cluster = icalcluster_new(path, 0)) == 0 || (parser = icalparser_new()) == 0) {
+        if (cluster != 0) {
+            icalcluster_free(cluster);
+        }
+        fclose(f);
+        return 0;
+    }
 
-    return icalerrno;
-}
+    icalparser_set_gen_data(parser, f);
 
-static void icaldirset_add_uid(icalcomponent *comp)
-{
-    char uidstring[MAXPATHLEN] = { 0 };
-    icalproperty *uid;
+    do {
+        line = icalparser_get_line(parser, icaldirset_read_stream);
 
-#if defined(HAVE_SYS_UTSNAME_H)
-    struct utsname unamebuf;
-#endif
+        if ((c = icalparser_add_line(parser, line)) != 0) {
+            if (icalcomponent_isa(c) == ICAL_XROOT_COMPONENT &&
+                icalcomponent_count_components(cluster->data, ICAL_ANY_COMPONENT) == 0) {
+                icalcomponent_free(cluster->data);
+                cluster->data = c;
+            } else {
+                icalcomponent_add_component(cluster->data, c);
+            }
+        }
 
-    icalerror_check_arg_rv((comp != 0), "comp");
+        if (line != 0) {
+            icalmemory_free_buffer(line);
+        }
+    } while (line != 0);
 
-    uid = icalcomponent_get_first_property(comp, ICAL_UID_PROPERTY);
+    icalparser_free(parser);
+    fclose(f);
 
-    if (uid == 0) {
+    *mtime = sbuf.st_mtime;
+    *size = sbuf.st_size;
 
-#if defined(HAVE_SYS_UTSNAME_H)
-        uname(&unamebuf);
-        snprintf(uidstring, sizeof(uidstring), "%d-%s", (int)getpid(), unamebuf.nodename);
-#else
-        /* FIXME: There must be an easy get the system name */
-        snprintf(uidstring, sizeof(uidstring), "%d-%s", (int)getpid(), "WINDOWS");
-#endif
-        uid = icalproperty_new_uid(uidstring);
-        icalcomponent_add_property(comp, uid);
-    } else {
-        strncpy(uidstring, icalproperty_get_uid(uid), MAXPATHLEN - 1);
-        uidstring[MAXPATHLEN - 1] = '\0';
-    }
+    return cluster;
 }
 
-/**
-  This assumes that the top level component is a VCALENDAR, and there
-   is an inner component of type VEVENT, VTODO or VJOURNAL. The inner
-  component must have a DSTAMP property
-*/
-
-icalerrorenum icaldirset_add_component(icalset *set, icalcomponent *comp)
+static void *icaldirset_scan_worker(void *data)
 {
-    char clustername[MAXPATHLEN] = { 0 };
-    icalproperty *dt = 0;
-    icalvalue *v;
-    struct icaltimetype tm;
-    icalerrorenum error = ICAL_NO_ERROR;
-    icalcomponent *inner;
-    icaldirset *dset;
-
-    icalerror_check_arg_rz((set != 0), "set");
-    icalerror_check_arg_rz((comp != 0), "comp");
+    struct icaldirset_scan *scan = (struct icaldirset_scan *)data;
 
-    dset = (icaldirset *) set;
-
-    icaldirset_add_uid(comp);
+    /* As icalparser_parse() does, but for this thread alone */
+    (void)icalerror_set_thread_error_state(ICAL_MALFORMEDDATA_ERROR, ICAL_ERROR_NONFATAL);
 
-    /* Determine which cluster this object belongs in. This is a HACK */
+    pthread_mutex_lock(&scan->mutex);
 
-    for (inner = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
-         inner != 0; inner = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT)) {
+    for (;;) {
+        struct icaldirset_scan_slot *slot;
 
-        dt = icalcomponent_get_first_property(inner, ICAL_DTSTAMP_PROPERTY);
+        /* Stay at most a window of slots ahead of the caller */
+        while (!scan->stop && scan->next_claim < scan->num_slots &&
+               scan->next_claim - scan->num_taken >= scan->window) {
+            pthread_cond_wait(&scan->cond, &scan->mutex);
+        }
 
-        if (dt != 0) {
+        if (scan->stop || scan->next_claim >= scan->num_slots) {
             break;
         }
-    }
 
-    if (dt == 0) {
-        for (inner = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
-             inner != 0; inner = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT)) {
+        slot = &scan->slots[scan->next_claim++];
 
-            dt = icalcomponent_get_first_property(inner, ICAL_DTSTART_PROPERTY);
+        if (!slot->cached) {
+            pthread_mutex_unlock(&scan->mutex);
 
-            if (dt != 0) {
-                break;
+            slot->cluster = icaldirset_parse_cluster(slot->path, &slot->mtime, &slot->size);
+            if (slot->cluster != 0) {
+                icaldirset_scan_match(slot, slot->cluster, scan->gauge);
             }
+
+            pthread_mutex_lock(&scan->mutex);
         }
-    }
 
-    if (dt == 0) {
-        icalerror_warn("The component does not have a DTSTAMP or DTSTART property, "
-                       "so it cannot be added to the store");
-        icalerror_set_errno(ICAL_BADARG_ERROR);
-        return ICAL_BADARG_ERROR;
+        slot->ready = 1;
+        scan->ready_order[scan->num_ready++] = (size_t)(slot - scan->slots);
+        pthread_cond_broadcast(&scan->cond);
     }
 
-    v = icalproperty_get_value(dt);
-    tm = icalvalue_get_datetime(v);
-
-    snprintf(clustername, MAXPATHLEN, "%s/%04d%02d", dset->dir, tm.year, tm.month);
+    pthread_mutex_unlock(&scan->mutex);
 
-    /* Load the cluster and insert the object */
-    if (dset->cluster != 0 && strcmp(clustername, icalcluster_key(dset->cluster)) != 0) {
-        icalcluster_free(dset->cluster);
-        dset->cluster = 0;
-    }
+    return 0;
+}
 
-    if (dset->cluster == 0) {
-        dset->cluster = icalfileset_produce_icalcluster(clustername);
+/* Wait for the workers to finish */
+static void icaldirset_scan_join(struct icaldirset_scan *scan)
+{
+    int t;
 
-        if (dset->cluster == 0) {
-            error = icalerrno;
-        }
+    if (scan->num_threads == 0) {
+        return;
     }
 
-    if (error != ICAL_NO_ERROR) {
-        icalerror_set_errno(error);
-        return error;
+    for (t = 0; t < scan->num_threads; t++) {
+        pthread_join(scan->threads[t], NULL);
     }
+    scan->num_threads = 0;
+}
 
-    /* Add the component to the cluster */
-    (void)icalcluster_add_component(dset->cluster, comp);
+static void icaldirset_scan_stop(icaldirset *dset)
+{
+    struct icaldirset_scan *scan = dset->scan;
+    size_t i;
 
-    /* icalcluster_mark(impl->cluster); */
+    if (scan == 0) {
+        return;
+    }
 
-    return ICAL_NO_ERROR;
-}
+    pthread_mutex_lock(&scan->mutex);
+    scan->stop = 1;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->mutex);
 
-/**
-   Remove a component in the current cluster. HACK. This routine is a
-   "friend" of icalfileset, and breaks its encapsulation. It was
-   either do it this way, or add several layers of interfaces that had
-   no other use.
- */
+    icaldirset_scan_join(scan);
 
-icalerrorenum icaldirset_remove_component(icalset *set, icalcomponent *comp)
-{
-    icaldirset *dset;
-    icalcomponent *filecomp;
-    icalcompiter i;
-    int found = 0;
+    for (i = 0; i < scan->num_slots; i++) {
+        free(scan->slots[i].path);
+        free(scan->slots[i].matches);
+        if (scan->slots[i].cluster != 0) {
+            icalcluster_free(scan->slots[i].cluster);
+        }
+    }
 
-    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
-    icalerror_check_arg_re((comp != 0), "comp", ICAL_BADARG_ERROR);
+    if (scan->gauge != 0) {
+        icalgauge_free(scan->gauge);
+    }
+    pthread_cond_destroy(&scan->cond);
+    pthread_mutex_destroy(&scan->mutex);
+    free(scan->slots);
+    free(scan->ready_order);
+    free(scan);
+    dset->scan = 0;
+}
 
-    dset = (icaldirset *) set;
-    icalerror_check_arg_re((dset->cluster != 0), "Cluster pointer", ICAL_USAGE_ERROR);
+/* Make the next cluster of the scan the current one. Return 0 once
+   there are no more. */
+static int icaldirset_scan_next_cluster(icaldirset *dset)
+{
+    struct icaldirset_scan *scan = dset->scan;
 
-    filecomp = icalcluster_get_component(dset->cluster);
+    for (;;) {
+        struct icaldirset_scan_slot *slot;
+        int done;
 
-    for (i = icalcomponent_begin_component(filecomp, ICAL_ANY_COMPONENT);
-         icalcompiter_deref(&i) != 0; icalcompiter_next(&i)) {
+        if (scan->slot != 0) {
+            free(scan->slot->matches);
+            scan->slot->matches = 0;
+            scan->slot->num_matches = 0;
+            scan->slot = 0;
+        }
+        scan->cluster = 0;
 
-        icalcomponent *this = icalcompiter_deref(&i);
+        if (scan->num_taken == scan->num_slots) {
+            return 0;
+        }
 
-        if (this == comp) {
-            found = 1;
-            break;
+        pthread_mutex_lock(&scan->mutex);
+        if (scan->ordered) {
+            while (!scan->slots[scan->num_taken].ready) {
+                pthread_cond_wait(&scan->cond, &scan->mutex);
+            }
+            slot = &scan->slots[scan->num_taken];
+        } else {
+            while (scan->num_ready == scan->num_taken) {
+                pthread_cond_wait(&scan->cond, &scan->mutex);
+            }
+            slot = &scan->slots[scan->ready_order[scan->num_taken]];
+        }
+        scan->num_taken++;
+        done = (scan->num_ready == scan->num_slots);
+        pthread_cond_broadcast(&scan->cond);
+        pthread_mutex_unlock(&scan->mutex);
+
+        /* The workers are done once every slot is ready */
+        if (done) {
+            icaldirset_scan_join(scan);
         }
-    }
 
-    if (found != 1) {
-        icalerror_warn("icaldirset_remove_component: component is not part of current cluster");
-        icalerror_set_errno(ICAL_USAGE_ERROR);
-        return ICAL_USAGE_ERROR;
-    }
+        scan->slot = slot;
 
-    (void)icalcluster_remove_component(dset->cluster, comp);
+        /* A worker's copy is only good if the cluster did not get into
+           the cache, and maybe changed there, in the meantime */
+        if (slot->cluster != 0 && slot->matches != 0 &&
+            icaldirset_cache_find(dset, slot->path) == 0) {
+            icalcluster *cluster = slot->cluster;
 
-    /* icalcluster_mark(impl->cluster); */
+            slot->cluster = 0;
+            icaldirset_cache_insert(dset, cluster, slot->mtime, slot->size);
+            dset->cluster = (icaldirset_cache_find(dset, slot->path) != 0) ? cluster : 0;
+        } else {
+            if (slot->cluster != 0) {
+                icalcluster_free(slot->cluster);
+                slot->cluster = 0;
+            }
 
-    /* If the removal emptied the fileset, get the next fileset */
-    if (icalcluster_count_components(dset->cluster, ICAL_ANY_COMPONENT) == 0) {
-        icalerrorenum error = icaldirset_next_cluster(dset);
+            dset->cluster = icaldirset_load_cluster(dset, slot->path);
+            if (dset->cluster != 0) {
+                icaldirset_scan_match(slot, dset->cluster, scan->gauge);
+            }
+        }
 
-        if (dset->cluster != 0 && error == ICAL_NO_ERROR) {
-            (void)icalcluster_get_first_component(dset->cluster);
-        } else {
-            /* HACK. Not strictly correct for impl->cluster==0 */
-            return error;
+        if (dset->cluster != 0) {
+            icaldirset_note_cluster_range(dset);
+            scan->cluster = dset->cluster;
+            scan->match = 0;
+            return 1;
         }
-    } else {
-        /* Do nothing */
     }
-
-    return ICAL_NO_ERROR;
 }
 
-int icaldirset_count_components(icalset *store, icalcomponent_kind kind)
+static icalcomponent *icaldirset_scan_next_component(icaldirset *dset)
 {
-    _unused(store);
-    _unused(kind);
+    struct icaldirset_scan *scan = dset->scan;
 
-    /* NOT IMPLEMENTED */
-    assert(0);
+    while (scan->cluster == 0 || scan->match >= scan->slot->num_matches) {
+        if (!icaldirset_scan_next_cluster(dset)) {
+            /* No more clusters */
+            icaldirset_scan_stop(dset);
+            dset->cluster = 0;
+            return 0;
+        }
+    }
 
-    return 0;
+    return scan->slot->matches[scan->match++];
 }
 
-icalcomponent *icaldirset_fetch_match(icalset *set, icalcomponent *c)
+/* Start a scan of the clusters of the directory that may hold
+   components passing the gauge */
+static icalerrorenum icaldirset_scan_start(icaldirset *dset)
 {
-    _unused(set);
-    _unused(c);
+    struct icaldirset_scan *scan;
+    char path[MAXPATHLEN];
+    size_t num_slots = 0, num_parsed = 0, i;
+    pvl_elem e;
+    int num_threads;
 
-    fprintf(stderr, " icaldirset_fetch_match is not implemented\n");
-    assert(0);
-    return 0;
-}
+    if ((scan = (struct icaldirset_scan *)calloc(1, sizeof(*scan))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return ICAL_NEWFAILED_ERROR;
+    }
 
-icalcomponent *icaldirset_fetch(icalset *set, icalcomponent_kind kind, const char *uid)
-{
-    icaldirset *dset;
-    icalgauge *gauge;
-    icalgauge *old_gauge;
-    icalcomponent *c;
-    char sql[256];
+    scan->slots = (struct icaldirset_scan_slot *)
+        calloc((size_t)pvl_count(dset->directory) + 1, sizeof(struct icaldirset_scan_slot));
+    scan->ready_order = (size_t *)calloc((size_t)pvl_count(dset->directory) + 1, sizeof(size_t));
 
-    _unused(kind);
+    if (scan->slots == 0 || scan->ready_order == 0) {
+        free(scan->slots);
+        free(scan->ready_order);
+        free(scan);
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return ICAL_NEWFAILED_ERROR;
+    }
 
-    icalerror_check_arg_rz((set != 0), "set");
-    icalerror_check_arg_rz((uid != 0), "uid");
+    for (e = pvl_head(dset->directory); e != 0; e = pvl_next(e)) {
+        snprintf(path, sizeof(path), "%s/%s", dset->dir, (char *)pvl_data(e));
 
-    snprintf(sql, 256, "SELECT * FROM VEVENT WHERE UID = \"%s\"", uid);
+        if (icaldirset_skip_cluster(dset, path) ||
+            (scan->slots[num_slots].path = strdup(path)) == 0) {
+            continue;
+        }
 
-    gauge = icalgauge_new_from_sql(sql, 0);
-    dset = (icaldirset *) set;
-    old_gauge = dset->gauge;
-    dset->gauge = gauge;
+        scan->slots[num_slots].cached = (icaldirset_cache_find(dset, path) != 0);
+        if (!scan->slots[num_slots].cached) {
+            num_parsed++;
+        }
+        num_slots++;
+    }
 
-    c = icaldirset_get_first_component(set);
+    /* Held while the workers may still test components against it */
+    scan->gauge = dset->gauge != 0 ? icalgauge_ref(dset->gauge) : 0;
+    scan->num_slots = num_slots;
+    scan->ordered = dset->scan_ordered;
+    scan->window = 2 * (size_t)dset->scan_threads;
 
-    dset->gauge = old_gauge;
+    pthread_mutex_init(&scan->mutex, NULL);
+    pthread_cond_init(&scan->cond, NULL);
+    dset->scan = scan;
 
-    if (gauge) {
-        icalgauge_free(gauge);
+    num_threads = dset->scan_threads;
+    if ((size_t)num_threads > num_parsed) {
+        num_threads = (int)num_parsed;
     }
 
-    return c;
-}
+    if (num_threads > 0) {
+        /* Loads the builtin timezones, which the gauge may need */
+        (void)icaltimezone_get_utc_timezone();
 
-int icaldirset_has_uid(icalset *set, const char *uid)
-{
-    icalcomponent *c;
 
-    icalerror_check_arg_rz((set != 0), "set");
-    icalerror_check_arg_rz((uid != 0), "uid");
+        for (; scan->num_threads < num_threads; scan->num_threads++) {
+            if (pthread_create(&scan->threads[scan->num_threads], NULL,
+                               icaldirset_scan_worker, scan) != 0) {
+                break;
+            }
+        }
+    }
 
-    /* HACK. This is a temporary implementation. _has_uid should use a
-       database, and _fetch should use _has_uid, not the other way
-       around */
-    c = icaldirset_fetch(set, 0, uid);
+    if (scan->num_threads == 0) {
+        /* Everything is loaded on the caller's thread */
+        for (i = 0; i < num_slots; i++) {
+            scan->slots[i].cached = 1;
+            scan->slots[i].ready = 1;
+            scan->ready_order[i] = i;
+        }
+        scan->next_claim = scan->num_ready = num_slots;
+    }
 
-    return c != 0;
+    return ICAL_NO_ERROR;
 }
 
-icalerrorenum icaldirset_select(icalset *set, icalgauge *gauge)
+#else
+
+static void icaldirset_scan_stop(icaldirset *dset)
+{
+    _unused(dset);
+}
+
+#endif /* HAVE_PTHREAD */
+
+icalerrorenum icaldirset_set_scan_threads(icalset *set, int num_threads, int ordered)
 {
     icaldirset *dset;
 
     icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
-    icalerror_check_arg_re((gauge != 0), "gauge", ICAL_BADARG_ERROR);
-
     dset = (icaldirset *) set;
-    dset->gauge = gauge;
 
-    return ICAL_NO_ERROR;
-}
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > ICALDIRSET_MAX_SCAN_THREADS) {
+        num_threads = ICALDIRSET_MAX_SCAN_THREADS;
+    }
 
-icalerrorenum icaldirset_modify(icalset *set, icalcomponent *old, icalcomponent *new)
-{
-    _unused(set);
-    _unused(old);
-    _unused(new);
+    icaldirset_scan_stop(dset);
+    dset->scan_threads = num_threads;
+    dset->scan_ordered = ordered ? 1 : 0;
 
-    /* NOT IMPLEMENTED */
-    assert(0);
     return ICAL_NO_ERROR;
 }
 
-void icaldirset_clear(icalset *set)
-{
-    _unused(set);
-
-    /* NOT IMPLEMENTED */
-    assert(0);
-    return;
-}
-
 icalcomponent *icaldirset_get_current_component(icalset *set)
 {
     icaldirset *dset = (icaldirset *) set;
 
+    if (dset->scan != 0 && dset->scan->cluster != 0 && dset->scan->match > 0) {
+        return dset->scan->slot->matches[dset->scan->match - 1];
+    }
+
     if (dset->cluster == 0) {
         (void)icaldirset_get_first_component(set);
     }
@@ -588,6 +2346,8 @@ icalcomponent *icaldirset_get_first_component(icalset *set)
     icalerrorenum error;
     char path[MAXPATHLEN];
 
+    icaldirset_scan_stop(dset);
+
     error = icaldirset_read_directory(dset);
 
     if (error != ICAL_NO_ERROR) {
@@ -595,30 +2355,39 @@ icalcomponent *icaldirset_get_first_component(icalset *set)
         return 0;
     }
 
-    dset->directory_iterator = pvl_head(dset->directory);
+#if defined(HAVE_PTHREAD)
+    if (dset->scan_threads > 1) {
+        if ((error = icaldirset_scan_start(dset)) != ICAL_NO_ERROR) {
+            return 0;
+        }
+        return icaldirset_scan_next_component(dset);
+    }
+#endif
+
+    for (dset->directory_iterator = pvl_head(dset->directory);
+         dset->directory_iterator != 0;
+         dset->directory_iterator = pvl_next(dset->directory_iterator)) {
+        snprintf(path, MAXPATHLEN, "%s/%s",
+                 dset->dir, (char *)pvl_data(dset->directory_iterator));
+
+        if (!icaldirset_skip_cluster(dset, path)) {
+            break;
+        }
+    }
 
     if (dset->directory_iterator == 0) {
         icalerror_set_errno(error);
         return 0;
     }
 
-    snprintf(path, MAXPATHLEN, "%s/%s", dset->dir, (char *)pvl_data(dset->directory_iterator));
+    /* Get the cluster, from the cache if it is unchanged */
 
-    /* If the next cluster we need is different than the current cluster,
-       delete the current one and get a new one */
-
-    if (dset->cluster != 0 && strcmp(path, icalcluster_key(dset->cluster)) != 0) {
-        icalcluster_free(dset->cluster);
-        dset->cluster = 0;
-    }
+    dset->cluster = icaldirset_load_cluster(dset, path);
 
     if (dset->cluster == 0) {
-        dset->cluster = icalfileset_produce_icalcluster(path);
-
-        if (dset->cluster == 0) {
-            error = icalerrno;
-        }
+        error = icalerrno;
     }
+    icaldirset_note_cluster_range(dset);
 
     if (error != ICAL_NO_ERROR) {
         icalerror_set_errno(error);
@@ -639,6 +2408,12 @@ icalcomponent *icaldirset_get_next_component(icalset *set)
     icalerror_check_arg_rz((set != 0), "set");
     dset = (icaldirset *) set;
 
+#if defined(HAVE_PTHREAD)
+    if (dset->scan != 0) {
+        return icaldirset_scan_next_component(dset);
+    }
+#endif
+
     if (dset->cluster == 0) {
         icalerror_warn("icaldirset_get_next_component called with a NULL cluster "
                        "(Caller must call icaldirset_get_first_component first)");
@@ -680,11 +2455,10 @@ icalcomponent *icaldirset_get_next_component(icalset *set)
         if (dset->cluster == 0 || error != ICAL_NO_ERROR) {
             /* No more clusters */
             return 0;
-        } else {
-            c = icalcluster_get_first_component(dset->cluster);
-
-            return c;
         }
+
+        /* The first component of the new cluster must pass the gauge too */
+        (void)icalcluster_get_first_component(dset->cluster);
     }
 
     return 0;   /* Should never get here */
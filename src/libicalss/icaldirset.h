@@ -44,12 +44,25 @@ LIBICAL_ICALSS_EXPORT void icaldirset_free(icalset *set);
 LIBICAL_ICALSS_EXPORT const char *icaldirset_path(icalset *set);
 
 /* Mark the cluster as changed, so it will be written to disk when it
-   is freed. Commit writes to disk immediately*/
+   is freed. Commit writes all changed clusters to disk immediately*/
 LIBICAL_ICALSS_EXPORT void icaldirset_mark(icalset *set);
 
 LIBICAL_ICALSS_EXPORT icalerrorenum icaldirset_commit(icalset *set);
 
 LIBICAL_ICALSS_EXPORT icalerrorenum icaldirset_add_component(icalset *store, icalcomponent *comp);
+
+/**
+ * Add num_comps components at once. They are grouped by the cluster they
+ * belong in, so that each cluster is loaded once, however the components
+ * are ordered, and those for a cluster that is not loaded are appended to
+ * its file without reading it. The entries of the components added are
+ * set to 0, and the components must not be used afterwards; those left
+ * could not be added. The first error is returned.
+ */
+LIBICAL_ICALSS_EXPORT icalerrorenum icaldirset_add_components(icalset *store,
+                                                              icalcomponent **comps,
+                                                              size_t num_comps);
+
 LIBICAL_ICALSS_EXPORT icalerrorenum icaldirset_remove_component(icalset *store,
                                                                 icalcomponent *comp);
 
@@ -61,7 +74,38 @@ LIBICAL_ICALSS_EXPORT icalerrorenum icaldirset_select(icalset *store, icalgauge
 
 LIBICAL_ICALSS_EXPORT void icaldirset_clear(icalset *store);
 
-/* Get a component by uid */
+/* Remember the time range of each cluster as it is loaded, and have
+   icaldirset_first, _next skip the clusters whose files are unchanged
+   since and whose ranges miss the times a gauge on DTSTART or DTEND
+   allows. */
+LIBICAL_ICALSS_EXPORT icalerrorenum icaldirset_set_time_index(icalset *store, int enable);
+
+/* Have icaldirset_get_first_component() and _next parse the clusters
+   and test them against the gauge on num_threads threads, ahead of the
+   caller. Components are returned cluster by cluster, in the order of
+   the clusters if ordered is 1, or as each cluster is ready if it is 0.
+   The gauge is the one selected when the scan began. While a scan is
+   in progress, only the current component may be removed. With 1
+   thread, the default, or without thread support, clusters are loaded
+   in turn. */
+LIBICAL_ICALSS_EXPORT icalerrorenum icaldirset_set_scan_threads(icalset *store,
+                                                                int num_threads, int ordered);
+
+/* Keep up to max_clusters of the clusters loaded, holding up to
+   max_components between them, so that going back to a cluster does not
+   read its file again. Changes are written to the cluster files when
+   they are committed or when the set is freed. A changed cluster stays
+   in the cache until then, beyond the limits if need be, so commit now
+   and then when changing many clusters. The default is 32 clusters and
+   100000 components. */
+LIBICAL_ICALSS_EXPORT icalerrorenum icaldirset_set_cache_size(icalset *store,
+                                                              size_t max_clusters,
+                                                              size_t max_components);
+
+/* Get a component by uid. The UIDs of each cluster are kept in an
+   index file in the directory, which is brought up to date with the
+   clusters changed since it was written, so only the cluster holding
+   the component is loaded. The cluster becomes the current one. */
 LIBICAL_ICALSS_EXPORT icalcomponent *icaldirset_fetch(icalset *store,
                                                       icalcomponent_kind kind, const char *uid);
 
@@ -33,11 +33,21 @@ struct icaldirset_impl
     icalset super;              /**< parent class */
     char *dir;                  /**< directory containing ics files  */
     icaldirset_options options; /**< copy of options passed to icalset_new() */
-    icalcluster *cluster;       /**< cluster containing data */
+    icalcluster *cluster;       /**< current cluster, one of those in the cache */
     icalgauge *gauge;           /**< gauge for filtering out data  */
     int first_component;        /**< ??? */
     pvl_list directory;         /**< ??? */
     pvl_elem directory_iterator;/**< ??? */
+    int time_index;             /**< boolean flag, 1 to skip clusters outside the gauge's times */
+    pvl_list cluster_ranges;    /**< struct icaldirset_cluster_range of the clusters seen */
+    struct icaldirset_uid_index *uid_index; /**< UIDs of each cluster, 0 until first used */
+    pvl_list cache;             /**< struct icaldirset_cached_cluster, most recently used first */
+    size_t cache_components;    /**< components in the cached clusters */
+    size_t cache_max_clusters;
+    size_t cache_max_components;
+    int scan_threads;           /**< threads to load clusters on, 1 to load them in turn */
+    int scan_ordered;           /**< boolean flag, 1 to return components in cluster order */
+    struct icaldirset_scan *scan; /**< parallel scan in progress, or 0 */
 };
 
 #endif
@@ -25,6 +25,7 @@
 
 #include "icalfileset.h"
 #include "icalfilesetimpl.h"
+#include "icalmemory.h"
 #include "icalparser.h"
 #include "icalvalue.h"
 
@@ -35,8 +36,13 @@
 #include <winbase.h>
 #endif
 
+/* Commits replace the file by renaming a new one over it */
+#if !defined(_WIN32) && defined(HAVE_FSYNC) && defined(HAVE_LINK)
+#define ICALFILESET_ATOMIC_COMMIT 1
+#endif
+
 /** Default options used when NULL is passed to icalset_new() **/
-icalfileset_options icalfileset_options_default = { O_RDWR | O_CREAT, 0644, 0, NULL };
+icalfileset_options icalfileset_options_default = { O_RDWR | O_CREAT, 0644, 0, NULL, 0 };
 
 static int _compare_ids(const char *compid, const char *matchid);
 
@@ -44,6 +50,10 @@ static int icalfileset_lock(icalfileset *set);
 static int icalfileset_unlock(icalfileset *set);
 static icalerrorenum icalfileset_read_file(icalfileset *set, int mode);
 static long icalfileset_filesize(icalfileset *set);
+static void icalfileset_replay_journal(icalfileset *fset, off_t from);
+static void icalfileset_note_base(icalfileset *fset, struct stat *sbuf);
+static void icalfileset_clear_records(icalfileset *fset);
+static void icalfileset_posmap_free(struct icalfileset_posmap *map);
 
 icalset *icalfileset_new(const char *path)
 {
@@ -63,11 +73,70 @@ icalset *icalfileset_new_writer(const char *path)
 {
     icalfileset_options writer_options = icalfileset_options_default;
 
-    writer_options.flags = O_RDONLY;
+    writer_options.flags = O_RDWR | O_CREAT;
 
     return icalset_new(ICAL_FILE_SET, path, &writer_options);
 }
 
+icalset *icalfileset_new_snapshot(const char *path)
+{
+    icalfileset_options snapshot_options = icalfileset_options_default;
+
+    snapshot_options.flags = O_RDONLY;
+    snapshot_options.snapshot = 1;
+
+    return icalset_new(ICAL_FILE_SET, path, &snapshot_options);
+}
+
+/* A snapshot reads whichever version of the file it opens without a
+   lock. That is only safe when commits replace the file by renaming a
+   new one over it, so the file never changes under the reader. */
+static int icalfileset_is_snapshot(icalfileset *fset)
+{
+#if defined(ICALFILESET_ATOMIC_COMMIT)
+    return fset->options.snapshot && (fset->options.flags & O_ACCMODE) == O_RDONLY;
+#else
+    _unused(fset);
+    return 0;
+#endif
+}
+
+/* Open the file and lock it, setting fset->fd */
+static int icalfileset_open_locked(icalfileset *fset, int flags, int mode)
+{
+#if defined(ICALFILESET_ATOMIC_COMMIT)
+    struct stat sbuf, pbuf;
+#endif
+
+    if ((fset->fd = open(fset->path, flags, mode)) < 0) {
+        return -1;
+    }
+
+    if (icalfileset_is_snapshot(fset)) {
+        return fset->fd;
+    }
+
+    (void)icalfileset_lock(fset);
+
+#if defined(ICALFILESET_ATOMIC_COMMIT)
+    /* While waiting for the lock, a commit may have renamed a new file
+       over the one opened, so open the file again until the lock is
+       held on the one the path names */
+    while (fstat(fset->fd, &sbuf) == 0 && stat(fset->path, &pbuf) == 0 &&
+           (sbuf.st_ino != pbuf.st_ino || sbuf.st_dev != pbuf.st_dev)) {
+        close(fset->fd);
+
+        if ((fset->fd = open(fset->path, flags, mode)) < 0) {
+            return -1;
+        }
+
+        (void)icalfileset_lock(fset);
+    }
+#endif
+
+    return fset->fd;
+}
+
 icalset *icalfileset_init(icalset *set, const char *path, void *options_in)
 {
     icalfileset_options *options = (options_in) ? options_in : &icalfileset_options_default;
@@ -75,6 +144,7 @@ icalset *icalfileset_init(icalset *set, const char *path, void *options_in)
     int flags;
     int mode;
     long cluster_file_size;
+    struct stat sbuf;
 
     icalerror_clear_errno();
     icalerror_check_arg_rz((path != 0), "path");
@@ -82,6 +152,8 @@ icalset *icalfileset_init(icalset *set, const char *path, void *options_in)
 
     fset->path = strdup(path);
     fset->options = *options;
+    fset->journal_fd = -1;
+    fset->journal_ratio = 1.0;
 
     flags = options->flags;
     mode = options->mode;
@@ -93,17 +165,23 @@ icalset *icalfileset_init(icalset *set, const char *path, void *options_in)
         return 0;
     }
 
-    fset->fd = open(fset->path, flags, mode);
-
-    if (fset->fd < 0) {
+    if (icalfileset_open_locked(fset, flags, mode) < 0) {
         icalerror_set_errno(ICAL_FILE_ERROR);
         icalfileset_free(set);
         return 0;
     }
 
-    (void)icalfileset_lock(fset);
+    if (fstat(fset->fd, &sbuf) == 0) {
+        icalfileset_note_base(fset, &sbuf);
+        cluster_file_size = (long)sbuf.st_size;
+    }
 
-    if (cluster_file_size > 0) {
+    if (options->cluster) {
+        /* The given cluster replaces the file, so the file is not read */
+        fset->cluster = icalcomponent_new_clone(icalcluster_get_component(options->cluster));
+        fset->changed = 1;
+        fset->rewrite = 1;
+    } else if (cluster_file_size > 0) {
         icalerrorenum error;
 
         if ((error = icalfileset_read_file(fset, mode)) != ICAL_NO_ERROR) {
@@ -112,15 +190,14 @@ icalset *icalfileset_init(icalset *set, const char *path, void *options_in)
         }
     }
 
-    if (options->cluster) {
-        fset->cluster = icalcomponent_new_clone(icalcluster_get_component(options->cluster));
-        fset->changed = 1;
-    }
-
     if (fset->cluster == 0) {
         fset->cluster = icalcomponent_new(ICAL_XROOT_COMPONENT);
     }
 
+    if (!options->cluster) {
+        icalfileset_replay_journal(fset, 0);
+    }
+
     return set;
 }
 
@@ -138,9 +215,12 @@ icalcluster *icalfileset_produce_icalcluster(const char *path)
     if (fileset == 0 || icalerrno == ICAL_FILE_ERROR) {
         /* file does not exist */
         ret = icalcluster_new(path, NULL);
+        if (fileset != 0) {
+            icalset_free(fileset);
+        }
     } else {
         ret = icalcluster_new(path, ((icalfileset *) fileset)->cluster);
-        icalfileset_free(fileset);
+        icalset_free(fileset);
     }
 
     icalerror_set_errors_are_fatal(errstate);
@@ -194,124 +274,1417 @@ icalerrorenum icalfileset_read_file(icalfileset *set, int mode)
            an XROOT. */
         icalcomponent *cl = set->cluster;
 
-        set->cluster = icalcomponent_new(ICAL_XROOT_COMPONENT);
-        icalcomponent_add_component(set->cluster, cl);
+        set->cluster = icalcomponent_new(ICAL_XROOT_COMPONENT);
+        icalcomponent_add_component(set->cluster, cl);
+    }
+
+    return ICAL_NO_ERROR;
+}
+
+long icalfileset_filesize(icalfileset *fset)
+{
+    struct stat sbuf;
+
+    if (stat(fset->path, &sbuf) != 0) {
+
+        /* A file by the given name does not exist, or there was
+           another error */
+        if (errno == ENOENT) {
+            /* It was because the file does not exist */
+            return 0;
+        } else {
+            /* It was because of another error */
+            icalerror_set_errno(ICAL_FILE_ERROR);
+            return -1;
+        }
+    } else {
+        /* A file by the given name exists, but is it a regular file? */
+
+        if (!S_ISREG(sbuf.st_mode)) {
+            /* Nope, not a regular file */
+            icalerror_set_errno(ICAL_FILE_ERROR);
+            return -1;
+        } else {
+            /* Lets assume that it is a file of the right type */
+            return (long)sbuf.st_size;
+        }
+    }
+
+    /*return -1; not reached */
+}
+
+void icalfileset_free(icalset *set)
+{
+    icalfileset *fset;
+
+    icalerror_check_arg_rv((set != 0), "set");
+
+    fset = (icalfileset *) set;
+
+    (void)icalfileset_set_time_index(set, 0);
+
+    if (fset->cluster != 0) {
+        (void)icalfileset_commit(set);
+        icalcomponent_free(fset->cluster);
+        fset->cluster = 0;
+    }
+
+    if (fset->gauge != 0) {
+        icalgauge_free(fset->gauge);
+        fset->gauge = 0;
+    }
+
+    if (fset->fd > 0) {
+        (void)icalfileset_unlock(fset);
+        close(fset->fd);
+        fset->fd = -1;
+    }
+
+    if (fset->journal_fd > 0) {
+        close(fset->journal_fd);
+        fset->journal_fd = -1;
+    }
+
+    icalfileset_clear_records(fset);
+    icalfileset_posmap_free(fset->positions);
+    fset->positions = 0;
+
+    if (fset->path != 0) {
+        free(fset->path);
+        fset->path = 0;
+    }
+}
+
+const char *icalfileset_path(icalset *set)
+{
+    icalerror_check_arg_rz((set != 0), "set");
+
+    return ((icalfileset *) set)->path;
+}
+
+/* Take a shared lock on the file for a set opened read only, so that
+   readers do not block each other, or an exclusive one otherwise */
+int icalfileset_lock(icalfileset *set)
+{
+#if !defined(_WIN32)
+    struct flock lock;
+    int rtrn;
+
+    icalerror_check_arg_rz((set->fd > 0), "set->fd");
+    errno = 0;
+    lock.l_type = ((set->options.flags & O_ACCMODE) == O_RDONLY) ? F_RDLCK : F_WRLCK;
+    lock.l_start = 0;   /* byte offset relative to l_whence */
+    lock.l_whence = SEEK_SET;   /* SEEK_SET, SEEK_CUR, SEEK_END */
+    lock.l_len = 0;     /* #bytes (0 means to EOF) */
+
+    rtrn = fcntl(set->fd, F_SETLKW, &lock);
+
+    return rtrn;
+#else
+    _unused(set);
+    return 0;
+#endif
+}
+
+int icalfileset_unlock(icalfileset *set)
+{
+#if !defined(_WIN32)
+    struct flock lock;
+
+    icalerror_check_arg_rz((set->fd > 0), "set->fd");
+
+    lock.l_type = F_UNLCK;      /* F_RDLCK, F_WRLCK, F_UNLCK */
+    lock.l_start = 0;   /* byte offset relative to l_whence */
+    lock.l_whence = SEEK_SET;   /* SEEK_SET, SEEK_CUR, SEEK_END */
+    lock.l_len = 0;     /* #bytes (0 means to EOF) */
+
+    return (fcntl(set->fd, F_SETLK, &lock));
+#else
+    _unused(set);
+    return 0;
+#endif
+}
+
+/***** Changing the cluster *****/
+
+/* Record the identity of the file just read or written */
+static void icalfileset_note_base(icalfileset *fset, struct stat *sbuf)
+{
+    fset->base_size = sbuf->st_size;
+    fset->base_mtime = sbuf->st_mtime;
+    fset->base_ino = sbuf->st_ino;
+    fset->base_dev = sbuf->st_dev;
+}
+
+/* Read all of fd from its start into a NUL terminated buffer */
+static char *icalfileset_read_whole(int fd, size_t *length)
+{
+    struct stat sbuf;
+    char *buf, *end;
+
+    if (fstat(fd, &sbuf) != 0 || lseek(fd, 0, SEEK_SET) < 0 ||
+        (buf = (char *)malloc((size_t)sbuf.st_size + 1)) == 0) {
+        return 0;
+    }
+
+    for (end = buf; end < buf + sbuf.st_size;) {
+        IO_SSIZE_T sz = read(fd, end, (IO_SIZE_T) (buf + sbuf.st_size - end));
+
+        if (sz <= 0) {
+            break;
+        }
+        end += sz;
+    }
+    *end = 0;
+    *length = (size_t)(end - buf);
+
+    return buf;
+}
+
+/***** Positions of the components *****/
+
+/* Journal records name components by their position in the cluster. To
+   find positions without walking the cluster, the position map keeps
+   the components in order as slots, clearing a slot when its component
+   goes, with a Fenwick tree counting the slots in use, so that finding
+   the position of a component or the component at a position takes
+   O(log n). Like the time index, it follows the cluster's revision and
+   is rebuilt when the cluster changed other than through the set. */
+
+#define ICALFILESET_NO_SLOT ((size_t)-1)
+
+struct icalfileset_posmap
+{
+    icalcomponent *parent;
+    unsigned long revision;     /**< of the parent when the map was last up to date */
+    icalcomponent **slots;      /**< the components in order, or 0 where removed */
+    size_t *next;               /**< chains the slots by component */
+    size_t *tree;               /**< Fenwick tree of the slots in use, from 1 */
+    size_t *buckets;            /**< first slot by component, max_slots of them */
+    size_t num_slots;
+    size_t max_slots;           /**< a power of 2 */
+    size_t count;               /**< slots in use */
+};
+
+static size_t icalfileset_posmap_hash(struct icalfileset_posmap *map, icalcomponent *comp)
+{
+    size_t h = (size_t)comp;
+
+    h ^= h >> 4;
+    h *= 2654435761U;
+    h ^= h >> 16;
+
+    return h & (map->max_slots - 1);
+}
+
+static void icalfileset_posmap_free(struct icalfileset_posmap *map)
+{
+    if (map != 0) {
+        free(map->slots);
+        free(map->next);
+        free(map->tree);
+        free(map->buckets);
+        free(map);
+    }
+}
+
+/* Index the slots in use again, dropping the cleared ones */
+static void icalfileset_posmap_reindex(struct icalfileset_posmap *map)
+{
+    size_t i, n;
+
+    for (i = 0, n = 0; i < map->num_slots; i++) {
+        if (map->slots[i] != 0) {
+            map->slots[n++] = map->slots[i];
+        }
+    }
+    map->num_slots = map->count = n;
+
+    memset(map->tree, 0, (map->max_slots + 1) * sizeof(size_t));
+    for (i = 0; i < map->max_slots; i++) {
+        map->buckets[i] = ICALFILESET_NO_SLOT;
+    }
+
+    for (i = 0; i < n; i++) {
+        size_t h = icalfileset_posmap_hash(map, map->slots[i]);
+
+        map->next[i] = map->buckets[h];
+        map->buckets[h] = i;
+    }
+
+    /* Each node adds itself to its parent, which follows it */
+    for (i = 1; i <= map->max_slots; i++) {
+        size_t j = i + (i & (~i + 1));
+
+        if (i <= n) {
+            map->tree[i]++;
+        }
+        if (j <= map->max_slots) {
+            map->tree[j] += map->tree[i];
+        }
+    }
+}
+
+/* Make room for another slot. Returns 0 if there is no memory. */
+static int icalfileset_posmap_reserve(struct icalfileset_posmap *map)
+{
+    size_t max_slots;
+    void *p;
+
+    if (map->num_slots < map->max_slots) {
+        return 1;
+    }
+
+    /* Reuse the cleared slots if they are most of them */
+    if (map->count < map->max_slots / 2) {
+        icalfileset_posmap_reindex(map);
+        return 1;
+    }
+
+    max_slots = map->max_slots * 2;
+
+    if ((p = realloc(map->slots, max_slots * sizeof(icalcomponent *))) == 0) {
+        return 0;
+    }
+    map->slots = (icalcomponent **)p;
+    if ((p = realloc(map->next, max_slots * sizeof(size_t))) == 0) {
+        return 0;
+    }
+    map->next = (size_t *)p;
+    if ((p = realloc(map->tree, (max_slots + 1) * sizeof(size_t))) == 0) {
+        return 0;
+    }
+    map->tree = (size_t *)p;
+    if ((p = realloc(map->buckets, max_slots * sizeof(size_t))) == 0) {
+        return 0;
+    }
+    map->buckets = (size_t *)p;
+
+    map->max_slots = max_slots;
+    icalfileset_posmap_reindex(map);
+
+    return 1;
+}
+
+static int icalfileset_posmap_append(struct icalfileset_posmap *map, icalcomponent *comp)
+{
+    size_t slot, h, i;
+
+    if (!icalfileset_posmap_reserve(map)) {
+        return 0;
+    }
+
+    slot = map->num_slots++;
+    map->slots[slot] = comp;
+    map->count++;
+
+    for (i = slot + 1; i <= map->max_slots; i += i & (~i + 1)) {
+        map->tree[i]++;
+    }
+
+    h = icalfileset_posmap_hash(map, comp);
+    map->next[slot] = map->buckets[h];
+    map->buckets[h] = slot;
+
+    return 1;
+}
+
+static void icalfileset_posmap_remove(struct icalfileset_posmap *map, icalcomponent *comp)
+{
+    size_t *sp, i;
+
+    for (sp = &map->buckets[icalfileset_posmap_hash(map, comp)]; *sp != ICALFILESET_NO_SLOT;
+         sp = &map->next[*sp]) {
+        size_t slot = *sp;
+
+        if (map->slots[slot] == comp) {
+            *sp = map->next[slot];
+            map->slots[slot] = 0;
+            map->count--;
+
+            for (i = slot + 1; i <= map->max_slots; i += i & (~i + 1)) {
+                map->tree[i]--;
+            }
+            return;
+        }
+    }
+}
+
+/* Return the map of fset's cluster, brought up to date, or 0 if there
+   is no memory for it */
+static struct icalfileset_posmap *icalfileset_positions(icalfileset *fset)
+{
+    struct icalfileset_posmap *map = fset->positions;
+    icalcompiter i;
+    icalcomponent *c;
+
+    if (map != 0 && map->parent == fset->cluster &&
+        map->revision == icalcomponent_get_revision(fset->cluster)) {
+        return map;
+    }
+
+    if (map == 0) {
+        if ((map = (struct icalfileset_posmap *)calloc(1, sizeof(*map))) == 0) {
+            return 0;
+        }
+        map->max_slots = 64;
+        map->slots = (icalcomponent **)malloc(map->max_slots * sizeof(icalcomponent *));
+        map->next = (size_t *)malloc(map->max_slots * sizeof(size_t));
+        map->tree = (size_t *)malloc((map->max_slots + 1) * sizeof(size_t));
+        map->buckets = (size_t *)malloc(map->max_slots * sizeof(size_t));
+        if (map->slots == 0 || map->next == 0 || map->tree == 0 || map->buckets == 0) {
+            icalfileset_posmap_free(map);
+            return 0;
+        }
+        fset->positions = map;
+    }
+
+    map->parent = fset->cluster;
+    map->num_slots = 0;
+    icalfileset_posmap_reindex(map);
+
+    for (i = icalcomponent_begin_component(fset->cluster, ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+        if (!icalfileset_posmap_append(map, c)) {
+            icalfileset_posmap_free(map);
+            fset->positions = 0;
+            return 0;
+        }
+    }
+
+    map->revision = icalcomponent_get_revision(fset->cluster);
+
+    return map;
+}
+
+/* Return the map if it is up to date before a change to the cluster, so
+   that the change can be applied to it, or else 0 */
+static struct icalfileset_posmap *icalfileset_positions_if_synced(icalfileset *fset)
+{
+    struct icalfileset_posmap *map = fset->positions;
+
+    if (map != 0 && map->parent == fset->cluster &&
+        map->revision == icalcomponent_get_revision(fset->cluster)) {
+        return map;
+    }
+
+    return 0;
+}
+
+/* Return the position of child in the set, or -1 if it is not there */
+static long icalfileset_component_position(icalfileset *fset, icalcomponent *child)
+{
+    struct icalfileset_posmap *map = icalfileset_positions(fset);
+    icalcompiter i;
+    icalcomponent *c;
+    long n = 0;
+
+    if (map != 0) {
+        size_t slot, j;
+
+        for (slot = map->buckets[icalfileset_posmap_hash(map, child)];
+             slot != ICALFILESET_NO_SLOT && map->slots[slot] != child; slot = map->next[slot]) ;
+
+        if (slot == ICALFILESET_NO_SLOT) {
+            return -1;
+        }
+
+        /* The slots in use before it */
+        for (j = slot; j > 0; j -= j & (~j + 1)) {
+            n += (long)map->tree[j];
+        }
+        return n;
+    }
+
+    for (i = icalcomponent_begin_component(fset->cluster, ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i), n++) {
+        if (c == child) {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+static icalcomponent *icalfileset_component_at(icalfileset *fset, long position)
+{
+    struct icalfileset_posmap *map = icalfileset_positions(fset);
+    icalcompiter i;
+    icalcomponent *c;
+    long n = 0;
+
+    if (position < 0) {
+        return 0;
+    }
+
+    if (map != 0) {
+        size_t slot = 0, step, left = (size_t)position + 1;
+
+        if ((size_t)position >= map->count) {
+            return 0;
+        }
+
+        /* Find the slot with position slots in use before it */
+        for (step = map->max_slots; step > 0; step >>= 1) {
+            if (slot + step <= map->max_slots && map->tree[slot + step] < left) {
+                slot += step;
+                left -= map->tree[slot];
+            }
+        }
+        return map->slots[slot];
+    }
+
+    for (i = icalcomponent_begin_component(fset->cluster, ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0 && n < position; (void)icalcompiter_next(&i), n++) ;
+
+    return c;
+}
+
+/* Add child to the cluster, keeping the time index and the position
+   map up to date */
+static void icalfileset_attach(icalfileset *fset, icalcomponent *child)
+{
+    struct icalfileset_posmap *map = icalfileset_positions_if_synced(fset);
+
+    if (fset->time_index != 0) {
+        icaltimeindex_sync(fset->time_index);
+    }
+
+    icalcomponent_add_component(fset->cluster, child);
+
+    if (fset->time_index != 0) {
+        icaltimeindex_add_component(fset->time_index, child);
+    }
+
+    if (map != 0 && icalfileset_posmap_append(map, child)) {
+        map->revision = icalcomponent_get_revision(fset->cluster);
+    }
+}
+
+/* Take child out of the cluster, keeping the time index and the
+   position map up to date */
+static void icalfileset_detach(icalfileset *fset, icalcomponent *child)
+{
+    struct icalfileset_posmap *map = icalfileset_positions_if_synced(fset);
+
+    if (fset->time_index != 0) {
+        icaltimeindex_sync(fset->time_index);
+    }
+
+    icalcomponent_remove_component(fset->cluster, child);
+
+    if (fset->time_index != 0) {
+        icaltimeindex_remove_component(fset->time_index, child);
+    }
+
+    if (map != 0) {
+        icalfileset_posmap_remove(map, child);
+        map->revision = icalcomponent_get_revision(fset->cluster);
+    }
+
+    /* Keep an iteration over the candidates from stepping on child */
+    if (fset->candidates != 0) {
+        size_t i;
+
+        for (i = 0; i < fset->candidates->num_elements; i++) {
+            icalcomponent **c = icalarray_element_at(fset->candidates, i);
+
+            if (*c == child) {
+                *c = 0;
+            }
+        }
+    }
+}
+
+/* Move child to the end of the cluster */
+static void icalfileset_move_to_end(icalfileset *fset, icalcomponent *child)
+{
+    struct icalfileset_posmap *map = icalfileset_positions_if_synced(fset);
+
+    if (fset->time_index != 0) {
+        icaltimeindex_sync(fset->time_index);
+        icaltimeindex_remove_component(fset->time_index, child);
+    }
+
+    icalcomponent_remove_component(fset->cluster, child);
+    icalcomponent_add_component(fset->cluster, child);
+
+    if (fset->time_index != 0) {
+        icaltimeindex_add_component(fset->time_index, child);
+    }
+
+    if (map != 0) {
+        icalfileset_posmap_remove(map, child);
+        if (icalfileset_posmap_append(map, child)) {
+            map->revision = icalcomponent_get_revision(fset->cluster);
+        }
+    }
+}
+
+/***** The journal *****/
+
+/* In journal mode, a commit appends records of the changes made since
+   the last commit to the journal instead of writing the whole file.
+   The journal starts with a line giving the size and modification time
+   of the file it applies to, followed by a record per change:
+
+     ADD <length>        then the component, <length> bytes of it
+     DEL <position>      removes the component at that position
+
+   Positions count the components in the order of the file, followed by
+   those added by earlier records. Loading the set replays the journal
+   over the file; writing the whole file drops the journal. */
+
+#define ICALFILESET_JOURNAL_MAGIC "ICALFILESET-JOURNAL 1"
+
+static void icalfileset_journal_path(icalfileset *fset, char *path, size_t size)
+{
+    snprintf(path, size, "%s%s", fset->path, ICALFILESET_JOURNAL_SUFFIX);
+}
+
+static void icalfileset_append_record(icalfileset *fset, const char *str)
+{
+    if (fset->records == 0) {
+        fset->records_size = 1024;
+        fset->records = fset->records_pos = icalmemory_new_buffer(fset->records_size);
+        if (fset->records == 0) {
+            fset->rewrite = 1;
+            return;
+        }
+    }
+
+    icalmemory_append_string(&fset->records, &fset->records_pos, &fset->records_size, str);
+}
+
+static void icalfileset_clear_records(icalfileset *fset)
+{
+    if (fset->records != 0) {
+        icalmemory_free_buffer(fset->records);
+        fset->records = fset->records_pos = 0;
+        fset->records_size = 0;
+    }
+}
+
+/* Record child, just added, for the journal */
+static void icalfileset_journal_add(icalfileset *fset, icalcomponent *child)
+{
+    char head[32];
+    char *str;
+
+    if (!fset->journal || fset->rewrite) {
+        return;
+    }
+
+    str = icalcomponent_as_ical_string_r(child);
+    snprintf(head, sizeof(head), "ADD %lu\n", (unsigned long)strlen(str));
+    icalfileset_append_record(fset, head);
+    icalfileset_append_record(fset, str);
+    free(str);
+}
+
+/* Record the removal of the component at position for the journal */
+static void icalfileset_journal_remove(icalfileset *fset, long position)
+{
+    char head[32];
+
+    if (!fset->journal || fset->rewrite || position < 0) {
+        return;
+    }
+
+    snprintf(head, sizeof(head), "DEL %ld\n", position);
+    icalfileset_append_record(fset, head);
+}
+
+/* Apply the records of the journal that applies to the file just read,
+   starting with the one at offset from, or with the first if from is 0.
+   A record cut short, as by a crash while it was written, ends the
+   journal, and is cut off when the journal is next appended to. */
+static void icalfileset_replay_journal(icalfileset *fset, off_t from)
+{
+    char path[MAXPATHLEN];
+    char *buf, *pos, *end, *eol;
+    long base_size, base_mtime;
+    size_t length;
+    int fd;
+
+    fset->journal_size = from;
+
+    icalfileset_journal_path(fset, path, sizeof(path));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return;
+    }
+
+    buf = icalfileset_read_whole(fd, &length);
+    close(fd);
+    if (buf == 0) {
+        return;
+    }
+    end = buf + length;
+
+    /* A journal left from before the file was last written is stale */
+    if ((eol = strchr(buf, '\n')) == 0 ||
+        sscanf(buf, ICALFILESET_JOURNAL_MAGIC " %ld %ld", &base_size, &base_mtime) != 2 ||
+        base_size != (long)fset->base_size || base_mtime != (long)fset->base_mtime ||
+        from > (off_t) length) {
+        fset->journal_size = 0;
+        free(buf);
+        return;
+    }
+
+    pos = (from > (off_t) (eol + 1 - buf)) ? buf + from : eol + 1;
+
+    for (; pos < end && (eol = memchr(pos, '\n', (size_t)(end - pos))) != 0;) {
+        if (strncmp(pos, "ADD ", 4) == 0) {
+            unsigned long length = strtoul(pos + 4, 0, 10);
+            icalcomponent *c;
+            char saved;
+
+            if (length > (unsigned long)(end - eol - 1)) {
+                break;
+            }
+
+            saved = eol[1 + length];
+            eol[1 + length] = 0;
+            c = icalparser_parse_string(eol + 1);
+            eol[1 + length] = saved;
+
+            if (c == 0) {
+                break;
+            }
+            icalfileset_attach(fset, c);
+            pos = eol + 1 + length;
+
+        } else if (strncmp(pos, "DEL ", 4) == 0) {
+            icalcomponent *c = icalfileset_component_at(fset, strtol(pos + 4, 0, 10));
+
+            if (c == 0) {
+                break;
+            }
+            icalfileset_detach(fset, c);
+            icalcomponent_free(c);
+            pos = eol + 1;
+
+        } else {
+            break;
+        }
+    }
+
+    fset->journal_size = (off_t) (pos - buf);
+    free(buf);
+}
+
+/* Append the records of the changes to the journal */
+static icalerrorenum icalfileset_append_journal(icalfileset *fset)
+{
+    char path[MAXPATHLEN];
+    size_t length = (size_t)(fset->records_pos - fset->records);
+
+    if (fset->records == 0 || length == 0) {
+        return ICAL_NO_ERROR;
+    }
+
+    if (fset->journal_fd < 0) {
+        icalfileset_journal_path(fset, path, sizeof(path));
+        if ((fset->journal_fd = open(path, O_WRONLY | O_CREAT, fset->options.mode)) < 0) {
+            icalerror_set_errno(ICAL_FILE_ERROR);
+            return ICAL_FILE_ERROR;
+        }
+    }
+
+    /* Start a new journal, or cut off what follows the valid records */
+    if (fset->journal_size == 0) {
+        char head[128];
+
+        snprintf(head, sizeof(head), ICALFILESET_JOURNAL_MAGIC " %ld %ld\n",
+                 (long)fset->base_size, (long)fset->base_mtime);
+
+        if (ftruncate(fset->journal_fd, 0) < 0 ||
+            lseek(fset->journal_fd, 0, SEEK_SET) < 0 ||
+            write(fset->journal_fd, head, (IO_SIZE_T) strlen(head)) != (IO_SSIZE_T) strlen(head)) {
+            icalerror_set_errno(ICAL_FILE_ERROR);
+            return ICAL_FILE_ERROR;
+        }
+        fset->journal_size = (off_t) strlen(head);
+    } else if (ftruncate(fset->journal_fd, fset->journal_size) < 0 ||
+               lseek(fset->journal_fd, fset->journal_size, SEEK_SET) < 0) {
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
+    }
+
+    if (write(fset->journal_fd, fset->records, (IO_SIZE_T) length) != (IO_SSIZE_T) length) {
+        (void)ftruncate(fset->journal_fd, fset->journal_size);
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
+    }
+
+    fset->journal_size += (off_t) length;
+    icalfileset_clear_records(fset);
+
+    return ICAL_NO_ERROR;
+}
+
+/* The whole file was just written, so the journal is not needed */
+static void icalfileset_drop_journal(icalfileset *fset)
+{
+    char path[MAXPATHLEN];
+    struct stat sbuf;
+
+    if (fset->journal_fd > 0) {
+        close(fset->journal_fd);
+        fset->journal_fd = -1;
+    }
+
+    icalfileset_journal_path(fset, path, sizeof(path));
+    (void)unlink(path);
+
+    fset->journal_size = 0;
+    fset->rewrite = 0;
+    icalfileset_clear_records(fset);
+
+    if (fstat(fset->fd, &sbuf) == 0) {
+        icalfileset_note_base(fset, &sbuf);
+    }
+}
+
+icalerrorenum icalfileset_set_journal(icalset *set, int enable, double compact_ratio)
+{
+    icalfileset *fset;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    fset = (icalfileset *) set;
+
+    /* Changes made without the journal have no records */
+    if (enable && !fset->journal && fset->changed) {
+        fset->rewrite = 1;
+    }
+    if (!enable) {
+        fset->rewrite = fset->changed;
+        icalfileset_clear_records(fset);
+    }
+
+    fset->journal = enable ? 1 : 0;
+    fset->journal_ratio = (compact_ratio > 0) ? compact_ratio : 1.0;
+
+    return ICAL_NO_ERROR;
+}
+
+icalerrorenum icalfileset_compact(icalset *set)
+{
+    icalfileset *fset;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    fset = (icalfileset *) set;
+
+    fset->changed = 1;
+    fset->rewrite = 1;
+
+    return icalfileset_commit(set);
+}
+
+/***** Refreshing *****/
+
+/* When the file was rewritten, it is split into its top-level
+   components, and each is looked up by the text of the components of
+   the set. Those whose text is unchanged keep their objects, and only
+   the others are parsed. */
+
+struct icalfileset_print
+{
+    unsigned int hash;
+    size_t length;
+    char *str;
+    icalcomponent *comp;
+    int used;
+};
+
+struct icalfileset_chunk
+{
+    icalcomponent *comp;
+    int reused;
+};
+
+static unsigned int icalfileset_hash_text(const char *str, size_t length)
+{
+    unsigned int hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)str[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+static int icalfileset_compare_prints(const void *a, const void *b)
+{
+    unsigned int ha = ((const struct icalfileset_print *)a)->hash;
+    unsigned int hb = ((const struct icalfileset_print *)b)->hash;
+
+    return (ha < hb) ? -1 : (ha > hb);
+}
+
+/* Return the unused component of the set with the given text, or 0 */
+static icalcomponent *icalfileset_find_print(struct icalfileset_print *prints, size_t count,
+                                             const char *str, size_t length)
+{
+    unsigned int hash = icalfileset_hash_text(str, length);
+    size_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (prints[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (; lo < count && prints[lo].hash == hash; lo++) {
+        if (!prints[lo].used && prints[lo].length == length &&
+            memcmp(prints[lo].str, str, length) == 0) {
+            prints[lo].used = 1;
+            return prints[lo].comp;
+        }
+    }
+
+    return 0;
+}
+
+/* Split buf into its top-level components, appending them to chunks.
+   Returns -1 if buf is not made of whole components. */
+static int icalfileset_split_file(char *buf, size_t length, struct icalfileset_print *prints,
+                                  size_t count, icalarray *chunks)
+{
+    char *end = buf + length;
+    char *pos, *next, *start = buf;
+    int depth = 0;
+
+    for (pos = buf; pos < end; pos = next) {
+        char *eol = memchr(pos, '\n', (size_t)(end - pos));
+
+        next = (eol != 0) ? eol + 1 : end;
+
+        if (strncasecmp(pos, "BEGIN:", 6) == 0) {
+            if (depth++ == 0) {
+                start = pos;
+            }
+        } else if (strncasecmp(pos, "END:", 4) == 0) {
+            struct icalfileset_chunk chunk;
+            char saved;
+
+            if (--depth < 0) {
+                return -1;
+            }
+            if (depth > 0) {
+                continue;
+            }
+
+            chunk.comp = icalfileset_find_print(prints, count, start, (size_t)(next - start));
+            chunk.reused = (chunk.comp != 0);
+
+            if (chunk.comp == 0) {
+                saved = *next;
+                *next = 0;
+                chunk.comp = icalparser_parse_string(start);
+                *next = saved;
+            }
+
+            if (chunk.comp != 0) {
+                icalarray_append(chunks, &chunk);
+            }
+        }
+    }
+
+    return (depth == 0) ? 0 : -1;
+}
+
+/* Load the file again from fd, keeping the components whose text has
+   not changed */
+static icalerrorenum icalfileset_reload(icalfileset *fset, int fd)
+{
+    struct icalfileset_print *prints;
+    icalarray *chunks;
+    icalcomponent *c;
+    icalcompiter it;
+    size_t count, length, i;
+    char *buf;
+    int in_order, seen_new;
+
+    if ((buf = icalfileset_read_whole(fd, &length)) == 0) {
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
+    }
+
+    count = (size_t)icalcomponent_count_components(fset->cluster, ICAL_ANY_COMPONENT);
+    prints = (struct icalfileset_print *)malloc((count + 1) * sizeof(struct icalfileset_print));
+    chunks = icalarray_new(sizeof(struct icalfileset_chunk), 64);
+    if (prints == 0 || chunks == 0) {
+        free(prints);
+        if (chunks != 0) {
+            icalarray_free(chunks);
+        }
+        free(buf);
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return ICAL_NEWFAILED_ERROR;
+    }
+
+    for (i = 0, c = icalcomponent_get_first_component(fset->cluster, ICAL_ANY_COMPONENT);
+         c != 0 && i < count;
+         i++, c = icalcomponent_get_next_component(fset->cluster, ICAL_ANY_COMPONENT)) {
+        prints[i].str = icalcomponent_as_ical_string_r(c);
+        prints[i].length = strlen(prints[i].str);
+        prints[i].hash = icalfileset_hash_text(prints[i].str, prints[i].length);
+        prints[i].comp = c;
+        prints[i].used = 0;
+    }
+    count = i;
+    qsort(prints, count, sizeof(struct icalfileset_print), icalfileset_compare_prints);
+
+    if (icalfileset_split_file(buf, length, prints, count, chunks) < 0) {
+        /* Not laid out as the set writes it, so load all of it again */
+        for (i = 0; i < chunks->num_elements; i++) {
+            struct icalfileset_chunk *chunk = icalarray_element_at(chunks, i);
+
+            if (!chunk->reused) {
+                icalcomponent_free(chunk->comp);
+            }
+        }
+        icalarray_free(chunks);
+        chunks = icalarray_new(sizeof(struct icalfileset_chunk), 64);
+
+        for (i = 0; i < count; i++) {
+            prints[i].used = 0;
+        }
+
+        if ((c = icalparser_parse_string(buf)) != 0) {
+            struct icalfileset_chunk chunk;
+
+            chunk.reused = 0;
+            if (icalcomponent_isa(c) == ICAL_XROOT_COMPONENT) {
+                while ((chunk.comp = icalcomponent_get_first_component(c, ICAL_ANY_COMPONENT))) {
+                    icalcomponent_remove_component(c, chunk.comp);
+                    icalarray_append(chunks, &chunk);
+                }
+                icalcomponent_free(c);
+            } else {
+                chunk.comp = c;
+                icalarray_append(chunks, &chunk);
+            }
+        }
+    }
+
+    /* Free the components that changed or went away */
+    for (i = 0; i < count; i++) {
+        if (!prints[i].used) {
+            icalfileset_detach(fset, prints[i].comp);
+            icalcomponent_free(prints[i].comp);
+        }
+        free(prints[i].str);
+    }
+    free(prints);
+
+    /* The components left are usually in the order of the file, with the
+       new ones after them, so only the new ones need adding */
+    in_order = 1;
+    seen_new = 0;
+    it = icalcomponent_begin_component(fset->cluster, ICAL_ANY_COMPONENT);
+    for (i = 0; i < chunks->num_elements && in_order; i++) {
+        struct icalfileset_chunk *chunk = icalarray_element_at(chunks, i);
+
+        if (!chunk->reused) {
+            seen_new = 1;
+        } else if (seen_new || icalcompiter_deref(&it) != chunk->comp) {
+            in_order = 0;
+        } else {
+            (void)icalcompiter_next(&it);
+        }
+    }
+
+    for (i = 0; i < chunks->num_elements; i++) {
+        struct icalfileset_chunk *chunk = icalarray_element_at(chunks, i);
+
+        if (!chunk->reused) {
+            icalfileset_attach(fset, chunk->comp);
+        } else if (!in_order) {
+            icalfileset_move_to_end(fset, chunk->comp);
+        }
+    }
+
+    icalarray_free(chunks);
+    free(buf);
+
+    return ICAL_NO_ERROR;
+}
+
+icalerrorenum icalfileset_refresh(icalset *set)
+{
+    icalfileset *fset;
+    char path[MAXPATHLEN];
+    struct stat sbuf;
+    icalerrorenum error;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    fset = (icalfileset *) set;
+
+    icalerror_check_arg_re((fset->fd > 0), "set->fd is invalid", ICAL_INTERNAL_ERROR);
+
+    /* Changes not yet committed would be lost */
+    if (fset->changed) {
+        icalerror_set_errno(ICAL_USAGE_ERROR);
+        return ICAL_USAGE_ERROR;
+    }
+
+    if (stat(fset->path, &sbuf) != 0) {
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
+    }
+
+    if (sbuf.st_ino != fset->base_ino || sbuf.st_dev != fset->base_dev ||
+        sbuf.st_size != fset->base_size || sbuf.st_mtime != fset->base_mtime) {
+
+        /* Another file was renamed over the one open */
+        if (sbuf.st_ino != fset->base_ino || sbuf.st_dev != fset->base_dev) {
+            int old_fd = fset->fd;
+
+            if (icalfileset_open_locked(fset, fset->options.flags, fset->options.mode) < 0) {
+                fset->fd = old_fd;
+                icalerror_set_errno(ICAL_FILE_ERROR);
+                return ICAL_FILE_ERROR;
+            }
+            close(old_fd);
+        }
+
+        if (fstat(fset->fd, &sbuf) != 0) {
+            icalerror_set_errno(ICAL_FILE_ERROR);
+            return ICAL_FILE_ERROR;
+        }
+
+        if ((error = icalfileset_reload(fset, fset->fd)) != ICAL_NO_ERROR) {
+            return error;
+        }
+        icalfileset_note_base(fset, &sbuf);
+
+        /* The journal is read again from its start */
+        if (fset->journal_fd > 0) {
+            close(fset->journal_fd);
+            fset->journal_fd = -1;
+        }
+        icalfileset_replay_journal(fset, 0);
+
+    } else {
+        struct stat jbuf;
+
+        icalfileset_journal_path(fset, path, sizeof(path));
+
+        if (stat(path, &jbuf) == 0 && jbuf.st_size > fset->journal_size) {
+            /* Only the records appended since it was last read */
+            icalfileset_replay_journal(fset, fset->journal_size);
+
+        } else if (fset->journal_size > 0 &&
+                   (stat(path, &jbuf) != 0 || jbuf.st_size < fset->journal_size)) {
+            /* The journal was cut short, so what it added is not known */
+            if ((error = icalfileset_reload(fset, fset->fd)) != ICAL_NO_ERROR) {
+                return error;
+            }
+            if (fset->journal_fd > 0) {
+                close(fset->journal_fd);
+                fset->journal_fd = -1;
+            }
+            icalfileset_replay_journal(fset, 0);
+        }
+    }
+
+    fset->changed = 0;
+
+    return ICAL_NO_ERROR;
+}
+
+/***** Writing the file *****/
+
+/* Where the system has them, a commit writes the whole file to a
+   temporary file next to it, syncs that to disk and renames it over
+   the file, so the file on disk is always either the old or the new
+   version. Otherwise the file is overwritten in place. */
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+#include <sys/uio.h>
+#include <limits.h>
+#endif
+
+/* The number of components written at once, with one writev() */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define ICALFILESET_IOV_COUNT IOV_MAX
+#else
+#define ICALFILESET_IOV_COUNT 64
+#endif
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+
+/* Write out all of the buffers, then free them */
+static int icalfileset_writev_all(int fd, struct iovec *iov, char **strs, int count)
+{
+    struct iovec *pos = iov;
+    int left = count;
+    int rtrn = 0;
+    int i;
+
+    while (left > 0) {
+        ssize_t sz = writev(fd, pos, left);
+
+        if (sz < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sz <= 0) {
+            rtrn = -1;
+            break;
+        }
+
+        /* Skip past what was written, which may end inside a buffer */
+        while (left > 0 && (size_t)sz >= pos->iov_len) {
+            sz -= (ssize_t) pos->iov_len;
+            pos++;
+            left--;
+        }
+        if (left > 0) {
+            pos->iov_base = (char *)pos->iov_base + sz;
+            pos->iov_len -= (size_t)sz;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        free(strs[i]);
+    }
+
+    return rtrn;
+}
+#endif
+
+/* Write count components, no more than ICALFILESET_IOV_COUNT, to fd,
+   returning the number of bytes written, or -1 */
+static off_t icalfileset_write_batch(int fd, icalcomponent **comps, int count)
+{
+    off_t write_size = 0;
+    int i;
+
+#if defined(HAVE_WRITEV) && defined(HAVE_SYS_UIO_H)
+    struct iovec iov[ICALFILESET_IOV_COUNT];
+    char *strs[ICALFILESET_IOV_COUNT];
+
+    for (i = 0; i < count; i++) {
+        strs[i] = icalcomponent_as_ical_string_r(comps[i]);
+        iov[i].iov_base = strs[i];
+        iov[i].iov_len = strlen(strs[i]);
+        write_size += (off_t) iov[i].iov_len;
+    }
+
+    if (icalfileset_writev_all(fd, iov, strs, count) < 0) {
+        return -1;
+    }
+#else
+    for (i = 0; i < count; i++) {
+        IO_SSIZE_T sz;
+        char *str = icalcomponent_as_ical_string_r(comps[i]);
+
+        sz = write(fd, str, (IO_SIZE_T) strlen(str));
+        if (sz != (IO_SSIZE_T) strlen(str)) {
+            free(str);
+            return -1;
+        }
+
+        free(str);
+        write_size += sz;
     }
+#endif
 
-    return ICAL_NO_ERROR;
+    return write_size;
 }
 
-long icalfileset_filesize(icalfileset *fset)
+/* Write each component of the cluster to fd, returning the number of
+   bytes written, or -1 */
+static off_t icalfileset_write_components(icalfileset *fset, int fd)
 {
-    struct stat sbuf;
+    icalcomponent *batch[ICALFILESET_IOV_COUNT];
+    icalcomponent *c;
+    off_t write_size = 0, sz;
+    int count = 0;
 
-    if (stat(fset->path, &sbuf) != 0) {
+    for (c = icalcomponent_get_first_component(fset->cluster, ICAL_ANY_COMPONENT);
+         c != 0; c = icalcomponent_get_next_component(fset->cluster, ICAL_ANY_COMPONENT)) {
+        batch[count++] = c;
 
-        /* A file by the given name does not exist, or there was
-           another error */
-        if (errno == ENOENT) {
-            /* It was because the file does not exist */
-            return 0;
-        } else {
-            /* It was because of another error */
-            icalerror_set_errno(ICAL_FILE_ERROR);
-            return -1;
+        if (count == ICALFILESET_IOV_COUNT) {
+            if ((sz = icalfileset_write_batch(fd, batch, count)) < 0) {
+                return -1;
+            }
+            write_size += sz;
+            count = 0;
         }
-    } else {
-        /* A file by the given name exists, but is it a regular file? */
+    }
 
-        if (!S_ISREG(sbuf.st_mode)) {
-            /* Nope, not a regular file */
-            icalerror_set_errno(ICAL_FILE_ERROR);
+    if (count > 0) {
+        if ((sz = icalfileset_write_batch(fd, batch, count)) < 0) {
             return -1;
-        } else {
-            /* Lets assume that it is a file of the right type */
-            return (long)sbuf.st_size;
         }
+        write_size += sz;
     }
 
-    /*return -1; not reached */
+    return write_size;
 }
 
-void icalfileset_free(icalset *set)
+icalerrorenum icalfileset_append_components(const char *path, int mode,
+                                            icalcomponent **comps, size_t num_comps)
 {
-    icalfileset *fset;
-
-    icalerror_check_arg_rv((set != 0), "set");
+#if !defined(_WIN32)
+    icalfileset file;
+    char journal[MAXPATHLEN];
+    struct stat sbuf;
+    size_t i;
+    char last;
+
+    /* Appending would change the size of the file, so its journal would
+       no longer apply */
+    snprintf(journal, sizeof(journal), "%s%s", path, ICALFILESET_JOURNAL_SUFFIX);
+    if (stat(journal, &sbuf) == 0) {
+        return ICAL_USAGE_ERROR;
+    }
 
-    fset = (icalfileset *) set;
+    memset(&file, 0, sizeof(file));
+    file.path = (char *)path;
+    file.options = icalfileset_options_default;
+    file.options.flags = O_RDWR | O_CREAT | O_APPEND;
 
-    if (fset->cluster != 0) {
-        (void)icalfileset_commit(set);
-        icalcomponent_free(fset->cluster);
-        fset->cluster = 0;
+    if (icalfileset_open_locked(&file, file.options.flags, mode) < 0 ||
+        fstat(file.fd, &sbuf) != 0) {
+        goto error;
     }
 
-    if (fset->gauge != 0) {
-        icalgauge_free(fset->gauge);
-        fset->gauge = 0;
+    /* Start on a line of its own */
+    if (sbuf.st_size > 0 &&
+        (lseek(file.fd, sbuf.st_size - 1, SEEK_SET) < 0 || read(file.fd, &last, 1) != 1 ||
+         (last != '\n' && write(file.fd, "\r\n", 2) != 2))) {
+        goto error;
     }
 
-    if (fset->fd > 0) {
-        (void)icalfileset_unlock(fset);
-        close(fset->fd);
-        fset->fd = -1;
+    for (i = 0; i < num_comps; i += ICALFILESET_IOV_COUNT) {
+        int count = (num_comps - i < ICALFILESET_IOV_COUNT) ?
+            (int)(num_comps - i) : ICALFILESET_IOV_COUNT;
+
+        if (icalfileset_write_batch(file.fd, comps + i, count) < 0) {
+            (void)ftruncate(file.fd, sbuf.st_size);
+            goto error;
+        }
     }
 
-    if (fset->path != 0) {
-        free(fset->path);
-        fset->path = 0;
+#if defined(HAVE_FSYNC)
+    (void)fsync(file.fd);
+#endif
+    close(file.fd);
+
+    return ICAL_NO_ERROR;
+
+  error:
+    if (file.fd > 0) {
+        close(file.fd);
     }
+    icalerror_set_errno(ICAL_FILE_ERROR);
+    return ICAL_FILE_ERROR;
+#else
+    _unused(path);
+    _unused(mode);
+    _unused(comps);
+    _unused(num_comps);
+    return ICAL_UNIMPLEMENTED_ERROR;
+#endif
 }
 
-const char *icalfileset_path(icalset *set)
+#if defined(ICALFILESET_ATOMIC_COMMIT)
+
+/* Sync the directory holding the file, so that a rename into it is on disk */
+static void icalfileset_sync_dir(const char *path)
 {
-    icalerror_check_arg_rz((set != 0), "set");
+    char dir[MAXPATHLEN];
+    const char *slash = strrchr(path, '/');
+    int fd;
+
+    if (slash == 0) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    }
 
-    return ((icalfileset *) set)->path;
+    if ((fd = open(dir, O_RDONLY)) >= 0) {
+        (void)fsync(fd);
+        close(fd);
+    }
 }
 
-int icalfileset_lock(icalfileset *set)
+static icalerrorenum icalfileset_write_file(icalfileset *fset)
 {
-#if !defined(_WIN32)
-    struct flock lock;
-    int rtrn;
+    char tmp[MAXPATHLEN];
+    struct stat sbuf;
+    int old_fd = fset->fd;
+    int fd;
 
-    icalerror_check_arg_rz((set->fd > 0), "set->fd");
-    errno = 0;
-    lock.l_type = F_WRLCK;      /* F_RDLCK, F_WRLCK, F_UNLCK */
-    lock.l_start = 0;   /* byte offset relative to l_whence */
-    lock.l_whence = SEEK_SET;   /* SEEK_SET, SEEK_CUR, SEEK_END */
-    lock.l_len = 0;     /* #bytes (0 means to EOF) */
+    if ((fset->options.flags & O_ACCMODE) == O_RDONLY) {
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
+    }
 
-    rtrn = fcntl(set->fd, F_SETLKW, &lock);
+    snprintf(tmp, sizeof(tmp), "%s" ICALFILESET_TEMP_INFIX "XXXXXX", fset->path);
+    if ((fd = mkstemp(tmp)) < 0) {
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
+    }
 
-    return rtrn;
-#else
-    _unused(set);
-    return 0;
-#endif
-}
+    if (fstat(old_fd, &sbuf) == 0) {
+        (void)fchmod(fd, sbuf.st_mode & 07777);
+    } else {
+        (void)fchmod(fd, (mode_t) fset->options.mode);
+    }
 
-int icalfileset_unlock(icalfileset *set)
-{
-#if !defined(_WIN32)
-    struct flock lock;
+    if (icalfileset_write_components(fset, fd) < 0 || fsync(fd) < 0) {
+        goto error;
+    }
 
-    icalerror_check_arg_rz((set->fd > 0), "set->fd");
+    /* Keep the old version as the backup. It is a second link to the
+       old file, so it costs no copy */
+    if (fset->options.safe_saves == 1) {
+        char bak[MAXPATHLEN];
 
-    lock.l_type = F_WRLCK;      /* F_RDLCK, F_WRLCK, F_UNLCK */
-    lock.l_start = 0;   /* byte offset relative to l_whence */
-    lock.l_whence = SEEK_SET;   /* SEEK_SET, SEEK_CUR, SEEK_END */
-    lock.l_len = 0;     /* #bytes (0 means to EOF) */
+        snprintf(bak, sizeof(bak), "%s.bak", fset->path);
+        if ((unlink(bak) < 0 && errno != ENOENT) || link(fset->path, bak) < 0) {
+            goto error;
+        }
+    }
 
-    return (fcntl(set->fd, F_UNLCK, &lock));
-#else
-    _unused(set);
-    return 0;
-#endif
+    /* Hold the lock on the new file before other processes can see it */
+    fset->fd = fd;
+    (void)icalfileset_lock(fset);
+
+    if (rename(tmp, fset->path) < 0) {
+        fset->fd = old_fd;
+        goto error;
+    }
+    icalfileset_sync_dir(fset->path);
+
+    /* Closing the old file drops the lock held on it */
+    close(old_fd);
+    fset->changed = 0;
+
+    return ICAL_NO_ERROR;
+
+  error:
+    close(fd);
+    (void)unlink(tmp);
+    icalerror_set_errno(ICAL_FILE_ERROR);
+    return ICAL_FILE_ERROR;
 }
 
+#else
+
 #if !defined(_WIN32)
 static char *shell_quote(const char *s)
 {
@@ -336,32 +1709,21 @@ static char *shell_quote(const char *s)
 
 #endif
 
-icalerrorenum icalfileset_commit(icalset *set)
+static icalerrorenum icalfileset_write_file(icalfileset *fset)
 {
     char tmp[MAXPATHLEN];
-    char *str;
-    icalcomponent *c;
-    size_t write_size = 0;
-    icalfileset *fset = (icalfileset *) set;
+    off_t write_size;
 
 #if defined(_WIN32_WCE)
     wchar_t *wtmp = 0;
     PROCESS_INFORMATION pi;
 #endif
 
-    icalerror_check_arg_re((fset != 0), "set", ICAL_BADARG_ERROR);
-
-    icalerror_check_arg_re((fset->fd > 0), "set->fd is invalid", ICAL_INTERNAL_ERROR);
-
-    if (fset->changed == 0) {
-        return ICAL_NO_ERROR;
-    }
-
     if (fset->options.safe_saves == 1) {
 #if !defined(_WIN32)
         char *quoted_file = shell_quote(fset->path);
 
-        snprintf(tmp, MAXPATHLEN, "cp '%s' '%s.bak'", fset->path, fset->path);
+        snprintf(tmp, MAXPATHLEN, "cp '%s' '%s.bak'", quoted_file, quoted_file);
         free(quoted_file);
 #else
         snprintf(tmp, MAXPATHLEN, "copy %s %s.bak", fset->path, fset->path);
@@ -388,28 +1750,16 @@ icalerrorenum icalfileset_commit(icalset *set)
         return ICAL_FILE_ERROR;
     }
 
-    for (c = icalcomponent_get_first_component(fset->cluster, ICAL_ANY_COMPONENT);
-         c != 0; c = icalcomponent_get_next_component(fset->cluster, ICAL_ANY_COMPONENT)) {
-        IO_SSIZE_T sz;
-
-        str = icalcomponent_as_ical_string_r(c);
-
-        sz = write(fset->fd, str, (IO_SIZE_T) strlen(str));
-        if (sz != (IO_SSIZE_T) strlen(str)) {
-            perror("write");
-            icalerror_set_errno(ICAL_FILE_ERROR);
-            free(str);
-            return ICAL_FILE_ERROR;
-        }
-
-        free(str);
-        write_size += sz;
+    if ((write_size = icalfileset_write_components(fset, fset->fd)) < 0) {
+        perror("write");
+        icalerror_set_errno(ICAL_FILE_ERROR);
+        return ICAL_FILE_ERROR;
     }
 
     fset->changed = 0;
 
 #if !defined(_WIN32)
-    if (ftruncate(fset->fd, (off_t) write_size) < 0) {
+    if (ftruncate(fset->fd, write_size) < 0) {
         return ICAL_FILE_ERROR;
     }
 #else
@@ -423,11 +1773,73 @@ icalerrorenum icalfileset_commit(icalset *set)
     return ICAL_NO_ERROR;
 }
 
+#endif
+
+icalerrorenum icalfileset_commit(icalset *set)
+{
+    icalfileset *fset = (icalfileset *) set;
+    icalerrorenum error;
+
+    icalerror_check_arg_re((fset != 0), "set", ICAL_BADARG_ERROR);
+
+    icalerror_check_arg_re((fset->fd > 0), "set->fd is invalid", ICAL_INTERNAL_ERROR);
+
+    if (fset->changed == 0) {
+        return ICAL_NO_ERROR;
+    }
+
+    /* Append the changes to the journal, until it is large enough that
+       the whole file is better written */
+    if (fset->journal && !fset->rewrite && fset->base_size > 0 &&
+        icalfileset_append_journal(fset) == ICAL_NO_ERROR) {
+        fset->changed = 0;
+
+        if ((double)fset->journal_size <= fset->journal_ratio * (double)fset->base_size) {
+            return ICAL_NO_ERROR;
+        }
+        fset->changed = 1;
+    }
+
+    if ((error = icalfileset_write_file(fset)) != ICAL_NO_ERROR) {
+        return error;
+    }
+
+    icalfileset_drop_journal(fset);
+
+    return ICAL_NO_ERROR;
+}
+
 void icalfileset_mark(icalset *set)
 {
     icalerror_check_arg_rv((set != 0), "set");
 
+    /* What changed is not known, so the whole file is written */
     ((icalfileset *) set)->changed = 1;
+    ((icalfileset *) set)->rewrite = 1;
+}
+
+icalerrorenum icalfileset_mark_component(icalset *set, icalcomponent *comp)
+{
+    icalfileset *fset;
+    long position;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((comp != 0), "comp", ICAL_BADARG_ERROR);
+    fset = (icalfileset *) set;
+
+    if ((position = icalfileset_component_position(fset, comp)) < 0) {
+        icalerror_set_errno(ICAL_USAGE_ERROR);
+        return ICAL_USAGE_ERROR;
+    }
+
+    /* Move it to the end, where replaying the journal puts it */
+    icalfileset_move_to_end(fset, comp);
+
+    icalfileset_journal_remove(fset, position);
+    icalfileset_journal_add(fset, comp);
+    fset->changed = 1;
+
+    return ICAL_NO_ERROR;
 }
 
 icalcomponent *icalfileset_get_component(icalset *set)
@@ -450,13 +1862,47 @@ icalerrorenum icalfileset_add_component(icalset *set, icalcomponent *child)
     icalerror_check_arg_re((child != 0), "child", ICAL_BADARG_ERROR);
 
     fset = (icalfileset *) set;
-    icalcomponent_add_component(fset->cluster, child);
 
-    icalfileset_mark(set);
+    icalfileset_attach(fset, child);
+    icalfileset_journal_add(fset, child);
+    fset->changed = 1;
 
     return ICAL_NO_ERROR;
 }
 
+icalerrorenum icalfileset_add_components(icalset *set, icalcomponent **comps, size_t num_comps)
+{
+    icalfileset *fset;
+    icalerrorenum error = ICAL_NO_ERROR;
+    size_t i;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    icalerror_check_arg_re((comps != 0 || num_comps == 0), "comps", ICAL_BADARG_ERROR);
+
+    fset = (icalfileset *) set;
+
+    for (i = 0; i < num_comps; i++) {
+        if (comps[i] == 0) {
+            error = ICAL_BADARG_ERROR;
+            continue;
+        }
+
+        icalfileset_attach(fset, comps[i]);
+        icalfileset_journal_add(fset, comps[i]);
+        comps[i] = 0;
+    }
+
+    if (num_comps > 0) {
+        fset->changed = 1;
+    }
+
+    if (error != ICAL_NO_ERROR) {
+        icalerror_set_errno(error);
+    }
+
+    return error;
+}
+
 icalerrorenum icalfileset_remove_component(icalset *set, icalcomponent *child)
 {
     icalfileset *fset;
@@ -465,9 +1911,13 @@ icalerrorenum icalfileset_remove_component(icalset *set, icalcomponent *child)
     icalerror_check_arg_re((child != 0), "child", ICAL_BADARG_ERROR);
 
     fset = (icalfileset *) set;
-    icalcomponent_remove_component(fset->cluster, child);
 
-    icalfileset_mark(set);
+    if (fset->journal && !fset->rewrite) {
+        icalfileset_journal_remove(fset, icalfileset_component_position(fset, child));
+    }
+
+    icalfileset_detach(fset, child);
+    fset->changed = 1;
 
     return ICAL_NO_ERROR;
 }
@@ -505,6 +1955,36 @@ void icalfileset_clear(icalset *set)
 
     fset = (icalfileset *) set;
     fset->gauge = 0;
+
+    if (fset->candidates != 0) {
+        icalarray_free(fset->candidates);
+        fset->candidates = 0;
+    }
+}
+
+icalerrorenum icalfileset_set_time_index(icalset *set, int enable)
+{
+    icalfileset *fset;
+
+    icalerror_check_arg_re((set != 0), "set", ICAL_BADARG_ERROR);
+    fset = (icalfileset *) set;
+
+    if (enable && fset->time_index == 0 && fset->cluster != 0) {
+        fset->time_index = icaltimeindex_new(fset->cluster);
+        if (fset->time_index == 0) {
+            return icalerrno;
+        }
+    } else if (!enable && fset->time_index != 0) {
+        icaltimeindex_free(fset->time_index);
+        fset->time_index = 0;
+
+        if (fset->candidates != 0) {
+            icalarray_free(fset->candidates);
+            fset->candidates = 0;
+        }
+    }
+
+    return ICAL_NO_ERROR;
 }
 
 icalcomponent *icalfileset_fetch(icalset *set, icalcomponent_kind kind, const char *uid)
@@ -682,9 +2162,34 @@ icalcomponent *icalfileset_get_current_component(icalset *set)
     icalerror_check_arg_rz((set != 0), "set");
 
     fset = (icalfileset *) set;
+
+    if (fset->candidates != 0) {
+        if (fset->candidate == 0 || fset->candidate > fset->candidates->num_elements) {
+            return 0;
+        }
+        return *(icalcomponent **)icalarray_element_at(fset->candidates, fset->candidate - 1);
+    }
+
     return icalcomponent_get_current_component(fset->cluster);
 }
 
+/* Return the next candidate from the time index that passes the gauge */
+static icalcomponent *icalfileset_next_candidate(icalfileset *fset)
+{
+    while (fset->candidate < fset->candidates->num_elements) {
+        icalcomponent *c =
+            *(icalcomponent **)icalarray_element_at(fset->candidates, fset->candidate);
+
+        fset->candidate++;
+
+        if (c != 0 && (fset->gauge == 0 || icalgauge_compare(fset->gauge, c) == 1)) {
+            return c;
+        }
+    }
+
+    return 0;
+}
+
 icalcomponent *icalfileset_get_first_component(icalset *set)
 {
     icalcomponent *c = 0;
@@ -693,6 +2198,25 @@ icalcomponent *icalfileset_get_first_component(icalset *set)
     icalerror_check_arg_rz((set != 0), "set");
     fset = (icalfileset *) set;
 
+    if (fset->candidates != 0) {
+        icalarray_free(fset->candidates);
+        fset->candidates = 0;
+    }
+
+    if (fset->time_index != 0 && fset->gauge != 0) {
+        time_t start, end;
+
+        if (icaltimeindex_get_gauge_range(fset->gauge, &start, &end)) {
+            fset->candidates = icalarray_new(sizeof(icalcomponent *), 64);
+            fset->candidate = 0;
+
+            if (fset->candidates != 0) {
+                (void)icaltimeindex_select(fset->time_index, start, end, fset->candidates);
+                return icalfileset_next_candidate(fset);
+            }
+        }
+    }
+
     do {
         if (c == 0) {
             c = icalcomponent_get_first_component(fset->cluster, ICAL_ANY_COMPONENT);
@@ -717,6 +2241,10 @@ icalcomponent *icalfileset_get_next_component(icalset *set)
     icalerror_check_arg_rz((set != 0), "set");
     fset = (icalfileset *) set;
 
+    if (fset->candidates != 0) {
+        return icalfileset_next_candidate(fset);
+    }
+
     do {
         c = icalcomponent_get_next_component(fset->cluster, ICAL_ANY_COMPONENT);
 
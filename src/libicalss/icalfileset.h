@@ -34,6 +34,16 @@ LIBICAL_ICALSS_EXPORT icalset *icalfileset_new_reader(const char *path);
 
 LIBICAL_ICALSS_EXPORT icalset *icalfileset_new_writer(const char *path);
 
+/**
+ * Open the file read only as a snapshot: the set reads the version of
+ * the file committed when it is opened, or refreshed with
+ * icalfileset_refresh(), without holding a lock on it. Readers of
+ * snapshots neither block nor are blocked by a writer, which publishes
+ * its next version by renaming it over the file. Where commits cannot
+ * rename, a snapshot is opened like any other read only set.
+ */
+LIBICAL_ICALSS_EXPORT icalset *icalfileset_new_snapshot(const char *path);
+
 LIBICAL_ICALSS_EXPORT icalset *icalfileset_init(icalset *set, const char *dsn, void *options);
 
 LIBICAL_ICALSS_EXPORT icalcluster *icalfileset_produce_icalcluster(const char *path);
@@ -46,10 +56,49 @@ LIBICAL_ICALSS_EXPORT const char *icalfileset_path(icalset *cluster);
    is freed. Commit writes to disk immediately. */
 LIBICAL_ICALSS_EXPORT void icalfileset_mark(icalset *set);
 
+/* Mark comp, a component of the set changed in place, as changed. In
+   journal mode only comp is written by the next commit, rather than the
+   whole file. comp moves to the end of the set. */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_mark_component(icalset *set,
+                                                               icalcomponent *comp);
+
 LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_commit(icalset *set);
 
+/**
+ * Commit by appending the components added, removed or marked with
+ * icalfileset_mark_component() to a journal kept next to the file,
+ * rather than writing the whole file, or stop doing so. Once the journal
+ * grows past compact_ratio times the size of the file (1.0 if 0 is
+ * given), the next commit writes the whole file and drops the journal.
+ * Changes marked with icalfileset_mark() are also written by writing the
+ * whole file. A journal left by another set is replayed when the file is
+ * loaded, in journal mode or not.
+ */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_set_journal(icalset *set, int enable,
+                                                            double compact_ratio);
+
+/** Write the whole file and drop the journal */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_compact(icalset *set);
+
+/**
+ * Bring the set up to date with its file after another process changed
+ * it. Records appended to the journal since the set last read it are
+ * replayed. A file that was written again is reloaded, keeping the
+ * components whose text did not change, so pointers to them stay valid;
+ * those that changed or went away are freed. Does nothing if neither
+ * the file nor its journal changed. It is an error to refresh a set with
+ * changes that are not committed.
+ */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_refresh(icalset *set);
+
 LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_add_component(icalset *set, icalcomponent *child);
 
+/** Add num_comps components at once, leaving out any null ones and
+    setting the entries of the others to 0 */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_add_components(icalset *set,
+                                                               icalcomponent **comps,
+                                                               size_t num_comps);
+
 LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_remove_component(icalset *set,
                                                                  icalcomponent *child);
 
@@ -64,6 +113,15 @@ LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_select(icalset *set, icalgauge *
 /** clear the gauge **/
 LIBICAL_ICALSS_EXPORT void icalfileset_clear(icalset *set);
 
+/**
+ * Keep an index of the times of the components, or drop it. While there
+ * is one, icalfileset_get_first_component() and _next only look at the
+ * components whose times may pass a gauge that restricts DTSTART or
+ * DTEND, and return them in order of their start. The index is kept up
+ * to date as components are added, removed or changed.
+ */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalfileset_set_time_index(icalset *set, int enable);
+
 /** Get and search for a component by uid **/
 LIBICAL_ICALSS_EXPORT icalcomponent *icalfileset_fetch(icalset *set,
                                                        icalcomponent_kind kind, const char *uid);
@@ -116,6 +174,8 @@ typedef struct icalfileset_options
     int mode;                 /**< file mode */
     int safe_saves;           /**< to lock or not */
     icalcluster *cluster;     /**< use this cluster to initialize data */
+    int snapshot;             /**< read only sets: read without a lock, see
+                                   icalfileset_new_snapshot() */
 } icalfileset_options;
 
 extern icalfileset_options icalfileset_options_default;
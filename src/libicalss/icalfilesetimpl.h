@@ -24,6 +24,15 @@
 #define ICALFILESETIMPL_H
 
 #include "icalfileset.h"
+#include "icaltimeindex.h"
+
+/** The journal of a fileset is kept in a file named after the fileset's,
+    with this suffix */
+#define ICALFILESET_JOURNAL_SUFFIX ".journal"
+
+/** A commit writes the new file under a temporary name made of the
+    fileset's, this and a unique suffix, then renames it */
+#define ICALFILESET_TEMP_INFIX ".commit-"
 
 struct icalfileset_impl
 {
@@ -35,6 +44,31 @@ struct icalfileset_impl
     icalgauge *gauge;           /**< gauge for filtering out data */
     int changed;                /**< boolean flag, 1 if data has changed */
     int fd;                     /**< file descriptor */
+
+    icaltimeindex *time_index;  /**< index of the times of the components, or 0 */
+    icalarray *candidates;      /**< components the iteration visits, from time_index */
+    size_t candidate;           /**< position in candidates of the next component */
+
+    int journal;                /**< boolean flag, 1 to commit by appending to the journal */
+    double journal_ratio;       /**< compact once the journal is this times the file's size */
+    int rewrite;                /**< boolean flag, 1 if not all changes have journal records */
+    char *records;              /**< journal records of the changes not yet committed */
+    char *records_pos;
+    size_t records_size;
+    int journal_fd;             /**< journal open for appending, or -1 */
+    off_t journal_size;         /**< length of the journal's valid records, 0 if none */
+    off_t base_size;            /**< size and modification time of the file the... */
+    time_t base_mtime;          /**< ...journal applies to */
+    ino_t base_ino;             /**< identity of the file last read, to tell when */
+    dev_t base_dev;             /**< another one is renamed over it */
+    struct icalfileset_posmap *positions; /**< positions of the components, or 0 */
 };
 
+/* Append comps to the file at path without reading it, as icaldirset
+   does to clusters it has not loaded. Writes nothing and returns
+   ICAL_USAGE_ERROR if the file has a journal, which appending would
+   make stale. */
+icalerrorenum icalfileset_append_components(const char *path, int mode,
+                                            icalcomponent **comps, size_t num_comps);
+
 #endif
@@ -29,17 +29,67 @@
 #include "icalerror.h"
 #include "icalvalue.h"
 
+#include "icalssyacc.h"
+
 #include <stdlib.h>
+#include <string.h>
 
-extern int ssparse(void);
-extern char *input_buffer;
-extern char *input_buffer_p;
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif
 
-struct icalgauge_impl *icalss_yy_gauge;
+/** Number of gauges icalgauge_new_from_sql() keeps for reuse */
+#define ICALGAUGE_CACHE_SIZE 32
 
-icalgauge *icalgauge_new_from_sql(const char *sql, int expand)
+struct icalgauge_cache_entry
+{
+    char *sql;
+    int expand;
+    unsigned int hash;
+    unsigned long last_used;
+    icalgauge *gauge;           /**< Holds one reference */
+};
+
+static struct icalgauge_cache_entry gauge_cache[ICALGAUGE_CACHE_SIZE];
+static unsigned long gauge_cache_clock = 0;
+
+#if defined(HAVE_PTHREAD)
+/* Guards gauge_cache and the reference counts of all gauges */
+static pthread_mutex_t gauge_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int icalgauge_compile(icalgauge *gauge);
+static void icalgauge_destroy(icalgauge *gauge);
+
+static void icalgauge_cache_lock(void)
+{
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_lock(&gauge_cache_mutex);
+#endif
+}
+
+static void icalgauge_cache_unlock(void)
+{
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_unlock(&gauge_cache_mutex);
+#endif
+}
+
+static unsigned int icalgauge_hash_sql(const char *sql)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; *sql != '\0'; sql++) {
+        hash = (hash ^ (unsigned char)*sql) * 16777619U;
+    }
+
+    return hash;
+}
+
+static icalgauge *icalgauge_parse(const char *sql, int expand)
 {
     struct icalgauge_impl *impl;
+    struct icalss_scanner scanner;
     int r;
 
     if ((impl = (struct icalgauge_impl *)malloc(sizeof(struct icalgauge_impl))) == 0) {
@@ -51,26 +101,147 @@ icalgauge *icalgauge_new_from_sql(const char *sql, int expand)
     impl->from = pvl_newlist();
     impl->where = pvl_newlist();
     impl->expand = expand;
+    impl->from_mask = 0;
+    impl->clauses = 0;
+    impl->num_clauses = 0;
+    impl->refcount = 1;
 
-    icalss_yy_gauge = impl;
-    input_buffer = input_buffer_p = (char *)sql;
+    scanner.p = sql;
+    scanner.gauge = impl;
 
-    r = ssparse();
+    r = ssparse(&scanner);
 
-    if (r == 0) {
+    if (r == 0 && icalgauge_compile(impl) == 0) {
         return impl;
     } else {
-        icalgauge_free(impl);
+        icalgauge_destroy(impl);
         return NULL;
     }
 }
 
+icalgauge *icalgauge_new_from_sql(const char *sql, int expand)
+{
+    icalgauge *gauge;
+    icalgauge *evicted = 0;
+    struct icalgauge_cache_entry *entry;
+    unsigned int hash;
+    int i;
+
+    icalerror_check_arg_rz((sql != 0), "sql");
+
+    hash = icalgauge_hash_sql(sql);
+
+    icalgauge_cache_lock();
+    for (i = 0; i < ICALGAUGE_CACHE_SIZE; i++) {
+        entry = &gauge_cache[i];
+        if (entry->gauge != 0 && entry->hash == hash && entry->expand == expand &&
+            strcmp(entry->sql, sql) == 0) {
+            entry->last_used = ++gauge_cache_clock;
+            gauge = entry->gauge;
+            gauge->refcount++;
+            icalgauge_cache_unlock();
+            return gauge;
+        }
+    }
+    icalgauge_cache_unlock();
+
+    /* Parse outside the lock; if another thread adds the same query
+       meanwhile, the cache just holds it twice until one is evicted */
+    gauge = icalgauge_parse(sql, expand);
+    if (gauge == 0) {
+        return 0;
+    }
+
+    icalgauge_cache_lock();
+    entry = &gauge_cache[0];
+    for (i = 1; i < ICALGAUGE_CACHE_SIZE && entry->gauge != 0; i++) {
+        if (gauge_cache[i].gauge == 0 || gauge_cache[i].last_used < entry->last_used) {
+            entry = &gauge_cache[i];
+        }
+    }
+
+    if (entry->gauge != 0) {
+        if (--entry->gauge->refcount == 0) {
+            evicted = entry->gauge;
+        }
+        free(entry->sql);
+        entry->gauge = 0;
+        entry->sql = 0;
+    }
+
+    if ((entry->sql = strdup(sql)) != 0) {
+        entry->expand = expand;
+        entry->hash = hash;
+        entry->last_used = ++gauge_cache_clock;
+        entry->gauge = gauge;
+        gauge->refcount++;
+    }
+    icalgauge_cache_unlock();
+
+    if (evicted != 0) {
+        icalgauge_destroy(evicted);
+    }
+
+    return gauge;
+}
+
+void icalgauge_free_cache(void)
+{
+    icalgauge *gauges[ICALGAUGE_CACHE_SIZE];
+    int i, n = 0;
+
+    icalgauge_cache_lock();
+    for (i = 0; i < ICALGAUGE_CACHE_SIZE; i++) {
+        struct icalgauge_cache_entry *entry = &gauge_cache[i];
+
+        if (entry->gauge != 0) {
+            if (--entry->gauge->refcount == 0) {
+                gauges[n++] = entry->gauge;
+            }
+            free(entry->sql);
+            entry->sql = 0;
+            entry->gauge = 0;
+        }
+    }
+    icalgauge_cache_unlock();
+
+    for (i = 0; i < n; i++) {
+        icalgauge_destroy(gauges[i]);
+    }
+}
+
 int icalgauge_get_expand(icalgauge *gauge)
 {
     return (gauge->expand);
 }
 
+icalgauge *icalgauge_ref(icalgauge *gauge)
+{
+    icalerror_check_arg_rz((gauge != 0), "gauge");
+
+    icalgauge_cache_lock();
+    gauge->refcount++;
+    icalgauge_cache_unlock();
+
+    return gauge;
+}
+
 void icalgauge_free(icalgauge *gauge)
+{
+    int refcount;
+
+    icalerror_check_arg_rv((gauge != 0), "gauge");
+
+    icalgauge_cache_lock();
+    refcount = --gauge->refcount;
+    icalgauge_cache_unlock();
+
+    if (refcount == 0) {
+        icalgauge_destroy(gauge);
+    }
+}
+
+static void icalgauge_destroy(icalgauge *gauge)
 {
     struct icalgauge_where *w;
 
@@ -106,9 +277,118 @@ void icalgauge_free(icalgauge *gauge)
         gauge->from = 0;
     }
 
+    if (gauge->clauses) {
+        int i;
+
+        for (i = 0; i < gauge->num_clauses; i++) {
+            if (gauge->clauses[i].value != 0) {
+                icalvalue_free(gauge->clauses[i].value);
+            }
+        }
+        free(gauge->clauses);
+        gauge->clauses = 0;
+    }
+
     free(gauge);
 }
 
+#define ICALGAUGE_RESULT_BIT(r) \
+    (((int)(r) >= (int)ICAL_XLICCOMPARETYPE_X && \
+      (int)(r) <= (int)ICAL_XLICCOMPARETYPE_ISNOTNULL) ? \
+     (1U << ((int)(r) - (int)ICAL_XLICCOMPARETYPE_X)) : 0U)
+
+/* Turns the FROM list into a bitmask, and parses the literal and works out
+   which comparison results pass for each WHERE clause, so that none of
+   that is repeated for every component tested. Clauses that cannot be
+   used record the error icalgauge_compare() would have raised. */
+static int icalgauge_compile(icalgauge *gauge)
+{
+    pvl_elem e;
+    int i;
+    icalerrorstate saved_states[ICAL_UNKNOWN_ERROR];
+    icalerrorenum saved_errno = icalerrno;
+
+    for (e = pvl_head(gauge->from); e != 0; e = pvl_next(e)) {
+        icalcomponent_kind k = (icalcomponent_kind) pvl_data(e);
+
+        if ((unsigned int)k >= sizeof(gauge->from_mask) * 8) {
+            icalerror_set_errno(ICAL_INTERNAL_ERROR);
+            return -1;
+        }
+        gauge->from_mask |= 1UL << k;
+    }
+
+    gauge->num_clauses = pvl_count(gauge->where);
+    gauge->clauses = calloc((size_t)gauge->num_clauses + 1, sizeof(struct icalgauge_clause));
+    if (gauge->clauses == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return -1;
+    }
+
+    /* Errors are raised when the clause is used, not here. Only this
+       thread's error states change, so other threads are left alone. */
+    for (i = ICAL_BADARG_ERROR; i < ICAL_UNKNOWN_ERROR; i++) {
+        saved_states[i] =
+            icalerror_set_thread_error_state((icalerrorenum)i, ICAL_ERROR_NONFATAL);
+    }
+
+    for (e = pvl_head(gauge->where), i = 0; e != 0; e = pvl_next(e), i++) {
+        struct icalgauge_where *w = pvl_data(e);
+        struct icalgauge_clause *c = &gauge->clauses[i];
+        icalvalue_kind vk;
+
+        c->error = ICAL_NO_ERROR;
+
+        if (!w || w->prop == ICAL_NO_PROPERTY || w->value == 0) {
+            c->error = ICAL_INTERNAL_ERROR;
+            continue;
+        }
+
+        c->logic = w->logic;
+        c->comp = w->comp;
+        c->prop = w->prop;
+        c->compare = w->compare;
+
+        vk = icalenum_property_kind_to_value_kind(w->prop);
+
+        if (vk == ICAL_NO_VALUE) {
+            c->error = ICAL_INTERNAL_ERROR;
+            continue;
+        }
+
+        if (w->compare == ICALGAUGECOMPARE_ISNULL || w->compare == ICALGAUGECOMPARE_ISNOTNULL) {
+            c->value = icalvalue_new(vk);
+        } else {
+            icalerror_clear_errno();
+            c->value = icalvalue_new_from_string(vk, w->value);
+        }
+
+        if (c->value == 0) {
+            c->error = (icalerrno != ICAL_NO_ERROR) ? icalerrno : ICAL_MALFORMEDDATA_ERROR;
+            continue;
+        }
+
+        c->accept = ICALGAUGE_RESULT_BIT(w->compare);
+        if (w->compare == ICALGAUGECOMPARE_LESSEQUAL) {
+            c->accept |= ICALGAUGE_RESULT_BIT(ICALGAUGECOMPARE_LESS) |
+                         ICALGAUGE_RESULT_BIT(ICALGAUGECOMPARE_EQUAL);
+        } else if (w->compare == ICALGAUGECOMPARE_GREATEREQUAL) {
+            c->accept |= ICALGAUGE_RESULT_BIT(ICALGAUGECOMPARE_GREATER) |
+                         ICALGAUGE_RESULT_BIT(ICALGAUGECOMPARE_EQUAL);
+        } else if (w->compare == ICALGAUGECOMPARE_NOTEQUAL) {
+            c->accept |= ICALGAUGE_RESULT_BIT(ICALGAUGECOMPARE_GREATER) |
+                         ICALGAUGE_RESULT_BIT(ICALGAUGECOMPARE_LESS);
+        }
+    }
+
+    for (i = ICAL_BADARG_ERROR; i < ICAL_UNKNOWN_ERROR; i++) {
+        (void)icalerror_set_thread_error_state((icalerrorenum)i, saved_states[i]);
+    }
+    icalerrno = saved_errno;
+
+    return 0;
+}
+
 /** Convert a VQUERY component into a gauge */
 icalcomponent *icalgauge_make_gauge(icalcomponent *query);
 
@@ -259,10 +539,10 @@ int icalgauge_compare(icalgauge *gauge, icalcomponent *comp)
     icalcomponent *inner;
     int local_pass = 0;
     int last_clause = 1, this_clause = 1;
-    pvl_elem e;
     icalcomponent_kind kind;
     icalproperty *rrule;
     int compare_recur = 0;
+    int i;
 
     icalerror_check_arg_rz((comp != 0), "comp");
     icalerror_check_arg_rz((gauge != 0), "gauge");
@@ -287,48 +567,18 @@ int icalgauge_compare(icalgauge *gauge, icalcomponent *comp)
     }
 
     /* Check that this component is one of the FROM types */
-    local_pass = 0;
-    for (e = pvl_head(gauge->from); e != 0; e = pvl_next(e)) {
-        icalcomponent_kind k = (icalcomponent_kind) pvl_data(e);
-
-        if (k == icalcomponent_isa(inner)) {
-            local_pass = 1;
-        }
-    }
-
-    if (local_pass == 0) {
+    if ((gauge->from_mask & (1UL << icalcomponent_isa(inner))) == 0) {
         return 0;
     }
 
     /**** Check each where clause against the component ****/
-    for (e = pvl_head(gauge->where); e != 0; e = pvl_next(e)) {
-        struct icalgauge_where *w = pvl_data(e);
+    for (i = 0; i < gauge->num_clauses; i++) {
+        const struct icalgauge_clause *w = &gauge->clauses[i];
         icalcomponent *sub_comp;
-        icalvalue *v;
         icalproperty *prop;
-        icalvalue_kind vk;
-
-        if (!w || w->prop == ICAL_NO_PROPERTY || w->value == 0) {
-            icalerror_set_errno(ICAL_INTERNAL_ERROR);
-            return 0;
-        }
-
-        /* First, create a value from the gauge */
-        vk = icalenum_property_kind_to_value_kind(w->prop);
-
-        if (vk == ICAL_NO_VALUE) {
-            icalerror_set_errno(ICAL_INTERNAL_ERROR);
-            return 0;
-        }
-
-        if (w->compare == ICALGAUGECOMPARE_ISNULL || w->compare == ICALGAUGECOMPARE_ISNOTNULL) {
-            v = icalvalue_new(vk);
-        } else {
-            v = icalvalue_new_from_string(vk, w->value);
-        }
 
-        if (v == 0) {
-            /* Keep error set by icalvalue_from-string */
+        if (w->error != ICAL_NO_ERROR) {
+            icalerror_set_errno(w->error);
             return 0;
         }
 
@@ -340,23 +590,29 @@ int icalgauge_compare(icalgauge *gauge, icalcomponent *comp)
         } else {
             sub_comp = icalcomponent_get_first_component(inner, w->comp);
             if (sub_comp == 0) {
-                icalvalue_free(v);
                 return 0;
             }
         }
 
         /* check if it is a recurring */
-        rrule = icalcomponent_get_first_property(sub_comp, ICAL_RRULE_PROPERTY);
-
-        if (gauge->expand && rrule) {
+        if (gauge->expand &&
+            (w->prop == ICAL_DTSTART_PROPERTY ||
+             w->prop == ICAL_DTEND_PROPERTY || w->prop == ICAL_DUE_PROPERTY)) {
+            rrule = icalcomponent_get_first_property(sub_comp, ICAL_RRULE_PROPERTY);
 
-            if (w->prop == ICAL_DTSTART_PROPERTY ||
-                w->prop == ICAL_DTEND_PROPERTY || w->prop == ICAL_DUE_PROPERTY) {
+            if (rrule) {
                 /** needs to use recurrence-id to do comparison */
                 compare_recur = 1;
             }
         }
 
+        /* The result of a clause that cannot change the outcome is not
+           needed */
+        if ((w->logic == ICALGAUGELOGIC_AND && !last_clause) ||
+            (w->logic == ICALGAUGELOGIC_OR && last_clause)) {
+            continue;
+        }
+
         local_pass = (w->compare == ICALGAUGECOMPARE_ISNULL) ? 1 : 0;
 
         for (prop = icalcomponent_get_first_property(sub_comp, w->prop);
@@ -384,20 +640,9 @@ int icalgauge_compare(icalgauge *gauge, icalcomponent *comp)
             }
 
             /* coverity[mixed_enums] */
-            relation = (icalgaugecompare) icalvalue_compare(prop_value, v);
+            relation = (icalgaugecompare) icalvalue_compare(prop_value, w->value);
 
-            if (relation == w->compare) {
-                local_pass++;
-            } else if (w->compare == ICALGAUGECOMPARE_LESSEQUAL &&
-                       (relation == ICALGAUGECOMPARE_LESS || relation == ICALGAUGECOMPARE_EQUAL)) {
-                local_pass++;
-            } else if (w->compare == ICALGAUGECOMPARE_GREATEREQUAL &&
-                       (relation == ICALGAUGECOMPARE_GREATER ||
-                        relation == ICALGAUGECOMPARE_EQUAL)) {
-                local_pass++;
-            } else if (w->compare == ICALGAUGECOMPARE_NOTEQUAL &&
-                       (relation == ICALGAUGECOMPARE_GREATER ||
-                        relation == ICALGAUGECOMPARE_LESS)) {
+            if (w->accept & ICALGAUGE_RESULT_BIT(relation)) {
                 local_pass++;
             } else {
                 local_pass = 0;
@@ -417,8 +662,6 @@ int icalgauge_compare(icalgauge *gauge, icalcomponent *comp)
             last_clause = this_clause;
         }
 
-        icalvalue_free(v);
-
     }/**** check next one in where clause ****/
 
     return last_clause;
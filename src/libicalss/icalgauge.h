@@ -32,12 +32,33 @@
 
 typedef struct icalgauge_impl icalgauge;
 
+/** @brief Build a gauge from an SQL query
+ *
+ * May be called from several threads at once. The most recently used
+ * gauges are cached by their query text and expand flag, and asking for
+ * one of those again returns it without parsing; gauges are not changed
+ * once built, so sharing them is safe. Either way, free the result with
+ * icalgauge_free().
+ */
 LIBICAL_ICALSS_EXPORT icalgauge *icalgauge_new_from_sql(const char *sql, int expand);
 
 LIBICAL_ICALSS_EXPORT int icalgauge_get_expand(icalgauge *gauge);
 
 LIBICAL_ICALSS_EXPORT void icalgauge_free(icalgauge *gauge);
 
+/** @brief Take another reference to a gauge
+ *
+ * May be called from several threads at once. Returns gauge, which stays
+ * valid until each reference taken has been released with icalgauge_free().
+ */
+LIBICAL_ICALSS_EXPORT icalgauge *icalgauge_ref(icalgauge *gauge);
+
+/** @brief Empty the cache kept by icalgauge_new_from_sql()
+ *
+ * Gauges still held by callers stay valid until they are freed.
+ */
+LIBICAL_ICALSS_EXPORT void icalgauge_free_cache(void);
+
 LIBICAL_ICALSS_EXPORT void icalgauge_dump(icalgauge *gauge);
 
 /** @brief Return true if comp matches the gauge.
@@ -21,6 +21,7 @@
 #define ICALGAUGEIMPL_H
 
 #include "icalcomponent.h"
+#include "icalerror.h"
 
 typedef enum icalgaugecompare
 {
@@ -52,12 +53,31 @@ struct icalgauge_where
     char *value;
 };
 
+/** A WHERE clause compiled for testing components against */
+struct icalgauge_clause
+{
+    icalgaugelogic logic;
+    icalcomponent_kind comp;
+    icalproperty_kind prop;
+    icalgaugecompare compare;
+    unsigned int accept;      /**< Bit (r - ICAL_XLICCOMPARETYPE_X) is set for each result r
+                                   of icalvalue_compare() that passes the clause */
+    icalvalue *value;         /**< The literal, parsed once */
+    icalerrorenum error;      /**< If not ICAL_NO_ERROR, the clause fails with this error */
+};
+
 struct icalgauge_impl
 {
     pvl_list select;     /**< Of icalgaugecompare, using only prop and comp fields*/
     pvl_list from;       /**< List of component_kinds, as integers */
     pvl_list where;      /**< List of icalgaugecompare */
     int expand;
+
+    unsigned long from_mask;            /**< Bit k is set for each FROM kind k */
+    struct icalgauge_clause *clauses;   /**< The where list, compiled */
+    int num_clauses;
+
+    int refcount;        /**< Held by each caller of icalgauge_new_from_sql() and the cache */
 };
 
 #endif
@@ -0,0 +1,1305 @@
+/*======================================================================
+ FILE: icalinstances.c
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+ ======================================================================*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "icalinstances.h"
+#include "icalfileset.h"
+#include "icaltimeindex.h"
+#include "icaltimezone.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
+/** Number of components a worker claims from the job at a time */
+#define ICALINSTANCES_CHUNK 16
+
+/** Upper bound on the number of worker threads */
+#define ICALINSTANCES_MAX_THREADS 64
+
+/** An instance, plus what we need to order it deterministically */
+struct icalinstances_entry
+{
+    icalinstance instance;
+    size_t series;      /**< index of the component in the job */
+    size_t ordinal;     /**< position in the component's own expansion */
+};
+
+struct icalinstances_job
+{
+    icalcomponent **comps;
+    size_t num_comps;
+    struct icaltimetype start;
+    struct icaltimetype end;
+    size_t next;        /**< first component not yet claimed by a worker */
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_t mutex;
+#endif
+};
+
+/** Per-thread result buffer */
+struct icalinstances_worker
+{
+    struct icalinstances_job *job;
+    struct icalinstances_entry *entries;
+    size_t num_entries;
+    size_t space_allocated;
+    size_t series;      /**< component currently being expanded */
+    size_t ordinal;
+    int overrides;      /**< 1 if the component has a RECURRENCE-ID */
+    time_t recurrence_id;       /**< of the component, if it overrides */
+    int failed;
+};
+
+static int icalinstances_is_series(icalcomponent *comp)
+{
+    icalcomponent_kind kind = icalcomponent_isa(comp);
+
+    return (kind == ICAL_VEVENT_COMPONENT ||
+            kind == ICAL_VTODO_COMPONENT || kind == ICAL_VJOURNAL_COMPONENT);
+}
+
+/* Return 1 and set *rid to the RECURRENCE-ID of comp in UTC, if it has one */
+static int icalinstances_get_recurrence_id(icalcomponent *comp, time_t *rid)
+{
+    icalproperty *p = icalcomponent_get_first_property(comp, ICAL_RECURRENCEID_PROPERTY);
+    struct icaltimetype t;
+
+    if (p == 0) {
+        return 0;
+    }
+
+    t = icalproperty_get_recurrenceid(p);
+    if (icaltime_is_null_time(t)) {
+        return 0;
+    }
+
+    *rid = icaltime_as_timet_with_zone(t, t.zone ? t.zone : icaltimezone_get_utc_timezone());
+    return 1;
+}
+
+static int icalinstances_compare_entry(const void *a, const void *b)
+{
+    const struct icalinstances_entry *ea = (const struct icalinstances_entry *)a;
+    const struct icalinstances_entry *eb = (const struct icalinstances_entry *)b;
+
+    if (ea->instance.span.start != eb->instance.span.start) {
+        return (ea->instance.span.start < eb->instance.span.start) ? -1 : 1;
+    }
+    if (ea->instance.span.end != eb->instance.span.end) {
+        return (ea->instance.span.end < eb->instance.span.end) ? -1 : 1;
+    }
+    if (ea->series != eb->series) {
+        return (ea->series < eb->series) ? -1 : 1;
+    }
+    if (ea->ordinal != eb->ordinal) {
+        return (ea->ordinal < eb->ordinal) ? -1 : 1;
+    }
+    return 0;
+}
+
+static void icalinstances_callback(icalcomponent *comp, struct icaltime_span *span, void *data)
+{
+    struct icalinstances_worker *w = (struct icalinstances_worker *)data;
+    struct icalinstances_entry *e;
+
+    if (w->failed) {
+        return;
+    }
+
+    if (w->num_entries == w->space_allocated) {
+        size_t space = w->space_allocated ? 2 * w->space_allocated : 64;
+        struct icalinstances_entry *entries;
+
+        entries = (struct icalinstances_entry *)realloc(w->entries, space * sizeof(*entries));
+        if (!entries) {
+            w->failed = 1;
+            return;
+        }
+        w->entries = entries;
+        w->space_allocated = space;
+    }
+
+    e = &w->entries[w->num_entries++];
+    e->instance.comp = comp;
+    e->instance.span = *span;
+    e->instance.recurrence_id = w->overrides ? w->recurrence_id : span->start;
+    e->series = w->series;
+    e->ordinal = w->ordinal++;
+}
+
+/** Claim the next chunk of components, returning 0 once the job is done */
+static int icalinstances_claim(struct icalinstances_job *job, size_t *first, size_t *last)
+{
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_lock(&job->mutex);
+#endif
+    *first = job->next;
+    *last = job->next + ICALINSTANCES_CHUNK;
+    if (*last > job->num_comps) {
+        *last = job->num_comps;
+    }
+    job->next = *last;
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_unlock(&job->mutex);
+#endif
+
+    return (*first < *last);
+}
+
+static void *icalinstances_run_worker(void *data)
+{
+    struct icalinstances_worker *w = (struct icalinstances_worker *)data;
+    struct icalinstances_job *job = w->job;
+    size_t first, last;
+
+    while (!w->failed && icalinstances_claim(job, &first, &last)) {
+        for (w->series = first; w->series < last; w->series++) {
+            icalcomponent *comp = job->comps[w->series];
+
+            if (!icalinstances_is_series(comp)) {
+                continue;
+            }
+            w->ordinal = 0;
+            w->overrides = icalinstances_get_recurrence_id(comp, &w->recurrence_id);
+            icalcomponent_foreach_recurrence(comp, job->start, job->end,
+                                             icalinstances_callback, w);
+        }
+    }
+
+    /* Sort on the worker, so the merge below only has to interleave */
+    if (!w->failed && w->num_entries > 1) {
+        qsort(w->entries, w->num_entries, sizeof(struct icalinstances_entry),
+              icalinstances_compare_entry);
+    }
+
+    return NULL;
+}
+
+/** Make sure expanding on several threads does not race on lazily built
+    state that is shared between components. */
+static void icalinstances_prepare_shared_state(struct icalinstances_job *job)
+{
+    size_t i;
+    icalcomponent *c;
+
+    /* Loads the builtin timezones */
+    (void)icaltimezone_get_utc_timezone();
+
+    /* icalcomponent_get_timezone() sorts the timezones of the VCALENDAR on
+       first use, so do that now for every parent a TZID may be resolved in. */
+    for (i = 0; i < job->num_comps; i++) {
+        for (c = icalcomponent_get_parent(job->comps[i]); c != 0; c = icalcomponent_get_parent(c)) {
+            (void)icalcomponent_get_timezone(c, "");
+        }
+    }
+}
+
+/** Sift entry pos of a min-heap of worker indices down to its place */
+static void icalinstances_heap_down(struct icalinstances_worker *workers, size_t *pos,
+                                    int *heap, int heap_size, int i)
+{
+    for (;;) {
+        int smallest = i;
+        int l = 2 * i + 1, r = 2 * i + 2;
+
+        if (l < heap_size &&
+            icalinstances_compare_entry(&workers[heap[l]].entries[pos[heap[l]]],
+                                        &workers[heap[smallest]].entries[pos[heap[smallest]]]) < 0) {
+            smallest = l;
+        }
+        if (r < heap_size &&
+            icalinstances_compare_entry(&workers[heap[r]].entries[pos[heap[r]]],
+                                        &workers[heap[smallest]].entries[pos[heap[smallest]]]) < 0) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            return;
+        }
+        l = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = l;
+        i = smallest;
+    }
+}
+
+/** k-way merge of the sorted per-thread buffers into one icalarray */
+static icalarray *icalinstances_merge(struct icalinstances_worker *workers, int num_workers)
+{
+    icalarray *instances;
+    size_t total = 0;
+    size_t pos[ICALINSTANCES_MAX_THREADS];
+    int heap[ICALINSTANCES_MAX_THREADS];
+    int heap_size = 0;
+    int i;
+
+    for (i = 0; i < num_workers; i++) {
+        total += workers[i].num_entries;
+        pos[i] = 0;
+        if (workers[i].num_entries > 0) {
+            heap[heap_size++] = i;
+        }
+    }
+
+    instances = icalarray_new(sizeof(icalinstance), total > 0 ? total : 1);
+    if (!instances) {
+        return NULL;
+    }
+
+    for (i = heap_size / 2 - 1; i >= 0; i--) {
+        icalinstances_heap_down(workers, pos, heap, heap_size, i);
+    }
+
+    while (heap_size > 0) {
+        int w = heap[0];
+
+        icalarray_append(instances, &workers[w].entries[pos[w]].instance);
+
+        if (++pos[w] == workers[w].num_entries) {
+            heap[0] = heap[--heap_size];
+        }
+        icalinstances_heap_down(workers, pos, heap, heap_size, 0);
+    }
+
+    return instances;
+}
+
+icalarray *icalinstances_expand(icalcomponent **comps, size_t num_comps,
+                                struct icaltimetype start, struct icaltimetype end,
+                                int num_threads)
+{
+    struct icalinstances_job job;
+    struct icalinstances_worker *workers;
+    icalarray *instances = NULL;
+    int failed = 0;
+    int i;
+
+    icalerror_check_arg_rz((comps != 0 || num_comps == 0), "comps");
+
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > ICALINSTANCES_MAX_THREADS) {
+        num_threads = ICALINSTANCES_MAX_THREADS;
+    }
+#if !defined(HAVE_PTHREAD)
+    num_threads = 1;
+#endif
+    if ((size_t) num_threads > num_comps / ICALINSTANCES_CHUNK + 1) {
+        num_threads = (int)(num_comps / ICALINSTANCES_CHUNK + 1);
+    }
+
+    job.comps = comps;
+    job.num_comps = num_comps;
+    job.start = start;
+    job.end = end;
+    job.next = 0;
+
+    workers = (struct icalinstances_worker *)calloc((size_t) num_threads, sizeof(*workers));
+    if (!workers) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return NULL;
+    }
+    for (i = 0; i < num_threads; i++) {
+        workers[i].job = &job;
+    }
+
+#if defined(HAVE_PTHREAD)
+    pthread_mutex_init(&job.mutex, NULL);
+
+    if (num_threads > 1) {
+        pthread_t threads[ICALINSTANCES_MAX_THREADS];
+        int started;
+
+        icalinstances_prepare_shared_state(&job);
+
+        /* The calling thread is worker 0 */
+        for (started = 1; started < num_threads; started++) {
+            if (pthread_create(&threads[started], NULL, icalinstances_run_worker,
+                               &workers[started]) != 0) {
+                break;
+            }
+        }
+        (void)icalinstances_run_worker(&workers[0]);
+        for (i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    } else {
+        (void)icalinstances_run_worker(&workers[0]);
+    }
+
+    pthread_mutex_destroy(&job.mutex);
+#else
+    (void)icalinstances_run_worker(&workers[0]);
+#endif
+
+    for (i = 0; i < num_threads; i++) {
+        failed |= workers[i].failed;
+    }
+
+    if (!failed) {
+        instances = icalinstances_merge(workers, num_threads);
+    }
+    if (!instances) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        free(workers[i].entries);
+    }
+    free(workers);
+
+    return instances;
+}
+
+icalarray *icalinstances_expand_vcalendar(icalcomponent *vcalendar,
+                                          struct icaltimetype start,
+                                          struct icaltimetype end, int num_threads)
+{
+    icalcomponent **comps;
+    icalcomponent *c;
+    icalarray *instances;
+    size_t num_comps = 0;
+    int count;
+
+    icalerror_check_arg_rz((vcalendar != 0), "vcalendar");
+
+    count = icalcomponent_count_components(vcalendar, ICAL_ANY_COMPONENT);
+    comps = (icalcomponent **)malloc((count > 0 ? (size_t) count : 1) * sizeof(icalcomponent *));
+    if (!comps) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return NULL;
+    }
+
+    for (c = icalcomponent_get_first_component(vcalendar, ICAL_ANY_COMPONENT);
+         c != 0; c = icalcomponent_get_next_component(vcalendar, ICAL_ANY_COMPONENT)) {
+        if (icalinstances_is_series(c)) {
+            comps[num_comps++] = c;
+        }
+    }
+
+    instances = icalinstances_expand(comps, num_comps, start, end, num_threads);
+    free(comps);
+
+    return instances;
+}
+
+icalarray *icalinstances_expand_set(icalset *set,
+                                    struct icaltimetype start,
+                                    struct icaltimetype end, int num_threads)
+{
+    icalarray *comps;
+    icalcomponent **list;
+    icalcomponent *c, *inner;
+    icalarray *instances;
+    size_t i;
+
+    icalerror_check_arg_rz((set != 0), "set");
+
+    /* Other sets may free what the walk returned before it ends */
+    if (set->kind != ICAL_FILE_SET) {
+        icalerror_set_errno(ICAL_UNIMPLEMENTED_ERROR);
+        return NULL;
+    }
+
+    if ((comps = icalarray_new(sizeof(icalcomponent *), 1024)) == 0) {
+        return NULL;
+    }
+
+    /* Walking the set loads and filters it, which has to stay serial */
+    for (c = icalset_get_first_component(set); c != 0; c = icalset_get_next_component(set)) {
+        if (icalcomponent_isa(c) == ICAL_VCALENDAR_COMPONENT) {
+            for (inner = icalcomponent_get_first_component(c, ICAL_ANY_COMPONENT);
+                 inner != 0; inner = icalcomponent_get_next_component(c, ICAL_ANY_COMPONENT)) {
+                if (icalinstances_is_series(inner)) {
+                    icalarray_append(comps, &inner);
+                }
+            }
+        } else if (icalinstances_is_series(c)) {
+            icalarray_append(comps, &c);
+        }
+    }
+
+    list = (icalcomponent **)malloc((comps->num_elements > 0 ? comps->num_elements : 1) *
+                                    sizeof(icalcomponent *));
+    if (!list) {
+        icalarray_free(comps);
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return NULL;
+    }
+    for (i = 0; i < comps->num_elements; i++) {
+        list[i] = *(icalcomponent **)icalarray_element_at(comps, i);
+    }
+
+    instances = icalinstances_expand(list, comps->num_elements, start, end, num_threads);
+
+    free(list);
+    icalarray_free(comps);
+
+    return instances;
+}
+
+/***** Instance index *****/
+
+/** Number of buckets of the table of overriding instances */
+#define ICALINSTANCEINDEX_OVERRIDE_BUCKETS 256
+
+enum icalinstanceindex_state
+{
+    ICALINSTANCEINDEX_CURRENT,  /**< its instances in the index are up to date */
+    ICALINSTANCEINDEX_CHANGED,  /**< it is new or changed, and must be expanded */
+    ICALINSTANCEINDEX_GONE      /**< it is no longer a child of the parent */
+};
+
+/** The UID and RECURRENCE-ID of a component that overrides an instance */
+struct icalinstanceindex_override
+{
+    char *uid;
+    time_t recurrence_id;
+    struct icalinstanceindex_override *hash_next;
+    struct icalinstanceindex_override *series_next;
+};
+
+/** A child of the parent, with the components in it */
+struct icalinstanceindex_series
+{
+    icalcomponent *comp;
+    unsigned long revision;     /**< of comp when it was last expanded */
+    unsigned long epoch;        /**< the last sync that found comp in the parent */
+    unsigned long seq;          /**< orders the instances of series that start together */
+    enum icalinstanceindex_state state;
+    time_t start;               /**< the range of times of comp */
+    time_t end;
+    struct icalinstanceindex_override *overrides;
+    struct icalinstanceindex_series *hash_next;
+};
+
+struct icalinstanceindex_entry
+{
+    icalinstance instance;
+    struct icalinstanceindex_series *series;
+    int overrides;              /**< 1 if instance.comp has a RECURRENCE-ID */
+};
+
+struct icalinstanceindex_buffer
+{
+    struct icalinstanceindex_entry *entries;
+    size_t num_entries;
+    size_t space_allocated;
+    int failed;
+};
+
+struct icalinstanceindex_impl
+{
+    icalcomponent *parent;
+    unsigned long revision;     /**< of the parent when the index was last up to date */
+    int synced;
+    unsigned long epoch;
+    unsigned long next_seq;
+
+    /* The index holds the instances that start in [horizon_start, horizon_end) */
+    time_t horizon_start;
+    time_t horizon_end;
+    time_t max_duration;        /**< the longest instance any series may have */
+
+    struct icalinstanceindex_series **series_buckets;
+    size_t num_series_buckets;
+    size_t num_series;
+
+    struct icalinstanceindex_override *override_buckets[ICALINSTANCEINDEX_OVERRIDE_BUCKETS];
+    size_t num_overrides;
+
+    struct icalinstanceindex_buffer instances;  /**< sorted by icalinstanceindex_compare() */
+};
+
+/** The data of an icalcomponent_foreach_recurrence() callback */
+struct icalinstanceindex_expansion
+{
+    struct icalinstanceindex_buffer *buffer;
+    struct icalinstanceindex_series *series;
+    time_t start;               /**< keep the instances that start in [start, end) */
+    time_t end;
+    int overrides;
+    time_t recurrence_id;
+};
+
+static time_t icalinstanceindex_as_timet(struct icaltimetype t)
+{
+    return icaltime_as_timet_with_zone(t, t.zone ? t.zone : icaltimezone_get_utc_timezone());
+}
+
+static int icalinstanceindex_compare(const void *a, const void *b)
+{
+    const struct icalinstanceindex_entry *ea = (const struct icalinstanceindex_entry *)a;
+    const struct icalinstanceindex_entry *eb = (const struct icalinstanceindex_entry *)b;
+
+    if (ea->instance.span.start != eb->instance.span.start) {
+        return (ea->instance.span.start < eb->instance.span.start) ? -1 : 1;
+    }
+    if (ea->instance.span.end != eb->instance.span.end) {
+        return (ea->instance.span.end < eb->instance.span.end) ? -1 : 1;
+    }
+    if (ea->series->seq != eb->series->seq) {
+        return (ea->series->seq < eb->series->seq) ? -1 : 1;
+    }
+    if (ea->instance.comp != eb->instance.comp) {
+        return (ea->instance.comp < eb->instance.comp) ? -1 : 1;
+    }
+    return 0;
+}
+
+static void icalinstanceindex_append(struct icalinstanceindex_buffer *buffer,
+                                     const struct icalinstanceindex_entry *entry)
+{
+    if (buffer->failed) {
+        return;
+    }
+
+    if (buffer->num_entries == buffer->space_allocated) {
+        size_t space = buffer->space_allocated ? 2 * buffer->space_allocated : 64;
+        struct icalinstanceindex_entry *entries;
+
+        entries = (struct icalinstanceindex_entry *)realloc(buffer->entries,
+                                                            space * sizeof(*entries));
+        if (!entries) {
+            buffer->failed = 1;
+            return;
+        }
+        buffer->entries = entries;
+        buffer->space_allocated = space;
+    }
+
+    buffer->entries[buffer->num_entries++] = *entry;
+}
+
+static void icalinstanceindex_callback(icalcomponent *comp, struct icaltime_span *span,
+                                       void *data)
+{
+    struct icalinstanceindex_expansion *x = (struct icalinstanceindex_expansion *)data;
+    struct icalinstanceindex_entry e;
+
+    if (span->start < x->start || span->start >= x->end) {
+        return;
+    }
+
+    e.instance.comp = comp;
+    e.instance.span = *span;
+    e.instance.recurrence_id = x->overrides ? x->recurrence_id : span->start;
+    e.series = x->series;
+    e.overrides = x->overrides;
+
+    icalinstanceindex_append(x->buffer, &e);
+}
+
+/* Append the instances of a series that start in [start, end) */
+static void icalinstanceindex_expand_series(struct icalinstanceindex_series *series,
+                                            time_t start, time_t end,
+                                            struct icalinstanceindex_buffer *buffer)
+{
+    struct icalinstanceindex_expansion x;
+    struct icaltimetype window_start, window_end;
+    icalcompiter i;
+    icalcomponent *c;
+
+    if (start >= end || series->start >= end || series->end < start) {
+        return;
+    }
+
+    x.buffer = buffer;
+    x.series = series;
+    x.start = start;
+    x.end = end;
+
+    /* A second early, since an instance without duration that starts at
+       the start of the window does not overlap it */
+    window_start = icaltime_from_timet_with_zone(start - 1, 0, icaltimezone_get_utc_timezone());
+    window_end = icaltime_from_timet_with_zone(end, 0, icaltimezone_get_utc_timezone());
+
+    if (icalinstances_is_series(series->comp)) {
+        x.overrides = icalinstances_get_recurrence_id(series->comp, &x.recurrence_id);
+        icalcomponent_foreach_recurrence(series->comp, window_start, window_end,
+                                         icalinstanceindex_callback, &x);
+        return;
+    }
+
+    for (i = icalcomponent_begin_component(series->comp, ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+        if (icalinstances_is_series(c)) {
+            x.overrides = icalinstances_get_recurrence_id(c, &x.recurrence_id);
+            icalcomponent_foreach_recurrence(c, window_start, window_end,
+                                             icalinstanceindex_callback, &x);
+        }
+    }
+}
+
+/***** Overrides *****/
+
+static size_t icalinstanceindex_override_hash(const char *uid, time_t recurrence_id)
+{
+    size_t h = 2166136261U;
+
+    for (; *uid != '\0'; uid++) {
+        h = (h ^ (unsigned char)*uid) * 16777619U;
+    }
+    h ^= (size_t)recurrence_id;
+
+    return h % ICALINSTANCEINDEX_OVERRIDE_BUCKETS;
+}
+
+static int icalinstanceindex_is_overridden(icalinstanceindex *index,
+                                           const struct icalinstanceindex_entry *e)
+{
+    struct icalinstanceindex_override *o;
+    const char *uid;
+
+    if (index->num_overrides == 0 || e->overrides) {
+        return 0;
+    }
+
+    uid = icalcomponent_get_uid(e->instance.comp);
+    if (uid == 0) {
+        return 0;
+    }
+
+    for (o = index->override_buckets[icalinstanceindex_override_hash(uid,
+                                                                     e->instance.recurrence_id)];
+         o != 0; o = o->hash_next) {
+        if (o->recurrence_id == e->instance.recurrence_id && strcmp(o->uid, uid) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void icalinstanceindex_add_override(icalinstanceindex *index,
+                                           struct icalinstanceindex_series *series,
+                                           icalcomponent *comp)
+{
+    struct icalinstanceindex_override *o;
+    const char *uid = icalcomponent_get_uid(comp);
+    time_t recurrence_id;
+    size_t h;
+
+    if (uid == 0 || !icalinstances_get_recurrence_id(comp, &recurrence_id)) {
+        return;
+    }
+
+    if ((o = (struct icalinstanceindex_override *)malloc(sizeof(*o))) == 0) {
+        return;
+    }
+    if ((o->uid = strdup(uid)) == 0) {
+        free(o);
+        return;
+    }
+    o->recurrence_id = recurrence_id;
+
+    h = icalinstanceindex_override_hash(uid, recurrence_id);
+    o->hash_next = index->override_buckets[h];
+    index->override_buckets[h] = o;
+    o->series_next = series->overrides;
+    series->overrides = o;
+    index->num_overrides++;
+}
+
+static void icalinstanceindex_remove_overrides(icalinstanceindex *index,
+                                               struct icalinstanceindex_series *series)
+{
+    while (series->overrides != 0) {
+        struct icalinstanceindex_override *o = series->overrides;
+        struct icalinstanceindex_override **op =
+            &index->override_buckets[icalinstanceindex_override_hash(o->uid, o->recurrence_id)];
+
+        while (*op != o) {
+            op = &(*op)->hash_next;
+        }
+        *op = o->hash_next;
+
+        series->overrides = o->series_next;
+        index->num_overrides--;
+        free(o->uid);
+        free(o);
+    }
+}
+
+/* Note the longest instance and the override of a component of a series */
+static void icalinstanceindex_scan_component(icalinstanceindex *index,
+                                             struct icalinstanceindex_series *series,
+                                             icalcomponent *comp)
+{
+    struct icaltimetype dtstart = icalcomponent_get_dtstart(comp);
+    struct icaltimetype dtend = icalcomponent_get_dtend(comp);
+    time_t duration = 0;
+
+    if (!icaltime_is_null_time(dtstart) && !icaltime_is_null_time(dtend)) {
+        duration = icalinstanceindex_as_timet(dtend) - icalinstanceindex_as_timet(dtstart);
+    } else if (!icaltime_is_null_time(dtstart) && dtstart.is_date) {
+        duration = 24 * 60 * 60;
+    }
+    if (duration > index->max_duration) {
+        index->max_duration = duration;
+    }
+
+    icalinstanceindex_add_override(index, series, comp);
+}
+
+/* Note the range, the longest instance and the overrides of a series */
+static void icalinstanceindex_scan_series(icalinstanceindex *index,
+                                          struct icalinstanceindex_series *series)
+{
+    icalcompiter i;
+    icalcomponent *c;
+
+    icalinstanceindex_remove_overrides(index, series);
+    (void)icaltimeindex_get_component_range(series->comp, &series->start, &series->end);
+
+    if (icalinstances_is_series(series->comp)) {
+        icalinstanceindex_scan_component(index, series, series->comp);
+        return;
+    }
+
+    for (i = icalcomponent_begin_component(series->comp, ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+        if (icalinstances_is_series(c)) {
+            icalinstanceindex_scan_component(index, series, c);
+        }
+    }
+}
+
+/***** Series by component *****/
+
+static size_t icalinstanceindex_series_hash(icalinstanceindex *index, icalcomponent *comp)
+{
+    size_t h = (size_t)comp;
+
+    h ^= h >> 4;
+    h *= 2654435761U;
+    h ^= h >> 16;
+
+    return h & (index->num_series_buckets - 1);
+}
+
+static struct icalinstanceindex_series *icalinstanceindex_lookup(icalinstanceindex *index,
+                                                                 icalcomponent *comp)
+{
+    struct icalinstanceindex_series *series;
+
+    for (series = index->series_buckets[icalinstanceindex_series_hash(index, comp)];
+         series != 0; series = series->hash_next) {
+        if (series->comp == comp) {
+            return series;
+        }
+    }
+
+    return 0;
+}
+
+static void icalinstanceindex_grow(icalinstanceindex *index)
+{
+    struct icalinstanceindex_series **old_buckets = index->series_buckets;
+    size_t old_num_buckets = index->num_series_buckets;
+    size_t i;
+
+    index->num_series_buckets = old_num_buckets * 2;
+    index->series_buckets = (struct icalinstanceindex_series **)
+        calloc(index->num_series_buckets, sizeof(struct icalinstanceindex_series *));
+
+    if (index->series_buckets == 0) {
+        index->series_buckets = old_buckets;
+        index->num_series_buckets = old_num_buckets;
+        return;
+    }
+
+    for (i = 0; i < old_num_buckets; i++) {
+        struct icalinstanceindex_series *series, *next;
+
+        for (series = old_buckets[i]; series != 0; series = next) {
+            size_t h = icalinstanceindex_series_hash(index, series->comp);
+
+            next = series->hash_next;
+            series->hash_next = index->series_buckets[h];
+            index->series_buckets[h] = series;
+        }
+    }
+
+    free(old_buckets);
+}
+
+/***** Maintenance *****/
+
+/* Merge a buffer of new instances into the index */
+static void icalinstanceindex_merge(icalinstanceindex *index,
+                                    struct icalinstanceindex_buffer *added)
+{
+    struct icalinstanceindex_entry *merged;
+    size_t i = 0, j = 0, k = 0, total;
+
+    if (added->num_entries == 0) {
+        return;
+    }
+
+    qsort(added->entries, added->num_entries, sizeof(struct icalinstanceindex_entry),
+          icalinstanceindex_compare);
+
+    total = index->instances.num_entries + added->num_entries;
+    merged = (struct icalinstanceindex_entry *)malloc(total * sizeof(*merged));
+    if (merged == 0) {
+        added->failed = 1;
+        return;
+    }
+
+    while (i < index->instances.num_entries && j < added->num_entries) {
+        if (icalinstanceindex_compare(&added->entries[j], &index->instances.entries[i]) < 0) {
+            merged[k++] = added->entries[j++];
+        } else {
+            merged[k++] = index->instances.entries[i++];
+        }
+    }
+    while (i < index->instances.num_entries) {
+        merged[k++] = index->instances.entries[i++];
+    }
+    while (j < added->num_entries) {
+        merged[k++] = added->entries[j++];
+    }
+
+    free(index->instances.entries);
+    index->instances.entries = merged;
+    index->instances.num_entries = total;
+    index->instances.space_allocated = total;
+}
+
+/* Have the next sync expand every series again, after running out of
+   memory part way through an update */
+static void icalinstanceindex_invalidate(icalinstanceindex *index)
+{
+    size_t b;
+
+    for (b = 0; b < index->num_series_buckets; b++) {
+        struct icalinstanceindex_series *series;
+
+        for (series = index->series_buckets[b]; series != 0; series = series->hash_next) {
+            series->revision = 0;
+        }
+    }
+
+    index->instances.num_entries = 0;
+    index->synced = 0;
+    icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+}
+
+void icalinstanceindex_sync(icalinstanceindex *index)
+{
+    struct icalinstanceindex_buffer added = { 0, 0, 0, 0 };
+    icalcompiter i;
+    icalcomponent *c;
+    unsigned long revision;
+    int changed = 0;
+    size_t b, n, kept;
+
+    icalerror_check_arg_rv((index != 0), "index");
+
+    revision = icalcomponent_get_revision(index->parent);
+    if (index->synced && index->revision == revision) {
+        return;
+    }
+
+    index->epoch++;
+    index->synced = 1;
+
+    for (i = icalcomponent_begin_component(index->parent, ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+        struct icalinstanceindex_series *series = icalinstanceindex_lookup(index, c);
+
+        if (series == 0) {
+            if ((series = (struct icalinstanceindex_series *)malloc(sizeof(*series))) == 0) {
+                icalinstanceindex_invalidate(index);
+                return;
+            }
+            series->comp = c;
+            series->revision = 0;
+            series->seq = index->next_seq++;
+            series->overrides = 0;
+
+            if (index->num_series >= index->num_series_buckets) {
+                icalinstanceindex_grow(index);
+            }
+            b = icalinstanceindex_series_hash(index, c);
+            series->hash_next = index->series_buckets[b];
+            index->series_buckets[b] = series;
+            index->num_series++;
+        }
+
+        if (series->revision != icalcomponent_get_revision(c) || series->revision == 0) {
+            series->state = ICALINSTANCEINDEX_CHANGED;
+            changed = 1;
+        } else {
+            series->state = ICALINSTANCEINDEX_CURRENT;
+        }
+        series->epoch = index->epoch;
+    }
+
+    for (b = 0; b < index->num_series_buckets; b++) {
+        struct icalinstanceindex_series *series;
+
+        for (series = index->series_buckets[b]; series != 0; series = series->hash_next) {
+            if (series->epoch != index->epoch) {
+                series->state = ICALINSTANCEINDEX_GONE;
+                changed = 1;
+            }
+        }
+    }
+
+    if (changed) {
+        /* Drop the instances of the series that changed or are gone */
+        for (n = 0, kept = 0; n < index->instances.num_entries; n++) {
+            if (index->instances.entries[n].series->state == ICALINSTANCEINDEX_CURRENT) {
+                index->instances.entries[kept++] = index->instances.entries[n];
+            }
+        }
+        index->instances.num_entries = kept;
+
+        for (b = 0; b < index->num_series_buckets; b++) {
+            struct icalinstanceindex_series **sp = &index->series_buckets[b];
+
+            while (*sp != 0) {
+                struct icalinstanceindex_series *series = *sp;
+
+                if (series->state == ICALINSTANCEINDEX_GONE) {
+                    /* The component may have been freed; only the series
+                       is looked at */
+                    *sp = series->hash_next;
+                    icalinstanceindex_remove_overrides(index, series);
+                    index->num_series--;
+                    free(series);
+                    continue;
+                }
+
+                if (series->state == ICALINSTANCEINDEX_CHANGED) {
+                    icalinstanceindex_scan_series(index, series);
+                    icalinstanceindex_expand_series(series, index->horizon_start,
+                                                    index->horizon_end, &added);
+                    series->revision = icalcomponent_get_revision(series->comp);
+                    series->state = ICALINSTANCEINDEX_CURRENT;
+                }
+                sp = &series->hash_next;
+            }
+        }
+
+        if (!added.failed) {
+            icalinstanceindex_merge(index, &added);
+        }
+        free(added.entries);
+
+        if (added.failed) {
+            icalinstanceindex_invalidate(index);
+            return;
+        }
+    }
+
+    index->revision = revision;
+}
+
+/* Expand every series over [start, end) and add the instances */
+static void icalinstanceindex_expand_all(icalinstanceindex *index, time_t start, time_t end)
+{
+    struct icalinstanceindex_buffer added = { 0, 0, 0, 0 };
+    size_t b;
+
+    if (start >= end) {
+        return;
+    }
+
+    for (b = 0; b < index->num_series_buckets; b++) {
+        struct icalinstanceindex_series *series;
+
+        for (series = index->series_buckets[b]; series != 0; series = series->hash_next) {
+            icalinstanceindex_expand_series(series, start, end, &added);
+        }
+    }
+
+    if (!added.failed) {
+        icalinstanceindex_merge(index, &added);
+    }
+    free(added.entries);
+
+    if (added.failed) {
+        icalinstanceindex_invalidate(index);
+    }
+}
+
+static icalerrorenum icalinstanceindex_move_horizon(icalinstanceindex *index,
+                                                    time_t start, time_t end)
+{
+    time_t overlap_start, overlap_end;
+    size_t n, kept;
+
+    if (end < start) {
+        end = start;
+    }
+
+    /* Drop the instances that start outside the new horizon */
+    for (n = 0, kept = 0; n < index->instances.num_entries; n++) {
+        time_t t = index->instances.entries[n].instance.span.start;
+
+        if (t >= start && t < end) {
+            index->instances.entries[kept++] = index->instances.entries[n];
+        }
+    }
+    index->instances.num_entries = kept;
+
+    overlap_start = (start > index->horizon_start) ? start : index->horizon_start;
+    overlap_end = (end < index->horizon_end) ? end : index->horizon_end;
+
+    if (overlap_start >= overlap_end) {
+        icalinstanceindex_expand_all(index, start, end);
+    } else {
+        icalinstanceindex_expand_all(index, start, overlap_start);
+        icalinstanceindex_expand_all(index, overlap_end, end);
+    }
+
+    index->horizon_start = start;
+    index->horizon_end = end;
+
+    if (!index->synced) {
+        /* Ran out of memory; the next sync starts over */
+        return ICAL_NEWFAILED_ERROR;
+    }
+
+    return ICAL_NO_ERROR;
+}
+
+/***** Public interface *****/
+
+icalinstanceindex *icalinstanceindex_new(icalcomponent *parent,
+                                         struct icaltimetype start, struct icaltimetype end)
+{
+    icalinstanceindex *index;
+
+    icalerror_check_arg_rz((parent != 0), "parent");
+
+    if ((index = (icalinstanceindex *)calloc(1, sizeof(*index))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    index->parent = parent;
+    index->horizon_start = index->horizon_end = icalinstanceindex_as_timet(start);
+    index->num_series_buckets = 64;
+    index->series_buckets = (struct icalinstanceindex_series **)
+        calloc(index->num_series_buckets, sizeof(struct icalinstanceindex_series *));
+
+    if (index->series_buckets == 0) {
+        free(index);
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    icalinstanceindex_sync(index);
+    (void)icalinstanceindex_move_horizon(index, index->horizon_start,
+                                         icalinstanceindex_as_timet(end));
+
+    return index;
+}
+
+icalinstanceindex *icalinstanceindex_new_from_set(icalset *set,
+                                                  struct icaltimetype start,
+                                                  struct icaltimetype end)
+{
+    icalerror_check_arg_rz((set != 0), "set");
+
+    if (set->kind != ICAL_FILE_SET) {
+        icalerror_set_errno(ICAL_UNIMPLEMENTED_ERROR);
+        return 0;
+    }
+
+    return icalinstanceindex_new(icalfileset_get_component(set), start, end);
+}
+
+void icalinstanceindex_free(icalinstanceindex *index)
+{
+    size_t b;
+
+    icalerror_check_arg_rv((index != 0), "index");
+
+    for (b = 0; b < index->num_series_buckets; b++) {
+        struct icalinstanceindex_series *series, *next;
+
+        for (series = index->series_buckets[b]; series != 0; series = next) {
+            next = series->hash_next;
+            icalinstanceindex_remove_overrides(index, series);
+            free(series);
+        }
+    }
+
+    free(index->series_buckets);
+    free(index->instances.entries);
+    free(index);
+}
+
+icalerrorenum icalinstanceindex_set_horizon(icalinstanceindex *index,
+                                            struct icaltimetype start, struct icaltimetype end)
+{
+    icalerror_check_arg_re((index != 0), "index", ICAL_BADARG_ERROR);
+
+    icalinstanceindex_sync(index);
+
+    return icalinstanceindex_move_horizon(index, icalinstanceindex_as_timet(start),
+                                          icalinstanceindex_as_timet(end));
+}
+
+/* Bring the index up to date and make it cover the instances that may
+   overlap [start, end). Returns the position of the first of them. */
+static size_t icalinstanceindex_prepare(icalinstanceindex *index, time_t start, time_t end)
+{
+    time_t first;
+    size_t lo, hi;
+
+    icalinstanceindex_sync(index);
+
+    first = start - index->max_duration;
+    if (first < index->horizon_start || end > index->horizon_end) {
+        (void)icalinstanceindex_move_horizon(index,
+                                             first < index->horizon_start ?
+                                             first : index->horizon_start,
+                                             end > index->horizon_end ?
+                                             end : index->horizon_end);
+    }
+
+    lo = 0;
+    hi = index->instances.num_entries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (index->instances.entries[mid].instance.span.start < first) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static int icalinstanceindex_overlaps(const struct icaltime_span *span, time_t start, time_t end)
+{
+    return span->start < end && (span->end > start || span->start >= start);
+}
+
+icalarray *icalinstanceindex_select(icalinstanceindex *index,
+                                    struct icaltimetype start, struct icaltimetype end)
+{
+    icalarray *result;
+    time_t s, e;
+    size_t n;
+
+    icalerror_check_arg_rz((index != 0), "index");
+
+    s = icalinstanceindex_as_timet(start);
+    e = icalinstanceindex_as_timet(end);
+
+    if ((result = icalarray_new(sizeof(icalinstance), 64)) == 0) {
+        return 0;
+    }
+
+    for (n = icalinstanceindex_prepare(index, s, e);
+         n < index->instances.num_entries && index->instances.entries[n].instance.span.start < e;
+         n++) {
+        const struct icalinstanceindex_entry *entry = &index->instances.entries[n];
+
+        if (icalinstanceindex_overlaps(&entry->instance.span, s, e) &&
+            !icalinstanceindex_is_overridden(index, entry)) {
+            icalarray_append(result, &entry->instance);
+        }
+    }
+
+    return result;
+}
+
+icalarray *icalinstanceindex_get_busy(icalinstanceindex *index,
+                                      struct icaltimetype start, struct icaltimetype end)
+{
+    icalarray *result;
+    struct icaltime_span busy;
+    int have_busy = 0;
+    time_t s, e;
+    size_t n;
+
+    icalerror_check_arg_rz((index != 0), "index");
+
+    s = icalinstanceindex_as_timet(start);
+    e = icalinstanceindex_as_timet(end);
+
+    if ((result = icalarray_new(sizeof(struct icaltime_span), 64)) == 0) {
+        return 0;
+    }
+
+    busy.start = busy.end = 0;
+    busy.is_busy = 1;
+
+    for (n = icalinstanceindex_prepare(index, s, e);
+         n < index->instances.num_entries && index->instances.entries[n].instance.span.start < e;
+         n++) {
+        const struct icalinstanceindex_entry *entry = &index->instances.entries[n];
+        time_t t0 = entry->instance.span.start, t1 = entry->instance.span.end;
+
+        if (!entry->instance.span.is_busy || t1 <= s || t1 <= t0 ||
+            icalinstanceindex_is_overridden(index, entry)) {
+            continue;
+        }
+
+        if (t0 < s) {
+            t0 = s;
+        }
+        if (t1 > e) {
+            t1 = e;
+        }
+
+        /* The instances come in order of start, so each one either
+           extends the current busy span or starts the next one */
+        if (have_busy && t0 <= busy.end) {
+            if (t1 > busy.end) {
+                busy.end = t1;
+            }
+        } else {
+            if (have_busy) {
+                icalarray_append(result, &busy);
+            }
+            busy.start = t0;
+            busy.end = t1;
+            have_busy = 1;
+        }
+    }
+
+    if (have_busy) {
+        icalarray_append(result, &busy);
+    }
+
+    return result;
+}
+
+size_t icalinstanceindex_count(icalinstanceindex *index)
+{
+    icalerror_check_arg_rz((index != 0), "index");
+
+    icalinstanceindex_sync(index);
+
+    return index->instances.num_entries;
+}
@@ -0,0 +1,159 @@
+/*======================================================================
+ FILE: icalinstances.h
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+=========================================================================*/
+#ifndef ICALINSTANCES_H
+#define ICALINSTANCES_H
+
+#include "libical_icalss_export.h"
+#include "icalset.h"
+
+/** @file icalinstances.h
+ *  @brief Expansion of many recurring components into one time-sorted
+ *         list of instances, optionally on several threads
+ */
+
+/** One occurrence of a VEVENT, VTODO or VJOURNAL within a time window */
+typedef struct icalinstance
+{
+    icalcomponent *comp;        /**< the component the instance was expanded from */
+    struct icaltime_span span;  /**< start and end in UTC, and the busy flag */
+    time_t recurrence_id;       /**< the RECURRENCE-ID of the instance in UTC: the
+                                     RECURRENCE-ID property of a component that
+                                     overrides an instance, else span.start */
+} icalinstance;
+
+/** @brief Expand a list of components over a time window
+ *
+ *  @param comps        An array of VEVENT, VTODO or VJOURNAL components.
+ *                      Components of any other kind are skipped.
+ *  @param num_comps    The number of entries in comps
+ *  @param start        Ignore instances that end before this time
+ *  @param end          Ignore instances that start after this time
+ *  @param num_threads  The number of worker threads to expand on. Values
+ *                      less than 2 expand on the calling thread.
+ *
+ *  @return An icalarray of icalinstance, or NULL on error. The caller
+ *          must free it with icalarray_free().
+ *
+ *  Every component is expanded with icalcomponent_foreach_recurrence().
+ *  The instances are ordered by start time, then end time, then the
+ *  position of their component in comps, so the result does not depend
+ *  on num_threads. A component must not appear twice in comps, and
+ *  neither the components nor their parents may be modified while the
+ *  expansion runs.
+ */
+LIBICAL_ICALSS_EXPORT icalarray *icalinstances_expand(icalcomponent **comps, size_t num_comps,
+                                                      struct icaltimetype start,
+                                                      struct icaltimetype end, int num_threads);
+
+/** @brief Expand all VEVENT, VTODO and VJOURNAL children of a VCALENDAR */
+LIBICAL_ICALSS_EXPORT icalarray *icalinstances_expand_vcalendar(icalcomponent *vcalendar,
+                                                                struct icaltimetype start,
+                                                                struct icaltimetype end,
+                                                                int num_threads);
+
+/** @brief Expand all VEVENT, VTODO and VJOURNAL components of a set
+ *
+ *  The set is walked with icalset_get_first_component() and
+ *  icalset_get_next_component(), so a gauge selected on it applies.
+ *  Components that are VCALENDARs contribute their children.
+ *
+ *  Only file sets are supported, whose components stay in memory until
+ *  the expansion is done; other kinds of sets, such as directory sets
+ *  that free clusters as the walk moves on, set ICAL_UNIMPLEMENTED_ERROR
+ *  and return NULL.
+ */
+LIBICAL_ICALSS_EXPORT icalarray *icalinstances_expand_set(icalset *set,
+                                                          struct icaltimetype start,
+                                                          struct icaltimetype end,
+                                                          int num_threads);
+
+/** @brief An index of the instances of the children of a component
+ *
+ *  The index keeps the instances of the VEVENT, VTODO and VJOURNAL
+ *  children of a parent (or of the children of its VCALENDAR children)
+ *  that start within a horizon, sorted by start, so that a time range or
+ *  free/busy query is a scan of the index rather than an expansion of
+ *  every series. A series is expanded again only when it changes, which
+ *  is noticed from the revisions of the components, and the horizon is
+ *  extended as queries reach past it. An instance that is overridden by
+ *  a component with the same UID and RECURRENCE-ID is left out of the
+ *  results in favour of the override.
+ */
+typedef struct icalinstanceindex_impl icalinstanceindex;
+
+/** @brief Index the instances of the children of parent
+ *
+ *  @param parent  An XROOT or VCALENDAR, typically the component of an
+ *                 icalfileset. The index does not own it.
+ *  @param start   The start of the initial horizon
+ *  @param end     The end of the initial horizon. Instances that start
+ *                 from start up to but not including end are expanded.
+ */
+LIBICAL_ICALSS_EXPORT icalinstanceindex *icalinstanceindex_new(icalcomponent *parent,
+                                                               struct icaltimetype start,
+                                                               struct icaltimetype end);
+
+/** @brief Index the instances in a set
+ *
+ *  Only file sets are supported, whose components stay in memory; other
+ *  kinds of sets set ICAL_UNIMPLEMENTED_ERROR and return NULL.
+ */
+LIBICAL_ICALSS_EXPORT icalinstanceindex *icalinstanceindex_new_from_set(icalset *set,
+                                                                        struct icaltimetype start,
+                                                                        struct icaltimetype end);
+
+LIBICAL_ICALSS_EXPORT void icalinstanceindex_free(icalinstanceindex *index);
+
+/** @brief Re-expand the series that changed since the index was last used
+ *
+ *  The queries below do this themselves.
+ */
+LIBICAL_ICALSS_EXPORT void icalinstanceindex_sync(icalinstanceindex *index);
+
+/** @brief Move the horizon
+ *
+ *  Instances that start outside the new horizon are dropped, and the
+ *  series are expanded over the parts of it that are new.
+ */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalinstanceindex_set_horizon(icalinstanceindex *index,
+                                                                  struct icaltimetype start,
+                                                                  struct icaltimetype end);
+
+/** @brief Return the instances that overlap a window
+ *
+ *  @return An icalarray of icalinstance ordered by start time, or NULL on
+ *          error. The caller must free it with icalarray_free(). An
+ *          instance overlaps the window if it starts before end and
+ *          either ends after start or, having no duration, starts at or
+ *          after start. The horizon is extended to cover the window first.
+ */
+LIBICAL_ICALSS_EXPORT icalarray *icalinstanceindex_select(icalinstanceindex *index,
+                                                          struct icaltimetype start,
+                                                          struct icaltimetype end);
+
+/** @brief Return the busy time in a window
+ *
+ *  @return An icalarray of struct icaltime_span holding the busy
+ *          instances overlapping the window, clipped to it and merged
+ *          where they overlap or touch, in order. NULL on error.
+ */
+LIBICAL_ICALSS_EXPORT icalarray *icalinstanceindex_get_busy(icalinstanceindex *index,
+                                                            struct icaltimetype start,
+                                                            struct icaltimetype end);
+
+/** @brief Return the number of instances in the index */
+LIBICAL_ICALSS_EXPORT size_t icalinstanceindex_count(icalinstanceindex *index);
+
+#endif /* !ICALINSTANCES_H */
@@ -75,7 +75,8 @@ static icalset icalset_dirset_init = {
     icaldirset_get_next_component,
     icaldirset_begin_component,
     icaldirsetiter_to_next,
-    icaldirsetiter_to_prior
+    icaldirsetiter_to_prior,
+    icaldirset_add_components
 };
 
 static icalset icalset_fileset_init = {
@@ -101,7 +102,8 @@ static icalset icalset_fileset_init = {
     icalfileset_get_next_component,
     icalfileset_begin_component,
     icalfilesetiter_to_next,
-    NULL
+    NULL,
+    icalfileset_add_components
 };
 
 #if defined(HAVE_BDB)
@@ -128,7 +130,8 @@ static icalset icalset_bdbset_init = {
     icalbdbset_get_next_component,
     icalbdbset_begin_component,
     icalbdbsetiter_to_next,
-    NULL
+    NULL,
+    icalbdbset_add_components
 };
 #endif
 
@@ -402,6 +405,33 @@ icalerrorenum icalset_add_component(icalset *set, icalcomponent *comp)
     return set->add_component(set, comp);
 }
 
+icalerrorenum icalset_add_components(icalset *set, icalcomponent **comps, size_t num_comps)
+{
+    icalerrorenum error = ICAL_NO_ERROR;
+    size_t i;
+
+    if (set->add_components != 0) {
+        return set->add_components(set, comps, num_comps);
+    }
+
+    /* A class registered without it adds them one at a time */
+    for (i = 0; i < num_comps; i++) {
+        icalerrorenum err;
+
+        if (comps[i] == 0) {
+            err = ICAL_BADARG_ERROR;
+        } else if ((err = set->add_component(set, comps[i])) == ICAL_NO_ERROR) {
+            comps[i] = 0;
+        }
+
+        if (err != ICAL_NO_ERROR && error == ICAL_NO_ERROR) {
+            error = err;
+        }
+    }
+
+    return error;
+}
+
 icalerrorenum icalset_remove_component(icalset *set, icalcomponent *comp)
 {
     return set->remove_component(set, comp);
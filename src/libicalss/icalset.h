@@ -84,6 +84,7 @@ struct icalset_impl
                                            const char *tzid);
     icalcomponent *(*icalsetiter_to_next) (icalset *set, icalsetiter *i);
     icalcomponent *(*icalsetiter_to_prior) (icalset *set, icalsetiter *i);
+    icalerrorenum(*add_components) (icalset *set, icalcomponent **comps, size_t num_comps);
 };
 
 /** @brief Register a new derived class */
@@ -123,6 +124,20 @@ LIBICAL_ICALSS_EXPORT icalerrorenum icalset_commit(icalset *set);
 
 LIBICAL_ICALSS_EXPORT icalerrorenum icalset_add_component(icalset *set, icalcomponent *comp);
 
+/** @brief Add many components at once
+ *
+ * The set adds them in fewer, larger steps than one
+ * icalset_add_component() call each, as by loading each cluster of a
+ * directory set once. The set takes the components it adds, and sets
+ * their entries in comps to 0; the ones left are the caller's to free.
+ * A directory set may write components straight to a cluster file that
+ * is not loaded and free them, so they must not be used once added.
+ * The first error is returned.
+ */
+LIBICAL_ICALSS_EXPORT icalerrorenum icalset_add_components(icalset *set,
+                                                           icalcomponent **comps,
+                                                           size_t num_comps);
+
 LIBICAL_ICALSS_EXPORT icalerrorenum icalset_remove_component(icalset *set, icalcomponent *comp);
 
 LIBICAL_ICALSS_EXPORT int icalset_count_components(icalset *set, icalcomponent_kind kind);
@@ -28,35 +28,65 @@
 
 struct icalspanlist_impl
 {
-    pvl_list spans;             /**< list of icaltime_span data **/
+    icaltime_span *spans;       /**< busy and free spans, sorted, not overlapping **/
+    size_t num_spans;
+    icaltime_span *busy;        /**< the busy spans as found, sorted by start **/
+    size_t num_busy;
+    size_t busy_allocated;
+    int failed;                 /**< 1 if collecting the busy spans ran out of memory **/
     struct icaltimetype start;  /**< start time of span **/
     struct icaltimetype end;    /**< end time of span **/
 };
 
 /** @brief Internal comparison function for two spans
  *
- *  @param  a   a spanlist.
- *  @param  b   another spanlist.
+ *  @param  a   a span.
+ *  @param  b   another span.
  *
- *  @return     -1, 0, 1 depending on the comparison of the start times.
+ *  @return     -1, 0, 1 depending on the comparison of the start times,
+ *              then of the end times.
  *
- * Used to insert spans into the tree in sorted order.
+ * Used to sort the busy spans.
  */
 
-static int compare_span(void *a, void *b)
+static int compare_span(const void *a, const void *b)
 {
-    struct icaltime_span *span_a = (struct icaltime_span *)a;
-    struct icaltime_span *span_b = (struct icaltime_span *)b;
-
-    if (span_a->start == span_b->start) {
+    const struct icaltime_span *span_a = (const struct icaltime_span *)a;
+    const struct icaltime_span *span_b = (const struct icaltime_span *)b;
+
+    if (span_a->start != span_b->start) {
+        return (span_a->start < span_b->start) ? -1 : 1;
+    } else if (span_a->end != span_b->end) {
+        return (span_a->end < span_b->end) ? -1 : 1;
+    } else {
         return 0;
-    } else if (span_a->start < span_b->start) {
-        return -1;
-    } else {    /*if(span_a->start > span->b.start) */
-        return 1;
     }
 }
 
+static void icalspanlist_add_busy(icalspanlist *sl, const struct icaltime_span *span)
+{
+    if (sl->failed) {
+        return;
+    }
+
+    if (sl->num_busy == sl->busy_allocated) {
+        size_t space = sl->busy_allocated ? 2 * sl->busy_allocated : 64;
+        icaltime_span *busy = (icaltime_span *) realloc(sl->busy, space * sizeof(icaltime_span));
+
+        if (busy == 0) {
+            icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+            sl->failed = 1;
+            return;
+        }
+        sl->busy = busy;
+        sl->busy_allocated = space;
+    }
+
+    sl->busy[sl->num_busy] = *span;
+    sl->busy[sl->num_busy].is_busy = 1;
+    sl->num_busy++;
+}
+
 /** @brief callback function for collecting spanlists of a
  *         series of events.
  *
@@ -70,7 +100,6 @@ static int compare_span(void *a, void *b)
 
 static void icalspanlist_new_callback(icalcomponent *comp, struct icaltime_span *span, void *data)
 {
-    icaltime_span *s;
     icalspanlist *sl = (icalspanlist *) data;
 
     _unused(comp);
@@ -78,14 +107,94 @@ static void icalspanlist_new_callback(icalcomponent *comp, struct icaltime_span
     if (span->is_busy == 0)
         return;
 
-    if ((s = (icaltime_span *) malloc(sizeof(icaltime_span))) == 0) {
+    icalspanlist_add_busy(sl, span);
+}
+
+static icalspanlist *icalspanlist_alloc(struct icaltimetype start, struct icaltimetype end)
+{
+    icalspanlist *sl;
+
+    if ((sl = (struct icalspanlist_impl *)malloc(sizeof(struct icalspanlist_impl))) == 0) {
         icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-        return;
+        return 0;
     }
 
-  /** copy span data into allocated memory.. **/
-    *s = *span;
-    pvl_insert_ordered(sl->spans, compare_span, (void *)s);
+    sl->spans = 0;
+    sl->num_spans = 0;
+    sl->busy = 0;
+    sl->num_busy = 0;
+    sl->busy_allocated = 0;
+    sl->failed = 0;
+    sl->start = start;
+    sl->end = end;
+
+    return sl;
+}
+
+/** @brief Sort the busy spans and lay out the busy and free time
+ *
+ *  Overlapping and adjacent busy spans are coalesced, and the gaps
+ *  between them from range_start on become free spans, in one pass. If
+ *  open_ended is set, everything after the last busy span is free, which
+ *  is marked by a free span of no length at its end.
+ */
+
+static int icalspanlist_build(icalspanlist *sl, time_t range_start, int open_ended)
+{
+    size_t i, n = 0;
+
+    if (sl->failed) {
+        return 0;
+    }
+
+    if (sl->num_busy > 1) {
+        qsort(sl->busy, sl->num_busy, sizeof(icaltime_span), compare_span);
+    }
+
+    /* At most a free span before each busy span, and one at the end */
+    sl->spans = (icaltime_span *) malloc((2 * sl->num_busy + 1) * sizeof(icaltime_span));
+    if (sl->spans == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    for (i = 0; i < sl->num_busy;) {
+        icaltime_span merged = sl->busy[i++];
+
+        while (i < sl->num_busy && sl->busy[i].start <= merged.end) {
+            if (sl->busy[i].end > merged.end) {
+                merged.end = sl->busy[i].end;
+            }
+            i++;
+        }
+
+        if (range_start < merged.start) {
+            sl->spans[n].start = range_start;
+            sl->spans[n].end = merged.start;
+            sl->spans[n].is_busy = 0;
+            n++;
+        }
+
+        sl->spans[n++] = merged;
+        if (merged.end > range_start) {
+            range_start = merged.end;
+        }
+    }
+
+    /* If the end of the range is null, then assume that everything
+       after the last item in the calendar is open and add a span
+       that indicates this */
+
+    if (open_ended && n > 0) {
+        sl->spans[n].start = sl->spans[n - 1].end;
+        sl->spans[n].end = sl->spans[n].start;
+        sl->spans[n].is_busy = 0;
+        n++;
+    }
+
+    sl->num_spans = n;
+
+    return 1;
 }
 
 /** @brief Make a free list from a set of VEVENT components.
@@ -102,27 +211,15 @@ static void icalspanlist_new_callback(icalcomponent *comp, struct icaltime_span
 
 icalspanlist *icalspanlist_new(icalset *set, struct icaltimetype start, struct icaltimetype end)
 {
-    struct icaltime_span range;
-    pvl_elem itr;
     icalcomponent *c, *inner;
     icalcomponent_kind kind, inner_kind;
     icalspanlist *sl;
-    struct icaltime_span *freetime;
 
-    if ((sl = (struct icalspanlist_impl *)malloc(sizeof(struct icalspanlist_impl))) == 0) {
-        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+    if ((sl = icalspanlist_alloc(start, end)) == 0) {
         return 0;
     }
 
-    sl->spans = pvl_newlist();
-    sl->start = start;
-    sl->end = end;
-
-    range.start = icaltime_as_timet(start);
-    range.end = icaltime_as_timet(end);
-
-    /* Get a list of spans of busy time from the events in the set
-       and order the spans based on the start time */
+    /* Get a list of spans of busy time from the events in the set */
 
     for (c = icalset_get_first_component(set);
          c != 0;
@@ -144,59 +241,11 @@ icalspanlist *icalspanlist_new(icalset *set, struct icaltimetype start, struct i
         icalcomponent_foreach_recurrence(c, start, end, icalspanlist_new_callback, (void *)sl);
     }
 
-    /* Now Fill in the free time spans. loop through the spans. if the
-       start of the range is not within the span, create a free entry
-       that runs from the start of the range to the start of the
-       span. */
-
-    for (itr = pvl_head(sl->spans); itr != 0; itr = pvl_next(itr)) {
-        struct icaltime_span *s = (struct icaltime_span *)pvl_data(itr);
-
-        if (!s)
-            continue;
-
-        if ((freetime = (struct icaltime_span *)malloc(sizeof(struct icaltime_span))) == 0) {
-            icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-            icalspanlist_free(sl);
-            return 0;
-        }
-
-        if (range.start < s->start) {
-            freetime->start = range.start;
-            freetime->end = s->start;
-
-            freetime->is_busy = 0;
-
-            pvl_insert_ordered(sl->spans, compare_span, (void *)freetime);
-        } else {
-            free(freetime);
-        }
-
-        range.start = s->end;
-    }
-
-    /* If the end of the range is null, then assume that everything
-       after the last item in the calendar is open and add a span
-       that indicates this */
-
-    if (icaltime_is_null_time(end)) {
-        struct icaltime_span *last_span;
+    /* Now fill in the free time spans between them */
 
-        last_span = (struct icaltime_span *)pvl_data(pvl_tail(sl->spans));
-
-        if (last_span != 0) {
-
-            if ((freetime = (struct icaltime_span *)malloc(sizeof(struct icaltime_span))) == 0) {
-                icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-                icalspanlist_free(sl);
-                return 0;
-            }
-
-            freetime->is_busy = 0;
-            freetime->start = last_span->end;
-            freetime->end = freetime->start;
-            pvl_insert_ordered(sl->spans, compare_span, (void *)freetime);
-        }
+    if (!icalspanlist_build(sl, icaltime_as_timet(start), icaltime_is_null_time(end))) {
+        icalspanlist_free(sl);
+        return 0;
     }
 
     return sl;
@@ -210,18 +259,14 @@ icalspanlist *icalspanlist_new(icalset *set, struct icaltimetype start, struct i
 
 void icalspanlist_free(icalspanlist *s)
 {
-    struct icaltime_span *span;
-
     if (s == NULL)
         return;
 
-    while ((span = pvl_pop(s->spans)) != 0) {
-        free(span);
-    }
-
-    pvl_free(s->spans);
+    free(s->spans);
+    free(s->busy);
 
     s->spans = 0;
+    s->busy = 0;
 
     free(s);
 }
@@ -232,20 +277,36 @@ void icalspanlist_free(icalspanlist *s)
 
 void icalspanlist_dump(icalspanlist *sl)
 {
-    int i = 0;
-    pvl_elem itr;
-
-    for (itr = pvl_head(sl->spans); itr != 0; itr = pvl_next(itr)) {
-        struct icaltime_span *s = (struct icaltime_span *)pvl_data(itr);
-        if (s) {
-            printf("#%02d %d start: %s", ++i, s->is_busy, ctime(&s->start));
-            printf("      end  : %s", ctime(&s->end));
-        }
+    size_t i;
+
+    for (i = 0; i < sl->num_spans; i++) {
+        icaltime_span *s = &sl->spans[i];
+
+        printf("#%02d %d start: %s", (int)i + 1, s->is_busy, ctime(&s->start));
+        printf("      end  : %s", ctime(&s->end));
     }
 }
 
 icalcomponent *icalspanlist_make_busy_list(icalspanlist *sl);
 
+/** Return the position of the first span that starts at or after t */
+static size_t icalspanlist_find(const icaltime_span *spans, size_t num_spans, time_t t)
+{
+    size_t lo = 0, hi = num_spans;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (spans[mid].start < t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
 /** @brief Find next free time span in a spanlist.
  *
  *  @param  sl     The spanlist to search.
@@ -257,23 +318,22 @@ icalcomponent *icalspanlist_make_busy_list(icalspanlist *sl);
 
 struct icalperiodtype icalspanlist_next_free_time(icalspanlist *sl, struct icaltimetype t)
 {
-    pvl_elem itr;
     struct icalperiodtype period;
     struct icaltime_span *s;
+    size_t i;
 
     time_t rangett = icaltime_as_timet(t);
 
     period.start = icaltime_null_time();
     period.end = icaltime_null_time();
 
-    itr = pvl_head(sl->spans);
-    s = (struct icaltime_span *)pvl_data(itr);
-
-    if (s == 0) {
+    if (sl->num_spans == 0) {
         /* No elements in span */
         return period;
     }
 
+    s = &sl->spans[0];
+
     /* Is the reference time before the first span? If so, assume
        that the reference time is free */
     if (rangett < s->start) {
@@ -290,15 +350,13 @@ struct icalperiodtype icalspanlist_next_free_time(icalspanlist *sl, struct icalt
         return period;
     }
 
-    /* Otherwise, find the first free span that contains the
-       reference time. */
-    for (itr = pvl_head(sl->spans); itr != 0; itr = pvl_next(itr)) {
-        s = (struct icaltime_span *)pvl_data(itr);
+    /* Otherwise, find the first free span that starts at or after the
+       reference time. Busy and free spans alternate, so it is at most
+       one span past the first that starts there. */
+    for (i = icalspanlist_find(sl->spans, sl->num_spans, rangett); i < sl->num_spans; i++) {
+        s = &sl->spans[i];
 
-        if (!s)
-            continue;
-
-        if (s->is_busy == 0 && s->start >= rangett && (rangett < s->end || s->end == s->start)) {
+        if (s->is_busy == 0) {
 
             if (rangett < s->start) {
                 period.start = icaltime_from_timet_with_zone(s->start, 0, NULL);
@@ -312,9 +370,6 @@ struct icalperiodtype icalspanlist_next_free_time(icalspanlist *sl, struct icalt
         }
     }
 
-    period.start = icaltime_null_time();
-    period.end = icaltime_null_time();
-
     return period;
 }
 
@@ -340,11 +395,11 @@ struct icalperiodtype icalspanlist_next_free_time(icalspanlist *sl, struct icalt
 
 int *icalspanlist_as_freebusy_matrix(icalspanlist *sl, int delta_t)
 {
-    pvl_elem itr;
     time_t spanduration_secs;
     int *matrix;
     time_t matrix_slots;
     time_t sl_start, sl_end;
+    size_t n;
 
     icalerror_check_arg_rz((sl != 0), "spanlist");
 
@@ -378,27 +433,56 @@ int *icalspanlist_as_freebusy_matrix(icalspanlist *sl, int delta_t)
     memset(matrix, 0, (size_t)(sizeof(int) * matrix_slots));
     matrix[matrix_slots - 1] = -1;
 
-    /* loop through each span and mark the slots in the array */
+    /* Mark the slots of each busy event, which are sorted by start, so
+       the ones that start after the matrix need not be looked at */
 
-    for (itr = pvl_head(sl->spans); itr != 0; itr = pvl_next(itr)) {
-        struct icaltime_span *s = (struct icaltime_span *)pvl_data(itr);
+    for (n = 0; n < sl->num_busy && sl->busy[n].start < sl_end; n++) {
+        const icaltime_span *s = &sl->busy[n];
+        time_t offset_start = s->start / delta_t - sl_start / delta_t;
+        time_t offset_end = (s->end - 1) / delta_t - sl_start / delta_t + 1;
+        time_t i;
 
-        if (s && s->is_busy == 1) {
-            time_t offset_start = s->start / delta_t - sl_start / delta_t;
-            time_t offset_end = (s->end - 1) / delta_t - sl_start / delta_t + 1;
-            time_t i;
+        if (offset_start < 0)
+            offset_start = 0;
 
-            if (offset_end >= matrix_slots)
-                offset_end = matrix_slots - 1;
+        if (offset_end >= matrix_slots)
+            offset_end = matrix_slots - 1;
 
-            for (i = offset_start; i < offset_end; i++) {
-                matrix[i]++;
-            }
+        for (i = offset_start; i < offset_end; i++) {
+            matrix[i]++;
         }
     }
     return matrix;
 }
 
+icalbusymap *icalspanlist_as_busymap(icalspanlist *sl, int delta_t)
+{
+    icalbusymap *map;
+    struct icaltimetype end;
+    size_t n;
+
+    icalerror_check_arg_rz((sl != 0), "spanlist");
+
+    end = sl->end;
+    if (icaltime_is_null_time(end) && sl->num_spans > 0) {
+        end = icaltime_from_timet_with_zone(sl->spans[sl->num_spans - 1].end, 0,
+                                            icaltimezone_get_utc_timezone());
+    }
+
+    if ((map = icalbusymap_new(sl->start, end, delta_t)) == 0) {
+        return 0;
+    }
+
+    /* The merged busy spans set each run of bits once */
+    for (n = 0; n < sl->num_spans; n++) {
+        if (sl->spans[n].is_busy) {
+            icalbusymap_mark_busy(map, sl->spans[n].start, sl->spans[n].end);
+        }
+    }
+
+    return map;
+}
+
 /** @brief Return a VFREEBUSY component for the corresponding spanlist
  *
  *   @param sl         A valid icalspanlist, from icalspanlist_new()
@@ -409,7 +493,8 @@ int *icalspanlist_as_freebusy_matrix(icalspanlist *sl, int delta_t)
  *
  * This function returns a VFREEBUSY component for the given spanlist.
  * The start time is mapped to DTSTART, the end time to DTEND.
- * Each busy span is represented as a separate FREEBUSY entry.
+ * Each busy span is represented as a separate FREEBUSY entry, with
+ * overlapping busy times merged into one.
  * An attendee parameter is required, and organizer parameter is
  * optional.
  */
@@ -420,9 +505,9 @@ icalcomponent *icalspanlist_as_vfreebusy(icalspanlist *sl,
     icalcomponent *comp;
     icalproperty *p;
     struct icaltimetype atime = icaltime_from_timet_with_zone(time(0), 0, NULL);
-    pvl_elem itr;
     icaltimezone *utc_zone;
     icalparameter *param;
+    size_t i;
 
     if (!attendee) {
         icalerror_set_errno(ICAL_USAGE_ERROR);
@@ -444,11 +529,11 @@ icalcomponent *icalspanlist_as_vfreebusy(icalspanlist *sl,
 
     /* now add the freebusy sections.. */
 
-    for (itr = pvl_head(sl->spans); itr != 0; itr = pvl_next(itr)) {
+    for (i = 0; i < sl->num_spans; i++) {
         struct icalperiodtype period;
-        struct icaltime_span *s = (struct icaltime_span *)pvl_data(itr);
+        struct icaltime_span *s = &sl->spans[i];
 
-        if (s && s->is_busy == 1) {
+        if (s->is_busy == 1) {
 
             period.start = icaltime_from_timet_with_zone(s->start, 0, utc_zone);
             period.end = icaltime_from_timet_with_zone(s->end, 0, utc_zone);
@@ -472,6 +557,9 @@ icalcomponent *icalspanlist_as_vfreebusy(icalspanlist *sl,
  *
  *   @return           A valid icalspanlist or NULL if no VFREEBUSY section.
  *
+ * The busy periods are those whose FBTYPE is BUSY, BUSY-UNAVAILABLE or
+ * BUSY-TENTATIVE, or that have no FBTYPE. The time between them from
+ * the DTSTART of the VFREEBUSY is free.
  */
 
 icalspanlist *icalspanlist_from_vfreebusy(icalcomponent *comp)
@@ -479,6 +567,7 @@ icalspanlist *icalspanlist_from_vfreebusy(icalcomponent *comp)
     icalcomponent *inner;
     icalproperty *prop;
     icalspanlist *sl;
+    struct icaltimetype start, end;
 
     icalerror_check_arg_rz((comp != NULL), "comp");
 
@@ -486,26 +575,21 @@ icalspanlist *icalspanlist_from_vfreebusy(icalcomponent *comp)
     if (!inner)
         return NULL;
 
-    if ((sl = (icalspanlist *) malloc(sizeof(icalspanlist))) == 0) {
-        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+    start = icalcomponent_get_dtstart(inner);
+    end = icalcomponent_get_dtend(inner);
+
+    if ((sl = icalspanlist_alloc(start, end)) == 0) {
         return 0;
     }
-    sl->spans = pvl_newlist();
 
     /* cycle through each FREEBUSY property, adding to the spanlist */
     for (prop = icalcomponent_get_first_property(inner, ICAL_FREEBUSY_PROPERTY);
          prop != NULL;
          prop = icalcomponent_get_next_property(inner, ICAL_FREEBUSY_PROPERTY)) {
-        icaltime_span *s = (icaltime_span *) malloc(sizeof(icaltime_span));
         icalparameter *param;
         struct icalperiodtype period;
         icalparameter_fbtype fbtype;
-
-        if (s == 0) {
-            icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-            icalspanlist_free(sl);
-            return 0;
-        }
+        icaltime_span s;
 
         param = icalproperty_get_first_parameter(prop, ICAL_FBTYPE_PARAMETER);
         fbtype = (param) ? icalparameter_get_fbtype(param) : ICAL_FBTYPE_BUSY;
@@ -514,18 +598,208 @@ icalspanlist *icalspanlist_from_vfreebusy(icalcomponent *comp)
         case ICAL_FBTYPE_FREE:
         case ICAL_FBTYPE_NONE:
         case ICAL_FBTYPE_X:
-            s->is_busy = 1;
-            break;
+            continue;
         default:
-            s->is_busy = 0;
+            break;
         }
 
         period = icalproperty_get_freebusy(prop);
-        s->start = icaltime_as_timet_with_zone(period.start, icaltimezone_get_utc_timezone());
-        s->end = icaltime_as_timet_with_zone(period.end, icaltimezone_get_utc_timezone());
-        ;
-        pvl_insert_ordered(sl->spans, compare_span, (void *)s);
+        s.start = icaltime_as_timet_with_zone(period.start, icaltimezone_get_utc_timezone());
+        if (!icaltime_is_null_time(period.end)) {
+            s.end = icaltime_as_timet_with_zone(period.end, icaltimezone_get_utc_timezone());
+        } else {
+            s.end = s.start + icaldurationtype_as_int(period.duration);
+        }
+        s.is_busy = 1;
+
+        icalspanlist_add_busy(sl, &s);
     }
-  /** @todo calculate start/end limits.. fill in holes? **/
+
+    if (!icalspanlist_build(sl,
+                            icaltime_is_null_time(start) ?
+                            (sl->num_busy > 0 ? sl->busy[0].start : 0) :
+                            icaltime_as_timet_with_zone(start, icaltimezone_get_utc_timezone()),
+                            0)) {
+        icalspanlist_free(sl);
+        return 0;
+    }
+
     return sl;
 }
+
+/* A position in the sorted busy spans of one of the lists being merged */
+struct icalspanlist_cursor
+{
+    const icaltime_span *next;
+    const icaltime_span *end;
+};
+
+static void icalspanlist_sift_down(struct icalspanlist_cursor *heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t child = 2 * i + 1;
+        struct icalspanlist_cursor tmp;
+
+        if (child >= n) {
+            return;
+        }
+        if (child + 1 < n && heap[child + 1].next->start < heap[child].next->start) {
+            child++;
+        }
+        if (heap[i].next->start <= heap[child].next->start) {
+            return;
+        }
+
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+/* Append the part of the free time [free_start, free_end) that can hold
+   slots, or return 0 once max_slots have been found */
+static int icalspanlist_add_free(icalarray *slots, time_t free_start, time_t free_end,
+                                 time_t window_start, int duration, int granularity,
+                                 size_t max_slots)
+{
+    struct icalperiodtype period;
+    icaltimezone *utc_zone = icaltimezone_get_utc_timezone();
+
+    if (granularity > 1) {
+        time_t offset = (free_start - window_start) % granularity;
+
+        if (offset != 0) {
+            free_start += granularity - offset;
+        }
+    }
+
+    if (free_end - free_start < duration) {
+        return 1;
+    }
+
+    period.start = icaltime_from_timet_with_zone(free_start, 0, utc_zone);
+    period.end = icaltime_from_timet_with_zone(free_end, 0, utc_zone);
+    period.duration = icaldurationtype_null_duration();
+
+    icalarray_append(slots, &period);
+
+    return (max_slots == 0 || slots->num_elements < max_slots);
+}
+
+icalarray *icalspanlist_find_common_free(icalspanlist **lists, size_t num_lists,
+                                         struct icaltimetype start, struct icaltimetype end,
+                                         int duration, int granularity, size_t max_slots)
+{
+    struct icalspanlist_cursor *heap;
+    icalarray *slots;
+    time_t window_start, window_end, free_start;
+    size_t i, n = 0;
+    int more = 1;
+
+    icalerror_check_arg_rz((lists != 0 || num_lists == 0), "lists");
+    icalerror_check_arg_rz((duration > 0), "duration");
+    icalerror_check_arg_rz((granularity >= 0), "granularity");
+    icalerror_check_arg_rz(!icaltime_is_null_time(start), "start");
+    icalerror_check_arg_rz(!icaltime_is_null_time(end), "end");
+
+    for (i = 0; i < num_lists; i++) {
+        icalerror_check_arg_rz((lists[i] != 0), "lists");
+    }
+
+    window_start = icaltime_as_timet_with_zone(start, icaltimezone_get_utc_timezone());
+    window_end = icaltime_as_timet_with_zone(end, icaltimezone_get_utc_timezone());
+
+    slots = icalarray_new(sizeof(struct icalperiodtype), 16);
+    if (slots == 0) {
+        return 0;
+    }
+
+    heap = (struct icalspanlist_cursor *)malloc((num_lists + 1) * sizeof(*heap));
+    if (heap == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        icalarray_free(slots);
+        return 0;
+    }
+
+    for (i = 0; i < num_lists; i++) {
+        if (lists[i]->num_busy > 0) {
+            heap[n].next = lists[i]->busy;
+            heap[n].end = lists[i]->busy + lists[i]->num_busy;
+            n++;
+        }
+    }
+
+    for (i = n / 2; i-- > 0;) {
+        icalspanlist_sift_down(heap, n, i);
+    }
+
+    /* Take the busy spans of all lists in order of their start. The time
+       between the end of everything taken so far and the start of the
+       next one is free for everybody. */
+
+    free_start = window_start;
+
+    while (more && n > 0 && heap[0].next->start < window_end) {
+        const icaltime_span *s = heap[0].next;
+
+        if (s->start > free_start) {
+            more = icalspanlist_add_free(slots, free_start, s->start, window_start,
+                                         duration, granularity, max_slots);
+        }
+        if (s->end > free_start) {
+            free_start = s->end;
+        }
+
+        if (++heap[0].next == heap[0].end) {
+            heap[0] = heap[--n];
+        }
+        icalspanlist_sift_down(heap, n, 0);
+    }
+
+    if (more && free_start < window_end) {
+        (void)icalspanlist_add_free(slots, free_start, window_end, window_start,
+                                    duration, granularity, max_slots);
+    }
+
+    free(heap);
+
+    return slots;
+}
+
+icalarray *icalspanlist_find_common_free_in_sets(icalset **sets, size_t num_sets,
+                                                 struct icaltimetype start,
+                                                 struct icaltimetype end,
+                                                 int duration, int granularity,
+                                                 size_t max_slots)
+{
+    icalspanlist **lists;
+    icalarray *slots = 0;
+    size_t i, n;
+
+    icalerror_check_arg_rz((sets != 0 || num_sets == 0), "sets");
+
+    lists = (icalspanlist **)malloc((num_sets + 1) * sizeof(icalspanlist *));
+    if (lists == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    for (n = 0; n < num_sets; n++) {
+        if ((lists[n] = icalspanlist_new(sets[n], start, end)) == 0) {
+            break;
+        }
+    }
+
+    if (n == num_sets) {
+        slots = icalspanlist_find_common_free(lists, num_sets, start, end,
+                                              duration, granularity, max_slots);
+    }
+
+    for (i = 0; i < n; i++) {
+        icalspanlist_free(lists[i]);
+    }
+    free(lists);
+
+    return slots;
+}
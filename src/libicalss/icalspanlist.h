@@ -20,6 +20,8 @@
 #define ICALSPANLIST_H
 
 #include "libical_icalss_export.h"
+#include "icalarray.h"
+#include "icalbusymap.h"
 #include "icalset.h"
 
 /** @file icalspanlist.h
@@ -54,7 +56,51 @@ LIBICAL_ICALSS_EXPORT icalcomponent *icalspanlist_as_vfreebusy(icalspanlist *sl,
 /** @brief Return an integer matrix of total events per delta_t timespan */
 LIBICAL_ICALSS_EXPORT int *icalspanlist_as_freebusy_matrix(icalspanlist *span, int delta_t);
 
+/** @brief Return a busy map of the window of this span list
+ *
+ *  A slot is busy if any busy span overlaps it. If the span list has no
+ *  end, the map ends with the last busy span.
+ */
+LIBICAL_ICALSS_EXPORT icalbusymap *icalspanlist_as_busymap(icalspanlist *sl, int delta_t);
+
 /** @brief Construct an icalspanlist from a VFREEBUSY component */
 LIBICAL_ICALSS_EXPORT icalspanlist *icalspanlist_from_vfreebusy(icalcomponent *comp);
 
+/** @brief Find the times in a window when none of several span lists is busy
+ *
+ *  @param lists        The span lists, such as one per attendee
+ *  @param num_lists    The number of span lists
+ *  @param start        The start of the window, in UTC
+ *  @param end          The end of the window, in UTC
+ *  @param duration     The shortest slot wanted, in seconds
+ *  @param granularity  Slots start a multiple of this many seconds after
+ *                      start. 0 lets them start at any second.
+ *  @param max_slots    The most slots to return, or 0 for all of them
+ *
+ *  @return An icalarray of struct icalperiodtype in UTC, in order, each
+ *          at least duration long, or NULL on error. The busy times of the
+ *          lists are merged in one pass, in O(n log num_lists) for n busy
+ *          times. Free the array with icalarray_free().
+ */
+LIBICAL_ICALSS_EXPORT icalarray *icalspanlist_find_common_free(icalspanlist **lists,
+                                                               size_t num_lists,
+                                                               struct icaltimetype start,
+                                                               struct icaltimetype end,
+                                                               int duration,
+                                                               int granularity,
+                                                               size_t max_slots);
+
+/** @brief Like icalspanlist_find_common_free(), for the VEVENTs of several sets
+ *
+ *  A span list is made for each set over the window, as by
+ *  icalspanlist_new().
+ */
+LIBICAL_ICALSS_EXPORT icalarray *icalspanlist_find_common_free_in_sets(icalset **sets,
+                                                                      size_t num_sets,
+                                                                      struct icaltimetype start,
+                                                                      struct icaltimetype end,
+                                                                      int duration,
+                                                                      int granularity,
+                                                                      size_t max_slots);
+
 #endif
@@ -2,13 +2,16 @@
 # It is required to make the combined header icalss.h properly.
 set(COMBINEDHEADERSICALSS
   ${TOPS}/src/libicalss/icalgauge.h
+  ${TOPS}/src/libicalss/icaltimeindex.h
   ${TOPS}/src/libicalss/icalset.h
   ${TOPS}/src/libicalss/icalcluster.h
   ${TOPS}/src/libicalss/icalfileset.h
   ${TOPS}/src/libicalss/icaldirset.h
   ${TOPS}/src/libicalss/icalcalendar.h
   ${TOPS}/src/libicalss/icalclassify.h
+  ${TOPS}/src/libicalss/icalbusymap.h
   ${TOPS}/src/libicalss/icalspanlist.h
+  ${TOPS}/src/libicalss/icalinstances.h
   ${TOPS}/src/libicalss/icalmessage.h
 )
 if(BDB_FOUND)
@@ -29,30 +29,32 @@
 #include "icalgauge.h"
 #include "icalgaugeimpl.h"
 
-extern struct icalgauge_impl *icalss_yy_gauge;
-
-#define YYPARSE_PARAM yy_globals
-#define YYLEX_PARAM yy_globals
-#define YY_EXTRA_TYPE  icalgauge_impl*
-
-
-void sserror(char *s);
-
 static void ssyacc_add_where(struct icalgauge_impl* impl, char* prop,
-            icalgaugecompare compare , char* value);
+            icalgaugecompare compare , const char* value);
 static void ssyacc_add_select(struct icalgauge_impl* impl, char* str1);
 static void ssyacc_add_from(struct icalgauge_impl* impl, char* str1);
 static void set_logic(struct icalgauge_impl* impl,icalgaugelogic l);
+%}
 
-/* Don't know why I need this....  */
+%code requires {
+struct icalgauge_impl;
 
-/* older flex version (such as included in OpenBSD) takes a different calling syntax */
-#ifdef YYPARSE_PARAM
-int sslex(void *YYPARSE_PARAM);
-#else
-int sslex(void);
-#endif
-%}
+/* Everything one call to ssparse() works on, so that several queries can
+   be parsed at once in different threads */
+struct icalss_scanner {
+    const char *p;                  /* next character to scan */
+    struct icalgauge_impl *gauge;   /* the gauge the query is built into */
+};
+}
+
+%code provides {
+int sslex(SSSTYPE *lvalp, struct icalss_scanner *scanner);
+void sserror(struct icalss_scanner *scanner, const char *s);
+}
+
+%define api.pure full
+%define api.prefix {ss}
+%param {struct icalss_scanner *scanner}
 
 %union {
     char* v_string;
@@ -74,43 +76,45 @@ query_min: SELECT select_list FROM from_list WHERE where_list
        ;
 
 select_list:
-    STRING {ssyacc_add_select(icalss_yy_gauge,$1);}
-    | select_list COMMA STRING {ssyacc_add_select(icalss_yy_gauge,$3);}
+    STRING {ssyacc_add_select(scanner->gauge,$1);}
+    | select_list COMMA STRING {ssyacc_add_select(scanner->gauge,$3);}
     ;
 
 
 from_list:
-    STRING {ssyacc_add_from(icalss_yy_gauge,$1);}
-    | from_list COMMA STRING {ssyacc_add_from(icalss_yy_gauge,$3);}
+    STRING {ssyacc_add_from(scanner->gauge,$1);}
+    | from_list COMMA STRING {ssyacc_add_from(scanner->gauge,$3);}
     ;
 
 where_clause:
     /* Empty */
-    | STRING EQUALS STRING {ssyacc_add_where(icalss_yy_gauge,$1,ICALGAUGECOMPARE_EQUAL,$3); }
-    | STRING IS SQLNULL {ssyacc_add_where(icalss_yy_gauge,$1,ICALGAUGECOMPARE_ISNULL,""); }
-    | STRING IS NOT SQLNULL {ssyacc_add_where(icalss_yy_gauge,$1,ICALGAUGECOMPARE_ISNOTNULL,""); }
-    | STRING NOTEQUALS STRING {ssyacc_add_where(icalss_yy_gauge,$1,ICALGAUGECOMPARE_NOTEQUAL,$3); }
-    | STRING LESS STRING {ssyacc_add_where(icalss_yy_gauge,$1,ICALGAUGECOMPARE_LESS,$3); }
-    | STRING GREATER STRING {ssyacc_add_where(icalss_yy_gauge,$1,ICALGAUGECOMPARE_GREATER,$3); }
-    | STRING LESSEQUALS STRING {ssyacc_add_where(icalss_yy_gauge,$1,ICALGAUGECOMPARE_LESSEQUAL,$3); }
-    | STRING GREATEREQUALS STRING {ssyacc_add_where(icalss_yy_gauge,$1,ICALGAUGECOMPARE_GREATEREQUAL,$3); }
+    | STRING EQUALS STRING {ssyacc_add_where(scanner->gauge,$1,ICALGAUGECOMPARE_EQUAL,$3); }
+    | STRING IS SQLNULL {ssyacc_add_where(scanner->gauge,$1,ICALGAUGECOMPARE_ISNULL,""); }
+    | STRING IS NOT SQLNULL {ssyacc_add_where(scanner->gauge,$1,ICALGAUGECOMPARE_ISNOTNULL,""); }
+    | STRING NOTEQUALS STRING {ssyacc_add_where(scanner->gauge,$1,ICALGAUGECOMPARE_NOTEQUAL,$3); }
+    | STRING LESS STRING {ssyacc_add_where(scanner->gauge,$1,ICALGAUGECOMPARE_LESS,$3); }
+    | STRING GREATER STRING {ssyacc_add_where(scanner->gauge,$1,ICALGAUGECOMPARE_GREATER,$3); }
+    | STRING LESSEQUALS STRING {ssyacc_add_where(scanner->gauge,$1,ICALGAUGECOMPARE_LESSEQUAL,$3); }
+    | STRING GREATEREQUALS STRING {ssyacc_add_where(scanner->gauge,$1,ICALGAUGECOMPARE_GREATEREQUAL,$3); }
     ;
 
 where_list:
-    where_clause {set_logic(icalss_yy_gauge,ICALGAUGELOGIC_NONE);}
-    | where_list AND where_clause {set_logic(icalss_yy_gauge,ICALGAUGELOGIC_AND);}
-    | where_list OR where_clause {set_logic(icalss_yy_gauge,ICALGAUGELOGIC_OR);}
+    where_clause {set_logic(scanner->gauge,ICALGAUGELOGIC_NONE);}
+    | where_list AND where_clause {set_logic(scanner->gauge,ICALGAUGELOGIC_AND);}
+    | where_list OR where_clause {set_logic(scanner->gauge,ICALGAUGELOGIC_OR);}
     ;
 
 
 %%
 
 static void ssyacc_add_where(struct icalgauge_impl* impl, char* str1,
-    icalgaugecompare compare , char* value_str)
+    icalgaugecompare compare , const char* value_str)
 {
 
     struct icalgauge_where *where;
-    char *compstr, *propstr, *c, *s,*l;
+    char *compstr, *propstr, *c;
+    const char *s;
+    size_t len;
 
     if ( (where = malloc(sizeof(struct icalgauge_where))) ==0){
     icalerror_set_errno(ICAL_NEWFAILED_ERROR);
@@ -128,12 +132,15 @@ static void ssyacc_add_where(struct icalgauge_impl* impl, char* str1,
     if(*s == '\''){
     s++;
     }
-    l = s+strlen(s)-1;
-    if(*l == '\''){
-    *l=0;
+    len = strlen(s);
+    if(len > 0 && s[len-1] == '\''){
+    len--;
     }
 
-    where->value = strdup(s);
+    if((where->value = malloc(len+1)) != 0){
+    memcpy(where->value, s, len);
+    where->value[len] = 0;
+    }
 
     /* Is there a period in str1 ? If so, the string specified both a */
     /* component and a property                                       */
@@ -160,7 +167,7 @@ static void ssyacc_add_where(struct icalgauge_impl* impl, char* str1,
 
     if(where->value == 0){
     icalerror_set_errno(ICAL_NEWFAILED_ERROR);
-    free(where->value);
+    free(where);
     return;
     }
 
@@ -247,7 +254,8 @@ static void ssyacc_add_from(struct icalgauge_impl* impl, char* str1)
 }
 
 
-void sserror(char *s){
+void sserror(struct icalss_scanner *scanner, const char *s){
+  (void)scanner;
   fprintf(stderr,"Parse error \'%s\'\n", s);
   icalerror_set_errno(ICAL_MALFORMEDDATA_ERROR);
 }
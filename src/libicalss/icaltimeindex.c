@@ -0,0 +1,697 @@
+/*======================================================================
+ FILE: icaltimeindex.c
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+=========================================================================*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "icaltimeindex.h"
+#include "icalgaugeimpl.h"
+#include "icalerror.h"
+#include "icaltimezone.h"
+#include "icalvalue.h"
+
+#include <stdlib.h>
+
+/** A series with a COUNT larger than this is indexed as if it never ended,
+    rather than expanded to find its last instance */
+#define ICALTIMEINDEX_MAX_COUNT 10000
+
+/** Slack around times whose time zone is not looked up, such as RDATEs */
+#define ICALTIMEINDEX_SLACK (24 * 60 * 60)
+
+struct icaltimeindex_node
+{
+    icalcomponent *comp;
+    unsigned long revision;     /**< of comp when its range was computed */
+    unsigned long epoch;        /**< the last sync that found comp in the parent */
+    unsigned long seq;          /**< orders nodes with the same start */
+    time_t start;
+    time_t end;
+    time_t max_end;             /**< the latest end in the subtree rooted here */
+    unsigned int priority;
+    struct icaltimeindex_node *left;
+    struct icaltimeindex_node *right;
+    struct icaltimeindex_node *hash_next;
+};
+
+struct icaltimeindex_impl
+{
+    icalcomponent *parent;
+    unsigned long revision;     /**< of the parent when the index was last up to date */
+    int synced;
+    unsigned long epoch;
+    unsigned long next_seq;
+    unsigned int random;
+
+    struct icaltimeindex_node *root;
+
+    /* Nodes by component, chained through hash_next */
+    struct icaltimeindex_node **buckets;
+    size_t num_buckets;
+    size_t count;
+};
+
+static time_t icaltimeindex_as_timet(struct icaltimetype t)
+{
+    if (icaltime_is_null_time(t)) {
+        return 0;
+    }
+
+    return icaltime_as_timet_with_zone(t, t.zone ? t.zone : icaltimezone_get_utc_timezone());
+}
+
+/* Widen [*start, *end] to cover the instances of one VEVENT, VTODO or
+   VJOURNAL. Returns 0 if it has no DTSTART. */
+static int icaltimeindex_add_inner_range(icalcomponent *inner, time_t *start, time_t *end)
+{
+    struct icaltimetype dtstart, dtend;
+    time_t s, e, duration;
+    icalproperty *p;
+
+    dtstart = icalcomponent_get_dtstart(inner);
+    if (icaltime_is_null_time(dtstart)) {
+        return 0;
+    }
+
+    s = icaltimeindex_as_timet(dtstart);
+    e = s;
+
+    dtend = icalcomponent_get_dtend(inner);
+    if (!icaltime_is_null_time(dtend)) {
+        e = icaltimeindex_as_timet(dtend);
+    } else if (dtstart.is_date) {
+        e = s + 24 * 60 * 60;
+    }
+
+    if (e < s) {
+        time_t t = s;
+
+        s = e;
+        e = t;
+    }
+    duration = e - s;
+
+    for (p = icalcomponent_get_first_property(inner, ICAL_RRULE_PROPERTY);
+         p != 0; p = icalcomponent_get_next_property(inner, ICAL_RRULE_PROPERTY)) {
+        struct icalrecurrencetype recur = icalproperty_get_rrule(p);
+        time_t last;
+
+        if (!icaltime_is_null_time(recur.until)) {
+            struct icaltimetype until = recur.until;
+
+            if (until.zone == 0 && !until.is_utc) {
+                until.zone = dtstart.zone;
+            }
+            last = icaltimeindex_as_timet(until);
+            if (until.is_date) {
+                last += 24 * 60 * 60;
+            }
+        } else if (recur.count > 0 && recur.count <= ICALTIMEINDEX_MAX_COUNT) {
+            icalrecur_iterator *ritr = icalrecur_iterator_new(recur, dtstart);
+            struct icaltimetype next, prev = dtstart;
+            int i;
+
+            if (ritr == 0) {
+                last = ICALTIMEINDEX_END_OF_TIME;
+            } else {
+                for (i = 0; i < recur.count; i++) {
+                    next = icalrecur_iterator_next(ritr);
+                    if (icaltime_is_null_time(next)) {
+                        break;
+                    }
+                    prev = next;
+                }
+                icalrecur_iterator_free(ritr);
+                last = icaltimeindex_as_timet(prev);
+            }
+        } else {
+            last = ICALTIMEINDEX_END_OF_TIME;
+        }
+
+        if (last == ICALTIMEINDEX_END_OF_TIME || last > ICALTIMEINDEX_END_OF_TIME - duration) {
+            e = ICALTIMEINDEX_END_OF_TIME;
+        } else if (last + duration > e) {
+            e = last + duration;
+        }
+    }
+
+    for (p = icalcomponent_get_first_property(inner, ICAL_RDATE_PROPERTY);
+         p != 0; p = icalcomponent_get_next_property(inner, ICAL_RDATE_PROPERTY)) {
+        struct icaldatetimeperiodtype rdate = icalproperty_get_rdate(p);
+        time_t rs, re;
+
+        if (!icaltime_is_null_time(rdate.time)) {
+            rs = icaltimeindex_as_timet(rdate.time);
+            re = rs + duration;
+        } else if (!icaltime_is_null_time(rdate.period.start)) {
+            rs = icaltimeindex_as_timet(rdate.period.start);
+            if (!icaltime_is_null_time(rdate.period.end)) {
+                re = icaltimeindex_as_timet(rdate.period.end);
+            } else {
+                re = rs + icaldurationtype_as_int(rdate.period.duration);
+            }
+        } else {
+            continue;
+        }
+
+        if (rs - ICALTIMEINDEX_SLACK < s) {
+            s = rs - ICALTIMEINDEX_SLACK;
+        }
+        if (e != ICALTIMEINDEX_END_OF_TIME && re + ICALTIMEINDEX_SLACK > e) {
+            e = re + ICALTIMEINDEX_SLACK;
+        }
+    }
+
+    if (s < *start) {
+        *start = s;
+    }
+    if (e > *end) {
+        *end = e;
+    }
+
+    return 1;
+}
+
+int icaltimeindex_get_component_range(icalcomponent *comp, time_t *start, time_t *end)
+{
+    icalcomponent_kind kind;
+    icalcomponent *inner;
+    int found = 0;
+
+    icalerror_check_arg_rz((comp != 0), "comp");
+    icalerror_check_arg_rz((start != 0), "start");
+    icalerror_check_arg_rz((end != 0), "end");
+
+    *start = ICALTIMEINDEX_END_OF_TIME;
+    *end = ICALTIMEINDEX_BEGINNING_OF_TIME;
+
+    kind = icalcomponent_isa(comp);
+
+    if (kind == ICAL_VEVENT_COMPONENT || kind == ICAL_VTODO_COMPONENT ||
+        kind == ICAL_VJOURNAL_COMPONENT) {
+        found = icaltimeindex_add_inner_range(comp, start, end);
+    } else {
+        icalcompiter i;
+
+        for (i = icalcomponent_begin_component(comp, ICAL_ANY_COMPONENT);
+             (inner = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+            kind = icalcomponent_isa(inner);
+            if (kind != ICAL_VEVENT_COMPONENT && kind != ICAL_VTODO_COMPONENT &&
+                kind != ICAL_VJOURNAL_COMPONENT) {
+                continue;
+            }
+            if (!icaltimeindex_add_inner_range(inner, start, end)) {
+                found = 0;
+                break;
+            }
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        *start = ICALTIMEINDEX_BEGINNING_OF_TIME;
+        *end = ICALTIMEINDEX_END_OF_TIME;
+    }
+
+    return found;
+}
+
+int icaltimeindex_get_gauge_range(icalgauge *gauge, time_t *start, time_t *end)
+{
+    int i, restricted = 0;
+
+    icalerror_check_arg_rz((gauge != 0), "gauge");
+    icalerror_check_arg_rz((start != 0), "start");
+    icalerror_check_arg_rz((end != 0), "end");
+
+    *start = ICALTIMEINDEX_BEGINNING_OF_TIME;
+    *end = ICALTIMEINDEX_END_OF_TIME;
+
+    /* An expanding gauge compares the RECURRENCE-ID of an instance in
+       place of its DTSTART */
+    if (gauge->expand) {
+        return 0;
+    }
+
+    for (i = 0; i < gauge->num_clauses; i++) {
+        const struct icalgauge_clause *c = &gauge->clauses[i];
+        struct icaltimetype t;
+        time_t lower, upper;
+
+        if (i > 0 && c->logic != ICALGAUGELOGIC_AND) {
+            return 0;
+        }
+
+        if (c->error != ICAL_NO_ERROR || c->comp != ICAL_NO_COMPONENT ||
+            (c->prop != ICAL_DTSTART_PROPERTY && c->prop != ICAL_DTEND_PROPERTY) ||
+            c->value == 0 || icalvalue_isa(c->value) != ICAL_DATETIME_VALUE) {
+            continue;
+        }
+
+        t = icalvalue_get_datetime(c->value);
+        if (icaltime_is_null_time(t)) {
+            continue;
+        }
+
+        lower = icaltimeindex_as_timet(t) - ICALTIMEINDEX_SLACK;
+        upper = icaltimeindex_as_timet(t) + ICALTIMEINDEX_SLACK;
+
+        /* A range starts no later than DTSTART and DTEND, and ends no
+           earlier than either */
+        switch (c->compare) {
+        case ICALGAUGECOMPARE_EQUAL:
+            if (lower > *start) {
+                *start = lower;
+            }
+            if (upper < *end) {
+                *end = upper;
+            }
+            break;
+        case ICALGAUGECOMPARE_LESS:
+        case ICALGAUGECOMPARE_LESSEQUAL:
+            if (upper < *end) {
+                *end = upper;
+            }
+            break;
+        case ICALGAUGECOMPARE_GREATER:
+        case ICALGAUGECOMPARE_GREATEREQUAL:
+            if (lower > *start) {
+                *start = lower;
+            }
+            break;
+        default:
+            continue;
+        }
+
+        restricted = 1;
+    }
+
+    return restricted;
+}
+
+/***** The tree: a treap ordered by (start, seq) *****/
+
+static int icaltimeindex_node_less(const struct icaltimeindex_node *a,
+                                   const struct icaltimeindex_node *b)
+{
+    return a->start < b->start || (a->start == b->start && a->seq < b->seq);
+}
+
+static void icaltimeindex_node_update(struct icaltimeindex_node *n)
+{
+    n->max_end = n->end;
+    if (n->left != 0 && n->left->max_end > n->max_end) {
+        n->max_end = n->left->max_end;
+    }
+    if (n->right != 0 && n->right->max_end > n->max_end) {
+        n->max_end = n->right->max_end;
+    }
+}
+
+static struct icaltimeindex_node *icaltimeindex_rotate_right(struct icaltimeindex_node *n)
+{
+    struct icaltimeindex_node *l = n->left;
+
+    n->left = l->right;
+    l->right = n;
+    icaltimeindex_node_update(n);
+    icaltimeindex_node_update(l);
+    return l;
+}
+
+static struct icaltimeindex_node *icaltimeindex_rotate_left(struct icaltimeindex_node *n)
+{
+    struct icaltimeindex_node *r = n->right;
+
+    n->right = r->left;
+    r->left = n;
+    icaltimeindex_node_update(n);
+    icaltimeindex_node_update(r);
+    return r;
+}
+
+static struct icaltimeindex_node *icaltimeindex_tree_insert(struct icaltimeindex_node *root,
+                                                            struct icaltimeindex_node *n)
+{
+    if (root == 0) {
+        n->left = n->right = 0;
+        icaltimeindex_node_update(n);
+        return n;
+    }
+
+    if (icaltimeindex_node_less(n, root)) {
+        root->left = icaltimeindex_tree_insert(root->left, n);
+        if (root->left->priority > root->priority) {
+            return icaltimeindex_rotate_right(root);
+        }
+    } else {
+        root->right = icaltimeindex_tree_insert(root->right, n);
+        if (root->right->priority > root->priority) {
+            return icaltimeindex_rotate_left(root);
+        }
+    }
+
+    icaltimeindex_node_update(root);
+    return root;
+}
+
+/* Join two trees where everything in a orders before everything in b */
+static struct icaltimeindex_node *icaltimeindex_tree_join(struct icaltimeindex_node *a,
+                                                          struct icaltimeindex_node *b)
+{
+    if (a == 0) {
+        return b;
+    }
+    if (b == 0) {
+        return a;
+    }
+
+    if (a->priority > b->priority) {
+        a->right = icaltimeindex_tree_join(a->right, b);
+        icaltimeindex_node_update(a);
+        return a;
+    } else {
+        b->left = icaltimeindex_tree_join(a, b->left);
+        icaltimeindex_node_update(b);
+        return b;
+    }
+}
+
+static struct icaltimeindex_node *icaltimeindex_tree_remove(struct icaltimeindex_node *root,
+                                                            struct icaltimeindex_node *n)
+{
+    if (root == 0) {
+        return 0;
+    }
+
+    if (root == n) {
+        return icaltimeindex_tree_join(n->left, n->right);
+    }
+
+    if (icaltimeindex_node_less(n, root)) {
+        root->left = icaltimeindex_tree_remove(root->left, n);
+    } else {
+        root->right = icaltimeindex_tree_remove(root->right, n);
+    }
+
+    icaltimeindex_node_update(root);
+    return root;
+}
+
+static void icaltimeindex_tree_select(struct icaltimeindex_node *n, time_t start, time_t end,
+                                      icalarray *result, size_t *count)
+{
+    while (n != 0 && n->max_end >= start) {
+        icaltimeindex_tree_select(n->left, start, end, result, count);
+
+        /* This node and everything to its right start after the window */
+        if (n->start > end) {
+            return;
+        }
+
+        if (n->end >= start) {
+            icalarray_append(result, &n->comp);
+            (*count)++;
+        }
+
+        n = n->right;
+    }
+}
+
+/***** Nodes by component *****/
+
+static size_t icaltimeindex_hash(icaltimeindex *index, icalcomponent *comp)
+{
+    size_t h = (size_t)comp;
+
+    h ^= h >> 4;
+    h *= 2654435761U;
+    h ^= h >> 16;
+
+    return h & (index->num_buckets - 1);
+}
+
+static struct icaltimeindex_node *icaltimeindex_lookup(icaltimeindex *index,
+                                                       icalcomponent *comp)
+{
+    struct icaltimeindex_node *n;
+
+    for (n = index->buckets[icaltimeindex_hash(index, comp)]; n != 0; n = n->hash_next) {
+        if (n->comp == comp) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+static int icaltimeindex_grow(icaltimeindex *index)
+{
+    struct icaltimeindex_node **old_buckets = index->buckets;
+    size_t old_num_buckets = index->num_buckets;
+    size_t i;
+
+    index->num_buckets = old_num_buckets * 2;
+    index->buckets = calloc(index->num_buckets, sizeof(struct icaltimeindex_node *));
+
+    if (index->buckets == 0) {
+        index->buckets = old_buckets;
+        index->num_buckets = old_num_buckets;
+        return 0;
+    }
+
+    for (i = 0; i < old_num_buckets; i++) {
+        struct icaltimeindex_node *n, *next;
+
+        for (n = old_buckets[i]; n != 0; n = next) {
+            size_t h = icaltimeindex_hash(index, n->comp);
+
+            next = n->hash_next;
+            n->hash_next = index->buckets[h];
+            index->buckets[h] = n;
+        }
+    }
+
+    free(old_buckets);
+    return 1;
+}
+
+/* (Re)compute the range of a node and put it in the tree */
+static void icaltimeindex_place(icaltimeindex *index, struct icaltimeindex_node *n)
+{
+    (void)icaltimeindex_get_component_range(n->comp, &n->start, &n->end);
+    n->revision = icalcomponent_get_revision(n->comp);
+    n->seq = index->next_seq++;
+
+    /* xorshift, for the treap priorities */
+    index->random ^= index->random << 13;
+    index->random ^= index->random >> 17;
+    index->random ^= index->random << 5;
+    n->priority = index->random;
+
+    index->root = icaltimeindex_tree_insert(index->root, n);
+}
+
+static void icaltimeindex_index(icaltimeindex *index, icalcomponent *comp)
+{
+    struct icaltimeindex_node *n = icaltimeindex_lookup(index, comp);
+
+    if (n != 0) {
+        if (n->revision != icalcomponent_get_revision(comp)) {
+            index->root = icaltimeindex_tree_remove(index->root, n);
+            icaltimeindex_place(index, n);
+        }
+        n->epoch = index->epoch;
+        return;
+    }
+
+    if (index->count >= index->num_buckets) {
+        (void)icaltimeindex_grow(index);
+    }
+
+    if ((n = (struct icaltimeindex_node *)malloc(sizeof(*n))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        /* Have the next query look at the children again */
+        index->synced = 0;
+        return;
+    }
+
+    n->comp = comp;
+    n->epoch = index->epoch;
+    icaltimeindex_place(index, n);
+
+    {
+        size_t h = icaltimeindex_hash(index, comp);
+
+        n->hash_next = index->buckets[h];
+        index->buckets[h] = n;
+    }
+    index->count++;
+}
+
+/***** Public interface *****/
+
+icaltimeindex *icaltimeindex_new(icalcomponent *parent)
+{
+    icaltimeindex *index;
+
+    icalerror_check_arg_rz((parent != 0), "parent");
+
+    if ((index = (icaltimeindex *)malloc(sizeof(*index))) == 0) {
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    index->parent = parent;
+    index->revision = 0;
+    index->synced = 0;
+    index->epoch = 0;
+    index->next_seq = 0;
+    index->random = 2463534242U;
+    index->root = 0;
+    index->count = 0;
+    index->num_buckets = 64;
+    index->buckets = calloc(index->num_buckets, sizeof(struct icaltimeindex_node *));
+
+    if (index->buckets == 0) {
+        free(index);
+        icalerror_set_errno(ICAL_NEWFAILED_ERROR);
+        return 0;
+    }
+
+    icaltimeindex_sync(index);
+
+    return index;
+}
+
+void icaltimeindex_free(icaltimeindex *index)
+{
+    size_t i;
+
+    icalerror_check_arg_rv((index != 0), "index");
+
+    for (i = 0; i < index->num_buckets; i++) {
+        struct icaltimeindex_node *n, *next;
+
+        for (n = index->buckets[i]; n != 0; n = next) {
+            next = n->hash_next;
+            free(n);
+        }
+    }
+
+    free(index->buckets);
+    free(index);
+}
+
+void icaltimeindex_sync(icaltimeindex *index)
+{
+    icalcompiter i;
+    icalcomponent *c;
+    unsigned long revision;
+    size_t b;
+
+    icalerror_check_arg_rv((index != 0), "index");
+
+    revision = icalcomponent_get_revision(index->parent);
+    if (index->synced && index->revision == revision) {
+        return;
+    }
+
+    index->epoch++;
+    index->synced = 1;
+
+    /* An external iterator, so as not to disturb anyone iterating the
+       parent with icalcomponent_get_first/next_component() */
+    for (i = icalcomponent_begin_component(index->parent, ICAL_ANY_COMPONENT);
+         (c = icalcompiter_deref(&i)) != 0; (void)icalcompiter_next(&i)) {
+        icaltimeindex_index(index, c);
+    }
+
+    /* Drop the children that are gone. Their components may have been
+       freed, so only the node is looked at. */
+    for (b = 0; b < index->num_buckets; b++) {
+        struct icaltimeindex_node **np = &index->buckets[b];
+
+        while (*np != 0) {
+            struct icaltimeindex_node *n = *np;
+
+            if (n->epoch != index->epoch) {
+                *np = n->hash_next;
+                index->root = icaltimeindex_tree_remove(index->root, n);
+                index->count--;
+                free(n);
+            } else {
+                np = &n->hash_next;
+            }
+        }
+    }
+
+    index->revision = revision;
+}
+
+void icaltimeindex_add_component(icaltimeindex *index, icalcomponent *comp)
+{
+    icalerror_check_arg_rv((index != 0), "index");
+    icalerror_check_arg_rv((comp != 0), "comp");
+
+    icaltimeindex_index(index, comp);
+    index->revision = icalcomponent_get_revision(index->parent);
+}
+
+void icaltimeindex_remove_component(icaltimeindex *index, icalcomponent *comp)
+{
+    struct icaltimeindex_node **np;
+
+    icalerror_check_arg_rv((index != 0), "index");
+    icalerror_check_arg_rv((comp != 0), "comp");
+
+    for (np = &index->buckets[icaltimeindex_hash(index, comp)]; *np != 0;
+         np = &(*np)->hash_next) {
+        struct icaltimeindex_node *n = *np;
+
+        if (n->comp == comp) {
+            *np = n->hash_next;
+            index->root = icaltimeindex_tree_remove(index->root, n);
+            index->count--;
+            free(n);
+            break;
+        }
+    }
+
+    index->revision = icalcomponent_get_revision(index->parent);
+}
+
+size_t icaltimeindex_select(icaltimeindex *index, time_t start, time_t end, icalarray *result)
+{
+    size_t count = 0;
+
+    icalerror_check_arg_rz((index != 0), "index");
+    icalerror_check_arg_rz((result != 0), "result");
+
+    icaltimeindex_sync(index);
+    icaltimeindex_tree_select(index->root, start, end, result, &count);
+
+    return count;
+}
+
+size_t icaltimeindex_count(icaltimeindex *index)
+{
+    icalerror_check_arg_rz((index != 0), "index");
+
+    icaltimeindex_sync(index);
+
+    return index->count;
+}
@@ -0,0 +1,125 @@
+/*======================================================================
+ FILE: icaltimeindex.h
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+=========================================================================*/
+#ifndef ICALTIMEINDEX_H
+#define ICALTIMEINDEX_H
+
+#include "libical_icalss_export.h"
+#include "icalarray.h"
+#include "icalcomponent.h"
+#include "icalgauge.h"
+
+#include <time.h>
+
+/** @file icaltimeindex.h
+ *  @brief An interval index over the time ranges of the children of a
+ *         component, for finding the ones that may fall in a window
+ *         without looking at the others
+ *
+ *  Each child is indexed by a range that contains every time it can
+ *  occupy: a recurring series by the range from its first instance to
+ *  the end of its last, or to the end of time if the series does not
+ *  end. Children without a DTSTART are returned by every query. The
+ *  ranges are kept in a balanced tree ordered by start and annotated
+ *  with the latest end below each node, so a query takes O(log n + k).
+ */
+
+typedef struct icaltimeindex_impl icaltimeindex;
+
+/** The end of the range of a series that never ends */
+#define ICALTIMEINDEX_END_OF_TIME \
+    ((time_t)(sizeof(time_t) > 4 ? 0x7fffffffffffffffLL : 0x7fffffffLL))
+
+/** The start of the range of a component that could be anywhere in time */
+#define ICALTIMEINDEX_BEGINNING_OF_TIME (-ICALTIMEINDEX_END_OF_TIME - 1)
+
+/** @brief Index the children of a component
+ *
+ *  The index does not own the parent or the children. The parent is
+ *  typically an XROOT or VCALENDAR holding VCALENDAR, VEVENT, VTODO or
+ *  VJOURNAL children.
+ */
+LIBICAL_ICALSS_EXPORT icaltimeindex *icaltimeindex_new(icalcomponent *parent);
+
+LIBICAL_ICALSS_EXPORT void icaltimeindex_free(icaltimeindex *index);
+
+/** @brief Bring the index up to date with its parent
+ *
+ *  Children that were added, removed or changed since the index was
+ *  last up to date are found by their revisions, in one pass over the
+ *  children. Does nothing if the parent has not changed.
+ */
+LIBICAL_ICALSS_EXPORT void icaltimeindex_sync(icaltimeindex *index);
+
+/** @brief Index a child that was just added to the parent
+ *
+ *  Call icaltimeindex_sync() before changing the parent, and this after
+ *  adding comp, to keep the index up to date without a pass over the
+ *  children.
+ */
+LIBICAL_ICALSS_EXPORT void icaltimeindex_add_component(icaltimeindex *index,
+                                                       icalcomponent *comp);
+
+/** @brief Drop a child that was just removed from the parent
+ *
+ *  Call icaltimeindex_sync() before changing the parent, and this after
+ *  removing comp.
+ */
+LIBICAL_ICALSS_EXPORT void icaltimeindex_remove_component(icaltimeindex *index,
+                                                          icalcomponent *comp);
+
+/** @brief Find the children whose ranges meet a window
+ *
+ *  @param index  The index, which is brought up to date first
+ *  @param start  The start of the window, in UTC
+ *  @param end    The end of the window, in UTC. Both ends are inclusive.
+ *  @param result An icalarray of icalcomponent pointers the children are
+ *                appended to, in order of the start of their ranges
+ *
+ *  @return The number of children appended. These are candidates: a
+ *          child is returned if its range meets the window, whether or
+ *          not any of its instances do.
+ */
+LIBICAL_ICALSS_EXPORT size_t icaltimeindex_select(icaltimeindex *index,
+                                                  time_t start, time_t end, icalarray *result);
+
+/** @brief Return the number of children in the index */
+LIBICAL_ICALSS_EXPORT size_t icaltimeindex_count(icaltimeindex *index);
+
+/** @brief Compute the range a component is indexed by
+ *
+ *  comp may be a VEVENT, VTODO or VJOURNAL, or a VCALENDAR holding some,
+ *  in which case the range covers all of them.
+ *
+ *  @return 1, or 0 if comp has no DTSTART, so that it could be anywhere
+ *          in time; start and end are then the beginning and end of time
+ */
+LIBICAL_ICALSS_EXPORT int icaltimeindex_get_component_range(icalcomponent *comp,
+                                                            time_t *start, time_t *end);
+
+/** @brief Work out the window a gauge restricts the times of its matches to
+ *
+ *  The window is taken from the DTSTART and DTEND clauses of a gauge that
+ *  does not expand recurrences and whose clauses are all joined by AND, so that every component the gauge
+ *  accepts has a range that meets it. The gauge compares times as they
+ *  are written, without regard to their TZID, so the window is widened by
+ *  a day on each side.
+ *
+ *  @return 1 if start and end were set, 0 if the gauge does not restrict
+ *          the times of its matches
+ */
+LIBICAL_ICALSS_EXPORT int icaltimeindex_get_gauge_range(icalgauge *gauge,
+                                                        time_t *start, time_t *end);
+
+#endif /* !ICALTIMEINDEX_H */
@@ -0,0 +1,171 @@
+/*======================================================================
+ FILE: expandbench.c
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+======================================================================*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "libical/ical.h"
+#include "libicalss/icalss.h"
+
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* This program times icalinstances_expand_vcalendar() over a calendar of
+   synthetic recurring series at 1, 2, 4, 8 and 16 threads, then times
+   monthly queries by expansion and by an icalinstanceindex. */
+
+static const char *rules[] = {
+    "FREQ=DAILY",
+    "FREQ=WEEKLY;BYDAY=MO,WE,FR",
+    "FREQ=MONTHLY;BYDAY=2TU",
+    "FREQ=WEEKLY;INTERVAL=2;BYDAY=TH",
+    "FREQ=MONTHLY;BYMONTHDAY=1,15",
+    "FREQ=YEARLY;BYMONTH=3,9;BYDAY=-1FR"
+};
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static icalcomponent *make_calendar(int num_series)
+{
+    icalcomponent *calendar = icalcomponent_new_vcalendar();
+    int i;
+
+    for (i = 0; i < num_series; i++) {
+        struct icaltimetype start = icaltime_from_string("20150105T080000Z");
+        struct icaltimetype end;
+        icalcomponent *event = icalcomponent_new_vevent();
+
+        icaltime_adjust(&start, i % 365, i % 10, (i % 4) * 15, 0);
+        end = start;
+        icaltime_adjust(&end, 0, 1, 0, 0);
+
+        icalcomponent_set_dtstart(event, start);
+        icalcomponent_set_dtend(event, end);
+        icalcomponent_add_property(event,
+            icalproperty_new_rrule(icalrecurrencetype_from_string(
+                rules[i % (int)(sizeof(rules) / sizeof(rules[0]))])));
+        icalcomponent_add_component(calendar, event);
+    }
+
+    return calendar;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_series = (argc > 1) ? atoi(argv[1]) : 50000;
+    int threads[] = { 1, 2, 4, 8, 16 };
+    icalcomponent *calendar;
+    size_t expected = 0;
+    double base = 0;
+    size_t t;
+
+    calendar = make_calendar(num_series);
+
+    printf("%d series, window 20160101T000000Z-20170101T000000Z\n", num_series);
+
+    for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        icalarray *instances;
+        double start, elapsed;
+
+        start = now();
+        instances = icalinstances_expand_vcalendar(calendar,
+                                                   icaltime_from_string("20160101T000000Z"),
+                                                   icaltime_from_string("20170101T000000Z"),
+                                                   threads[t]);
+        elapsed = now() - start;
+
+        if (!instances) {
+            fprintf(stderr, "expansion failed: %s\n", icalerror_strerror(icalerrno));
+            return 1;
+        }
+        if (t == 0) {
+            expected = instances->num_elements;
+            base = elapsed;
+        } else if (instances->num_elements != expected) {
+            fprintf(stderr, "thread count changed the result\n");
+            return 1;
+        }
+
+        printf("%2d threads: %8lu instances in %7.3f s (speedup %.2f)\n",
+               threads[t], (unsigned long)instances->num_elements, elapsed,
+               elapsed > 0 ? base / elapsed : 0.0);
+
+        icalarray_free(instances);
+    }
+
+    {
+        icalinstanceindex *index;
+        size_t by_expansion = 0, by_index = 0;
+        double start, expand_time, build_time, index_time;
+        int month;
+
+        start = now();
+        for (month = 1; month <= 12; month++) {
+            struct icaltimetype from = icaltime_from_string("20160101T000000Z");
+            struct icaltimetype to;
+            icalarray *instances;
+
+            from.month = month;
+            to = from;
+            to.month++;
+            to = icaltime_normalize(to);
+
+            instances = icalinstances_expand_vcalendar(calendar, from, to, 1);
+            by_expansion += instances->num_elements;
+            icalarray_free(instances);
+        }
+        expand_time = now() - start;
+
+        start = now();
+        index = icalinstanceindex_new(calendar, icaltime_from_string("20160101T000000Z"),
+                                      icaltime_from_string("20170101T000000Z"));
+        build_time = now() - start;
+
+        start = now();
+        for (month = 1; month <= 12; month++) {
+            struct icaltimetype from = icaltime_from_string("20160101T000000Z");
+            struct icaltimetype to;
+            icalarray *instances;
+
+            from.month = month;
+            to = from;
+            to.month++;
+            to = icaltime_normalize(to);
+
+            instances = icalinstanceindex_select(index, from, to);
+            by_index += instances->num_elements;
+            icalarray_free(instances);
+        }
+        index_time = now() - start;
+
+        printf("12 monthly queries: expansion %7.3f s (%lu instances), "
+               "index %7.3f s after building it in %7.3f s (%lu instances)\n",
+               expand_time, (unsigned long)by_expansion,
+               index_time, build_time, (unsigned long)by_index);
+
+        icalinstanceindex_free(index);
+    }
+
+    icalcomponent_free(calendar);
+
+    return 0;
+}
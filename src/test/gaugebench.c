@@ -0,0 +1,154 @@
+/*======================================================================
+ FILE: gaugebench.c
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+======================================================================*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "libical/ical.h"
+#include "libicalss/icalss.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* This program writes an icalfileset of synthetic VEVENTs and times
+   selecting from it with a few icalgauge queries, without and then with
+   the time index. */
+
+static const char *queries[] = {
+    "SELECT * FROM VEVENT WHERE DTSTART >= '20160601T000000Z' AND DTSTART < '20160701T000000Z'",
+    "SELECT * FROM VEVENT WHERE SUMMARY = 'Event 42' OR LOCATION = 'Room 7'",
+    "SELECT * FROM VEVENT WHERE LOCATION = 'Room 3' AND SEQUENCE > 2 AND PRIORITY <= 5",
+    "SELECT * FROM VEVENT,VTODO WHERE VALARM.ACTION = 'AUDIO'"
+};
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int write_fileset(const char *path, int num_events)
+{
+    icalset *set;
+    int i;
+
+    (void)unlink(path);
+
+    set = icalfileset_new(path);
+    if (set == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < num_events; i++) {
+        struct icaltimetype start = icaltime_from_string("20160101T080000Z");
+        icalcomponent *event = icalcomponent_new_vevent();
+        char buf[64];
+
+        icaltime_adjust(&start, i % 366, i % 10, 0, 0);
+
+        snprintf(buf, sizeof(buf), "event-%d@gaugebench", i);
+        icalcomponent_set_uid(event, buf);
+        snprintf(buf, sizeof(buf), "Event %d", i % 1000);
+        icalcomponent_set_summary(event, buf);
+        snprintf(buf, sizeof(buf), "Room %d", i % 10);
+        icalcomponent_set_location(event, buf);
+        icalcomponent_set_dtstart(event, start);
+        icalcomponent_set_sequence(event, i % 5);
+        icalcomponent_add_property(event, icalproperty_new_priority(i % 10));
+
+        if (i % 4 == 0) {
+            icalcomponent_add_component(event,
+                icalcomponent_vanew(ICAL_VALARM_COMPONENT,
+                                    icalproperty_new_action(i % 8 ? ICAL_ACTION_DISPLAY :
+                                                            ICAL_ACTION_AUDIO),
+                                    (void *)0));
+        }
+
+        icalfileset_add_component(set, event);
+    }
+
+    icalfileset_commit(set);
+    icalfileset_free(set);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_events = (argc > 1) ? atoi(argv[1]) : 100000;
+    const char *path = (argc > 2) ? argv[2] : "gaugebench.ics";
+    icalset *set;
+    double start;
+    size_t q;
+    int indexed;
+
+    start = now();
+    if (write_fileset(path, num_events) != 0) {
+        fprintf(stderr, "cannot write %s: %s\n", path, icalerror_strerror(icalerrno));
+        return 1;
+    }
+    printf("wrote %d events in %.3f s\n", num_events, now() - start);
+
+    start = now();
+    set = icalfileset_new_reader(path);
+    if (set == 0) {
+        fprintf(stderr, "cannot read %s: %s\n", path, icalerror_strerror(icalerrno));
+        return 1;
+    }
+    printf("loaded in %.3f s\n", now() - start);
+
+    for (indexed = 0; indexed < 2; indexed++) {
+        if (indexed) {
+            start = now();
+            icalfileset_set_time_index(set, 1);
+            printf("indexed in %.3f s\n", now() - start);
+        }
+
+        for (q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+            icalgauge *gauge = icalgauge_new_from_sql(queries[q], 0);
+            icalcomponent *c;
+            int matches = 0;
+            double elapsed;
+
+            if (gauge == 0) {
+                fprintf(stderr, "cannot parse %s\n", queries[q]);
+                return 1;
+            }
+
+            start = now();
+            icalfileset_select(set, gauge);
+            for (c = icalfileset_get_first_component(set); c != 0;
+                 c = icalfileset_get_next_component(set)) {
+                matches++;
+            }
+            elapsed = now() - start;
+
+            printf("%7.3f s %7d matches  %s\n", elapsed, matches, queries[q]);
+
+            icalfileset_clear(set);
+            icalgauge_free(gauge);
+        }
+    }
+
+    icalfileset_free(set);
+    (void)unlink(path);
+
+    return 0;
+}
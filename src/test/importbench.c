@@ -0,0 +1,159 @@
+/*======================================================================
+ FILE: importbench.c
+
+ This library is free software; you can redistribute it and/or modify
+ it under the terms of either:
+
+    The LGPL as published by the Free Software Foundation, version
+    2.1, available at: http://www.gnu.org/licenses/lgpl-2.1.html
+
+ Or:
+
+    The Mozilla Public License Version 2.0. You may obtain a copy of
+    the License at http://www.mozilla.org/MPL/
+======================================================================*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "libical/ical.h"
+#include "libicalss/icalss.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* This program imports synthetic VEVENTs, spread over two years so that
+   consecutive events fall in different clusters, into an icaldirset and
+   an icalfileset, adding them in batches with icalset_add_components()
+   and then one at a time with icalset_add_component(). Adding one at a
+   time to a directory set writes and reloads clusters as they fall out
+   of its cache, so past a few hundred thousand events that part takes
+   a long time. */
+
+#define BATCH_SIZE 10000
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static icalcomponent *make_event(int i)
+{
+    struct icaltimetype start = icaltime_from_string("20150101T080000Z");
+    icalcomponent *event = icalcomponent_new_vevent();
+    char buf[64];
+
+    start.year += (i % 24) / 12;
+    start.month += (i % 24) % 12;
+    start.day += (i / 24) % 28;
+    start.hour += i % 10;
+
+    snprintf(buf, sizeof(buf), "event-%d@importbench", i);
+    icalcomponent_set_uid(event, buf);
+    snprintf(buf, sizeof(buf), "Event %d", i % 1000);
+    icalcomponent_set_summary(event, buf);
+    icalcomponent_set_dtstart(event, start);
+    icalcomponent_add_property(event, icalproperty_new_dtstamp(start));
+
+    return icalcomponent_vanew(ICAL_VCALENDAR_COMPONENT, event, (void *)0);
+}
+
+static void clean_dir(const char *dir)
+{
+    char path[1024];
+    struct dirent *de;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == 0) {
+        (void)mkdir(dir, 0755);
+        return;
+    }
+
+    while ((de = readdir(dp)) != 0) {
+        if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || de->d_name[1] == '.')) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        (void)unlink(path);
+    }
+
+    closedir(dp);
+}
+
+static int import(icalset *set, int num_events, int batch)
+{
+    icalcomponent **comps;
+    int i, n;
+
+    if (!batch) {
+        for (i = 0; i < num_events; i++) {
+            if (icalset_add_component(set, make_event(i)) != ICAL_NO_ERROR) {
+                return -1;
+            }
+        }
+        return (icalset_commit(set) == ICAL_NO_ERROR) ? 0 : -1;
+    }
+
+    if ((comps = (icalcomponent **)malloc(BATCH_SIZE * sizeof(icalcomponent *))) == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < num_events; i += n) {
+        for (n = 0; n < BATCH_SIZE && i + n < num_events; n++) {
+            comps[n] = make_event(i + n);
+        }
+        if (icalset_add_components(set, comps, (size_t)n) != ICAL_NO_ERROR) {
+            free(comps);
+            return -1;
+        }
+    }
+    free(comps);
+
+    return (icalset_commit(set) == ICAL_NO_ERROR) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_events = (argc > 1) ? atoi(argv[1]) : 1000000;
+    const char *dir = (argc > 2) ? argv[2] : "importbench.d";
+    const char *path = (argc > 3) ? argv[3] : "importbench.ics";
+    int batch;
+
+    for (batch = 1; batch >= 0; batch--) {
+        const char *how = batch ? "in batches" : "one at a time";
+        icalset *set;
+        double start;
+
+        clean_dir(dir);
+        start = now();
+        if ((set = icaldirset_new(dir)) == 0 || import(set, num_events, batch) != 0) {
+            fprintf(stderr, "cannot import into %s: %s\n", dir, icalerror_strerror(icalerrno));
+            return 1;
+        }
+        icalset_free(set);
+        printf("dirset:  %7.3f s  %d events %s\n", now() - start, num_events, how);
+
+        (void)unlink(path);
+        start = now();
+        if ((set = icalfileset_new(path)) == 0 || import(set, num_events, batch) != 0) {
+            fprintf(stderr, "cannot import into %s: %s\n", path, icalerror_strerror(icalerrno));
+            return 1;
+        }
+        icalset_free(set);
+        printf("fileset: %7.3f s  %d events %s\n", now() - start, num_events, how);
+    }
+
+    clean_dir(dir);
+    (void)rmdir(dir);
+    (void)unlink(path);
+
+    return 0;
+}
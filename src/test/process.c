@@ -34,7 +34,7 @@ int main(int argc, char *argv[])
     icalcomponent *c, *next_c = NULL;
     int i = 0;
     int dont_remove;
-    icalfileset_options options = { O_RDONLY, 0644, 0, NULL };
+    icalfileset_options options = { O_RDONLY, 0644, 0, NULL, 0 };
 
     icalset *f = icalset_new(ICAL_FILE_SET, TEST_DATADIR "/process-incoming.ics", &options);
     icalset *trash = icalset_new_file("trash.ics");
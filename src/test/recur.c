@@ -135,6 +135,8 @@ int main(int argc, char *argv[])
 
     icaltimezone_free_builtin_timezones();
 
+    icalrecurrencetype_free_cache();
+
     icalmemory_free_ring();
 
     free_zone_directory();
@@ -80,7 +80,7 @@ void test_classify(void)
 
     /* Open up the two storage files, one for the incoming components,
        one for the calendar */
-    icalfileset_options options = { O_RDONLY, 0644, 0, NULL };
+    icalfileset_options options = { O_RDONLY, 0644, 0, NULL, 0 };
     icalset *incoming = icalset_new(ICAL_FILE_SET, TEST_DATADIR "/incoming.ics", &options);
     icalset *cal = icalset_new(ICAL_FILE_SET, TEST_DATADIR "/calendar.ics", &options);
     icalset *f = icalset_new(ICAL_FILE_SET, TEST_DATADIR "/classify.ics", &options);
@@ -24,6 +24,8 @@
 #include "regression.h"
 #include "libical/ical.h"
 
+#include <stdlib.h>
+
 void create_simple_component(void)
 {
     icalcomponent *calendar;
@@ -499,3 +501,663 @@ void test_icalcomponent_get_span()
     /* assert(icalerrno == ICAL_MALFORMEDDATA_ERROR); */
     icalerror_set_errors_are_fatal(1);
 }
+
+static int utc_hour(struct icaltimetype t)
+{
+    return icaltime_convert_to_zone(t, icaltimezone_get_utc_timezone()).hour;
+}
+
+/** Test that the times cached by icalcomponent_get_span() and friends
+ *  follow changes to the component
+ */
+void test_icalcomponent_cached_times()
+{
+    static const char calendar_str[] =
+        "BEGIN:VCALENDAR\n"
+        "BEGIN:VTIMEZONE\n"
+        "TZID:Fixed/Plus1\n"
+        "BEGIN:STANDARD\n"
+        "DTSTART:19700101T000000\n"
+        "TZOFFSETFROM:+0100\n"
+        "TZOFFSETTO:+0100\n"
+        "END:STANDARD\n"
+        "END:VTIMEZONE\n"
+        "BEGIN:VTIMEZONE\n"
+        "TZID:Fixed/Plus2\n"
+        "BEGIN:STANDARD\n"
+        "DTSTART:19700101T000000\n"
+        "TZOFFSETFROM:+0200\n"
+        "TZOFFSETTO:+0200\n"
+        "END:STANDARD\n"
+        "END:VTIMEZONE\n"
+        "BEGIN:VEVENT\n"
+        "UID:cached-times\n"
+        "DTSTART;TZID=Fixed/Plus1:20160301T100000\n"
+        "DTEND;TZID=Fixed/Plus1:20160301T110000\n"
+        "END:VEVENT\n"
+        "END:VCALENDAR\n";
+    icalcomponent *calendar, *event, *vtimezone, *other, *moved;
+    icalproperty *dtstart, *dtend;
+    struct icaldurationtype dur;
+    struct icaltime_span span;
+    time_t start;
+
+    calendar = icalparser_parse_string(calendar_str);
+    event = icalcomponent_get_first_component(calendar, ICAL_VEVENT_COMPONENT);
+    dtstart = icalcomponent_get_first_property(event, ICAL_DTSTART_PROPERTY);
+    dtend = icalcomponent_get_first_property(event, ICAL_DTEND_PROPERTY);
+
+    span = icalcomponent_get_span(event);
+    start = span.start;
+    int_is("span", (int)(span.end - span.start), 3600);
+    int_is("repeated span", (int)icalcomponent_get_span(event).start, (int)start);
+
+    /* Editing a parameter in place */
+    icalparameter_set_tzid(icalproperty_get_first_parameter(dtstart, ICAL_TZID_PARAMETER),
+                           "Fixed/Plus2");
+    str_is("TZID changed",
+           icaltimezone_get_tzid((icaltimezone *)icalcomponent_get_dtstart(event).zone),
+           "Fixed/Plus2");
+
+    /* Editing a value in place */
+    icalvalue_set_datetime(icalproperty_get_value(dtstart),
+                           icaltime_from_string("20160301T090000"));
+    int_is("value changed", icalcomponent_get_dtstart(event).hour, 9);
+    int_is("value changed, span", (int)icalcomponent_get_span(event).start, (int)(start - 3600));
+
+    /* Replacing DTEND with DURATION */
+    icalcomponent_remove_property(event, dtend);
+    icalproperty_free(dtend);
+    ok("no DTEND", icaltime_is_null_time(icalcomponent_get_dtend(event)));
+    memset(&dur, 0, sizeof(dur));
+    dur.minutes = 30;
+    icalcomponent_add_property(event, icalproperty_new_duration(dur));
+    span = icalcomponent_get_span(event);
+    int_is("DURATION added", (int)(span.end - span.start), 1800);
+
+    /* Removing the VTIMEZONE the event refers to */
+    vtimezone =
+        icaltimezone_get_component((icaltimezone *)icalcomponent_get_dtstart(event).zone);
+    icalcomponent_remove_component(calendar, vtimezone);
+    icalcomponent_free(vtimezone);
+    ok("VTIMEZONE removed", icalcomponent_get_dtstart(event).zone == NULL);
+
+    /* Moving the event out of the calendar */
+    icalcomponent_set_dtstart(event, icaltime_from_string("20160301T090000Z"));
+    span = icalcomponent_get_span(event);
+    icalcomponent_remove_component(calendar, event);
+    int_is("event detached", (int)icalcomponent_get_span(event).start, (int)span.start);
+    icalcomponent_set_dtstart(event, icaltime_from_string("20160301T080000Z"));
+    int_is("detached event changed", (int)icalcomponent_get_span(event).start,
+           (int)(span.start - 3600));
+
+    icalcomponent_free(event);
+    icalcomponent_free(calendar);
+
+    /* Times follow VTIMEZONEs added after they were cached, and the
+       calendar an event moves to, though the event itself is unchanged */
+    calendar = icalparser_parse_string(calendar_str);
+    event = icalcomponent_get_first_component(calendar, ICAL_VEVENT_COMPONENT);
+    other = icalcomponent_new_clone(event);
+    icalcomponent_add_component(calendar, other);
+    dtstart = icalcomponent_get_first_property(event, ICAL_DTSTART_PROPERTY);
+    icalparameter_set_tzid(icalproperty_get_first_parameter(dtstart, ICAL_TZID_PARAMETER),
+                           "Fixed/Plus3");
+    ok("no such VTIMEZONE", icalcomponent_get_dtstart(event).zone == NULL);
+    int_is("cached in Fixed/Plus1", utc_hour(icalcomponent_get_dtstart(other)), 9);
+    icalcomponent_set_summary(event, "sibling changed");
+    int_is("sibling edited", utc_hour(icalcomponent_get_dtstart(other)), 9);
+
+    vtimezone = icalcomponent_new_clone(
+        icalcomponent_get_first_component(calendar, ICAL_VTIMEZONE_COMPONENT));
+    icalproperty_set_tzid(icalcomponent_get_first_property(vtimezone, ICAL_TZID_PROPERTY),
+                          "Fixed/Plus3");
+    icalcomponent_add_component(calendar, vtimezone);
+    ok("VTIMEZONE added", icalcomponent_get_dtstart(event).zone != NULL);
+
+    moved = icalparser_parse_string("BEGIN:VCALENDAR\n"
+                                    "BEGIN:VTIMEZONE\n"
+                                    "TZID:Fixed/Plus1\n"
+                                    "BEGIN:STANDARD\n"
+                                    "DTSTART:19700101T000000\n"
+                                    "TZOFFSETFROM:+0200\n"
+                                    "TZOFFSETTO:+0200\n"
+                                    "END:STANDARD\n"
+                                    "END:VTIMEZONE\n"
+                                    "END:VCALENDAR\n");
+    icalcomponent_remove_component(calendar, other);
+    icalcomponent_add_component(moved, other);
+    int_is("moved to where Fixed/Plus1 is +2", utc_hour(icalcomponent_get_dtstart(other)), 8);
+
+    icalcomponent_free(moved);
+    icalcomponent_free(calendar);
+}
+
+/** Test that every setter of a property, parameter or value moves the
+ *  revision of the component holding it
+ */
+void test_icalcomponent_revision()
+{
+    icalcomponent *event = icalcomponent_new_from_string(
+        "BEGIN:VEVENT\n"
+        "UID:revision\n"
+        "RRULE:FREQ=DAILY\n"
+        "ATTACH:http://example.com/a\n"
+        "X-NOTE;X-LEVEL=1:x\n"
+        "END:VEVENT\n");
+    icalproperty *rrule = icalcomponent_get_first_property(event, ICAL_RRULE_PROPERTY);
+    icalproperty *attach = icalcomponent_get_first_property(event, ICAL_ATTACH_PROPERTY);
+    icalproperty *x = icalcomponent_get_first_property(event, ICAL_X_PROPERTY);
+    icalparameter *level = icalproperty_get_first_parameter(x, ICAL_X_PARAMETER);
+    struct icalrecurrencetype recur = icalrecurrencetype_from_string("FREQ=WEEKLY");
+    icalattach *url = icalattach_new_from_url("http://example.com/b");
+    unsigned long revision = icalcomponent_get_revision(event);
+
+#define REVISION_MOVED(name) \
+    ok(name, icalcomponent_get_revision(event) != revision); \
+    revision = icalcomponent_get_revision(event)
+
+    icalproperty_set_x_name(x, "X-OTHER");
+    REVISION_MOVED("property x name");
+    icalparameter_set_xname(level, "X-DEPTH");
+    REVISION_MOVED("parameter x name");
+    icalparameter_set_xvalue(level, "2");
+    REVISION_MOVED("parameter x value");
+    icalvalue_set_x(icalproperty_get_value(x), "y");
+    REVISION_MOVED("x value");
+    icalvalue_set_recur(icalproperty_get_value(rrule), recur);
+    REVISION_MOVED("recur value");
+    icalvalue_set_attach(icalproperty_get_value(attach), url);
+    REVISION_MOVED("attach value");
+
+#undef REVISION_MOVED
+
+    icalattach_unref(url);
+    icalcomponent_free(event);
+}
+
+static icalcomponent *make_merge_calendar(const char *uid, int offset)
+{
+    char buf[1024];
+
+    snprintf(buf, sizeof(buf),
+             "BEGIN:VCALENDAR\n"
+             "BEGIN:VTIMEZONE\n"
+             "TZID:London\n"
+             "BEGIN:STANDARD\n"
+             "DTSTART:19700101T000000\n"
+             "TZOFFSETFROM:+%02d00\n"
+             "TZOFFSETTO:+%02d00\n"
+             "END:STANDARD\n"
+             "END:VTIMEZONE\n"
+             "BEGIN:VEVENT\n"
+             "UID:%s\n"
+             "DTSTART;TZID=London:20160301T100000\n"
+             "END:VEVENT\n"
+             "END:VCALENDAR\n", offset, offset, uid);
+
+    return icalparser_parse_string(buf);
+}
+
+static const char *merged_event_tzid(icalcomponent *calendar, const char *uid)
+{
+    icalcomponent *event;
+
+    for (event = icalcomponent_get_first_component(calendar, ICAL_VEVENT_COMPONENT);
+         event != 0;
+         event = icalcomponent_get_next_component(calendar, ICAL_VEVENT_COMPONENT)) {
+        if (strcmp(icalcomponent_get_uid(event), uid) == 0) {
+            icalproperty *dtstart = icalcomponent_get_first_property(event, ICAL_DTSTART_PROPERTY);
+
+            return icalproperty_get_parameter_as_string(dtstart, "TZID");
+        }
+    }
+
+    return "";
+}
+
+/** Test that icalcomponent_merge_component() shares identical VTIMEZONEs
+ *  and renames conflicting ones
+ */
+void test_icalcomponent_merge()
+{
+    icalcomponent *calendar = make_merge_calendar("a", 0);
+
+    /* The same zone under the same TZID is shared */
+    icalcomponent_merge_component(calendar, make_merge_calendar("b", 0));
+    /* A different zone under that TZID gets a new one */
+    icalcomponent_merge_component(calendar, make_merge_calendar("c", 1));
+    /* which later copies of it are renamed to as well */
+    icalcomponent_merge_component(calendar, make_merge_calendar("d", 1));
+    icalcomponent_merge_component(calendar, make_merge_calendar("e", 2));
+    icalcomponent_merge_component(calendar, make_merge_calendar("f", 0));
+    icalcomponent_merge_component(calendar, make_merge_calendar("g", 2));
+
+    int_is("VTIMEZONEs", icalcomponent_count_components(calendar, ICAL_VTIMEZONE_COMPONENT), 3);
+    int_is("VEVENTs", icalcomponent_count_components(calendar, ICAL_VEVENT_COMPONENT), 7);
+    str_is("a", merged_event_tzid(calendar, "a"), "London");
+    str_is("b", merged_event_tzid(calendar, "b"), "London");
+    str_is("c", merged_event_tzid(calendar, "c"), "London1");
+    str_is("d", merged_event_tzid(calendar, "d"), "London1");
+    str_is("e", merged_event_tzid(calendar, "e"), "London2");
+    str_is("f", merged_event_tzid(calendar, "f"), "London");
+    str_is("g", merged_event_tzid(calendar, "g"), "London2");
+
+    icalcomponent_free(calendar);
+}
+
+static int uid_is_odd(icalcomponent *child, void *data)
+{
+    (void)data;
+    return atoi(icalcomponent_get_uid(child)) % 2;
+}
+
+/** Test removing single children and whole selections of them */
+void test_icalcomponent_bulk_children()
+{
+    icalcomponent *from = icalcomponent_new_vcalendar();
+    icalcomponent *to = icalcomponent_new_vcalendar();
+    icalcomponent *events[10];
+    icaltimezone *zone;
+    char uid[8];
+    size_t n;
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        events[i] = icalcomponent_new_vevent();
+        snprintf(uid, sizeof(uid), "%d", i);
+        icalcomponent_set_uid(events[i], uid);
+        icalcomponent_add_component(from, events[i]);
+    }
+    icalcomponent_merge_component(from, make_merge_calendar("x", 0));
+    int_is("VTIMEZONE added", icalcomponent_count_components(from, ICAL_VTIMEZONE_COMPONENT), 1);
+
+    /* Removing a child out of the middle keeps the iterator usable */
+    (void)icalcomponent_get_first_component(from, ICAL_VEVENT_COMPONENT);
+    icalcomponent_remove_component(from, events[0]);
+    icalcomponent_free(events[0]);
+    str_is("iterator moved on",
+           icalcomponent_get_uid(icalcomponent_get_current_component(from)), "1");
+
+    n = icalcomponent_move_components(to, from, ICAL_VEVENT_COMPONENT, uid_is_odd, 0);
+    int_is("moved", (int)n, 5);
+    int_is("moved VEVENTs", icalcomponent_count_components(to, ICAL_VEVENT_COMPONENT), 5);
+    ok("moved parent", icalcomponent_get_parent(events[3]) == to);
+
+    n = icalcomponent_remove_components(from, ICAL_VEVENT_COMPONENT, 0, 0);
+    int_is("removed", (int)n, 5);
+    int_is("VEVENTs left", icalcomponent_count_components(from, ICAL_VEVENT_COMPONENT), 0);
+
+    /* A removed VTIMEZONE is no longer found by TZID */
+    ok("zone before", icalcomponent_get_timezone(from, "London") != 0);
+    n = icalcomponent_remove_components(from, ICAL_VTIMEZONE_COMPONENT, 0, 0);
+    int_is("removed VTIMEZONE", (int)n, 1);
+    zone = icalcomponent_get_timezone(from, "London");
+    ok("zone after", zone == 0);
+    int_is("all children", icalcomponent_count_components(from, ICAL_ANY_COMPONENT), 0);
+
+    icalcomponent_free(from);
+    icalcomponent_free(to);
+}
+
+static int fingerprints_equal(icalcomponent *a, icalcomponent *b)
+{
+    icalfingerprint fa = icalcomponent_fingerprint(a);
+    icalfingerprint fb = icalcomponent_fingerprint(b);
+
+    return icalfingerprint_compare(&fa, &fb) == 0;
+}
+
+/* Whether the fingerprint of comp is that of comp parsed afresh */
+static int fingerprint_matches_text(icalcomponent *comp)
+{
+    char *str = icalcomponent_as_ical_string_r(comp);
+    icalcomponent *parsed = icalcomponent_new_from_string(str);
+    int equal = fingerprints_equal(comp, parsed);
+
+    icalcomponent_free(parsed);
+    free(str);
+
+    return equal;
+}
+
+/** Test that icalcomponent_fingerprint() ignores ordering and follows
+ *  changes to the component
+ */
+void test_icalcomponent_fingerprint()
+{
+    icalcomponent *a = icalcomponent_new_from_string(
+        "BEGIN:VEVENT\n"
+        "UID:fingerprint\n"
+        "SUMMARY:Lunch\n"
+        "ATTENDEE;ROLE=CHAIR;RSVP=TRUE:mailto:a@example.com\n"
+        "DTSTART:20160301T120000Z\n"
+        "BEGIN:VALARM\n"
+        "ACTION:DISPLAY\n"
+        "TRIGGER:-PT15M\n"
+        "END:VALARM\n"
+        "END:VEVENT\n");
+    icalcomponent *b = icalcomponent_new_from_string(
+        "BEGIN:VEVENT\n"
+        "DTSTART:20160301T120000Z\n"
+        "BEGIN:VALARM\n"
+        "TRIGGER:-PT15M\n"
+        "ACTION:DISPLAY\n"
+        "END:VALARM\n"
+        "ATTENDEE;RSVP=TRUE;ROLE=CHAIR:mailto:a@example.com\n"
+        "summary:Lunch\n"
+        "UID:fingerprint\n"
+        "END:VEVENT\n");
+    icalcomponent *alarm = icalcomponent_get_first_component(a, ICAL_VALARM_COMPONENT);
+    icalproperty *attendee = icalcomponent_get_first_property(a, ICAL_ATTENDEE_PROPERTY);
+    icalcomponent *clone;
+    icalfingerprint fp;
+    char *str;
+
+    ok("reordered", fingerprints_equal(a, b));
+
+    fp = icalcomponent_fingerprint(a);
+    str = icalfingerprint_as_string_r(&fp);
+    int_is("hex digits", (int)strlen(str), 32);
+    free(str);
+
+    str = icalcomponent_as_ical_string_r(a);
+    clone = icalcomponent_new_from_string(str);
+    free(str);
+    ok("reparsed", fingerprints_equal(a, clone));
+    icalcomponent_free(clone);
+
+    icalcomponent_set_summary(a, "Dinner");
+    ok("changed value", !fingerprints_equal(a, b));
+    icalcomponent_set_summary(a, "Lunch");
+    ok("restored value", fingerprints_equal(a, b));
+
+    icalparameter_set_role(icalproperty_get_first_parameter(attendee, ICAL_ROLE_PARAMETER),
+                           ICAL_ROLE_OPTPARTICIPANT);
+    ok("changed parameter", !fingerprints_equal(a, b));
+    icalparameter_set_role(icalproperty_get_first_parameter(attendee, ICAL_ROLE_PARAMETER),
+                           ICAL_ROLE_CHAIR);
+    ok("restored parameter", fingerprints_equal(a, b));
+
+    icalcomponent_add_property(alarm, icalproperty_new_description("Reminder"));
+    ok("changed child", !fingerprints_equal(a, b));
+
+    icalcomponent_free(a);
+    icalcomponent_free(b);
+
+    /* Setters that change names and values in place */
+    a = icalcomponent_new_from_string(
+        "BEGIN:VEVENT\n"
+        "UID:fingerprint-setters\n"
+        "RRULE:FREQ=DAILY\n"
+        "X-NOTE;X-LEVEL=1:x\n"
+        "END:VEVENT\n");
+    (void)icalcomponent_fingerprint(a);
+
+    icalproperty_set_x_name(icalcomponent_get_first_property(a, ICAL_X_PROPERTY), "X-OTHER");
+    ok("property x name", fingerprint_matches_text(a));
+
+    icalparameter_set_xvalue(
+        icalproperty_get_first_parameter(icalcomponent_get_first_property(a, ICAL_X_PROPERTY),
+                                         ICAL_X_PARAMETER), "2");
+    ok("parameter x value", fingerprint_matches_text(a));
+
+    icalvalue_set_recur(
+        icalproperty_get_value(icalcomponent_get_first_property(a, ICAL_RRULE_PROPERTY)),
+        icalrecurrencetype_from_string("FREQ=WEEKLY"));
+    ok("recur value", fingerprint_matches_text(a));
+
+    icalcomponent_free(a);
+}
+
+static void sort_event(icalcomponent *calendar, const char *uid, const char *dtstart)
+{
+    icalcomponent *event = icalcomponent_new_vevent();
+
+    icalcomponent_set_uid(event, uid);
+    if (dtstart) {
+        icalcomponent_add_property(event, icalproperty_new_from_string(dtstart));
+    }
+    icalcomponent_add_component(calendar, event);
+}
+
+/** Test that a patch from icalcomponent_diff() turns the old version into
+ *  the new one, also after a round trip through text
+ */
+void test_icalcomponent_diff()
+{
+    icalcomponent *a = icalparser_parse_string(
+        "BEGIN:VCALENDAR\n"
+        "PRODID:-//diff//EN\n"
+        "BEGIN:VEVENT\n"
+        "UID:series\n"
+        "DTSTART:20160301T120000Z\n"
+        "RRULE:FREQ=WEEKLY\n"
+        "SUMMARY:Lunch\n"
+        "ATTENDEE;ROLE=CHAIR:mailto:a@example.com\n"
+        "ATTENDEE:mailto:b@example.com\n"
+        "BEGIN:VALARM\n"
+        "ACTION:DISPLAY\n"
+        "TRIGGER:-PT15M\n"
+        "END:VALARM\n"
+        "END:VEVENT\n"
+        "BEGIN:VEVENT\n"
+        "UID:series\n"
+        "RECURRENCE-ID:20160308T120000Z\n"
+        "DTSTART:20160308T130000Z\n"
+        "SUMMARY:Late lunch\n"
+        "END:VEVENT\n"
+        "BEGIN:VEVENT\n"
+        "UID:gone\n"
+        "DTSTART:20160302T120000Z\n"
+        "END:VEVENT\n"
+        "END:VCALENDAR\n");
+    icalcomponent *b = icalparser_parse_string(
+        "BEGIN:VCALENDAR\n"
+        "PRODID:-//diff//EN\n"
+        "BEGIN:VEVENT\n"
+        "UID:new\n"
+        "DTSTART:20160303T120000Z\n"
+        "END:VEVENT\n"
+        "BEGIN:VEVENT\n"
+        "UID:series\n"
+        "RECURRENCE-ID:20160308T120000Z\n"
+        "DTSTART:20160308T130000Z\n"
+        "SUMMARY:Later lunch\n"
+        "END:VEVENT\n"
+        "BEGIN:VEVENT\n"
+        "UID:series\n"
+        "DTSTART:20160301T120000Z\n"
+        "RRULE:FREQ=WEEKLY\n"
+        "SUMMARY:Dinner\n"
+        "ATTENDEE;ROLE=OPT-PARTICIPANT:mailto:a@example.com\n"
+        "ATTENDEE:mailto:c@example.com\n"
+        "BEGIN:VALARM\n"
+        "ACTION:DISPLAY\n"
+        "TRIGGER:-PT30M\n"
+        "END:VALARM\n"
+        "END:VEVENT\n"
+        "END:VCALENDAR\n");
+    icalcomponent *patch, *copy, *other;
+    char *str, uid[16];
+    int i;
+
+    patch = icalcomponent_diff(a, a);
+    int_is("no changes", icalcomponent_count_components(patch, ICAL_ANY_COMPONENT), 0);
+    icalcomponent_free(patch);
+
+    patch = icalcomponent_diff(a, b);
+    ok("diff", patch != 0);
+    int_is("top level operations", icalcomponent_count_components(patch, ICAL_ANY_COMPONENT), 4);
+
+    copy = icalcomponent_new_clone(a);
+    int_is("apply", icalcomponent_apply_patch(copy, patch), 0);
+    ok("patched", fingerprints_equal(copy, b));
+    icalcomponent_free(copy);
+
+    str = icalcomponent_as_ical_string_r(patch);
+    icalcomponent_free(patch);
+    patch = icalparser_parse_string(str);
+    free(str);
+
+    copy = icalcomponent_new_clone(a);
+    int_is("apply parsed", icalcomponent_apply_patch(copy, patch), 0);
+    ok("patched from text", fingerprints_equal(copy, b));
+    icalcomponent_free(copy);
+
+    /* The patch does not fit a calendar without the removed event */
+    other = icalcomponent_new_clone(a);
+    icalcomponent_remove_components(other, ICAL_VEVENT_COMPONENT, 0, 0);
+    icalerror_set_errors_are_fatal(0);
+    int_is("mismatch", icalcomponent_apply_patch(other, patch), -1);
+    icalerror_set_errors_are_fatal(1);
+    int_is("mismatch error", icalerrno, ICAL_MALFORMEDDATA_ERROR);
+    icalerror_clear_errno();
+    icalcomponent_free(other);
+
+    icalcomponent_free(patch);
+    icalcomponent_free(a);
+    icalcomponent_free(b);
+
+    /* Children are matched whatever their order, and twins without a
+       UID pair up one for one */
+    a = icalcomponent_new_vcalendar();
+    b = icalcomponent_new_vcalendar();
+    for (i = 0; i < 200; i++) {
+        snprintf(uid, sizeof(uid), "many-%03d", i);
+        sort_event(a, uid, "DTSTART:20160301T100000Z");
+        snprintf(uid, sizeof(uid), "many-%03d", 199 - i);
+        sort_event(b, uid, i == 50 ? "DTSTART:20160302T100000Z" : "DTSTART:20160301T100000Z");
+    }
+    for (i = 0; i < 3; i++) {
+        icalcomponent_add_component(a, icalcomponent_vanew(ICAL_VALARM_COMPONENT,
+                                                           icalproperty_new_action(ICAL_ACTION_DISPLAY),
+                                                           icalproperty_new_description("twin"),
+                                                           (void *)0));
+    }
+    icalcomponent_add_component(b, icalcomponent_vanew(ICAL_VALARM_COMPONENT,
+                                                       icalproperty_new_action(ICAL_ACTION_DISPLAY),
+                                                       icalproperty_new_description("twin"),
+                                                       (void *)0));
+    icalcomponent_add_property(a, icalproperty_new_comment("kept"));
+    icalcomponent_add_property(a, icalproperty_new_comment("kept"));
+    icalcomponent_add_property(b, icalproperty_new_comment("kept"));
+
+    patch = icalcomponent_diff(a, b);
+    int_is("reordered children, one changed",
+           icalcomponent_count_components(patch, ICAL_ANY_COMPONENT), 3);
+    other = icalcomponent_get_first_component(patch, ICAL_ANY_COMPONENT);
+    ok("extra comment removed", (other != 0 &&
+                                 strcmp(icalcomponent_get_x_name(other), "X-LIC-REMOVE-PROPERTY") == 0));
+    other = icalcomponent_get_next_component(patch, ICAL_ANY_COMPONENT);
+    ok("changed child patched", (other != 0 &&
+                                 strcmp(icalcomponent_get_x_name(other), "X-LIC-PATCH-COMPONENT") == 0));
+    other = icalcomponent_get_next_component(patch, ICAL_ANY_COMPONENT);
+    ok("extra twins removed", (other != 0 &&
+                               icalcomponent_count_components(other, ICAL_VALARM_COMPONENT) == 2));
+    copy = icalcomponent_new_clone(a);
+    int_is("apply to reordered", icalcomponent_apply_patch(copy, patch), 0);
+    int_is("patched twins", icalcomponent_count_components(copy, ICAL_VALARM_COMPONENT), 1);
+    int_is("patched comments", icalcomponent_count_properties(copy, ICAL_COMMENT_PROPERTY), 1);
+    int_is("patched children", icalcomponent_count_components(copy, ICAL_VEVENT_COMPONENT), 200);
+    icalcomponent_free(copy);
+
+    icalcomponent_free(patch);
+    icalcomponent_free(a);
+    icalcomponent_free(b);
+
+    /* Children sharing a UID are each patched or removed by position */
+    a = icalparser_parse_string("BEGIN:VCALENDAR\n"
+                                "BEGIN:VEVENT\nUID:x\nSUMMARY:one\nEND:VEVENT\n"
+                                "BEGIN:VEVENT\nUID:x\nSUMMARY:two\nEND:VEVENT\n"
+                                "END:VCALENDAR\n");
+    b = icalparser_parse_string("BEGIN:VCALENDAR\n"
+                                "BEGIN:VEVENT\nUID:x\nSUMMARY:three\nEND:VEVENT\n"
+                                "END:VCALENDAR\n");
+    patch = icalcomponent_diff(a, b);
+    copy = icalcomponent_new_clone(a);
+    int_is("apply to shared UID", icalcomponent_apply_patch(copy, patch), 0);
+    ok("shared UID patched", fingerprints_equal(copy, b));
+    icalcomponent_free(copy);
+    icalcomponent_free(patch);
+
+    /* The second one goes, though the first needs no operation */
+    icalcomponent_free(b);
+    b = icalparser_parse_string("BEGIN:VCALENDAR\n"
+                                "BEGIN:VEVENT\nUID:x\nSUMMARY:one\nEND:VEVENT\n"
+                                "END:VCALENDAR\n");
+    patch = icalcomponent_diff(a, b);
+    str = icalcomponent_as_ical_string_r(patch);
+    icalcomponent_free(patch);
+    patch = icalparser_parse_string(str);
+    free(str);
+    copy = icalcomponent_new_clone(a);
+    int_is("apply parsed to shared UID", icalcomponent_apply_patch(copy, patch), 0);
+    ok("second of shared UID removed", fingerprints_equal(copy, b));
+    icalcomponent_free(copy);
+    icalcomponent_free(patch);
+
+    icalcomponent_free(a);
+    icalcomponent_free(b);
+}
+
+static void sort_order(icalcomponent *calendar, char *buf)
+{
+    icalcomponent *child;
+
+    buf[0] = '\0';
+    for (child = icalcomponent_get_first_component(calendar, ICAL_ANY_COMPONENT);
+         child != 0; child = icalcomponent_get_next_component(calendar, ICAL_ANY_COMPONENT)) {
+        strcat(buf, icalcomponent_isa(child) == ICAL_VTIMEZONE_COMPONENT ?
+               "tz" : icalcomponent_get_uid(child));
+        strcat(buf, " ");
+    }
+}
+
+/** Test sorting children by DTSTART and by UID */
+void test_icalcomponent_sort()
+{
+    icalcomponent *calendar = icalparser_parse_string(
+        "BEGIN:VCALENDAR\n"
+        "BEGIN:VTIMEZONE\n"
+        "TZID:Fixed/Plus5\n"
+        "BEGIN:STANDARD\n"
+        "DTSTART:19700101T000000\n"
+        "TZOFFSETFROM:+0500\n"
+        "TZOFFSETTO:+0500\n"
+        "END:STANDARD\n"
+        "END:VTIMEZONE\n"
+        "END:VCALENDAR\n");
+    icalcomponent *todo = icalcomponent_new_vtodo();
+    icalcomponent *child;
+    char order[256];
+
+    sort_event(calendar, "c", "DTSTART:20160301T100000Z");
+    sort_event(calendar, "none", 0);
+    sort_event(calendar, "a", "DTSTART;TZID=Fixed/Plus5:20160301T120000");
+    icalcomponent_set_uid(todo, "todo");
+    icalcomponent_add_component(calendar, todo);
+    sort_event(calendar, "b", "DTSTART:20160301T090000Z");
+    sort_event(calendar, "d", "DTSTART:20160301T090000Z");
+
+    int_is("sorted", (int)icalcomponent_sort_components(calendar, ICAL_VEVENT_COMPONENT, 0, 0), 5);
+    sort_order(calendar, order);
+    /* a is 07:00 UTC, d stays after b, and the VTODO keeps its place */
+    str_is("by DTSTART", order, "tz a b d todo c none ");
+
+    int_is("sorted all", (int)icalcomponent_sort_components(calendar, ICAL_ANY_COMPONENT,
+                                                            icalcomponent_sortkey_uid, 0), 7);
+    sort_order(calendar, order);
+    str_is("by UID", order, "a b c d none todo tz ");
+
+    /* Children can still be removed after moving */
+    icalcomponent_remove_component(calendar, todo);
+    icalcomponent_free(todo);
+    child = icalcomponent_get_first_component(calendar, ICAL_VEVENT_COMPONENT);
+    icalcomponent_remove_component(calendar, child);
+    icalcomponent_free(child);
+    sort_order(calendar, order);
+    str_is("after removal", order, "b c d none tz ");
+
+    icalcomponent_free(calendar);
+}
@@ -34,6 +34,14 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#if defined(HAVE_PTHREAD)
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_SYS_RESOURCE_H)
+#include <sys/resource.h>
+#endif
+
 /* For GNU libc, strcmp appears to be a macro, so using strcmp in
  assert results in incomprehansible assertion messages. This
  eliminates the problem */
@@ -276,6 +284,21 @@ void test_values()
     v = icalvalue_new_from_string(ICAL_REQUESTSTATUS_VALUE, "Gonk");
     ok("illegal requeststatus value", (v == 0));
 
+    /* A state set for this thread wins over the shared one */
+    icalerror_set_error_state(ICAL_MALFORMEDDATA_ERROR, ICAL_ERROR_FATAL);
+    ok("no thread state set",
+       (icalerror_set_thread_error_state(ICAL_MALFORMEDDATA_ERROR,
+                                         ICAL_ERROR_NONFATAL) == ICAL_ERROR_UNKNOWN));
+    v = icalvalue_new_from_string(ICAL_TRIGGER_VALUE, "Gonk");
+    ok("illegal value nonfatal in this thread", (v == 0 && icalerrno == ICAL_MALFORMEDDATA_ERROR));
+    ok("shared state unchanged",
+       (icalerror_get_error_state(ICAL_MALFORMEDDATA_ERROR) == ICAL_ERROR_FATAL));
+    ok("thread state restored",
+       (icalerror_set_thread_error_state(ICAL_MALFORMEDDATA_ERROR,
+                                         ICAL_ERROR_UNKNOWN) == ICAL_ERROR_NONFATAL));
+    ok("thread follows the shared state again",
+       (icalerror_get_thread_error_state(ICAL_MALFORMEDDATA_ERROR) == ICAL_ERROR_UNKNOWN));
+
     icalerror_set_error_state(ICAL_MALFORMEDDATA_ERROR, ICAL_ERROR_DEFAULT);
 }
 
@@ -1995,7 +2018,7 @@ void test_overlaps()
 
     time_t hh = 1800;   /* one half hour */
 
-    icalfileset_options options = { O_RDONLY, 0644, 0, NULL };
+    icalfileset_options options = { O_RDONLY, 0644, 0, NULL, 0 };
     set = icalset_new(ICAL_FILE_SET, TEST_DATADIR "/overlaps.ics", &options);
 
     c = icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
@@ -2064,7 +2087,7 @@ void test_overlaps()
 void test_fblist()
 {
     icalspanlist *sl, *new_sl;
-    icalfileset_options options = { O_RDONLY, 0644, 0, NULL };
+    icalfileset_options options = { O_RDONLY, 0644, 0, NULL, 0 };
     icalset *set = icalset_new(ICAL_FILE_SET, TEST_DATADIR "/spanlist.ics", &options);
     struct icalperiodtype period;
     icalcomponent *comp, *fbcomp;
@@ -2187,6 +2210,66 @@ void test_fblist()
         icalspanlist_dump(new_sl);
     }
 
+    /* Overlapping busy periods are merged, and FREE periods are not busy */
+    {
+        icalcomponent *fb, *merged;
+        icalspanlist *overlap;
+        icalproperty *p;
+        struct icalperiodtype period;
+        int count = 0;
+
+        fb = icalcomponent_vanew(
+            ICAL_VCALENDAR_COMPONENT,
+            icalcomponent_vanew(
+                ICAL_VFREEBUSY_COMPONENT,
+                icalproperty_new_dtstart(icaltime_from_string("20160101T000000Z")),
+                icalproperty_new_dtend(icaltime_from_string("20160102T000000Z")),
+                icalproperty_new_freebusy(
+                    icalperiodtype_from_string("20160101T090000Z/20160101T110000Z")),
+                icalproperty_new_freebusy(
+                    icalperiodtype_from_string("20160101T100000Z/20160101T103000Z")),
+                icalproperty_new_freebusy(
+                    icalperiodtype_from_string("20160101T103000Z/20160101T120000Z")),
+                icalproperty_vanew_freebusy(
+                    icalperiodtype_from_string("20160101T130000Z/20160101T140000Z"),
+                    icalparameter_new_fbtype(ICAL_FBTYPE_FREE),
+                    (void *)0),
+                icalproperty_vanew_freebusy(
+                    icalperiodtype_from_string("20160101T150000Z/PT1H"),
+                    icalparameter_new_fbtype(ICAL_FBTYPE_BUSYTENTATIVE),
+                    (void *)0),
+                (void *)0),
+            (void *)0);
+
+        overlap = icalspanlist_from_vfreebusy(fb);
+        ok("Spanlist from overlapping VFREEBUSY", (overlap != NULL));
+
+        period = icalspanlist_next_free_time(overlap,
+                                             icaltime_from_string("20160101T093000Z"));
+        str_is("Next free time after merged busy time",
+               icaltime_as_ical_string(period.start), "20160101T120000");
+        str_is("Next free time ends at tentative busy time",
+               icaltime_as_ical_string(period.end), "20160101T150000");
+
+        merged = icalspanlist_as_vfreebusy(overlap, 0, "mailto:a@example.com");
+        for (p = icalcomponent_get_first_property(merged, ICAL_FREEBUSY_PROPERTY);
+             p != 0; p = icalcomponent_get_next_property(merged, ICAL_FREEBUSY_PROPERTY)) {
+            if (count == 0) {
+                period = icalproperty_get_freebusy(p);
+                str_is("Merged busy time start",
+                       icaltime_as_ical_string(period.start), "20160101T090000Z");
+                str_is("Merged busy time end",
+                       icaltime_as_ical_string(period.end), "20160101T120000Z");
+            }
+            count++;
+        }
+        int_is("Busy periods after merging", count, 2);
+
+        icalcomponent_free(merged);
+        icalspanlist_free(overlap);
+        icalcomponent_free(fb);
+    }
+
 	icalspanlist_free(sl);
 
 	icalspanlist_free(new_sl);
@@ -2196,6 +2279,446 @@ void test_fblist()
     icalset_free(set);
 }
 
+static icalspanlist *make_busy_spanlist(const char **periods, int num_periods)
+{
+    icalcomponent *fb, *vfb;
+    icalspanlist *sl;
+    int i;
+
+    vfb = icalcomponent_vanew(
+        ICAL_VFREEBUSY_COMPONENT,
+        icalproperty_new_dtstart(icaltime_from_string("20160104T000000Z")),
+        icalproperty_new_dtend(icaltime_from_string("20160105T000000Z")),
+        (void *)0);
+
+    for (i = 0; i < num_periods; i++) {
+        icalcomponent_add_property(vfb,
+            icalproperty_new_freebusy(icalperiodtype_from_string(periods[i])));
+    }
+
+    fb = icalcomponent_vanew(ICAL_VCALENDAR_COMPONENT, vfb, (void *)0);
+    sl = icalspanlist_from_vfreebusy(fb);
+    icalcomponent_free(fb);
+
+    return sl;
+}
+
+void test_common_free()
+{
+    const char *alice[] = {
+        "20160104T090000Z/20160104T100000Z",
+        "20160104T130000Z/20160104T140000Z"
+    };
+    const char *bob[] = {
+        "20160104T093000Z/20160104T110000Z",
+        "20160104T113000Z/20160104T120000Z"
+    };
+    const char *carol[] = {
+        "20160104T120000Z/20160104T130000Z",
+        "20160104T140000Z/PT1H"
+    };
+    struct icaltimetype start = icaltime_from_string("20160104T080000Z");
+    struct icaltimetype end = icaltime_from_string("20160104T180000Z");
+    icalspanlist *lists[300];
+    struct icalperiodtype *slot;
+    icalarray *slots;
+    int i;
+
+    lists[0] = make_busy_spanlist(alice, 2);
+    lists[1] = make_busy_spanlist(bob, 2);
+    lists[2] = make_busy_spanlist(carol, 2);
+
+    /* Free for everybody: 08-09, 11-11:30, 15-18 */
+    slots = icalspanlist_find_common_free(lists, 3, start, end, 1800, 0, 0);
+    ok("Common free slots found", (slots != 0));
+    int_is("Number of common free slots", (int)slots->num_elements, 3);
+    slot = (struct icalperiodtype *)icalarray_element_at(slots, 1);
+    str_is("Second slot start", icaltime_as_ical_string(slot->start), "20160104T110000Z");
+    str_is("Second slot end", icaltime_as_ical_string(slot->end), "20160104T113000Z");
+    icalarray_free(slots);
+
+    /* Only the first hour-long slot */
+    slots = icalspanlist_find_common_free(lists, 3, start, end, 3600, 0, 1);
+    int_is("Number of first hour-long slots", (int)slots->num_elements, 1);
+    slot = (struct icalperiodtype *)icalarray_element_at(slots, 0);
+    str_is("First hour-long slot start", icaltime_as_ical_string(slot->start),
+           "20160104T080000Z");
+    icalarray_free(slots);
+
+    /* Hourly slots from 08:30: 08:30 and 11:30 do not have 45 minutes free */
+    slots = icalspanlist_find_common_free(lists, 3, icaltime_from_string("20160104T083000Z"),
+                                          end, 2700, 3600, 0);
+    int_is("Number of hourly slots", (int)slots->num_elements, 1);
+    slot = (struct icalperiodtype *)icalarray_element_at(slots, 0);
+    str_is("Hourly slot start", icaltime_as_ical_string(slot->start),
+           "20160104T153000Z");
+    icalarray_free(slots);
+
+    for (i = 0; i < 3; i++) {
+        icalspanlist_free(lists[i]);
+    }
+
+    /* Many attendees, each busy for an hour between 09 and 17 */
+    for (i = 0; i < 300; i++) {
+        char period[64];
+        const char *periods[1];
+
+        snprintf(period, sizeof(period), "20160104T%02d0000Z/PT1H", 9 + i % 8);
+        periods[0] = period;
+        lists[i] = make_busy_spanlist(periods, 1);
+    }
+
+    slots = icalspanlist_find_common_free(lists, 300, start, end, 1800, 900, 0);
+    int_is("Number of slots for many attendees", (int)slots->num_elements, 2);
+    slot = (struct icalperiodtype *)icalarray_element_at(slots, 1);
+    str_is("Last slot for many attendees", icaltime_as_ical_string(slot->start),
+           "20160104T170000Z");
+    icalarray_free(slots);
+
+    for (i = 0; i < 300; i++) {
+        icalspanlist_free(lists[i]);
+    }
+}
+
+void test_busymap()
+{
+    const char *alice[] = {
+        "20160104T090000Z/20160104T100000Z",
+        "20160104T130000Z/20160104T140000Z"
+    };
+    const char *bob[] = {
+        "20160104T093000Z/20160104T110000Z",
+        "20160104T113000Z/20160104T120000Z"
+    };
+    icalspanlist *sl;
+    icalbusymap *maps[2], *both, *week, *copy;
+    icalcomponent *fb;
+    int *matrix, *counts;
+    size_t i;
+    int same = 1;
+
+    sl = make_busy_spanlist(alice, 2);
+    maps[0] = icalspanlist_as_busymap(sl, 1800);
+    int_is("Busy map slots", (int)icalbusymap_get_num_slots(maps[0]), 48);
+    int_is("Busy map busy slots", (int)icalbusymap_count_busy(maps[0]), 4);
+
+    matrix = icalspanlist_as_freebusy_matrix(sl, 1800);
+    for (i = 0; matrix[i] != -1; i++) {
+        if (icalbusymap_is_busy(maps[0], i) != (matrix[i] > 0)) {
+            same = 0;
+        }
+    }
+    ok("Busy map agrees with freebusy matrix", (same && i == 48));
+    free(matrix);
+    icalspanlist_free(sl);
+
+    sl = make_busy_spanlist(bob, 2);
+    maps[1] = icalspanlist_as_busymap(sl, 1800);
+    icalspanlist_free(sl);
+
+    counts = icalbusymap_count_busy_maps(maps, 2);
+    int_is("Busy users 09:00", counts[18], 1);
+    int_is("Busy users 09:30", counts[19], 2);
+    int_is("Busy users 12:00", counts[24], 0);
+    int_is("Busy users end", counts[48], -1);
+    free(counts);
+
+    both = icalbusymap_clone(maps[0]);
+    ok("Intersecting busy maps", (icalbusymap_intersect(both, maps[1]) == ICAL_NO_ERROR));
+    int_is("Slots busy for both", (int)icalbusymap_count_busy(both), 1);
+    icalbusymap_free(both);
+
+    ok("Uniting busy maps", (icalbusymap_union(maps[0], maps[1]) == ICAL_NO_ERROR));
+    int_is("Slots busy for either", (int)icalbusymap_count_busy(maps[0]), 7);
+
+    /* The busy runs make FREEBUSY periods, which give back the same map */
+    fb = icalbusymap_as_vfreebusy(maps[0], 0, "mailto:a@example.com");
+    int_is("FREEBUSY periods of busy map",
+           icalcomponent_count_properties(fb, ICAL_FREEBUSY_PROPERTY), 3);
+    copy = icalbusymap_new_from_vfreebusy(fb, 1800);
+    ok("Busy map from VFREEBUSY", (copy != 0));
+    ok("Busy map from VFREEBUSY is the same",
+       (icalbusymap_intersect(copy, maps[0]) == ICAL_NO_ERROR &&
+        icalbusymap_count_busy(copy) == 7));
+    icalbusymap_free(copy);
+    icalcomponent_free(fb);
+
+    /* Runs across words, on a week of five minute slots */
+    week = icalbusymap_new(icaltime_from_string("20160104T000000Z"),
+                           icaltime_from_string("20160111T000000Z"), 300);
+    int_is("Week busy map slots", (int)icalbusymap_get_num_slots(week), 2016);
+    icalbusymap_mark_busy(week,
+                          icaltime_as_timet_with_zone(icaltime_from_string("20160104T050000Z"),
+                                                      icaltimezone_get_utc_timezone()),
+                          icaltime_as_timet_with_zone(icaltime_from_string("20160104T160000Z"),
+                                                      icaltimezone_get_utc_timezone()));
+    int_is("Week busy slots", (int)icalbusymap_count_busy(week), 132);
+    ok("Slot before run is free", !icalbusymap_is_busy(week, 59));
+    ok("First slot of run is busy", icalbusymap_is_busy(week, 60));
+    ok("Last slot of run is busy", icalbusymap_is_busy(week, 191));
+    ok("Slot after run is free", !icalbusymap_is_busy(week, 192));
+    icalbusymap_invert(week);
+    int_is("Week free slots", (int)icalbusymap_count_busy(week), 2016 - 132);
+
+    icalerror_set_errors_are_fatal(0);
+    ok("Busy maps on other grids are not combined",
+       (icalbusymap_union(week, maps[1]) == ICAL_USAGE_ERROR));
+    icalerror_set_errors_are_fatal(1);
+
+    icalbusymap_free(week);
+    icalbusymap_free(maps[0]);
+    icalbusymap_free(maps[1]);
+}
+
+void test_instances()
+{
+    icalcomponent *calendar;
+    icalarray *serial, *parallel;
+    icalfileset_options options = { O_RDONLY, 0644, 0, NULL, 0 };
+    icalset *set;
+    size_t i;
+    int sorted = 1, same = 1;
+
+    calendar = icalcomponent_new_vcalendar();
+
+    /* 100 daily series of 10 instances each, with the later half
+       starting before the earlier half so the input is not sorted */
+    for (i = 0; i < 100; i++) {
+        struct icaltimetype start = icaltime_from_string("20160101T090000Z");
+        struct icaltimetype end;
+        icalcomponent *event = icalcomponent_new_vevent();
+
+        icaltime_adjust(&start, 0, (int)((i + 50) % 100), 0, 0);
+        end = start;
+        icaltime_adjust(&end, 0, 1, 0, 0);
+
+        icalcomponent_set_dtstart(event, start);
+        icalcomponent_set_dtend(event, end);
+        icalcomponent_add_property(event,
+            icalproperty_new_rrule(icalrecurrencetype_from_string("FREQ=DAILY;COUNT=10")));
+        icalcomponent_add_component(calendar, event);
+    }
+
+    serial = icalinstances_expand_vcalendar(calendar,
+                                            icaltime_from_string("20160101T000000Z"),
+                                            icaltime_from_string("20170101T000000Z"), 1);
+    parallel = icalinstances_expand_vcalendar(calendar,
+                                              icaltime_from_string("20160101T000000Z"),
+                                              icaltime_from_string("20170101T000000Z"), 4);
+
+    ok("serial expansion", (serial != NULL));
+    ok("parallel expansion", (parallel != NULL));
+    assert(serial != NULL && parallel != NULL);
+
+    int_is("serial instance count", (int)serial->num_elements, 1000);
+    int_is("parallel instance count", (int)parallel->num_elements, 1000);
+
+    for (i = 0; i < serial->num_elements && i < parallel->num_elements; i++) {
+        icalinstance *a = (icalinstance *)icalarray_element_at(serial, i);
+        icalinstance *b = (icalinstance *)icalarray_element_at(parallel, i);
+
+        if (a->comp != b->comp || a->span.start != b->span.start || a->span.end != b->span.end) {
+            same = 0;
+        }
+        if (i > 0 &&
+            ((icalinstance *)icalarray_element_at(serial, i - 1))->span.start > a->span.start) {
+            sorted = 0;
+        }
+    }
+    ok("instances are sorted by start", sorted);
+    ok("parallel expansion matches serial expansion", same);
+
+    icalarray_free(serial);
+    icalarray_free(parallel);
+    icalcomponent_free(calendar);
+
+    set = icalset_new(ICAL_FILE_SET, TEST_DATADIR "/spanlist.ics", &options);
+    ok("open ../test-data/spanlist.ics", (set != NULL));
+    assert(set != NULL);
+
+    parallel = icalinstances_expand_set(set,
+                                        icaltime_from_string("19980101T000000Z"),
+                                        icaltime_from_string("19980108T000000Z"), 2);
+    ok("expand a file set", (parallel != NULL && parallel->num_elements > 0));
+    if (parallel) {
+        icalarray_free(parallel);
+    }
+
+    icalset_free(set);
+
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    /* A directory set frees clusters as the walk moves on */
+    (void)mkdir("test_expand_store", 0755);
+    set = icaldirset_new("test_expand_store");
+    icalerror_set_errors_are_fatal(0);
+    parallel = icalinstances_expand_set(set,
+                                        icaltime_from_string("19980101T000000Z"),
+                                        icaltime_from_string("19980108T000000Z"), 2);
+    icalerror_set_errors_are_fatal(1);
+    ok("expanding a directory set is refused",
+       (parallel == NULL && icalerrno == ICAL_UNIMPLEMENTED_ERROR));
+    icalerror_clear_errno();
+    icalset_free(set);
+    (void)unlink("test_expand_store/.icaldirset-uids");
+    ok("no files left behind", (rmdir("test_expand_store") == 0));
+#endif
+}
+
+static int count_instances(icalinstanceindex *index, const char *start, const char *end)
+{
+    icalarray *instances = icalinstanceindex_select(index, icaltime_from_string(start),
+                                                    icaltime_from_string(end));
+    int n = instances ? (int)instances->num_elements : -1;
+
+    if (instances) {
+        icalarray_free(instances);
+    }
+
+    return n;
+}
+
+static icalcomponent *make_replaced_event(const char *dtstart, const char *dtend)
+{
+    return icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                               icalproperty_new_uid("replaced@test"),
+                               icalproperty_new_dtstart(icaltime_from_string(dtstart)),
+                               icalproperty_new_dtend(icaltime_from_string(dtend)),
+                               (void *)0);
+}
+
+void test_instance_index()
+{
+    icalcomponent *root, *calendar, *series, *override, *single, *free_event, *replaced;
+    icalinstanceindex *index;
+    icalarray *instances, *busy;
+    icalinstance *instance;
+
+    root = icalcomponent_new(ICAL_XROOT_COMPONENT);
+
+    series = icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                                 icalproperty_new_uid("weekly@test"),
+                                 icalproperty_new_dtstart(icaltime_from_string("20200106T090000Z")),
+                                 icalproperty_new_dtend(icaltime_from_string("20200106T100000Z")),
+                                 icalproperty_new_rrule(icalrecurrencetype_from_string("FREQ=WEEKLY")),
+                                 (void *)0);
+    override = icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                                   icalproperty_new_uid("weekly@test"),
+                                   icalproperty_new_recurrenceid(
+                                       icaltime_from_string("20200113T090000Z")),
+                                   icalproperty_new_dtstart(icaltime_from_string("20200113T140000Z")),
+                                   icalproperty_new_dtend(icaltime_from_string("20200113T150000Z")),
+                                   (void *)0);
+    calendar = icalcomponent_vanew(ICAL_VCALENDAR_COMPONENT, series, override, (void *)0);
+    icalcomponent_add_component(root, calendar);
+
+    single = icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                                 icalproperty_new_uid("single@test"),
+                                 icalproperty_new_dtstart(icaltime_from_string("20200107T100000Z")),
+                                 icalproperty_new_dtend(icaltime_from_string("20200107T120000Z")),
+                                 (void *)0);
+    icalcomponent_add_component(root, single);
+
+    free_event = icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                                     icalproperty_new_uid("free@test"),
+                                     icalproperty_new_dtstart(icaltime_from_string("20200107T080000Z")),
+                                     icalproperty_new_dtend(icaltime_from_string("20200107T180000Z")),
+                                     icalproperty_new_transp(ICAL_TRANSP_TRANSPARENT),
+                                     (void *)0);
+    icalcomponent_add_component(root, free_event);
+
+    index = icalinstanceindex_new(root, icaltime_from_string("20200101T000000Z"),
+                                  icaltime_from_string("20200201T000000Z"));
+    ok("icalinstanceindex_new()", (index != 0));
+    assert(index != 0);
+
+    int_is("instances in the horizon", (int)icalinstanceindex_count(index), 7);
+    int_is("instances in January", count_instances(index, "20200101T000000Z",
+                                                   "20200201T000000Z"), 6);
+
+    instances = icalinstanceindex_select(index, icaltime_from_string("20200113T000000Z"),
+                                         icaltime_from_string("20200114T000000Z"));
+    int_is("overridden instance is replaced", (int)instances->num_elements, 1);
+    instance = (icalinstance *)icalarray_element_at(instances, 0);
+    ok("by its override", (instance->comp == override));
+    ok("with the recurrence-id of the instance",
+       (instance->recurrence_id == icaltime_as_timet(icaltime_from_string("20200113T090000Z"))));
+    icalarray_free(instances);
+
+    /* An instance that started before the window still overlaps it */
+    int_is("instance in progress", count_instances(index, "20200107T110000Z",
+                                                   "20200107T113000Z"), 2);
+
+    /* Queries past the horizon extend it */
+    int_is("instances in March", count_instances(index, "20200301T000000Z",
+                                                 "20200401T000000Z"), 5);
+
+    /* Changes are picked up from the revisions of the components */
+    icalcomponent_set_dtstart(single, icaltime_from_string("20200302T120000Z"));
+    icalcomponent_set_dtend(single, icaltime_from_string("20200302T130000Z"));
+    int_is("moved instance leaves January", count_instances(index, "20200101T000000Z",
+                                                            "20200201T000000Z"), 5);
+    int_is("and arrives in March", count_instances(index, "20200301T000000Z",
+                                                   "20200401T000000Z"), 6);
+
+    icalcomponent_remove_component(calendar, override);
+    icalcomponent_free(override);
+    instances = icalinstanceindex_select(index, icaltime_from_string("20200113T000000Z"),
+                                         icaltime_from_string("20200114T000000Z"));
+    ok("removing the override restores the instance",
+       (instances->num_elements == 1 &&
+        ((icalinstance *)icalarray_element_at(instances, 0))->comp == series));
+    icalarray_free(instances);
+
+    /* A child freed and replaced by a new one, which may be allocated
+       where the old one was */
+    replaced = make_replaced_event("20200310T120000Z", "20200310T130000Z");
+    icalcomponent_add_component(root, replaced);
+    int_is("child to replace", count_instances(index, "20200310T000000Z",
+                                               "20200311T000000Z"), 1);
+    icalcomponent_remove_component(root, replaced);
+    icalcomponent_free(replaced);
+    replaced = make_replaced_event("20200317T120000Z", "20200317T130000Z");
+    icalcomponent_add_component(root, replaced);
+    int_is("replaced child gone", count_instances(index, "20200310T000000Z",
+                                                  "20200311T000000Z"), 0);
+    int_is("replacement found", count_instances(index, "20200317T000000Z",
+                                                "20200318T000000Z"), 1);
+    icalcomponent_remove_component(root, replaced);
+    icalcomponent_free(replaced);
+
+    /* Busy time skips transparent events and merges overlapping ones */
+    icalcomponent_add_component(root,
+        icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                            icalproperty_new_uid("a@test"),
+                            icalproperty_new_dtstart(icaltime_from_string("20200302T123000Z")),
+                            icalproperty_new_dtend(icaltime_from_string("20200302T140000Z")),
+                            (void *)0));
+    busy = icalinstanceindex_get_busy(index, icaltime_from_string("20200302T000000Z"),
+                                      icaltime_from_string("20200303T000000Z"));
+    int_is("busy spans", (int)busy->num_elements, 2);
+    if (busy->num_elements == 2) {
+        struct icaltime_span *a = (struct icaltime_span *)icalarray_element_at(busy, 0);
+        struct icaltime_span *b = (struct icaltime_span *)icalarray_element_at(busy, 1);
+
+        ok("weekly instance",
+           (a->start == icaltime_as_timet(icaltime_from_string("20200302T090000Z")) &&
+            a->end == icaltime_as_timet(icaltime_from_string("20200302T100000Z"))));
+        ok("merged instances",
+           (b->start == icaltime_as_timet(icaltime_from_string("20200302T120000Z")) &&
+            b->end == icaltime_as_timet(icaltime_from_string("20200302T140000Z"))));
+    }
+    icalarray_free(busy);
+
+    /* Sliding the horizon drops what falls behind it */
+    ok("icalinstanceindex_set_horizon()",
+       icalinstanceindex_set_horizon(index, icaltime_from_string("20200301T000000Z"),
+                                     icaltime_from_string("20200401T000000Z")) == ICAL_NO_ERROR);
+    int_is("instances in the new horizon", (int)icalinstanceindex_count(index), 7);
+
+    icalinstanceindex_free(index);
+    icalcomponent_free(root);
+}
+
 void test_convenience()
 {
     icalcomponent *c;
@@ -2409,6 +2932,33 @@ void test_recur_parser()
 
     rt = icalrecurrencetype_from_string(str);
     str_is(str, icalrecurrencetype_as_string(&rt), str);
+
+    /* A second parse of the same text comes from the cache */
+    rt = icalrecurrencetype_from_string(str);
+    str_is("cached rule", icalrecurrencetype_as_string(&rt), str);
+
+    /* Other spellings of a rule share its canonical form */
+    rt = icalrecurrencetype_from_string(
+        "bymonth=1,2,3,4,8;byyearday=34,65,76,78;BYDAY=-1TU,3WE,-4FR,SA,SU;"
+        "INTERVAL=1;WKST=MO;count=3;freq=daily");
+    str_is("canonical form", icalrecurrencetype_as_string(&rt), str);
+
+    /* Malformed rules are reported every time */
+    icalerror_set_errors_are_fatal(0);
+    icalerror_clear_errno();
+    rt = icalrecurrencetype_from_string("FREQ=DAILY;INTERVAL=0");
+    ok("malformed rule", rt.freq == ICAL_NO_RECURRENCE &&
+       icalerrno == ICAL_MALFORMEDDATA_ERROR);
+    icalerror_clear_errno();
+    rt = icalrecurrencetype_from_string("FREQ=DAILY;INTERVAL=0");
+    ok("malformed rule again", rt.freq == ICAL_NO_RECURRENCE &&
+       icalerrno == ICAL_MALFORMEDDATA_ERROR);
+    icalerror_clear_errno();
+    icalerror_set_errors_are_fatal(1);
+
+    icalrecurrencetype_free_cache();
+    rt = icalrecurrencetype_from_string(str);
+    str_is("after freeing the cache", icalrecurrencetype_as_string(&rt), str);
 }
 
 char *ical_strstr(const char *haystack, const char *needle)
@@ -2916,6 +3466,136 @@ void test_gauge_compare()
     icalcomponent_free(c);
 }
 
+#if defined(HAVE_PTHREAD)
+struct gauge_thread_data
+{
+    int id;
+    int failures;
+};
+
+static void *gauge_thread(void *arg)
+{
+    struct gauge_thread_data *data = (struct gauge_thread_data *)arg;
+    icalcomponent *c;
+    char sql[128], summary[32];
+    int i;
+
+    for (i = 0; i < 200; i++) {
+        icalgauge *g;
+
+        snprintf(summary, sizeof(summary), "Thread %d item %d", data->id, i);
+        snprintf(sql, sizeof(sql), "SELECT * FROM VEVENT WHERE SUMMARY = '%s' AND SEQUENCE <= %d",
+                 summary, i);
+
+        c = icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                                icalproperty_new_summary(summary),
+                                icalproperty_new_sequence(i),
+                                (void *)0);
+        g = icalgauge_new_from_sql(sql, 0);
+        if (g == 0 || icalgauge_compare(g, c) != 1) {
+            data->failures++;
+        }
+        if (g != 0) {
+            icalgauge_free(g);
+        }
+        icalcomponent_free(c);
+
+        /* A bad literal is only an error once the gauge is used, even
+           though errors are fatal while other threads compile too */
+        snprintf(sql, sizeof(sql), "SELECT * FROM VEVENT WHERE DTSTART = 'Thread %d item %d'",
+                 data->id, i);
+        g = icalgauge_new_from_sql(sql, 0);
+        if (g == 0 || icalerror_get_errors_are_fatal() != 1 ||
+            icalerror_get_thread_error_state(ICAL_MALFORMEDDATA_ERROR) != ICAL_ERROR_UNKNOWN) {
+            data->failures++;
+        }
+        if (g != 0) {
+            icalgauge_free(g);
+        }
+    }
+
+    return 0;
+}
+#endif
+
+void test_gauge_cache()
+{
+    icalgauge *g1, *g2, *g3;
+    icalcomponent *c;
+    int estate;
+    const char *str = "select * from VEVENT where LOCATION = 'Room 1' and SEQUENCE >= 2";
+
+    c = icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                            icalproperty_new_location("Room 1"),
+                            icalproperty_new_sequence(3),
+                            (void *)0);
+
+    icalgauge_free_cache();
+
+    g1 = icalgauge_new_from_sql(str, 0);
+    ok(str, (g1 != 0));
+    assert(g1 != 0);
+    int_is("compare", icalgauge_compare(g1, c), 1);
+
+    g2 = icalgauge_new_from_sql(str, 0);
+    ok("same query reuses the gauge", (g2 == g1));
+
+    g3 = icalgauge_new_from_sql(str, 1);
+    ok("expand flag is part of the key", (g3 != 0 && g3 != g1));
+    int_is("expand", icalgauge_get_expand(g3), 1);
+    icalgauge_free(g3);
+
+    /* Each reference and the cache's own are released separately */
+    icalgauge_free(g1);
+    icalgauge_free_cache();
+    int_is("gauge outlives the cache", icalgauge_compare(g2, c), 1);
+
+    g1 = icalgauge_new_from_sql(str, 0);
+    ok("query is parsed again after the cache is emptied", (g1 != 0 && g1 != g2));
+    icalgauge_free(g2);
+    icalgauge_free(g1);
+
+    /* Scanner corner cases */
+    g1 = icalgauge_new_from_sql("SELECT * FROM VEVENT WHERE SEQUENCE<=5 AND LOCATION IS NOT NULL", 0);
+    ok("operators without spaces", (g1 != 0));
+    int_is("compare", icalgauge_compare(g1, c), 1);
+    icalgauge_free(g1);
+
+    estate = icalerror_get_errors_are_fatal();
+    icalerror_set_errors_are_fatal(0);
+    g1 = icalgauge_new_from_sql("SELECT * FROM VEVENT WHERE LOCATION = 'Room 1", 0);
+    ok("unterminated literal", (g1 == 0));
+    g1 = icalgauge_new_from_sql("SELECT * FROM VEVENT WHERE SEQUENCE ~ 5", 0);
+    ok("unknown operator", (g1 == 0));
+    icalerror_set_errors_are_fatal(estate);
+    icalerror_clear_errno();
+
+#if defined(HAVE_PTHREAD)
+    {
+        pthread_t threads[4];
+        struct gauge_thread_data data[4];
+        int i, failures = 0;
+
+        estate = icalerror_get_errors_are_fatal();
+        icalerror_set_errors_are_fatal(1);
+        for (i = 0; i < 4; i++) {
+            data[i].id = i;
+            data[i].failures = 0;
+            pthread_create(&threads[i], NULL, gauge_thread, &data[i]);
+        }
+        for (i = 0; i < 4; i++) {
+            pthread_join(threads[i], NULL);
+            failures += data[i].failures;
+        }
+        icalerror_set_errors_are_fatal(estate);
+        int_is("gauges built in parallel threads", failures, 0);
+    }
+#endif
+
+    icalgauge_free_cache();
+    icalcomponent_free(c);
+}
+
 icalcomponent *make_component(int i)
 {
     icalcomponent *c;
@@ -3005,6 +3685,1106 @@ void test_fileset()
 #endif
 }
 
+static icalcomponent *make_timed_event(const char *dtstart, const char *rrule)
+{
+    struct icaltimetype t = icaltime_from_string(dtstart);
+    icalcomponent *c;
+
+    c = icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                            icalproperty_new_dtstart(t),
+                            icalproperty_new_duration(icaldurationtype_from_string("PT1H")),
+                            (void *)0);
+    if (rrule != 0) {
+        icalcomponent_add_property(c,
+            icalproperty_new_rrule(icalrecurrencetype_from_string(rrule)));
+    }
+
+    return c;
+}
+
+static int count_selected(icaltimeindex *index, const char *start, const char *end)
+{
+    icalarray *result = icalarray_new(sizeof(icalcomponent *), 16);
+    int n;
+
+    n = (int)icaltimeindex_select(index,
+                                  icaltime_as_timet(icaltime_from_string(start)),
+                                  icaltime_as_timet(icaltime_from_string(end)), result);
+    icalarray_free(result);
+
+    return n;
+}
+
+void test_time_index()
+{
+    icalcomponent *root, *c, *moved, *series, *todo;
+    icaltimeindex *index;
+    icalarray *result;
+    time_t start, end;
+    icalgauge *g;
+    int i;
+
+    root = icalcomponent_new(ICAL_XROOT_COMPONENT);
+    for (i = 0; i < 100; i++) {
+        char buf[32];
+
+        snprintf(buf, sizeof(buf), "2000%02d%02dT080000Z", 1 + i / 28, 1 + i % 28);
+        icalcomponent_add_component(root, make_timed_event(buf, 0));
+    }
+    moved = make_timed_event("20001201T080000Z", 0);
+    icalcomponent_add_component(root, moved);
+
+    index = icaltimeindex_new(root);
+    ok("icaltimeindex_new()", (index != 0));
+    int_is("count", (int)icaltimeindex_count(index), 101);
+    int_is("select a day", count_selected(index, "20000110T000000Z", "20000110T235959Z"), 1);
+    int_is("ends are inclusive", count_selected(index, "20000110T090000Z", "20000111T080000Z"), 2);
+    int_is("select nothing", count_selected(index, "19990101T000000Z", "19991231T000000Z"), 0);
+
+    /* Children added behind the index's back are found by their revisions */
+    series = make_timed_event("20000601T100000Z", "FREQ=DAILY;COUNT=5");
+    icalcomponent_add_component(root, series);
+    todo = icalcomponent_new_vtodo();
+    icalcomponent_add_component(root, todo);
+    int_is("count after adding", (int)icaltimeindex_count(index), 103);
+    int_is("last instance of a series",
+           count_selected(index, "20000605T103000Z", "20000605T103000Z"), 2);
+    int_is("after the last instance",
+           count_selected(index, "20000605T120000Z", "20000606T000000Z"), 1);
+
+    /* Changing a child moves it in the index */
+    icalcomponent_set_dtstart(moved, icaltime_from_string("20000110T120000Z"));
+    int_is("modified child", count_selected(index, "20000110T000000Z", "20000110T235959Z"), 3);
+
+    icalproperty_set_rrule(icalcomponent_get_first_property(series, ICAL_RRULE_PROPERTY),
+                           icalrecurrencetype_from_string("FREQ=WEEKLY"));
+    int_is("series that does not end",
+           count_selected(index, "20300101T000000Z", "20300102T000000Z"), 2);
+
+    /* Removing, with and without telling the index */
+    icaltimeindex_sync(index);
+    icalcomponent_remove_component(root, moved);
+    icaltimeindex_remove_component(index, moved);
+    icalcomponent_free(moved);
+    icalcomponent_remove_component(root, todo);
+    icalcomponent_free(todo);
+    int_is("count after removing", (int)icaltimeindex_count(index), 101);
+
+    /* A child freed and replaced by a new one, which may be allocated
+       where the old one was */
+    c = make_timed_event("20000515T080000Z", 0);
+    icalcomponent_add_component(root, c);
+    int_is("child to replace", count_selected(index, "20000515T000000Z", "20000515T235959Z"), 1);
+    icalcomponent_remove_component(root, c);
+    icalcomponent_free(c);
+    c = make_timed_event("20000520T080000Z", 0);
+    icalcomponent_add_component(root, c);
+    int_is("replaced child gone",
+           count_selected(index, "20000515T000000Z", "20000515T235959Z"), 0);
+    int_is("replacement found", count_selected(index, "20000520T000000Z", "20000520T235959Z"), 1);
+    icalcomponent_remove_component(root, c);
+    icalcomponent_free(c);
+
+    result = icalarray_new(sizeof(icalcomponent *), 16);
+    int_is("select a month",
+           (int)icaltimeindex_select(index,
+                                     icaltime_as_timet(icaltime_from_string("20000201T000000Z")),
+                                     icaltime_as_timet(icaltime_from_string("20000228T235959Z")),
+                                     result), 28);
+    for (i = 1; i < (int)result->num_elements; i++) {
+        icalcomponent *a = *(icalcomponent **)icalarray_element_at(result, (size_t)i - 1);
+        icalcomponent *b = *(icalcomponent **)icalarray_element_at(result, (size_t)i);
+
+        if (icaltime_compare(icalcomponent_get_dtstart(a), icalcomponent_get_dtstart(b)) > 0) {
+            break;
+        }
+    }
+    int_is("in order of start", i, (int)result->num_elements);
+    icalarray_free(result);
+
+    icaltimeindex_free(index);
+    icalcomponent_free(root);
+
+    /* Gauges */
+    g = icalgauge_new_from_sql("SELECT * FROM VEVENT WHERE DTSTART >= '20000301T000000Z' "
+                               "AND DTSTART < '20000310T000000Z' AND SUMMARY IS NULL", 0);
+    ok("gauge restricts DTSTART",
+       (g != 0 && icaltimeindex_get_gauge_range(g, &start, &end) &&
+        start == icaltime_as_timet(icaltime_from_string("20000229T000000Z")) &&
+        end == icaltime_as_timet(icaltime_from_string("20000311T000000Z"))));
+    icalgauge_free(g);
+    g = icalgauge_new_from_sql("SELECT * FROM VEVENT WHERE DTSTART >= '20000301T000000Z' "
+                               "OR SUMMARY IS NULL", 0);
+    ok("gauge with OR does not", (g != 0 && !icaltimeindex_get_gauge_range(g, &start, &end)));
+    icalgauge_free(g);
+
+#if defined(HAVE_UNLINK)
+    {
+        const char *path = "test_timeindex.ics";
+        icalset *fs;
+        int plain = 0, indexed = 0, ordered = 1;
+        struct icaltimetype last = icaltime_null_time();
+
+        g = icalgauge_new_from_sql("SELECT * FROM VEVENT WHERE DTSTART > '20000103T120000Z' "
+                                   "AND DTSTART <= '20000106T120000Z'", 0);
+        unlink(path);
+        fs = icalfileset_new(path);
+        assert(fs != 0);
+        for (i = 9; i >= 0; i--) {
+            (void)icalfileset_add_component(fs, make_component(i));
+        }
+        (void)icalfileset_select(fs, g);
+
+        for (c = icalfileset_get_first_component(fs); c != 0;
+             c = icalfileset_get_next_component(fs)) {
+            plain++;
+        }
+
+        ok("icalfileset_set_time_index()", icalfileset_set_time_index(fs, 1) == ICAL_NO_ERROR);
+        for (c = icalfileset_get_first_component(fs); c != 0;
+             c = icalfileset_get_next_component(fs)) {
+            struct icaltimetype t = icalcomponent_get_dtstart(icalcomponent_get_inner(c));
+
+            if (icaltime_compare(last, t) > 0) {
+                ordered = 0;
+            }
+            last = t;
+            indexed++;
+        }
+        int_is("fileset matches without the index", plain, 3);
+        int_is("fileset matches with the index", indexed, 3);
+        ok("matches come in order of start", ordered);
+
+        /* Additions and removals during an iteration */
+        c = icalfileset_get_first_component(fs);
+        (void)icalfileset_remove_component(fs, c);
+        icalcomponent_free(c);
+        (void)icalfileset_add_component(fs, make_component(4));
+        indexed = 0;
+        for (c = icalfileset_get_first_component(fs); c != 0;
+             c = icalfileset_get_next_component(fs)) {
+            indexed++;
+        }
+        int_is("fileset matches after changes", indexed, 3);
+
+        /* The set owns the gauge it selected */
+        icalset_free(fs);
+        unlink(path);
+    }
+#endif
+
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    {
+        const char *dir = "test_timeindex_store";
+        char path[64];
+        icalset *ds;
+        int pass, matches[2] = { 0, 0 };
+
+        (void)mkdir(dir, 0755);
+        for (i = 1; i <= 3; i++) {
+            icalset *fs;
+
+            snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+            unlink(path);
+            fs = icalfileset_new(path);
+            assert(fs != 0);
+            snprintf(path, sizeof(path), "2000%02d15T080000Z", i);
+            (void)icalfileset_add_component(fs, make_timed_event(path, 0));
+            icalset_free(fs);
+        }
+
+        g = icalgauge_new_from_sql("SELECT * FROM VEVENT WHERE DTSTART >= '20000210T000000Z' "
+                                   "AND DTSTART < '20000220T000000Z'", 0);
+        ds = icaldirset_new(dir);
+        assert(ds != 0);
+        ok("icaldirset_set_time_index()", icaldirset_set_time_index(ds, 1) == ICAL_NO_ERROR);
+        (void)icaldirset_select(ds, g);
+
+        /* The second pass skips the clusters seen to be out of range */
+        for (pass = 0; pass < 2; pass++) {
+            for (c = icaldirset_get_first_component(ds); c != 0;
+                 c = icaldirset_get_next_component(ds)) {
+                matches[pass]++;
+            }
+        }
+        int_is("dirset matches", matches[0], 1);
+        int_is("dirset matches skipping clusters", matches[1], 1);
+
+        icalset_free(ds);
+        for (i = 1; i <= 3; i++) {
+            snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+            unlink(path);
+        }
+        (void)rmdir(dir);
+    }
+#endif
+}
+
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+static icalcomponent *make_uid_event(const char *uid, const char *dtstart)
+{
+    return icalcomponent_vanew(
+        ICAL_VCALENDAR_COMPONENT,
+        icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                            icalproperty_new_uid(uid),
+                            icalproperty_new_dtstart(icaltime_from_string(dtstart)),
+                            (void *)0),
+        (void *)0);
+}
+#endif
+
+void test_dirset_uid_index(void)
+{
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *dir = "test_uidindex_store";
+    char path[64];
+    icalset *ds, *fs;
+    icalcomponent *c;
+    struct stat sbuf;
+    int i;
+
+    (void)mkdir(dir, 0755);
+    for (i = 1; i <= 3; i++) {
+        snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+
+    ds = icaldirset_new(dir);
+    ok("opening dirset", (ds != 0));
+
+    (void)icaldirset_add_component(ds, make_uid_event("uid-1a", "20000110T080000Z"));
+    (void)icaldirset_add_component(ds, make_uid_event("uid-1b", "20000111T080000Z"));
+    ok("UID added but not committed", icaldirset_has_uid(ds, "uid-1b"));
+    (void)icaldirset_commit(ds);
+    (void)icaldirset_add_component(ds, make_uid_event("uid-2a", "20000210T080000Z"));
+    (void)icaldirset_commit(ds);
+    icalset_free(ds);
+
+    ok("UID index written", (stat(path, &sbuf) == 0));
+
+    /* The UIDs are found through the index */
+    ds = icaldirset_new(dir);
+    ok("has uid-1a", icaldirset_has_uid(ds, "uid-1a"));
+    ok("has uid-2a", icaldirset_has_uid(ds, "uid-2a"));
+    ok("has no other UID", !icaldirset_has_uid(ds, "uid-9z"));
+    c = icaldirset_fetch(ds, ICAL_VEVENT_COMPONENT, "uid-2a");
+    ok("fetch uid-2a", (c != 0));
+    str_is("fetched uid-2a", c ? icalcomponent_get_uid(c) : "", "uid-2a");
+    ok("fetch a missing UID", (icaldirset_fetch(ds, ICAL_VEVENT_COMPONENT, "uid-9z") == 0));
+
+    /* A cluster written without the index is read into it */
+    snprintf(path, sizeof(path), "%s/200003", dir);
+    fs = icalfileset_new(path);
+    (void)icalfileset_add_component(fs, make_uid_event("uid-3a", "20000310T080000Z"));
+    icalset_free(fs);
+    ok("has uid-3a written behind the index", icaldirset_has_uid(ds, "uid-3a"));
+
+    /* Removed UIDs leave the index */
+    c = icaldirset_fetch(ds, ICAL_VEVENT_COMPONENT, "uid-1b");
+    ok("fetch uid-1b", (c != 0));
+    ok("remove uid-1b", (icaldirset_remove_component(ds, c) == ICAL_NO_ERROR));
+    icalcomponent_free(c);
+    (void)icaldirset_commit(ds);
+    ok("uid-1b removed", !icaldirset_has_uid(ds, "uid-1b"));
+    icalset_free(ds);
+
+    ds = icaldirset_new(dir);
+    ok("uid-1b removed after reopening", !icaldirset_has_uid(ds, "uid-1b"));
+    ok("uid-1a kept after reopening", icaldirset_has_uid(ds, "uid-1a"));
+
+    /* So do the UIDs of a cluster that is deleted */
+    snprintf(path, sizeof(path), "%s/200002", dir);
+    unlink(path);
+    ok("uid-2a gone with its cluster", !icaldirset_has_uid(ds, "uid-2a"));
+    icalset_free(ds);
+
+    for (i = 1; i <= 3; i++) {
+        snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+    ok("no files left behind", (rmdir(dir) == 0));
+#endif
+}
+
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+static int count_dirset_components(icalset *ds)
+{
+    icalcomponent *c;
+    int n = 0;
+
+    for (c = icaldirset_get_first_component(ds); c != 0; c = icaldirset_get_next_component(ds)) {
+        n++;
+    }
+    return n;
+}
+#endif
+
+void test_dirset_cache(void)
+{
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *dir = "test_dircache_store";
+    char path[64];
+    struct stat sbuf;
+    icalset *ds, *fs;
+    icalcomponent *c;
+    int i;
+
+    (void)mkdir(dir, 0755);
+    for (i = 1; i <= 3; i++) {
+        snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+
+    /* Events out of order, with room for only one cluster. The changed
+       clusters are kept until commit rather than written back as they
+       fall out of the cache. */
+    ds = icaldirset_new(dir);
+    ok("opening dirset", (ds != 0));
+    ok("set cache size", (icaldirset_set_cache_size(ds, 1, 100) == ICAL_NO_ERROR));
+    (void)icaldirset_add_component(ds, make_uid_event("cache-1a", "20000110T080000Z"));
+    (void)icaldirset_add_component(ds, make_uid_event("cache-2a", "20000210T080000Z"));
+    (void)icaldirset_add_component(ds, make_uid_event("cache-1b", "20000111T080000Z"));
+    (void)icaldirset_add_component(ds, make_uid_event("cache-3a", "20000310T080000Z"));
+    (void)icaldirset_add_component(ds, make_uid_event("cache-2b", "20000211T080000Z"));
+    snprintf(path, sizeof(path), "%s/200001", dir);
+    ok("changed cluster not written before commit", (stat(path, &sbuf) != 0));
+    icalset_free(ds);
+
+    ds = icaldirset_new(dir);
+    ok("all events kept when freed", (count_dirset_components(ds) == 5));
+    ok("fetch cache-1b", (icaldirset_fetch(ds, ICAL_VEVENT_COMPONENT, "cache-1b") != 0));
+
+    /* A cached cluster rewritten behind the set's back is read again */
+    snprintf(path, sizeof(path), "%s/200001", dir);
+    fs = icalfileset_new(path);
+    (void)icalfileset_add_component(fs, make_uid_event("cache-1c", "20000112T080000Z"));
+    (void)icalfileset_commit(fs);
+    icalset_free(fs);
+    ok("changed cluster reloaded", (count_dirset_components(ds) == 6));
+
+    /* Commit writes the changes of every cached cluster */
+    (void)icaldirset_add_component(ds, make_uid_event("cache-2c", "20000212T080000Z"));
+    (void)icaldirset_add_component(ds, make_uid_event("cache-3b", "20000311T080000Z"));
+    ok("commit", (icaldirset_commit(ds) == ICAL_NO_ERROR));
+    snprintf(path, sizeof(path), "%s/200002", dir);
+    fs = icalfileset_new_reader(path);
+    for (i = 0, c = icalfileset_get_first_component(fs); c != 0;
+         c = icalfileset_get_next_component(fs)) {
+        i++;
+    }
+    ok("committed cluster has its events", (i == 3));
+    icalset_free(fs);
+    icalset_free(ds);
+
+    ds = icaldirset_new(dir);
+    ok("all events kept after commit", (count_dirset_components(ds) == 8));
+    icalset_free(ds);
+
+    for (i = 1; i <= 3; i++) {
+        snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+    ok("no files left behind", (rmdir(dir) == 0));
+#endif
+}
+
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+static int compare_uid_strings(const void *a, const void *b)
+{
+    return strcmp((const char *)a, (const char *)b);
+}
+
+/* The set frees the gauge selected, so each set gets its own */
+static icalgauge *make_scan_gauge(void)
+{
+    return icalgauge_new_from_sql("SELECT * FROM VEVENT WHERE DTSTART >= '20000301T000000Z' "
+                                  "AND DTSTART < '20001001T000000Z'", 0);
+}
+
+/* Record the UIDs of the components the dirset returns, in order */
+static int scan_dirset_uids(icalset *ds, char uids[][16], int max)
+{
+    icalcomponent *c;
+    int n = 0;
+
+    for (c = icaldirset_get_first_component(ds); c != 0; c = icaldirset_get_next_component(ds)) {
+        if (n < max) {
+            strncpy(uids[n], icalcomponent_get_uid(c), 15);
+            uids[n][15] = 0;
+        }
+        n++;
+    }
+    return n;
+}
+#endif
+
+void test_dirset_parallel_scan(void)
+{
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *dir = "test_dirscan_store";
+    char path[64], uid[16], dtstart[32];
+    char serial[60][16], parallel[60][16];
+    icalset *ds, *fs;
+    icalcomponent *c;
+    icalgauge *gauge;
+    int i, k, n, num_serial;
+
+    (void)mkdir(dir, 0755);
+    for (i = 1; i <= 12; i++) {
+        snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+        unlink(path);
+        fs = icalfileset_new(path);
+        for (k = 0; k < 5; k++) {
+            snprintf(uid, sizeof(uid), "scan-%02d-%d", i, k);
+            snprintf(dtstart, sizeof(dtstart), "2000%02d%02dT080000Z", i, k + 10);
+            (void)icalfileset_add_component(fs, make_uid_event(uid, dtstart));
+        }
+        icalset_free(fs);
+    }
+
+    ds = icaldirset_new(dir);
+    (void)icaldirset_select(ds, make_scan_gauge());
+    num_serial = scan_dirset_uids(ds, serial, 60);
+    int_is("serial scan", num_serial, 35);
+
+    /* In cluster order, the components come as they do serially. The
+       cache is cleared first so that the workers parse the clusters. */
+    icalset_free(ds);
+    ds = icaldirset_new(dir);
+    gauge = make_scan_gauge();
+    (void)icaldirset_select(ds, gauge);
+    ok("set scan threads", (icaldirset_set_scan_threads(ds, 4, 1) == ICAL_NO_ERROR));
+    n = scan_dirset_uids(ds, parallel, 60);
+    int_is("ordered parallel scan", n, num_serial);
+    for (i = 0; i < n && i < num_serial && strcmp(serial[i], parallel[i]) == 0; i++) ;
+    int_is("ordered parallel scan in cluster order", i, num_serial);
+
+    /* Unordered, they are the same components in some order */
+    (void)icaldirset_set_scan_threads(ds, 3, 0);
+    (void)icaldirset_set_cache_size(ds, 1, 100);
+    n = scan_dirset_uids(ds, parallel, 60);
+    int_is("unordered parallel scan", n, num_serial);
+    qsort(serial, (size_t)num_serial, sizeof(serial[0]), compare_uid_strings);
+    qsort(parallel, (size_t)num_serial, sizeof(parallel[0]), compare_uid_strings);
+    for (i = 0; i < num_serial && strcmp(serial[i], parallel[i]) == 0; i++) ;
+    int_is("unordered parallel scan has the same components", i, num_serial);
+
+    /* The current component may be removed during a scan */
+    (void)icaldirset_set_scan_threads(ds, 4, 1);
+    c = icaldirset_get_first_component(ds);
+    ok("current component of a scan", (c != 0 && icaldirset_get_current_component(ds) == c));
+    ok("scan leaves the shared error state alone",
+       (icalerror_get_error_state(ICAL_MALFORMEDDATA_ERROR) == ICAL_ERROR_DEFAULT));
+    ok("scan leaves the caller's thread error state alone",
+       (icalerror_get_thread_error_state(ICAL_MALFORMEDDATA_ERROR) == ICAL_ERROR_UNKNOWN));
+    ok("remove it", (icaldirset_remove_component(ds, c) == ICAL_NO_ERROR));
+    icalcomponent_free(c);
+    for (n = 0; icaldirset_get_next_component(ds) != 0; n++) ;
+    int_is("scan goes on after a removal", n, num_serial - 1);
+    (void)icaldirset_commit(ds);
+
+    /* A gauge replaced during a scan may be freed at once; the set then
+       holds the only reference to it */
+    icalgauge_free_cache();
+    (void)icaldirset_set_cache_size(ds, 1, 100);
+    ok("scan with a gauge to replace", (icaldirset_get_first_component(ds) != 0));
+    (void)icaldirset_select(ds, make_scan_gauge());
+    icalgauge_free(gauge);
+    int_is("scan with the new gauge", scan_dirset_uids(ds, parallel, 60), num_serial - 1);
+
+    /* A scan left unfinished is stopped when the set is freed */
+    (void)icaldirset_get_first_component(ds);
+    icalset_free(ds);
+
+    ds = icaldirset_new(dir);
+    (void)icaldirset_select(ds, make_scan_gauge());
+    int_is("removal kept", scan_dirset_uids(ds, serial, 60), num_serial - 1);
+    icalset_free(ds);
+
+    for (i = 1; i <= 12; i++) {
+        snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+    ok("no files left behind", (rmdir(dir) == 0));
+#endif
+}
+
+void test_set_add_components(void)
+{
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *dir = "test_batch_store";
+    const char *file = "test_batch.ics";
+    char path[64], uid[32], dtstart[32];
+    icalcomponent *comps[32];
+    icalset *ds, *fs;
+    icalcomponent *c;
+    int i, in_order, taken;
+
+    (void)mkdir(dir, 0755);
+    for (i = 1; i <= 3; i++) {
+        snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+
+    /* Spread over three clusters, in no order of cluster */
+    for (i = 0; i < 30; i++) {
+        snprintf(uid, sizeof(uid), "batch-%02d", i);
+        snprintf(dtstart, sizeof(dtstart), "2000%02d%02dT080000Z", i % 3 + 1, i + 1);
+        comps[i] = make_uid_event(uid, dtstart);
+    }
+    comps[30] = icalcomponent_vanew(ICAL_VCALENDAR_COMPONENT,
+                                    icalcomponent_vanew(ICAL_VEVENT_COMPONENT,
+                                                        icalproperty_new_uid("batch-none"),
+                                                        (void *)0),
+                                    (void *)0);
+    comps[31] = 0;
+
+    ds = icaldirset_new(dir);
+    icalerror_set_errors_are_fatal(0);
+    ok("dirset batch leaving one out",
+       (icalset_add_components(ds, comps, 32) == ICAL_BADARG_ERROR));
+    icalerror_set_errors_are_fatal(1);
+    icalerror_clear_errno();
+    for (i = 0, taken = 1; i < 30; i++) {
+        if (comps[i] != 0) {
+            taken = 0;
+        }
+    }
+    ok("entries of the components added cleared", taken);
+    ok("component without a time left to the caller", (comps[30] != 0));
+    icalcomponent_free(comps[30]);
+    icalset_free(ds);
+
+    /* Each cluster holds its components in the order they were given */
+    snprintf(path, sizeof(path), "%s/200002", dir);
+    fs = icalfileset_new_reader(path);
+    int_is("components in a cluster", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 10);
+    in_order = 1;
+    for (i = 1, c = icalfileset_get_first_component(fs); c != 0;
+         i += 3, c = icalfileset_get_next_component(fs)) {
+        snprintf(uid, sizeof(uid), "batch-%02d", i);
+        if (strcmp(icalcomponent_get_uid(icalcomponent_get_inner(c)), uid) != 0) {
+            in_order = 0;
+        }
+    }
+    ok("order kept within a cluster", in_order);
+    icalset_free(fs);
+
+    ds = icaldirset_new(dir);
+    int_is("dirset batch added", count_dirset_components(ds), 30);
+    ok("batch UIDs indexed", (icaldirset_has_uid(ds, "batch-29") == 1));
+    icalset_free(ds);
+
+    /* Appended to the files of clusters that are not loaded */
+    ds = icaldirset_new(dir);
+    for (i = 0; i < 3; i++) {
+        snprintf(uid, sizeof(uid), "batch-%02d", 30 + i);
+        snprintf(dtstart, sizeof(dtstart), "200001%02dT090000Z", i + 1);
+        comps[i] = make_uid_event(uid, dtstart);
+    }
+    ok("dirset batch appended", (icalset_add_components(ds, comps, 3) == ICAL_NO_ERROR));
+    ok("appended UIDs indexed", (icaldirset_has_uid(ds, "batch-32") == 1));
+    icalset_free(ds);
+
+    snprintf(path, sizeof(path), "%s/200001", dir);
+    fs = icalfileset_new_reader(path);
+    int_is("components appended", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 13);
+    c = icalfileset_fetch(fs, ICAL_ANY_COMPONENT, "batch-32");
+    ok("appended component parsed", (c != 0));
+    icalset_free(fs);
+
+    /* A file set */
+    unlink(file);
+    for (i = 0; i < 10; i++) {
+        snprintf(uid, sizeof(uid), "batch-%02d", i);
+        snprintf(dtstart, sizeof(dtstart), "200001%02dT080000Z", i + 1);
+        comps[i] = make_uid_event(uid, dtstart);
+    }
+    fs = icalfileset_new(file);
+    ok("fileset batch", (icalset_add_components(fs, comps, 10) == ICAL_NO_ERROR));
+    icalset_free(fs);
+    fs = icalfileset_new_reader(file);
+    int_is("fileset batch written", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 10);
+    icalset_free(fs);
+
+    unlink(file);
+    for (i = 1; i <= 3; i++) {
+        snprintf(path, sizeof(path), "%s/2000%02d", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+    ok("no files left behind", (rmdir(dir) == 0));
+#endif
+}
+
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+static long file_size(const char *path)
+{
+    struct stat sbuf;
+
+    return (stat(path, &sbuf) == 0) ? (long)sbuf.st_size : -1;
+}
+#endif
+
+void test_fileset_journal(void)
+{
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *path = "test_journal.ics";
+    const char *journal = "test_journal.ics.journal";
+    char uid[16], dtstart[32];
+    icalset *fs;
+    icalcomponent *c;
+    long base_size;
+    FILE *f;
+    int i, wrong;
+
+    unlink(path);
+    unlink(journal);
+
+    fs = icalfileset_new(path);
+    for (i = 0; i < 10; i++) {
+        snprintf(uid, sizeof(uid), "journal-%d", i);
+        snprintf(dtstart, sizeof(dtstart), "200001%02dT080000Z", i + 1);
+        (void)icalfileset_add_component(fs, make_uid_event(uid, dtstart));
+    }
+    icalset_free(fs);
+    base_size = file_size(path);
+
+    /* Changes go to the journal, and the file is left alone */
+    fs = icalfileset_new(path);
+    ok("set journal", (icalfileset_set_journal(fs, 1, 0) == ICAL_NO_ERROR));
+    (void)icalfileset_add_component(fs, make_uid_event("journal-10", "20000111T080000Z"));
+    c = icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, "journal-3");
+    ok("remove a component", (icalfileset_remove_component(fs, c) == ICAL_NO_ERROR));
+    icalcomponent_free(c);
+    c = icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, "journal-5");
+    icalcomponent_set_summary(icalcomponent_get_inner(c), "Changed");
+    ok("mark a component", (icalfileset_mark_component(fs, c) == ICAL_NO_ERROR));
+    ok("commit to the journal", (icalfileset_commit(fs) == ICAL_NO_ERROR));
+    int_is("file left alone", (int)file_size(path), (int)base_size);
+    ok("journal written", (file_size(journal) > 0));
+    icalset_free(fs);
+
+    /* The journal is replayed when the set is loaded, in journal mode or not */
+    fs = icalfileset_new_reader(path);
+    int_is("components after replay", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 10);
+    ok("added component replayed",
+       (icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, "journal-10") != 0));
+    ok("removed component replayed",
+       (icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, "journal-3") == 0));
+    c = icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, "journal-5");
+    str_is("changed component replayed",
+           c ? icalcomponent_get_summary(icalcomponent_get_inner(c)) : "", "Changed");
+    icalset_free(fs);
+
+    /* A record cut short is ignored, then cut off */
+    f = fopen(journal, "a");
+    fputs("ADD 500\nBEGIN:VCALENDAR\n", f);
+    fclose(f);
+    fs = icalfileset_new(path);
+    int_is("record cut short ignored", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 10);
+    (void)icalfileset_set_journal(fs, 1, 0);
+    (void)icalfileset_add_component(fs, make_uid_event("journal-11", "20000112T080000Z"));
+    icalset_free(fs);
+    fs = icalfileset_new_reader(path);
+    int_is("appended after the cut", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 11);
+    icalset_free(fs);
+
+    /* Past the ratio, the whole file is written and the journal dropped */
+    fs = icalfileset_new(path);
+    (void)icalfileset_set_journal(fs, 1, 0.01);
+    (void)icalfileset_add_component(fs, make_uid_event("journal-12", "20000113T080000Z"));
+    ok("commit past the ratio", (icalfileset_commit(fs) == ICAL_NO_ERROR));
+    ok("journal dropped", (file_size(journal) < 0));
+    ok("file written", (file_size(path) > base_size));
+
+    /* Or when asked to */
+    (void)icalfileset_set_journal(fs, 1, 0);
+    (void)icalfileset_add_component(fs, make_uid_event("journal-13", "20000114T080000Z"));
+    (void)icalfileset_commit(fs);
+    ok("journal written again", (file_size(journal) > 0));
+    ok("compact", (icalfileset_compact(fs) == ICAL_NO_ERROR));
+    ok("journal dropped by compact", (file_size(journal) < 0));
+    icalset_free(fs);
+
+    /* A journal older than the file is not replayed */
+    f = fopen(journal, "w");
+    fputs("ICALFILESET-JOURNAL 1 1 1\nDEL 0\n", f);
+    fclose(f);
+    fs = icalfileset_new_reader(path);
+    int_is("stale journal ignored", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 13);
+    icalset_free(fs);
+
+    /* Many removals, from both ends and after an edit that did not go
+       through the set, replay to the same components */
+    unlink(path);
+    unlink(journal);
+    fs = icalfileset_new(path);
+    for (i = 0; i < 300; i++) {
+        snprintf(uid, sizeof(uid), "many-%d", i);
+        (void)icalfileset_add_component(fs, make_uid_event(uid, "20000101T080000Z"));
+    }
+    icalset_free(fs);
+
+    fs = icalfileset_new(path);
+    (void)icalfileset_set_journal(fs, 1, 0);
+    for (i = 299; i >= 0; i -= 3) {
+        snprintf(uid, sizeof(uid), "many-%d", i);
+        c = icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, uid);
+        (void)icalfileset_remove_component(fs, c);
+        icalcomponent_free(c);
+    }
+    (void)icalfileset_add_component(fs, make_uid_event("many-300", "20000102T080000Z"));
+    c = icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, "many-1");
+    icalcomponent_set_summary(icalcomponent_get_inner(c), "Edited");
+    (void)icalfileset_mark_component(fs, c);
+    for (i = 0; i < 300; i += 3) {
+        snprintf(uid, sizeof(uid), "many-%d", i);
+        c = icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, uid);
+        (void)icalfileset_remove_component(fs, c);
+        icalcomponent_free(c);
+    }
+    ok("commit the removals", (icalfileset_commit(fs) == ICAL_NO_ERROR));
+    icalset_free(fs);
+
+    fs = icalfileset_new_reader(path);
+    int_is("components after the removals",
+           icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 101);
+    for (i = 0, wrong = 0; i < 300; i++) {
+        snprintf(uid, sizeof(uid), "many-%d", i);
+        if ((icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, uid) != 0) != (i % 3 == 1)) {
+            wrong++;
+        }
+    }
+    int_is("the right components removed", wrong, 0);
+    c = icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, "many-1");
+    str_is("edited component replayed",
+           c ? icalcomponent_get_summary(icalcomponent_get_inner(c)) : "", "Edited");
+    icalset_free(fs);
+
+    unlink(path);
+    unlink(journal);
+#endif
+}
+
+void test_fileset_commit(void)
+{
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *dir = "test_commit_store";
+    const char *path = "test_commit_store/calendar.ics";
+    const char *bak = "test_commit_store/calendar.ics.bak";
+    icalfileset_options options = { O_RDWR | O_CREAT, 0644, 1, NULL, 0 };
+    char uid[16], dtstart[32];
+    struct stat before, after;
+    icalset *fs;
+    icalcomponent *c;
+    int i;
+
+    (void)mkdir(dir, 0755);
+    unlink(path);
+    unlink(bak);
+
+    /* More components than are written at once */
+    fs = icalset_new(ICAL_FILE_SET, path, &options);
+    assert(fs != 0);
+    for (i = 0; i < 200; i++) {
+        snprintf(uid, sizeof(uid), "commit-%d", i);
+        snprintf(dtstart, sizeof(dtstart), "2000%02d%02dT080000Z", i / 28 + 1, i % 28 + 1);
+        (void)icalfileset_add_component(fs, make_uid_event(uid, dtstart));
+    }
+    ok("commit", (icalfileset_commit(fs) == ICAL_NO_ERROR));
+    icalset_free(fs);
+
+    fs = icalfileset_new_reader(path);
+    int_is("components written", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 200);
+    icalset_free(fs);
+
+    /* The file is replaced, and the old one kept as the backup */
+    (void)stat(path, &before);
+    fs = icalset_new(ICAL_FILE_SET, path, &options);
+    c = icalfileset_fetch(fs, ICAL_VEVENT_COMPONENT, "commit-0");
+    (void)icalfileset_remove_component(fs, c);
+    icalcomponent_free(c);
+    ok("commit with a backup", (icalfileset_commit(fs) == ICAL_NO_ERROR));
+    icalset_free(fs);
+    (void)stat(path, &after);
+    ok("file replaced", (before.st_ino != after.st_ino));
+    int_is("mode kept", (int)(after.st_mode & 07777), (int)(before.st_mode & 07777));
+
+    fs = icalfileset_new_reader(path);
+    int_is("components after the commit", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 199);
+    icalset_free(fs);
+    fs = icalfileset_new_reader(bak);
+    int_is("components in the backup", icalfileset_count_components(fs, ICAL_ANY_COMPONENT), 200);
+    icalset_free(fs);
+
+    unlink(path);
+    unlink(bak);
+    ok("no temporary files left behind", (rmdir(dir) == 0));
+#endif
+}
+
+void test_fileset_refresh(void)
+{
+#if defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *path = "test_refresh.ics";
+    const char *journal = "test_refresh.ics.journal";
+    char uid[16], dtstart[32];
+    icalset *writer, *reader;
+    icalcomponent *c, *kept;
+    int i;
+
+    unlink(path);
+    unlink(journal);
+
+    writer = icalfileset_new(path);
+    for (i = 0; i < 5; i++) {
+        snprintf(uid, sizeof(uid), "refresh-%d", i);
+        snprintf(dtstart, sizeof(dtstart), "200002%02dT080000Z", i + 1);
+        (void)icalfileset_add_component(writer, make_uid_event(uid, dtstart));
+    }
+    (void)icalfileset_commit(writer);
+
+    reader = icalfileset_new_reader(path);
+    (void)icalfileset_set_time_index(reader, 1);
+    kept = icalfileset_fetch(reader, ICAL_VEVENT_COMPONENT, "refresh-1");
+    ok("refresh unchanged", (icalfileset_refresh(reader) == ICAL_NO_ERROR));
+    ok("component kept",
+       (icalfileset_fetch(reader, ICAL_VEVENT_COMPONENT, "refresh-1") == kept));
+
+    /* Records appended to the journal */
+    (void)icalfileset_set_journal(writer, 1, 0);
+    (void)icalfileset_add_component(writer, make_uid_event("refresh-5", "20000206T080000Z"));
+    (void)icalfileset_commit(writer);
+    ok("refresh from the journal", (icalfileset_refresh(reader) == ICAL_NO_ERROR));
+    int_is("components after the journal",
+           icalfileset_count_components(reader, ICAL_ANY_COMPONENT), 6);
+    ok("added component seen",
+       (icalfileset_fetch(reader, ICAL_VEVENT_COMPONENT, "refresh-5") != 0));
+    ok("component kept through the journal",
+       (icalfileset_fetch(reader, ICAL_VEVENT_COMPONENT, "refresh-1") == kept));
+
+    /* The file written again */
+    c = icalfileset_fetch(writer, ICAL_VEVENT_COMPONENT, "refresh-2");
+    (void)icalfileset_remove_component(writer, c);
+    icalcomponent_free(c);
+    c = icalfileset_fetch(writer, ICAL_VEVENT_COMPONENT, "refresh-3");
+    icalcomponent_set_summary(icalcomponent_get_inner(c), "Changed");
+    (void)icalfileset_mark_component(writer, c);
+    ok("compact", (icalfileset_compact(writer) == ICAL_NO_ERROR));
+    ok("refresh from the file", (icalfileset_refresh(reader) == ICAL_NO_ERROR));
+    int_is("components after the file",
+           icalfileset_count_components(reader, ICAL_ANY_COMPONENT), 5);
+    ok("removed component gone",
+       (icalfileset_fetch(reader, ICAL_VEVENT_COMPONENT, "refresh-2") == 0));
+    c = icalfileset_fetch(reader, ICAL_VEVENT_COMPONENT, "refresh-3");
+    str_is("changed component seen",
+           c ? icalcomponent_get_summary(icalcomponent_get_inner(c)) : "", "Changed");
+    ok("component kept through the file",
+       (icalfileset_fetch(reader, ICAL_VEVENT_COMPONENT, "refresh-1") == kept));
+
+    /* The journal of the new file, after the file was reloaded */
+    (void)icalfileset_add_component(writer, make_uid_event("refresh-6", "20000207T080000Z"));
+    (void)icalfileset_commit(writer);
+    (void)icalfileset_refresh(reader);
+    int_is("components after the new journal",
+           icalfileset_count_components(reader, ICAL_ANY_COMPONENT), 6);
+
+    /* Uncommitted changes would be lost */
+    (void)icalfileset_add_component(writer, make_uid_event("refresh-7", "20000208T080000Z"));
+    icalerror_set_errors_are_fatal(0);
+    ok("refresh with changes", (icalfileset_refresh(writer) == ICAL_USAGE_ERROR));
+    icalerror_set_errors_are_fatal(1);
+    icalerror_clear_errno();
+
+    icalset_free(reader);
+    icalset_free(writer);
+    unlink(path);
+    unlink(journal);
+#endif
+}
+
+#if defined(HAVE_WAITPID) && defined(HAVE_FORK) && defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+/* The type of lock another process holds that would stop this one
+   taking a lock of the given type, or F_UNLCK */
+static int conflicting_lock(const char *path, int type)
+{
+    struct flock lock;
+    int fd = open(path, O_RDWR);
+
+    lock.l_type = (short)type;
+    lock.l_start = 0;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = 0;
+    (void)fcntl(fd, F_GETLK, &lock);
+    close(fd);
+
+    return lock.l_type;
+}
+
+/* Run check in a child process, returning its exit status */
+static int in_child(int (*check)(const char *), const char *path)
+{
+    pid_t pid = fork();
+    int status;
+
+    if (pid == 0) {
+        _exit(check(path));
+    }
+    (void)waitpid(pid, &status, 0);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int check_shared_lock(const char *path)
+{
+    return (conflicting_lock(path, F_RDLCK) == F_UNLCK &&
+            conflicting_lock(path, F_WRLCK) == F_RDLCK) ? 0 : 1;
+}
+
+static int check_exclusive_lock(const char *path)
+{
+    return (conflicting_lock(path, F_RDLCK) == F_WRLCK) ? 0 : 1;
+}
+
+static int check_no_lock(const char *path)
+{
+    return (conflicting_lock(path, F_WRLCK) == F_UNLCK) ? 0 : 1;
+}
+
+static int check_snapshot(const char *path)
+{
+    icalset *fs;
+    int count;
+
+    /* Blocking on the lock would end the test here */
+    alarm(10);
+    fs = icalfileset_new_snapshot(path);
+    count = icalfileset_count_components(fs, ICAL_ANY_COMPONENT);
+    icalset_free(fs);
+
+    return (count == 1) ? 0 : 1;
+}
+#endif
+
+void test_fileset_shared_locks(void)
+{
+#if defined(HAVE_WAITPID) && defined(HAVE_FORK) && defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *path = "test_shared_locks.ics";
+    icalset *writer, *reader, *snapshot;
+
+    unlink(path);
+    writer = icalfileset_new_writer(path);
+    (void)icalfileset_add_component(writer, make_uid_event("locks-0", "20000301T080000Z"));
+    (void)icalfileset_commit(writer);
+    int_is("writer holds an exclusive lock", in_child(check_exclusive_lock, path), 0);
+    ok("snapshot read past the writer", (in_child(check_snapshot, path) == 0));
+    icalset_free(writer);
+
+    reader = icalfileset_new_reader(path);
+    int_is("reader holds a shared lock", in_child(check_shared_lock, path), 0);
+    icalset_free(reader);
+    int_is("lock released", in_child(check_no_lock, path), 0);
+
+    snapshot = icalfileset_new_snapshot(path);
+    int_is("snapshot holds no lock", in_child(check_no_lock, path), 0);
+
+    /* The snapshot keeps the version it read until refreshed */
+    writer = icalfileset_new(path);
+    (void)icalfileset_add_component(writer, make_uid_event("locks-1", "20000302T080000Z"));
+    (void)icalfileset_commit(writer);
+    int_is("snapshot unchanged by a commit",
+           icalfileset_count_components(snapshot, ICAL_ANY_COMPONENT), 1);
+    ok("refresh the snapshot", (icalfileset_refresh(snapshot) == ICAL_NO_ERROR));
+    int_is("snapshot of the new version",
+           icalfileset_count_components(snapshot, ICAL_ANY_COMPONENT), 2);
+    icalset_free(writer);
+    icalset_free(snapshot);
+
+    unlink(path);
+#endif
+}
+
+#if defined(HAVE_WAITPID) && defined(HAVE_FORK) && defined(HAVE_SETRLIMIT) && \
+    defined(HAVE_SYS_RESOURCE_H) && defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+/* Commit a cluster too large for the file size limit, which must fail,
+   then lift the limit and free the set, which must write it */
+static int check_failed_commit(const char *dir)
+{
+    struct rlimit limit;
+    rlim_t saved;
+    char description[1024];
+    icalcomponent *c;
+    icalset *ds;
+    int failed;
+
+    (void)signal(SIGXFSZ, SIG_IGN);
+    (void)getrlimit(RLIMIT_FSIZE, &limit);
+    saved = limit.rlim_cur;
+    limit.rlim_cur = 512;
+    (void)setrlimit(RLIMIT_FSIZE, &limit);
+
+    memset(description, 'x', sizeof(description) - 1);
+    description[sizeof(description) - 1] = '\0';
+    c = make_uid_event("too-large", "20000110T080000Z");
+    icalcomponent_set_description(icalcomponent_get_inner(c), description);
+
+    icalerror_set_errors_are_fatal(0);
+    ds = icaldirset_new(dir);
+    (void)icaldirset_add_component(ds, c);
+    failed = (icaldirset_commit(ds) != ICAL_NO_ERROR);
+
+    limit.rlim_cur = saved;
+    (void)setrlimit(RLIMIT_FSIZE, &limit);
+    icalset_free(ds);
+
+    return failed ? 0 : 1;
+}
+#endif
+
+void test_dirset_failed_commit(void)
+{
+#if defined(HAVE_WAITPID) && defined(HAVE_FORK) && defined(HAVE_SETRLIMIT) && \
+    defined(HAVE_SYS_RESOURCE_H) && defined(HAVE_UNLINK) && defined(HAVE_DIRENT_H)
+    const char *dir = "test_failed_commit_store";
+    char path[64];
+    icalset *ds;
+
+    (void)mkdir(dir, 0755);
+    snprintf(path, sizeof(path), "%s/200001", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+
+    int_is("commit past the file size limit fails", in_child(check_failed_commit, dir), 0);
+
+    /* The cluster kept its changes and was written when the set was freed */
+    ds = icaldirset_new(dir);
+    int_is("component written later", count_dirset_components(ds), 1);
+    ok("its UID indexed", (icaldirset_has_uid(ds, "too-large") == 1));
+    icalset_free(ds);
+
+    snprintf(path, sizeof(path), "%s/200001", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/.icaldirset-uids", dir);
+    unlink(path);
+    ok("no files left behind", (rmdir(dir) == 0));
+#endif
+}
+
 void microsleep(int us)
 {       /*us is in microseconds */
 #if defined(HAVE_NANOSLEEP)
@@ -3962,15 +5742,37 @@ int main(int argc, char *argv[])
     test_run("Test parameter bug", test_recur_parameter_bug, do_test, do_header);
     test_run("Test Array Expansion", test_expand_recurrence, do_test, do_header);
     test_run("Test Free/Busy lists", test_fblist, do_test, do_header);
+    test_run("Test Common Free Time", test_common_free, do_test, do_header);
+    test_run("Test Busy Maps", test_busymap, do_test, do_header);
+    test_run("Test Parallel Instance Expansion", test_instances, do_test, do_header);
+    test_run("Test Instance Index", test_instance_index, do_test, do_header);
     test_run("Test Overlaps", test_overlaps, do_test, do_header);
 
     test_run("Test Span", test_icalcomponent_get_span, do_test, do_header);
+    test_run("Test Cached Times", test_icalcomponent_cached_times, do_test, do_header);
+    test_run("Test Revisions", test_icalcomponent_revision, do_test, do_header);
+    test_run("Test Merge", test_icalcomponent_merge, do_test, do_header);
+    test_run("Test Bulk Child Operations", test_icalcomponent_bulk_children, do_test, do_header);
+    test_run("Test Fingerprint", test_icalcomponent_fingerprint, do_test, do_header);
+    test_run("Test Diff and Patch", test_icalcomponent_diff, do_test, do_header);
+    test_run("Test Sort Components", test_icalcomponent_sort, do_test, do_header);
     test_run("Test Gauge SQL", test_gauge_sql, do_test, do_header);
     test_run("Test Gauge Compare", test_gauge_compare, do_test, do_header);
+    test_run("Test Gauge Cache", test_gauge_cache, do_test, do_header);
     test_run("Test File Set", test_fileset, do_test, do_header);
+    test_run("Test Time Index", test_time_index, do_test, do_header);
     test_run("Test File Set (Extended)", test_fileset_extended, do_test, do_header);
+    test_run("Test File Set Journal", test_fileset_journal, do_test, do_header);
+    test_run("Test File Set Commit", test_fileset_commit, do_test, do_header);
+    test_run("Test File Set Refresh", test_fileset_refresh, do_test, do_header);
+    test_run("Test File Set Shared Locks", test_fileset_shared_locks, do_test, do_header);
     test_run("Test Dir Set", test_dirset, do_test, do_header);
     test_run("Test Dir Set (Extended)", test_dirset_extended, do_test, do_header);
+    test_run("Test Dir Set UID Index", test_dirset_uid_index, do_test, do_header);
+    test_run("Test Dir Set Cache", test_dirset_cache, do_test, do_header);
+    test_run("Test Dir Set Failed Commit", test_dirset_failed_commit, do_test, do_header);
+    test_run("Test Dir Set Parallel Scan", test_dirset_parallel_scan, do_test, do_header);
+    test_run("Test Set Batch Add", test_set_add_components, do_test, do_header);
 
 /* test_file_locks is slow but should work ok -- uncomment to test it */
 /*    test_run("Test File Locks", test_file_locks, do_test, do_header);*/
@@ -4032,6 +5834,7 @@ int main(int argc, char *argv[])
 #endif
 
     icaltimezone_free_builtin_timezones();
+    icalrecurrencetype_free_cache();
     icalmemory_free_ring();
     free_zone_directory();
 
@@ -37,6 +37,13 @@ extern "C"
     void create_new_component_with_va_args(void);
     void create_simple_component(void);
     void test_icalcomponent_get_span(void);
+    void test_icalcomponent_cached_times(void);
+    void test_icalcomponent_revision(void);
+    void test_icalcomponent_merge(void);
+    void test_icalcomponent_bulk_children(void);
+    void test_icalcomponent_fingerprint(void);
+    void test_icalcomponent_diff(void);
+    void test_icalcomponent_sort(void);
 
 /* regression-classify.c */
     void test_classify(void);